@@ -0,0 +1,636 @@
+#include "Frame.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Load generator for a running broker: many MQTT 3.1.1 clients over loopback, driven by a few
+// threads with one epoll each, encoding and decoding through the broker's own Frame codec.
+// Results go to stdout as JSON so runs against different builds can be compared.
+
+using namespace MQTT;
+
+namespace {
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 1883;
+    // "pubsub" routes messages from publishers to subscribers; "connect" connects clients over and over
+    std::string scenario = "pubsub";
+    int publishers = 10;
+    int subscribers = 10;
+    // Clients of the connect scenario
+    int clients = 1000;
+    int threads = 4;
+    int seconds = 10;
+    // Publishes per second of each publisher; 0 sends whenever the connection takes more
+    int rate = 0;
+    size_t payloadBytes = 64;
+    QoS qos = QoS::QOS_0;
+    // Distinct topics the publishers spread over, 0 for one per publisher, and levels per topic
+    int topics = 0;
+    int levels = 3;
+    // Share of subscribers matching their topic through a '#' filter instead of the exact name
+    int wildcardPercent = 0;
+    // Subscribers are spread over this many $share groups; 0 subscribes them directly
+    int sharedGroups = 0;
+    // Unacknowledged QoS 1/2 publishes a publisher may have outstanding
+    int window = 16;
+};
+
+uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear histogram in the manner of HdrHistogram: each power of two is split into
+// 2^SUB_BUCKET_BITS sub-buckets, so any value is reported within 1% of what was recorded
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 7;
+    static constexpr int BUCKETS = (64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+    void record(uint64_t value) {
+        counts[bucketOf(value)]++;
+        total++;
+        max = std::max(max, value);
+    }
+    void merge(const LatencyHistogram &other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+    uint64_t getCount() const { return total; }
+
+    // Highest value counted in the bucket holding the quantile
+    uint64_t quantile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * double(total - 1)) + 1;
+        uint64_t cumulative = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            cumulative += counts[i];
+            if (cumulative >= rank) {
+                return i + 1 < BUCKETS ? std::min(lowerBound(i + 1) - 1, max) : max;
+            }
+        }
+        return max;
+    }
+
+    // Percentiles in microseconds, recorded in nanoseconds
+    std::string toJson() const {
+        char text[256];
+        snprintf(text, sizeof(text),
+                 "{\"count\": %llu, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+                 static_cast<unsigned long long>(total), quantile(0.5) / 1000.0, quantile(0.9) / 1000.0,
+                 quantile(0.99) / 1000.0, quantile(0.999) / 1000.0, max / 1000.0);
+        return text;
+    }
+
+private:
+    std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    static int bucketOf(uint64_t value) {
+        if (value < (1u << SUB_BUCKET_BITS)) {
+            return static_cast<int>(value);
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+        return ((shift + 1) << SUB_BUCKET_BITS) + static_cast<int>((value >> shift) & ((1u << SUB_BUCKET_BITS) - 1));
+    }
+    static uint64_t lowerBound(int bucket) {
+        if (bucket < (1 << SUB_BUCKET_BITS)) {
+            return static_cast<uint64_t>(bucket);
+        }
+        int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+        return static_cast<uint64_t>((1 << SUB_BUCKET_BITS) + (bucket & ((1 << SUB_BUCKET_BITS) - 1))) << shift;
+    }
+};
+
+// State every worker sees
+struct Run {
+    std::atomic<int> ready{0};
+    std::atomic<bool> measuring{false};
+    std::atomic<bool> stopping{false};
+};
+
+struct Client {
+    enum class Role { PUBLISHER, SUBSCRIBER, CONNECTOR };
+    enum class State { CONNECTING, CONNECTED, SUBSCRIBING, READY };
+
+    Role role;
+    State state = State::CONNECTING;
+    int fd = -1;
+    std::string clientId;
+    // Where a publisher publishes, or the filter a subscriber subscribes to
+    std::string topic;
+    std::vector<uint8_t> input;
+    std::vector<uint8_t> output;
+    size_t outputOffset = 0;
+    bool writable = false;
+    uint64_t connectStartedAt = 0;
+    // Counted towards Run::ready once
+    bool counted = false;
+    uint16_t nextPacketId = 1;
+    int inflight = 0;
+    uint64_t nextPublishAt = 0;
+};
+
+class Worker {
+public:
+    Worker(const Options &options, Run &run, sockaddr_in address)
+        : options(options), run(run), address(address), epollFd(epoll_create1(0)) {}
+    ~Worker() { close(epollFd); }
+
+    void add(std::unique_ptr<Client> client) { clients.push_back(std::move(client)); }
+    size_t size() const { return clients.size(); }
+    void loop();
+
+    LatencyHistogram latency;
+    // Connects while every client came up, and the ones once measuring started
+    LatencyHistogram setupLatency;
+    LatencyHistogram connectLatency;
+    uint64_t published = 0;
+    uint64_t received = 0;
+    uint64_t connects = 0;
+    uint64_t failures = 0;
+
+private:
+    const Options &options;
+    Run &run;
+    sockaddr_in address;
+    int epollFd;
+    Frame frame{Version::MQTT311};
+    std::vector<std::unique_ptr<Client>> clients;
+    std::vector<uint8_t> payload;
+
+    void open(Client &client);
+    void reconnect(Client &client);
+    void send(Client &client, const Packet &packet);
+    void flush(Client &client);
+    void readFrom(Client &client);
+    void handle(Client &client, const std::shared_ptr<Packet> &packet);
+    void publish(Client &client, uint64_t now);
+    void markReady(Client &client);
+};
+
+void Worker::open(Client &client) {
+    client.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client.fd < 0) {
+        throw std::runtime_error(std::string("socket: ") + strerror(errno));
+    }
+    int one = 1;
+    setsockopt(client.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client.state = Client::State::CONNECTING;
+    client.writable = false;
+    client.input.clear();
+    client.output.clear();
+    client.outputOffset = 0;
+    client.inflight = 0;
+    client.connectStartedAt = nowNs();
+    if (connect(client.fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 && errno != EINPROGRESS) {
+        throw std::runtime_error(std::string("connect: ") + strerror(errno));
+    }
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = &client;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, client.fd, &event);
+
+    ConnectPacket connect;
+    connect.protocolName = "MQTT";
+    connect.protocolVersion = Version::MQTT311;
+    connect.clientId = client.clientId;
+    connect.keepAlive = 0;
+    connect.cleanStart = true;
+    connect.willFlag = false;
+    connect.willQos = QoS::QOS_0;
+    connect.willRetain = false;
+    send(client, connect);
+}
+
+void Worker::reconnect(Client &client) {
+    // Reset rather than close gracefully, so a connect storm does not run out of ports to TIME_WAIT
+    linger reset{1, 0};
+    setsockopt(client.fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(client.fd);
+    open(client);
+}
+
+void Worker::send(Client &client, const Packet &packet) {
+    std::vector<uint8_t> bytes = frame.serialize(packet);
+    client.output.insert(client.output.end(), bytes.begin(), bytes.end());
+    flush(client);
+}
+
+void Worker::flush(Client &client) {
+    while (client.writable && client.outputOffset < client.output.size()) {
+        ssize_t written = write(client.fd, client.output.data() + client.outputOffset,
+                                client.output.size() - client.outputOffset);
+        if (written < 0) {
+            if (errno == EAGAIN) {
+                client.writable = false;
+            }
+            break;
+        }
+        client.outputOffset += written;
+    }
+    if (client.outputOffset == client.output.size()) {
+        client.output.clear();
+        client.outputOffset = 0;
+    }
+}
+
+void Worker::readFrom(Client &client) {
+    uint8_t buffer[16384];
+    while (true) {
+        ssize_t bytesRead = read(client.fd, buffer, sizeof(buffer));
+        if (bytesRead <= 0) {
+            if (bytesRead == 0 || errno != EAGAIN) {
+                failures++;
+                reconnect(client);
+            }
+            return;
+        }
+        client.input.insert(client.input.end(), buffer, buffer + bytesRead);
+        size_t offset = 0;
+        size_t length;
+        while ((length = Frame::packetLength(client.input.data() + offset, client.input.size() - offset)) > 0) {
+            auto packet = frame.parse(client.input.data() + offset, length);
+            offset += length;
+            handle(client, packet);
+            if (client.state == Client::State::CONNECTING) {
+                // Reconnected while handling; what is left belonged to the old connection
+                return;
+            }
+        }
+        client.input.erase(client.input.begin(), client.input.begin() + offset);
+    }
+}
+
+void Worker::markReady(Client &client) {
+    client.state = Client::State::READY;
+    if (!client.counted) {
+        client.counted = true;
+        run.ready.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Worker::handle(Client &client, const std::shared_ptr<Packet> &packet) {
+    switch (packet->type) {
+    case PacketType::CONNACK: {
+        auto connack = std::static_pointer_cast<ConnackPacket>(packet);
+        if (connack->reasonCode != ReasonCode::SUCCESS) {
+            failures++;
+            reconnect(client);
+            return;
+        }
+        connectLatency.record(nowNs() - client.connectStartedAt);
+        connects++;
+        client.state = Client::State::CONNECTED;
+        if (client.role == Client::Role::SUBSCRIBER) {
+            SubscribePacket subscribe;
+            subscribe.packetId = client.nextPacketId++;
+            subscribe.subscriptions.emplace_back(
+                client.topic, SubscriptionOptions{options.qos, false, false, RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES});
+            client.state = Client::State::SUBSCRIBING;
+            send(client, subscribe);
+            return;
+        }
+        markReady(client);
+        if (client.role == Client::Role::CONNECTOR && run.measuring.load(std::memory_order_relaxed) &&
+            !run.stopping.load(std::memory_order_relaxed)) {
+            reconnect(client);
+        }
+        return;
+    }
+    case PacketType::SUBACK:
+        markReady(client);
+        return;
+    case PacketType::PUBLISH: {
+        auto publish = std::static_pointer_cast<PublishPacket>(packet);
+        if (run.measuring.load(std::memory_order_relaxed) && publish->payload.size() >= sizeof(uint64_t)) {
+            uint64_t sentAt;
+            memcpy(&sentAt, publish->payload.data(), sizeof(sentAt));
+            latency.record(nowNs() - sentAt);
+            received++;
+        }
+        if (publish->qos == QoS::QOS_1) {
+            send(client, PubackPacket(publish->packetId));
+        } else if (publish->qos == QoS::QOS_2) {
+            send(client, PubrecPacket(publish->packetId));
+        }
+        return;
+    }
+    case PacketType::PUBREL:
+        send(client, PubcompPacket(std::static_pointer_cast<PubrelPacket>(packet)->packetId));
+        return;
+    case PacketType::PUBREC:
+        send(client, PubrelPacket(std::static_pointer_cast<PubrecPacket>(packet)->packetId));
+        return;
+    case PacketType::PUBACK:
+    case PacketType::PUBCOMP:
+        client.inflight--;
+        return;
+    default:
+        return;
+    }
+}
+
+void Worker::publish(Client &client, uint64_t now) {
+    // With a fixed rate the payload carries the time the publish was due rather than when it
+    // went out, so a stalled broker shows up as latency instead of as fewer samples
+    uint64_t interval = options.rate > 0 ? 1000000000ull / options.rate : 0;
+    for (int burst = 0; burst < 64; burst++) {
+        if (interval && client.nextPublishAt > now) {
+            return;
+        }
+        if (client.output.size() - client.outputOffset > 65536 ||
+            (options.qos > QoS::QOS_0 && client.inflight >= options.window)) {
+            return;
+        }
+        uint64_t stamp = interval ? client.nextPublishAt : nowNs();
+        memcpy(payload.data(), &stamp, sizeof(stamp));
+        PublishPacket packet{client.topic, payload, options.qos};
+        if (options.qos > QoS::QOS_0) {
+            packet.packetId = client.nextPacketId++;
+            if (client.nextPacketId == 0) {
+                client.nextPacketId = 1;
+            }
+            client.inflight++;
+        }
+        send(client, packet);
+        published++;
+        client.nextPublishAt += interval;
+    }
+}
+
+void Worker::loop() {
+    payload.assign(std::max(options.payloadBytes, sizeof(uint64_t)), 'x');
+    for (auto &client : clients) {
+        open(*client);
+    }
+    std::vector<epoll_event> events(256);
+    bool started = false;
+    while (!run.stopping.load(std::memory_order_relaxed)) {
+        bool measuring = run.measuring.load(std::memory_order_relaxed);
+        if (measuring && !started) {
+            started = true;
+            setupLatency = connectLatency;
+            connectLatency = LatencyHistogram();
+            connects = 0;
+            uint64_t now = nowNs();
+            for (auto &client : clients) {
+                client->nextPublishAt = now;
+                if (client->role == Client::Role::CONNECTOR && client->state == Client::State::READY) {
+                    reconnect(*client);
+                }
+            }
+        }
+        int ready = epoll_wait(epollFd, events.data(), events.size(), measuring ? 1 : 10);
+        for (int i = 0; i < ready; i++) {
+            auto &client = *static_cast<Client *>(events[i].data.ptr);
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                failures++;
+                reconnect(client);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                client.writable = true;
+                flush(client);
+            }
+            if (events[i].events & EPOLLIN) {
+                readFrom(client);
+            }
+        }
+        if (measuring) {
+            uint64_t now = nowNs();
+            for (auto &client : clients) {
+                if (client->role == Client::Role::PUBLISHER && client->state == Client::State::READY) {
+                    publish(*client, now);
+                }
+            }
+        }
+    }
+    for (auto &client : clients) {
+        close(client->fd);
+    }
+}
+
+std::string topicName(const Options &options, int index) {
+    std::string topic = "bench/t" + std::to_string(index);
+    for (int level = 2; level < options.levels; level++) {
+        topic += "/l" + std::to_string(level);
+    }
+    return topic;
+}
+
+void usage(const char *program) {
+    std::cerr << "Usage: " << program
+              << " [-h host] [-p port] [-s pubsub|connect] [-P publishers] [-S subscribers] [-n clients]"
+                 " [-t threads] [-d seconds] [-r rate] [-b payload-bytes] [-q qos] [-T topics] [-l levels]"
+                 " [-w wildcard-percent] [-g shared-groups] [-W window]"
+              << std::endl;
+}
+
+bool parseOptions(int argc, char *argv[], Options &options) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char *flag = argv[i];
+        const char *value = argv[++i];
+        if (std::strcmp(flag, "-h") == 0) {
+            options.host = value;
+        } else if (std::strcmp(flag, "-p") == 0) {
+            options.port = std::atoi(value);
+        } else if (std::strcmp(flag, "-s") == 0) {
+            options.scenario = value;
+        } else if (std::strcmp(flag, "-P") == 0) {
+            options.publishers = std::atoi(value);
+        } else if (std::strcmp(flag, "-S") == 0) {
+            options.subscribers = std::atoi(value);
+        } else if (std::strcmp(flag, "-n") == 0) {
+            options.clients = std::atoi(value);
+        } else if (std::strcmp(flag, "-t") == 0) {
+            options.threads = std::max(1, std::atoi(value));
+        } else if (std::strcmp(flag, "-d") == 0) {
+            options.seconds = std::atoi(value);
+        } else if (std::strcmp(flag, "-r") == 0) {
+            options.rate = std::atoi(value);
+        } else if (std::strcmp(flag, "-b") == 0) {
+            options.payloadBytes = std::atoi(value);
+        } else if (std::strcmp(flag, "-q") == 0) {
+            options.qos = static_cast<QoS>(std::min(2, std::max(0, std::atoi(value))));
+        } else if (std::strcmp(flag, "-T") == 0) {
+            options.topics = std::atoi(value);
+        } else if (std::strcmp(flag, "-l") == 0) {
+            options.levels = std::max(2, std::atoi(value));
+        } else if (std::strcmp(flag, "-w") == 0) {
+            options.wildcardPercent = std::atoi(value);
+        } else if (std::strcmp(flag, "-g") == 0) {
+            options.sharedGroups = std::atoi(value);
+        } else if (std::strcmp(flag, "-W") == 0) {
+            options.window = std::max(1, std::atoi(value));
+        } else {
+            return false;
+        }
+    }
+    return options.scenario == "pubsub" || options.scenario == "connect";
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+        std::cerr << "Error: host must be an IPv4 address" << std::endl;
+        return 1;
+    }
+    // Thousands of clients need as many descriptors as the hard limit allows
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    Run run;
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (int i = 0; i < options.threads; i++) {
+        workers.push_back(std::make_unique<Worker>(options, run, address));
+    }
+    int topics = options.topics > 0 ? options.topics : std::max(1, options.publishers);
+    int total = 0;
+    auto assign = [&](std::unique_ptr<Client> client) {
+        workers[total++ % workers.size()]->add(std::move(client));
+    };
+    if (options.scenario == "connect") {
+        for (int i = 0; i < options.clients; i++) {
+            auto client = std::make_unique<Client>();
+            client->role = Client::Role::CONNECTOR;
+            client->clientId = "bench-c" + std::to_string(i);
+            assign(std::move(client));
+        }
+    } else {
+        for (int i = 0; i < options.subscribers; i++) {
+            auto client = std::make_unique<Client>();
+            client->role = Client::Role::SUBSCRIBER;
+            client->clientId = "bench-s" + std::to_string(i);
+            client->topic = topicName(options, i % topics);
+            if (i * 100 < options.wildcardPercent * options.subscribers) {
+                client->topic = "bench/t" + std::to_string(i % topics) + "/#";
+            }
+            if (options.sharedGroups > 0) {
+                client->topic = "$share/g" + std::to_string(i % options.sharedGroups) + "/" + client->topic;
+            }
+            assign(std::move(client));
+        }
+        for (int i = 0; i < options.publishers; i++) {
+            auto client = std::make_unique<Client>();
+            client->role = Client::Role::PUBLISHER;
+            client->clientId = "bench-p" + std::to_string(i);
+            client->topic = topicName(options, i % topics);
+            assign(std::move(client));
+        }
+    }
+
+    uint64_t setupStartedAt = nowNs();
+    std::vector<std::thread> threads;
+    std::atomic<bool> failed{false};
+    for (auto &worker : workers) {
+        threads.emplace_back([&worker, &failed, &run] {
+            try {
+                worker->loop();
+            } catch (const std::exception &e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                failed = true;
+                run.stopping = true;
+            }
+        });
+    }
+    // Every client connected, and subscribed, before anything is measured
+    while (run.ready.load() < total && !failed && nowNs() - setupStartedAt < 60000000000ull) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    uint64_t setupNs = nowNs() - setupStartedAt;
+    bool allReady = run.ready.load() == total;
+    uint64_t measureStartedAt = nowNs();
+    run.measuring = allReady;
+    if (allReady) {
+        std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+    }
+    run.stopping = true;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    double elapsed = (nowNs() - measureStartedAt) / 1e9;
+    if (failed) {
+        return 1;
+    }
+
+    LatencyHistogram latency;
+    LatencyHistogram setupConnects;
+    LatencyHistogram connectLatency;
+    uint64_t published = 0, received = 0, connects = 0, failures = 0;
+    for (auto &worker : workers) {
+        latency.merge(worker->latency);
+        setupConnects.merge(allReady ? worker->setupLatency : worker->connectLatency);
+        if (allReady) {
+            connectLatency.merge(worker->connectLatency);
+        }
+        published += worker->published;
+        received += worker->received;
+        connects += worker->connects;
+        failures += worker->failures;
+    }
+    printf("{\n");
+    printf("  \"scenario\": \"%s\",\n", options.scenario.c_str());
+    printf("  \"clients\": %d,\n", total);
+    printf("  \"publishers\": %d,\n", options.scenario == "pubsub" ? options.publishers : 0);
+    printf("  \"subscribers\": %d,\n", options.scenario == "pubsub" ? options.subscribers : 0);
+    printf("  \"threads\": %d,\n", options.threads);
+    printf("  \"qos\": %d,\n", static_cast<int>(options.qos));
+    printf("  \"payload_bytes\": %zu,\n", std::max(options.payloadBytes, sizeof(uint64_t)));
+    printf("  \"topics\": %d,\n", topics);
+    printf("  \"levels\": %d,\n", options.levels);
+    printf("  \"wildcard_percent\": %d,\n", options.wildcardPercent);
+    printf("  \"shared_groups\": %d,\n", options.sharedGroups);
+    printf("  \"rate_per_publisher\": %d,\n", options.rate);
+    printf("  \"seconds\": %.3f,\n", elapsed);
+    printf("  \"setup\": {\"ready\": %s, \"seconds\": %.3f, \"connect_latency_us\": %s},\n",
+           allReady ? "true" : "false", setupNs / 1e9, setupConnects.toJson().c_str());
+    printf("  \"connects\": {\"count\": %llu, \"per_second\": %.1f, \"failures\": %llu, \"latency_us\": %s},\n",
+           static_cast<unsigned long long>(connects), connects / elapsed, static_cast<unsigned long long>(failures),
+           connectLatency.toJson().c_str());
+    printf("  \"messages\": {\"published\": %llu, \"received\": %llu, \"published_per_second\": %.1f, "
+           "\"received_per_second\": %.1f},\n",
+           static_cast<unsigned long long>(published), static_cast<unsigned long long>(received),
+           published / elapsed, received / elapsed);
+    printf("  \"latency_us\": %s\n", latency.toJson().c_str());
+    printf("}\n");
+    return allReady ? 0 : 1;
+}
@@ -0,0 +1,365 @@
+#include "Frame.h"
+#include "Topic.h"
+#include "Trie.h"
+#include "Broker.h"
+#include "Session.h"
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+// Microbenchmarks of the codec, topic matching and routing, run in-process without sockets.
+//
+// Every benchmark reports allocs_per_op and bytes_per_op next to its time, counted by the
+// operator new below. Pass --benchmark_out=<file> --benchmark_out_format=json to keep results,
+// and diff two of them with compare.py from Google Benchmark's tools. Filter sizes stop at
+// 1M unless --max-filters raises them, since building 10M filters takes minutes and gigabytes.
+
+using namespace MQTT;
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> allocatedBytes{0};
+
+// Allocations made while the benchmark loop runs, reported per iteration
+class AllocationCounter {
+public:
+    explicit AllocationCounter(benchmark::State &state)
+        : state(state), count(allocations.load(std::memory_order_relaxed)),
+          bytes(allocatedBytes.load(std::memory_order_relaxed)) {}
+    ~AllocationCounter() {
+        pause();
+        state.counters["allocs_per_op"] = benchmark::Counter(double(count), benchmark::Counter::kAvgIterations);
+        state.counters["bytes_per_op"] = benchmark::Counter(double(bytes), benchmark::Counter::kAvgIterations);
+    }
+
+    // Together with State::PauseTiming(), to leave out the allocations of untimed setup
+    void pause() {
+        count = allocations.load(std::memory_order_relaxed) - count;
+        bytes = allocatedBytes.load(std::memory_order_relaxed) - bytes;
+    }
+    void resume() {
+        count = allocations.load(std::memory_order_relaxed) - count;
+        bytes = allocatedBytes.load(std::memory_order_relaxed) - bytes;
+    }
+
+private:
+    benchmark::State &state;
+    uint64_t count;
+    uint64_t bytes;
+};
+
+int64_t maxFilters = 1000000;
+
+std::vector<uint8_t> payloadOf(size_t size) {
+    return std::vector<uint8_t>(size, 'x');
+}
+
+// One packet of each type the broker parses from clients or serializes to them
+std::unique_ptr<Packet> packetOf(PacketType type, size_t payloadSize) {
+    switch (type) {
+    case PacketType::CONNECT: {
+        auto connect = std::make_unique<ConnectPacket>();
+        connect->protocolName = "MQTT";
+        connect->protocolVersion = Version::MQTT311;
+        connect->clientId = "microbench-client";
+        connect->keepAlive = 60;
+        connect->cleanStart = true;
+        connect->willFlag = false;
+        connect->willQos = QoS::QOS_0;
+        connect->willRetain = false;
+        return connect;
+    }
+    case PacketType::CONNACK:
+        return std::make_unique<ConnackPacket>(PacketType::CONNACK, false, ReasonCode::SUCCESS);
+    case PacketType::PUBLISH:
+        return std::make_unique<PublishPacket>("site/7/device/42/sensor/temperature", payloadOf(payloadSize),
+                                               QoS::QOS_1, false, 1);
+    case PacketType::PUBACK:
+        return std::make_unique<PubackPacket>(1);
+    case PacketType::SUBSCRIBE: {
+        auto subscribe = std::make_unique<SubscribePacket>();
+        subscribe->packetId = 1;
+        subscribe->subscriptions.emplace_back(
+            "site/+/device/#", SubscriptionOptions{QoS::QOS_1, false, false, RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES});
+        return subscribe;
+    }
+    case PacketType::PINGREQ:
+        return std::make_unique<PingreqPacket>();
+    default:
+        return nullptr;
+    }
+}
+
+void applyPacketArguments(benchmark::internal::Benchmark *benchmark) {
+    benchmark->ArgNames({"type", "payload"});
+    for (PacketType type : {PacketType::CONNECT, PacketType::CONNACK, PacketType::PUBACK,
+                            PacketType::SUBSCRIBE, PacketType::PINGREQ}) {
+        benchmark->Args({static_cast<int64_t>(type), 0});
+    }
+    for (int64_t size : {16, 256, 4096, 65536}) {
+        benchmark->Args({static_cast<int64_t>(PacketType::PUBLISH), size});
+    }
+}
+
+void BM_FrameParse(benchmark::State &state) {
+    Frame frame{Version::MQTT311};
+    std::vector<uint8_t> bytes =
+        frame.serialize(*packetOf(static_cast<PacketType>(state.range(0)), static_cast<size_t>(state.range(1))));
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(frame.parse(bytes.data(), bytes.size()));
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(bytes.size()));
+}
+BENCHMARK(BM_FrameParse)->Apply(applyPacketArguments);
+
+void BM_FrameSerialize(benchmark::State &state) {
+    Frame frame{Version::MQTT311};
+    std::unique_ptr<Packet> packet =
+        packetOf(static_cast<PacketType>(state.range(0)), static_cast<size_t>(state.range(1)));
+    size_t size = frame.serialize(*packet).size();
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(frame.serialize(*packet));
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(size));
+}
+BENCHMARK(BM_FrameSerialize)->Apply(applyPacketArguments);
+
+// The delivery path: a routed message encoded once and copied for every subscriber after the first
+void BM_FrameSerializeRouted(benchmark::State &state) {
+    Frame frame{Version::MQTT311};
+    MessageRef message = MessageRef::create(Message("site/7/device/42/sensor/temperature",
+                                                    std::string(static_cast<size_t>(state.range(0)), 'x')));
+    std::vector<uint8_t> buffer;
+    uint16_t packetId = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        buffer.clear();
+        frame.serializePublish(message, QoS::QOS_1, false, ++packetId ? packetId : ++packetId, false, buffer);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * int64_t(buffer.size()));
+}
+BENCHMARK(BM_FrameSerializeRouted)->ArgName("payload")->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+
+// Topics and filters shaped like a fleet of devices: sites, devices and sensors under each.
+// Most subscribers name one topic; the rest use + for a level or # for a subtree.
+class Workload {
+public:
+    explicit Workload(uint32_t seed = 1) : random(seed) {}
+
+    std::string topic() {
+        return "site/" + std::to_string(pick(100)) + "/device/" + std::to_string(pick(100000)) + "/sensor/" +
+               SENSORS[pick(SENSOR_COUNT)];
+    }
+
+    std::string filter() {
+        std::string site = std::to_string(pick(100));
+        std::string device = std::to_string(pick(100000));
+        std::string sensor = SENSORS[pick(SENSOR_COUNT)];
+        uint32_t kind = pick(100);
+        if (kind < 80) {
+            return "site/" + site + "/device/" + device + "/sensor/" + sensor;
+        } else if (kind < 90) {
+            return "site/+/device/" + device + "/sensor/" + sensor;
+        } else if (kind < 95) {
+            return "site/" + site + "/device/" + device + "/#";
+        }
+        return "site/" + site + "/device/+/sensor/" + sensor;
+    }
+
+private:
+    static constexpr uint32_t SENSOR_COUNT = 8;
+    static constexpr const char *SENSORS[SENSOR_COUNT] = {"temperature", "humidity", "pressure", "voltage",
+                                                         "current", "rssi", "battery", "status"};
+    std::mt19937 random;
+
+    uint32_t pick(uint32_t bound) { return random() % bound; }
+};
+
+void BM_TopicSplit(benchmark::State &state) {
+    std::string topic = Workload().topic();
+    std::vector<std::string> levels;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        Topic::split(topic, levels);
+        benchmark::DoNotOptimize(levels.data());
+    }
+}
+BENCHMARK(BM_TopicSplit);
+
+void BM_TopicMatch(benchmark::State &state) {
+    Workload workload;
+    std::vector<std::string> topics, filters;
+    for (int i = 0; i < 1024; i++) {
+        topics.push_back(workload.topic());
+        filters.push_back(workload.filter());
+    }
+    size_t i = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Topic::match(topics[i & 1023], filters[i & 1023]));
+        i++;
+    }
+}
+BENCHMARK(BM_TopicMatch);
+
+void applyFilterCounts(benchmark::internal::Benchmark *benchmark) {
+    benchmark->ArgName("filters");
+    for (int64_t count = 1000; count <= maxFilters; count *= 10) {
+        benchmark->Arg(count);
+    }
+}
+
+// Tries are built once per size and shared by the match benchmarks, as building the large ones
+// takes far longer than measuring them
+Trie &trieOf(int64_t count) {
+    static std::map<int64_t, std::unique_ptr<Trie>> tries;
+    auto &trie = tries[count];
+    if (!trie) {
+        trie = std::make_unique<Trie>();
+        Workload workload;
+        for (int64_t i = 0; i < count; i++) {
+            trie->insert(workload.filter());
+        }
+    }
+    return *trie;
+}
+
+void BM_TrieInsert(benchmark::State &state) {
+    Trie &trie = trieOf(state.range(0));
+    Workload workload(2);
+    std::vector<std::string> filters;
+    for (int i = 0; i < 4096; i++) {
+        filters.push_back(workload.filter());
+    }
+    size_t i = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        // Removing again keeps the trie at its size; the pair is what a resubscribe costs
+        trie.insert(filters[i & 4095]);
+        trie.remove(filters[i & 4095]);
+        i++;
+    }
+}
+
+void BM_TrieMatch(benchmark::State &state) {
+    Trie &trie = trieOf(state.range(0));
+    Workload workload(3);
+    std::vector<std::string> topics;
+    for (int i = 0; i < 4096; i++) {
+        topics.push_back(workload.topic());
+    }
+    size_t i = 0, matched = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        matched += trie.match(topics[i & 4095]).size();
+        i++;
+    }
+    state.counters["matches_per_op"] = benchmark::Counter(double(matched), benchmark::Counter::kAvgIterations);
+}
+
+void BM_TrieRemove(benchmark::State &state) {
+    Trie trie;
+    Workload workload;
+    std::vector<std::string> filters;
+    for (int64_t i = 0; i < state.range(0); i++) {
+        filters.push_back(workload.filter());
+    }
+    size_t i = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        // Each round of removals needs a full trie; only the removals are timed
+        if (i % filters.size() == 0) {
+            state.PauseTiming();
+            counter.pause();
+            for (const auto &filter : filters) {
+                trie.insert(filter);
+            }
+            counter.resume();
+            state.ResumeTiming();
+        }
+        trie.remove(filters[i % filters.size()]);
+        i++;
+    }
+}
+BENCHMARK(BM_TrieRemove)->ArgName("filters")->Arg(1000)->Arg(10000)->Arg(100000);
+
+// Fan-out of one QoS 0 publish to every connected subscriber of its topic, half of them through a wildcard
+void BM_BrokerPublish(benchmark::State &state) {
+    Broker broker;
+    std::vector<std::unique_ptr<Session>> sessions;
+    uint64_t delivered = 0;
+    SubscriptionOptions options{QoS::QOS_0, false, false, RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    for (int64_t i = 0; i < state.range(0); i++) {
+        auto session = std::make_unique<Session>(&broker, "subscriber-" + std::to_string(i));
+        session->setDeliverCallback([&](const MessageRef &, uint16_t, QoS, bool) { delivered++; });
+        session->connect();
+        session->subscribe(i % 2 ? "site/7/device/+/sensor/temperature" : "site/7/device/42/sensor/temperature",
+                           options);
+        sessions.push_back(std::move(session));
+    }
+    MessageRef message = MessageRef::create(Message("site/7/device/42/sensor/temperature", std::string(64, 'x')));
+    AllocationCounter counter(state);
+    for (auto _ : state) {
+        broker.publish(message);
+    }
+    state.counters["deliveries_per_op"] = benchmark::Counter(double(delivered), benchmark::Counter::kAvgIterations);
+    state.SetItemsProcessed(int64_t(delivered));
+}
+BENCHMARK(BM_BrokerPublish)
+    ->ArgName("subscribers")
+    ->RangeMultiplier(10)
+    ->Range(1, 100000)
+    ->Unit(benchmark::kMicrosecond);
+
+}
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+int main(int argc, char *argv[]) {
+    // --max-filters=<n> is ours; everything else goes to Google Benchmark
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--max-filters=", 14) == 0) {
+            maxFilters = std::atoll(argv[i] + 14);
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    // Registered here rather than statically, once the sizes are known
+    benchmark::RegisterBenchmark("BM_TrieInsert", BM_TrieInsert)->Apply(applyFilterCounts);
+    benchmark::RegisterBenchmark("BM_TrieMatch", BM_TrieMatch)->Apply(applyFilterCounts);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,262 @@
+#include "Capture.h"
+#include "Connection.h"
+#include "Broker.h"
+#include "Metrics.h"
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <csignal>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Replays a capture recorded with flowmq -c through an in-process broker.
+//
+// Every captured connection gets a socket pair: the broker end is served by a
+// Connection on its own thread, exactly as Server does for an accepted client,
+// and the bytes the client sent are written to the other end in the recorded
+// order, at the recorded pace scaled by -x or, with -x 0, as fast as the broker
+// takes them. What the broker sends back is read and counted. Each connection
+// gets the same bytes in the same order on every run; how the connection
+// threads interleave is up to the scheduler, as it was when recording.
+
+using namespace MQTT;
+
+namespace {
+
+struct Options {
+    std::string capturePath;
+    // 1 replays at the recorded pace, 2 twice as fast, 0 without waiting
+    double speed = 1;
+    std::string dataDirectory;
+};
+
+uint64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Replayed {
+    int fd = -1;
+    std::thread thread;
+};
+
+// Reads and counts everything the broker writes to the client ends
+class Drain {
+public:
+    Drain() : epollFd(epoll_create1(0)) {
+        if (epollFd < 0) {
+            throw std::runtime_error(std::string("epoll_create1: ") + strerror(errno));
+        }
+        thread = std::thread(&Drain::loop, this);
+    }
+    ~Drain() {
+        stopping = true;
+        thread.join();
+        close(epollFd);
+    }
+
+    void add(int fd) {
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+    void remove(int fd) { epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr); }
+    uint64_t getBytes() const { return bytes.load(); }
+
+private:
+    int epollFd;
+    std::atomic<bool> stopping{false};
+    std::atomic<uint64_t> bytes{0};
+    std::thread thread;
+
+    void loop() {
+        epoll_event events[64];
+        uint8_t buffer[65536];
+        while (!stopping) {
+            int ready = epoll_wait(epollFd, events, 64, 100);
+            for (int i = 0; i < ready; i++) {
+                ssize_t length = recv(events[i].data.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+                if (length > 0) {
+                    bytes += length;
+                } else if (length == 0) {
+                    remove(events[i].data.fd);
+                }
+            }
+        }
+    }
+};
+
+void writeAll(int fd, const std::vector<uint8_t> &bytes) {
+    size_t offset = 0;
+    while (offset < bytes.size()) {
+        ssize_t written = write(fd, bytes.data() + offset, bytes.size() - offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // The broker closed the connection, as it did when recording
+            return;
+        }
+        offset += written;
+    }
+}
+
+void finish(Drain &drain, Replayed &replayed) {
+    shutdown(replayed.fd, SHUT_WR);
+    replayed.thread.join();
+    drain.remove(replayed.fd);
+    close(replayed.fd);
+}
+
+// Upper bound of the bucket holding the given quantile of a histogram, in microseconds
+double quantileUs(Histogram histogram, double quantile) {
+    std::vector<uint64_t> buckets = Metrics::getHistogram(histogram);
+    uint64_t total = 0;
+    for (uint64_t count : buckets) {
+        total += count;
+    }
+    uint64_t rank = static_cast<uint64_t>(quantile * total);
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < Metrics::BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (total && seen > rank) {
+            return (bucket + 1 < Metrics::BUCKETS ? Metrics::bucketLowerBound(bucket + 1) : ~0ull) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+void usage(const char *program) {
+    std::cerr << "Usage: " << program << " -f capture-file [-x speed] [-d data-directory]" << std::endl;
+}
+
+bool parseOptions(int argc, char *argv[], Options &options) {
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char *flag = argv[i];
+        const char *value = argv[++i];
+        if (std::strcmp(flag, "-f") == 0) {
+            options.capturePath = value;
+        } else if (std::strcmp(flag, "-x") == 0) {
+            options.speed = std::atof(value);
+        } else if (std::strcmp(flag, "-d") == 0) {
+            options.dataDirectory = value;
+        } else {
+            return false;
+        }
+    }
+    return !options.capturePath.empty() && options.speed >= 0;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::vector<CaptureRecord> records;
+    try {
+        records = Capture::read(options.capturePath);
+    } catch (const std::exception &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Either end may close while the other still writes, as clients and the broker did when recording
+    signal(SIGPIPE, SIG_IGN);
+
+    BrokerConfig config;
+    config.dataDirectory = options.dataDirectory;
+    // $SYS publishes are not part of the capture
+    config.sysIntervalMs = 0;
+    Broker broker(config);
+    uint64_t bytesIn = 0, connections = 0;
+    uint64_t startedAt = nowNs();
+    {
+        Drain drain;
+        std::map<uint32_t, Replayed> replaying;
+        for (const CaptureRecord &record : records) {
+            if (options.speed > 0) {
+                uint64_t dueAt = startedAt + static_cast<uint64_t>(record.at / options.speed);
+                uint64_t now = nowNs();
+                if (dueAt > now) {
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(dueAt - now));
+                }
+            }
+            auto it = replaying.find(record.connection);
+            switch (record.event) {
+            case CaptureEvent::OPEN: {
+                int fds[2];
+                if (it != replaying.end() || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+                    break;
+                }
+                Replayed &replayed = replaying[record.connection];
+                replayed.fd = fds[0];
+                int brokerFd = fds[1];
+                replayed.thread = std::thread([&broker, brokerFd] {
+                    {
+                        Connection connection(brokerFd, &broker);
+                        connection.run();
+                    }
+                    close(brokerFd);
+                });
+                drain.add(replayed.fd);
+                connections++;
+                break;
+            }
+            case CaptureEvent::DATA:
+                if (it != replaying.end()) {
+                    writeAll(it->second.fd, record.bytes);
+                    bytesIn += record.bytes.size();
+                }
+                break;
+            case CaptureEvent::CLOSE:
+                if (it != replaying.end()) {
+                    finish(drain, it->second);
+                    replaying.erase(it);
+                }
+                break;
+            }
+        }
+        // Connections still open when the capture ended
+        for (auto &entry : replaying) {
+            finish(drain, entry.second);
+        }
+        double elapsed = (nowNs() - startedAt) / 1e9;
+        double recorded = records.empty() ? 0 : records.back().at / 1e9;
+        uint64_t packets = 0;
+        for (int type = 1; type < 16; type++) {
+            packets += Metrics::getPacketsReceived(static_cast<PacketType>(type));
+        }
+        printf("{\n");
+        printf("  \"capture\": \"%s\",\n", options.capturePath.c_str());
+        printf("  \"speed\": %g,\n", options.speed);
+        printf("  \"records\": %zu,\n", records.size());
+        printf("  \"connections\": %llu,\n", static_cast<unsigned long long>(connections));
+        printf("  \"recorded_seconds\": %.3f,\n", recorded);
+        printf("  \"seconds\": %.3f,\n", elapsed);
+        printf("  \"bytes_in\": %llu,\n", static_cast<unsigned long long>(bytesIn));
+        printf("  \"bytes_out\": %llu,\n", static_cast<unsigned long long>(drain.getBytes()));
+        printf("  \"packets\": {\"count\": %llu, \"per_second\": %.1f},\n", static_cast<unsigned long long>(packets),
+               packets / elapsed);
+        printf("  \"loop_us\": {\"p50\": %.1f, \"p99\": %.1f},\n", quantileUs(Histogram::LOOP_NANOSECONDS, 0.5),
+               quantileUs(Histogram::LOOP_NANOSECONDS, 0.99));
+        printf("  \"route_us\": {\"p50\": %.1f, \"p99\": %.1f}\n", quantileUs(Histogram::ROUTE_NANOSECONDS, 0.5),
+               quantileUs(Histogram::ROUTE_NANOSECONDS, 0.99));
+        printf("}\n");
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include "Arena.h"
+#include <new>
+
+namespace MQTT {
+
+Arena::~Arena() {
+    for (Chunk &chunk : chunks) {
+        ::operator delete(chunk.data);
+    }
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+    while (current < chunks.size()) {
+        Chunk &chunk = chunks[current];
+        size_t aligned = (offset + alignment - 1) & ~(alignment - 1);
+        if (aligned + size <= chunk.size) {
+            offset = aligned + size;
+            used += size;
+            return chunk.data + aligned;
+        }
+        current++;
+        offset = 0;
+    }
+    // operator new returns max_align_t aligned memory, which covers every alignment used here
+    size_t chunkSize = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+    chunks.push_back(Chunk{static_cast<uint8_t *>(::operator new(chunkSize)), chunkSize});
+    current = chunks.size() - 1;
+    offset = size;
+    used += size;
+    return chunks.back().data;
+}
+
+void Arena::reset() {
+    current = 0;
+    offset = 0;
+    used = 0;
+}
+
+size_t Arena::getCapacity() const {
+    size_t capacity = 0;
+    for (const Chunk &chunk : chunks) {
+        capacity += chunk.size;
+    }
+    return capacity;
+}
+
+}
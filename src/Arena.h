@@ -0,0 +1,68 @@
+#ifndef ARENA_H
+#define ARENA_H
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+namespace MQTT {
+
+// Bump allocator for data that dies together, such as the packets parsed
+// from one read batch. Allocation moves a pointer; nothing is freed
+// individually and reset() makes all of it reusable at once. Chunks are kept
+// across resets, so a connection in steady state allocates nothing.
+class Arena {
+public:
+    static constexpr size_t CHUNK_SIZE = 16 * 1024;
+
+    Arena() = default;
+    ~Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+    // Everything allocated so far must no longer be in use
+    void reset();
+
+    size_t getUsedBytes() const { return used; }
+    size_t getCapacity() const;
+
+private:
+    struct Chunk {
+        uint8_t *data;
+        size_t size;
+    };
+
+    std::vector<Chunk> chunks;
+    size_t current = 0;
+    size_t offset = 0;
+    size_t used = 0;
+};
+
+// Standard allocator over an Arena; deallocate is a no-op
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    explicit ArenaAllocator(Arena &arena) noexcept : arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) noexcept : arena(other.arena) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T*, size_t) noexcept {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const noexcept { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const noexcept { return arena != other.arena; }
+
+    Arena *arena;
+};
+
+}
+
+#endif // ARENA_H
@@ -1,136 +1,663 @@
 #include "Broker.h"
 #include "Topic.h"
 #include "Session.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Probes.h"
+#include <chrono>
 #include <iostream>
 #include <thread>
-#include <random>
+#include <algorithm>
 
 namespace MQTT {
 
-Broker::Broker() : trie(std::make_unique<Trie>()) {}
+Broker::Broker(const BrokerConfig &config) : config(config), trie(std::make_unique<Trie>()) {
+    if (config.dataDirectory.empty()) {
+        retained = std::make_unique<RetainedStore>();
+    } else {
+        retained = std::make_unique<RetainedStore>(config.dataDirectory + "/retained");
+        wal = std::make_unique<WriteAheadLog>(config.dataDirectory + "/wal", config.walCommitIntervalUs,
+                                              config.walCommitBytes);
+        recovered = wal->recover();
+    }
+}
 
-void Broker::insertSession(const std::string &clientId, Session* session) {
-    sessions[clientId] = session;
+SessionHandle Broker::insertSession(const std::string &clientId, Session* session) {
+    return sessions.insert(clientId, session);
 }
 
-Session* Broker::findSession(const std::string &clientId) const {
-    auto it = sessions.find(clientId);
-    if (it != sessions.end()) {
-        return it->second;
+Broker::~Broker() {
+    // Sessions unsubscribe on destruction, so they must go while the routing state is still alive
+    ownedSessions.clear();
+}
+
+Session* Broker::openSession(const std::string &clientId, bool cleanStart, bool &sessionPresent) {
+    std::unique_lock<std::mutex> guard(sessionLock);
+    return openSessionLocked(guard, clientId, cleanStart, sessionPresent);
+}
+
+Session* Broker::attachSession(const std::string &clientId, bool cleanStart, bool &sessionPresent,
+                               std::function<void()> onTakeover) {
+    std::unique_lock<std::mutex> guard(sessionLock);
+    Session* session = openSessionLocked(guard, clientId, cleanStart, sessionPresent);
+    session->attached = true;
+    session->setDisconnectCallback(std::move(onTakeover));
+    // Off the offline LRU, so neither the reaper nor eviction takes it before the connection connects
+    activateSession(session);
+    return session;
+}
+
+Session* Broker::openSessionLocked(std::unique_lock<std::mutex> &guard, const std::string &clientId,
+                                   bool cleanStart, bool &sessionPresent) {
+    auto it = ownedSessions.find(clientId);
+    // Session takeover: the previous connection is closed, and the session is only resumed or
+    // discarded once that connection's thread is done with it
+    while (it != ownedSessions.end() && it->second->attached) {
+        Session* previous = it->second.get();
+        if (!previous->takenOver) {
+            previous->takenOver = true;
+            if (previous->isConnected()) {
+                previous->disconnect();
+                armWill(previous, MessageBlock::currentTime());
+            } else if (previous->onDisconnect) {
+                previous->onDisconnect();
+            }
+        }
+        sessionDetached.wait(guard);
+        it = ownedSessions.find(clientId);
+    }
+    uint64_t now = MessageBlock::currentTime();
+    if (it != ownedSessions.end()) {
+        if (it->second->isConnected()) {
+            // Connected without a connection thread of its own, as in tests, or by one taken over as it connected
+            it->second->disconnect();
+            armWill(it->second.get(), now);
+        }
+        // An expired session the reaper has not got to yet is gone as far as the client can tell
+        uint64_t expiresAt = it->second->getExpiresAt();
+        if (cleanStart || (expiresAt && expiresAt <= now)) {
+            ownedSessions.erase(it);
+            it = ownedSessions.end();
+        }
+    }
+    settleWill(clientId, it == ownedSessions.end(), now);
+    sessionPresent = it != ownedSessions.end();
+    if (!sessionPresent) {
+        it = ownedSessions.emplace(clientId, std::make_unique<Session>(this, clientId, cleanStart)).first;
+    }
+    return it->second.get();
+}
+
+void Broker::closeSession(Session* session) {
+    std::lock_guard<std::mutex> guard(sessionLock);
+    closeSessionLocked(session);
+}
+
+void Broker::detachSession(Session* &session) {
+    std::lock_guard<std::mutex> guard(sessionLock);
+    if (!session) {
+        return;
+    }
+    Session* closing = session;
+    closing->setDeliverCallback(nullptr);
+    closing->setDisconnectCallback(nullptr);
+    closing->setResendCallback(nullptr);
+    closing->detachInbox();
+    session = nullptr;
+    bool takenOver = closing->takenOver;
+    closing->attached = false;
+    closing->takenOver = false;
+    if (!takenOver) {
+        // A connection that ended before it connected parks the session it opened like any other
+        if (!closing->isConnected() && closing->getExpiryInterval() != 0) {
+            closing->disconnect();
+        }
+        closeSessionLocked(closing);
+    }
+    sessionDetached.notify_all();
+}
+
+void Broker::closeSessionLocked(Session* session) {
+    auto it = ownedSessions.find(session->getClientId());
+    if (it == ownedSessions.end() || it->second.get() != session) {
+        return;
+    }
+    armWill(session, MessageBlock::currentTime());
+    if (session->getExpiryInterval() == 0) {
+        ownedSessions.erase(it);
+    } else if (session->isConnected()) {
+        session->disconnect();
+    }
+}
+
+void Broker::armWill(Session* session, uint64_t nowMs) {
+    std::unique_ptr<Will> will = session->takeWill();
+    if (!will) {
+        return;
+    }
+    // The will goes out when the session ends if that comes before the delay runs out
+    uint32_t delay = std::min(will->delay, session->getExpiryInterval());
+    uint64_t fireAt = nowMs + uint64_t(delay) * 1000;
+    std::lock_guard<std::mutex> guard(willLock);
+    pendingWills.insert_or_assign(session->getClientId(), PendingWill{std::move(*will), fireAt});
+    willTimers.schedule(fireAt, session->getClientId());
+    uint64_t next = nextWillAt.load(std::memory_order_relaxed);
+    if (next == 0 || fireAt < next) {
+        nextWillAt.store(fireAt, std::memory_order_relaxed);
+    }
+}
+
+void Broker::settleWill(const std::string &clientId, bool sessionEnded, uint64_t nowMs) {
+    std::lock_guard<std::mutex> guard(willLock);
+    auto it = pendingWills.find(clientId);
+    if (it == pendingWills.end() || it->second.fireAt <= nowMs) {
+        return;
+    }
+    if (!sessionEnded) {
+        pendingWills.erase(it);
+        return;
+    }
+    it->second.fireAt = nowMs;
+    willTimers.schedule(nowMs, clientId);
+    nextWillAt.store(nowMs, std::memory_order_relaxed);
+}
+
+size_t Broker::fireWills(uint64_t nowMs) {
+    uint64_t next = nextWillAt.load(std::memory_order_relaxed);
+    if (next == 0 || nowMs < next) {
+        return 0;
+    }
+    std::vector<MessageRef> batch;
+    {
+        std::lock_guard<std::mutex> guard(willLock);
+        willTimers.expire(nowMs, [&](uint64_t fireAt, const std::string &clientId) {
+            // Cancelled wills, and ones moved earlier, left their old timers behind
+            auto it = pendingWills.find(clientId);
+            if (it == pendingWills.end() || it->second.fireAt != fireAt) {
+                return;
+            }
+            Will &will = it->second.will;
+            if (will.messageExpiry) {
+                will.message.expiresAt = nowMs + uint64_t(will.messageExpiry) * 1000;
+            }
+            if (wal && will.message.qos > QoS::QOS_0) {
+                wal->logMessage(will.message);
+            }
+            batch.push_back(MessageRef::create(will.message));
+            pendingWills.erase(it);
+        });
+        nextWillAt.store(willTimers.next(), std::memory_order_relaxed);
+    }
+    if (!batch.empty()) {
+        publish(batch);
+    }
+    return batch.size();
+}
+
+size_t Broker::getPendingWillCount() {
+    std::lock_guard<std::mutex> guard(willLock);
+    return pendingWills.size();
+}
+
+size_t Broker::publishSys(uint64_t nowMs) {
+    uint64_t publishAt = nextSysAt.load(std::memory_order_relaxed);
+    if (config.sysIntervalMs == 0 || nowMs < publishAt ||
+        !nextSysAt.compare_exchange_strong(publishAt, nowMs + config.sysIntervalMs)) {
+        return 0;
     }
-    return nullptr;
+    // A publisher still busy with the previous interval keeps it
+    std::unique_lock<std::mutex> guard(sysLock, std::try_to_lock);
+    return guard.owns_lock() ? sysTopics.publish(nowMs) : 0;
+}
+
+bool Broker::takeRecovered(const std::string &clientId, WriteAheadLog::Recovered &state) {
+    auto it = recovered.find(clientId);
+    if (it == recovered.end()) {
+        return false;
+    }
+    state = std::move(it->second);
+    recovered.erase(it);
+    return true;
+}
+
+Session* Broker::findSession(const std::string &clientId) const {
+    return sessions.get(sessions.find(clientId));
+}
+
+bool Broker::ownsSession(const Session* session) const {
+    auto it = ownedSessions.find(session->getClientId());
+    return it != ownedSessions.end() && it->second.get() == session;
+}
+
+void Broker::activateSession(Session* session) {
+    std::lock_guard<std::mutex> guard(expiryLock);
+    unlinkOffline(session);
 }
 
-void Broker::removeSession(const std::string &clientId) {
-    sessions.erase(clientId);
+void Broker::parkSession(Session* session) {
+    std::lock_guard<std::mutex> guard(expiryLock);
+    unlinkOffline(session);
+    session->offlinePosition = offlineSessions.insert(offlineSessions.end(), session);
+    session->parked = true;
+    updateOfflineMemoryLocked(session);
+    if (session->getExpiresAt()) {
+        sessionExpiry.schedule(session->getExpiresAt(), session->getHandle());
+    }
 }
 
 void Broker::removeSession(Session* session) {
-    sessions.erase(session->getClientId());
-}   
+    // Sessions reaped together were erased and waited for at once
+    if (sessions.erase(session->getHandle())) {
+        SessionRegistry::waitForReaders();
+    }
+    std::lock_guard<std::mutex> guard(expiryLock);
+    unlinkOffline(session);
+}
+
+void Broker::unlinkOffline(Session* session) {
+    if (!session->parked) {
+        return;
+    }
+    offlineSessions.erase(session->offlinePosition);
+    offlineBytes.fetch_sub(session->chargedBytes, std::memory_order_relaxed);
+    session->chargedBytes = 0;
+    session->parked = false;
+}
+
+void Broker::updateOfflineMemory(Session* session) {
+    std::lock_guard<std::mutex> guard(expiryLock);
+    updateOfflineMemoryLocked(session);
+}
+
+void Broker::updateOfflineMemoryLocked(Session* session) {
+    if (!session->parked) {
+        return;
+    }
+    size_t bytes = session->getMemoryBytes();
+    // Unsigned wrap-around makes this a subtraction when the session shrank
+    offlineBytes.fetch_add(bytes - session->chargedBytes, std::memory_order_relaxed);
+    session->chargedBytes = bytes;
+}
+
+bool Broker::hasSubscribers(const std::string &topicFilter) const {
+    return subscriptions.find(topicFilter) != subscriptions.end() ||
+           sharedSubscriptions.find(topicFilter) != sharedSubscriptions.end();
+}
 
 int Broker::getConnectedClients() const {
-    return sessions.size();
+    SessionRegistry::ReadGuard guard;
+    int connected = 0;
+    sessions.forEach([&](const Session *session) { connected += session->isConnected(); });
+    return connected;
 }
 
 bool Broker::isSubscribed(const std::string &clientId, const std::string &topicFilter) const {
+    std::shared_lock<RoutingLock> guard(routingLock);
     auto it = subscriptions.find(topicFilter);
     if (it != subscriptions.end()) {
-        return it->second.find(clientId) != it->second.end();
+        SessionHandle handle = sessions.find(clientId);
+        return handle != INVALID_SESSION && it->second.count(handle) > 0;
     }
     return false;
 }
 
 std::set<std::string> Broker::getSubscriptions(const std::string &topicFilter) {
     std::set<std::string> clientIds;
-    if (subscriptions.find(topicFilter) != subscriptions.end()) {
-        clientIds = subscriptions[topicFilter];
+    SessionRegistry::ReadGuard readers;
+    std::shared_lock<RoutingLock> guard(routingLock);
+    auto it = subscriptions.find(topicFilter);
+    if (it != subscriptions.end()) {
+        for (SessionHandle handle : it->second) {
+            if (Session* session = sessions.get(handle)) {
+                clientIds.insert(session->getClientId());
+            }
+        }
     }
     return clientIds;
 }
 
-void Broker::subscribe(const std::string &clientId, const std::string &topicFilter) {
-    std::set<std::string> clientIds;
-    if (subscriptions.find(topicFilter) == subscriptions.end()) {
+void Broker::subscribe(SessionHandle handle, const std::string &topicFilter) {
+    std::unique_lock<RoutingLock> guard(routingLock);
+    subscribeLocked(handle, topicFilter);
+}
+
+void Broker::subscribeLocked(SessionHandle handle, const std::string &topicFilter) {
+    auto it = subscriptions.find(topicFilter);
+    if (it == subscriptions.end()) {
         trie->insert(topicFilter);
-    } else {
-        clientIds = subscriptions[topicFilter];
+        it = subscriptions.emplace(topicFilter, Subscribers()).first;
+        Metrics::charge(MemoryTag::SUBSCRIPTIONS, heapBytes(it->first));
+    }
+    if (it->second.insert(handle).second) {
+        subscriptionCount.fetch_add(1, std::memory_order_relaxed);
     }
-    clientIds.insert(clientId);
-    subscriptions[topicFilter] = clientIds;
 }
 
-void Broker::unsubscribe(const std::string &clientId, const std::string &topicFilter) {
-    std::set<std::string> clientIds;
-    if (subscriptions.find(topicFilter) == subscriptions.end()) {
+void Broker::unsubscribe(SessionHandle handle, const std::string &topicFilter) {
+    std::unique_lock<RoutingLock> guard(routingLock);
+    unsubscribeLocked(handle, topicFilter);
+}
+
+void Broker::unsubscribeLocked(SessionHandle handle, const std::string &topicFilter) {
+    auto it = subscriptions.find(topicFilter);
+    if (it == subscriptions.end()) {
         return;
     }
+    if (it->second.erase(handle)) {
+        subscriptionCount.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (it->second.empty()) {
+        Metrics::charge(MemoryTag::SUBSCRIPTIONS, -static_cast<int64_t>(heapBytes(it->first)));
+        subscriptions.erase(it);
+        if (!hasSubscribers(topicFilter)) {
+            trie->remove(topicFilter);
+        }
+    }
+}
+
+void Broker::sharedSubscribe(SessionHandle handle, const std::string &topicFilter, const std::string &group) {
+    LOG_DEBUG("Broker::sharedSubscribe: %08x %s %s", handle, topicFilter.c_str(), group.c_str());
+    std::unique_lock<RoutingLock> guard(routingLock);
+    sharedSubscribeLocked(handle, topicFilter, group);
+}
+
+void Broker::sharedSubscribeLocked(SessionHandle handle, const std::string &topicFilter, const std::string &group) {
+    if (!hasSubscribers(topicFilter)) {
+        trie->insert(topicFilter);
+    }
+    auto &sharedGroup = sharedSubscriptions[topicFilter][group];
+    if (!sharedGroup) {
+        sharedGroup = std::make_unique<SharedGroup>(group, topicFilter);
+    }
+    if (sharedGroup->add(handle)) {
+        subscriptionCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
 
-    clientIds = subscriptions[topicFilter];
-    clientIds.erase(clientId);
+void Broker::sharedUnsubscribe(SessionHandle handle, const std::string &topicFilter, const std::string &group) {
+    std::unique_lock<RoutingLock> guard(routingLock);
+    sharedUnsubscribeLocked(handle, topicFilter, group);
+}
 
-    if (clientIds.empty()) {
-        trie->remove(topicFilter);
-        subscriptions.erase(topicFilter);
+void Broker::subscribe(Session* session, const std::string &topicFilter, const SubscriptionOptions &options) {
+    std::unique_lock<RoutingLock> guard(routingLock);
+    if (Topic::isShared(topicFilter)) {
+        auto [group, realTopicFilter] = Topic::splitShared(topicFilter);
+        sharedSubscribeLocked(session->getHandle(), realTopicFilter, group);
     } else {
-        subscriptions[topicFilter] = clientIds;
+        subscribeLocked(session->getHandle(), topicFilter);
     }
+    session->subscriptions[topicFilter] = options;
 }
 
-void Broker::sharedSubscribe(const std::string &clientId, const std::string &topicFilter, const std::string &group) {
-    printf("Broker::sharedSubscribe: %s %s %s\n", clientId.c_str(), topicFilter.c_str(), group.c_str());
-    SharedSubscription sharedSubscription(clientId, topicFilter, group);
-    if (sharedSubscriptions.find(topicFilter) == sharedSubscriptions.end()) {
-        sharedSubscriptions[topicFilter] = std::vector<SharedSubscription>();
-    }   
-    sharedSubscriptions[topicFilter].push_back(sharedSubscription);
-    trie->insert(topicFilter);
+void Broker::unsubscribe(Session* session, const std::string &topicFilter) {
+    std::unique_lock<RoutingLock> guard(routingLock);
+    if (Topic::isShared(topicFilter)) {
+        auto [group, realTopicFilter] = Topic::splitShared(topicFilter);
+        sharedUnsubscribeLocked(session->getHandle(), realTopicFilter, group);
+    } else {
+        unsubscribeLocked(session->getHandle(), topicFilter);
+    }
+    session->subscriptions.erase(topicFilter);
 }
 
-void Broker::sharedUnsubscribe(const std::string &clientId, const std::string &topicFilter, const std::string &group) {   
-    SharedSubscription sharedSubscription(clientId, topicFilter, group);
-    if (sharedSubscriptions.find(topicFilter) == sharedSubscriptions.end()) {
+void Broker::sharedUnsubscribeLocked(SessionHandle handle, const std::string &topicFilter, const std::string &group) {
+    auto it = sharedSubscriptions.find(topicFilter);
+    if (it == sharedSubscriptions.end()) {
+        return;
+    }
+    auto groupIt = it->second.find(group);
+    if (groupIt == it->second.end() || !groupIt->second->remove(handle)) {
         return;
     }
-    auto& sharedSubs = sharedSubscriptions[topicFilter];
-    auto it = std::find(sharedSubs.begin(), sharedSubs.end(), sharedSubscription);
-    if (it != sharedSubs.end()) {
-        sharedSubs.erase(it);
+    subscriptionCount.fetch_sub(1, std::memory_order_relaxed);
+
+    if (groupIt->second->empty()) {
+        it->second.erase(groupIt);
     }
-    if (sharedSubs.empty()) {
-        sharedSubscriptions.erase(topicFilter);
+    if (it->second.empty()) {
+        sharedSubscriptions.erase(it);
+        if (!hasSubscribers(topicFilter)) {
+            trie->remove(topicFilter);
+        }
     }
 }
 
-static int randIdx(int size) {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, size - 1);
-    return dis(gen);
+const SharedGroup* Broker::findSharedGroup(const std::string &topicFilter, const std::string &group) const {
+    std::shared_lock<RoutingLock> guard(routingLock);
+    auto it = sharedSubscriptions.find(topicFilter);
+    if (it == sharedSubscriptions.end()) {
+        return nullptr;
+    }
+    auto groupIt = it->second.find(group);
+    return groupIt != it->second.end() ? groupIt->second.get() : nullptr;
+}
+
+std::vector<MessageRef> Broker::getRetained(const std::string &topicFilter) const {
+    return retained->match(topicFilter);
+}
+
+size_t Broker::getRetainedCount() const {
+    // Statistics do not wait for the retained segments to load
+    return retained->loadedSize();
+}
+
+void Broker::scheduleExpiry(SessionHandle handle, uint64_t expiresAt) {
+    std::lock_guard<std::mutex> guard(expiryLock);
+    queueExpiry.schedule(expiresAt, handle);
+}
+
+size_t Broker::sweepExpired(uint64_t nowMs) {
+    uint64_t sweepAt = nextSweepAt.load(std::memory_order_relaxed);
+    if (config.expirySweepIntervalMs == 0 || nowMs < sweepAt ||
+        !nextSweepAt.compare_exchange_strong(sweepAt, nowMs + config.expirySweepIntervalMs)) {
+        return 0;
+    }
+    std::vector<std::pair<uint64_t, SessionHandle>> due;
+    {
+        std::lock_guard<std::mutex> guard(expiryLock);
+        queueExpiry.expire(nowMs, [&](uint64_t expiresAt, SessionHandle handle) { due.emplace_back(expiresAt, handle); });
+    }
+    size_t removed = 0;
+    {
+        // Keeps the sessions from being destroyed while they are purged
+        std::lock_guard<std::mutex> guard(sessionLock);
+        for (const auto &[expiresAt, handle] : due) {
+            Session* session = sessions.get(handle);
+            if (session) {
+                removed += session->purgeExpired(nowMs, expiresAt);
+            }
+        }
+    }
+    removed += retained->sweepExpired(nowMs);
+    reapSessions(nowMs);
+    Memory::checkLimits();
+    return removed;
+}
+
+size_t Broker::reapSessions(uint64_t nowMs) {
+    std::lock_guard<std::mutex> sessionGuard(sessionLock);
+    std::vector<Session*> reaped;
+    {
+        std::lock_guard<std::mutex> guard(expiryLock);
+        sessionExpiry.advance(nowMs, [&](uint64_t expiresAt, SessionHandle handle) {
+            // Sessions that reconnected, or disconnected again since, hold another deadline
+            Session* session = sessions.get(handle);
+            if (session && session->parked && session->getExpiresAt() == expiresAt && ownsSession(session)) {
+                unlinkOffline(session);
+                reaped.push_back(session);
+            }
+        });
+        size_t limit = config.offlineSessionMemoryBytes;
+        for (auto it = offlineSessions.begin(); limit && it != offlineSessions.end() && offlineBytes > limit;) {
+            Session* session = *it++;
+            if (ownsSession(session)) {
+                unlinkOffline(session);
+                reaped.push_back(session);
+            }
+        }
+    }
+    removeSessions(reaped);
+    return reaped.size();
+}
+
+void Broker::removeSessions(const std::vector<Session*> &reaped) {
+    // Gathered per filter, so a filter shared by many expiring sessions is looked up and
+    // dropped from the trie once rather than once per session
+    std::unordered_map<std::string, std::vector<SessionHandle>> filters;
+    std::vector<std::pair<SessionHandle, std::string>> shared;
+    // Routers read the sessions' subscription options until the index no longer leads to them
+    std::unique_lock<RoutingLock> routingGuard(routingLock);
+    for (Session* session : reaped) {
+        for (const auto &[topicFilter, options] : session->takeSubscriptions()) {
+            if (Topic::isShared(topicFilter)) {
+                shared.emplace_back(session->getHandle(), topicFilter);
+            } else {
+                filters[topicFilter].push_back(session->getHandle());
+            }
+        }
+    }
+    for (const auto &[handle, topicFilter] : shared) {
+        auto [group, realTopicFilter] = Topic::splitShared(topicFilter);
+        sharedUnsubscribeLocked(handle, realTopicFilter, group);
+    }
+    for (const auto &[topicFilter, handles] : filters) {
+        auto it = subscriptions.find(topicFilter);
+        if (it == subscriptions.end()) {
+            continue;
+        }
+        for (SessionHandle handle : handles) {
+            if (it->second.erase(handle)) {
+                subscriptionCount.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+        if (it->second.empty()) {
+            Metrics::charge(MemoryTag::SUBSCRIPTIONS, -static_cast<int64_t>(heapBytes(it->first)));
+            subscriptions.erase(it);
+            if (!hasSubscribers(topicFilter)) {
+                trie->remove(topicFilter);
+            }
+        }
+    }
+    routingGuard.unlock();
+    // Publishers may still be delivering to them; wait for those once rather than once per session
+    for (Session* session : reaped) {
+        sessions.erase(session->getHandle());
+    }
+    if (!reaped.empty()) {
+        SessionRegistry::waitForReaders();
+    }
+    for (Session* session : reaped) {
+        LOG_DEBUG("Broker::removeSessions: %s", session->getClientId().c_str());
+        settleWill(session->getClientId(), true, MessageBlock::currentTime());
+        if (wal && !session->isCleanStart()) {
+            wal->logDiscard(session->getClientId());
+        }
+        ownedSessions.erase(ownedSessions.find(session->getClientId()));
+    }
 }
 
 void Broker::publish(const Message &message) {
-    std::vector<std::string> topicFilters = trie->match(message.topic);
+    publish(MessageRef::create(message));
+}
+
+void Broker::publish(const MessageRef &message) {
+    if (message->isRetain()) {
+        retained->store(message);
+    }
+    MessageTrace* trace = message->getTrace();
+    if (trace) {
+        (*trace)[TracePoint::MATCH_START] = Trace::now();
+    }
+    std::string_view topic = message->getTopic();
+    FLOWMQ_PROBE(match__start, topic.data(), topic.size());
+    std::shared_lock<RoutingLock> guard(routingLock);
+    std::vector<std::string> topicFilters = trie->match(std::string(topic));
+    FLOWMQ_PROBE(match__end, topic.data(), topic.size(), topicFilters.size());
+    if (trace) {
+        (*trace)[TracePoint::MATCH_END] = Trace::now();
+    }
+    route(message, topicFilters);
+}
+
+void Broker::publish(const std::vector<MessageRef> &messages) {
+    std::vector<std::string> topics;
+    topics.reserve(messages.size());
+    bool traced = false;
+    for (const auto &message : messages) {
+        if (message->isRetain()) {
+            retained->store(message);
+        }
+        topics.emplace_back(message->getTopic());
+        traced = traced || message->getTrace();
+    }
+    uint64_t matchStart = traced ? Trace::now() : 0;
+    FLOWMQ_PROBE(match__batch__start, topics.size());
+    std::shared_lock<RoutingLock> guard(routingLock);
+    std::vector<std::vector<std::string>> topicFilters = trie->matchBatch(topics);
+    FLOWMQ_PROBE(match__batch__end, topics.size());
+    if (traced) {
+        uint64_t matchEnd = Trace::now();
+        for (const auto &message : messages) {
+            if (MessageTrace* trace = message->getTrace()) {
+                (*trace)[TracePoint::MATCH_START] = matchStart;
+                (*trace)[TracePoint::MATCH_END] = matchEnd;
+            }
+        }
+    }
+    for (size_t i = 0; i < messages.size(); i++) {
+        route(messages[i], topicFilters[i]);
+    }
+}
+
+void Broker::route(const MessageRef &message, const std::vector<std::string> &topicFilters) {
+    auto start = std::chrono::steady_clock::now();
+    // Sessions resolved below are not freed until this is released
+    SessionRegistry::ReadGuard guard;
+    uint64_t fanout = 0;
+    auto available = [this](SessionHandle handle) {
+        Session* session = sessions.get(handle);
+        return session && session->isSharedAvailable();
+    };
+    auto inflight = [this](SessionHandle handle) -> size_t {
+        Session* session = sessions.get(handle);
+        return session ? session->getInflightCount() : 0;
+    };
     for (const auto &topicFilter : topicFilters) {
-        std::set<std::string> clientIds = getSubscriptions(topicFilter);
-        for (const auto &clientId : clientIds) {
-            Session* session = findSession(clientId);
-            if (session) {   
-                session->deliver(topicFilter, message);
+        auto subscribers = subscriptions.find(topicFilter);
+        if (subscribers != subscriptions.end()) {
+            for (SessionHandle handle : subscribers->second) {
+                Session* session = sessions.get(handle);
+                if (session) {
+                    session->deliver(topicFilter, message);
+                    fanout++;
+                }
             }
         }
         if (!sharedSubscriptions.empty()) {
             auto it = sharedSubscriptions.find(topicFilter);
-            if (it != sharedSubscriptions.end()) {
-                auto idx = randIdx(it->second.size());
-                SharedSubscription sharedSubscription = it->second.at(idx);
-                Session* session = findSession(sharedSubscription.clientId);
+            if (it == sharedSubscriptions.end()) {
+                continue;
+            }
+            // Every group on the filter gets its own copy of the message
+            for (auto &[group, sharedGroup] : it->second) {
+                SessionHandle handle = sharedGroup->pick(sharedStrategy, message->getPublisherId(), message->getTopic(),
+                                                         available, inflight);
+                Session* session = sessions.get(handle);
                 if (session) {
-                    session->deliver(topicFilter, message);
+                    session->deliver(sharedGroup->getShareName(), message);
+                    fanout++;
                 }
             }
         }
     }
+    Metrics::increment(fanout ? Counter::PUBLISHES_ROUTED : Counter::PUBLISHES_DROPPED);
+    Metrics::record(Histogram::FANOUT, fanout);
+    uint64_t routing = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    Metrics::record(Histogram::ROUTE_NANOSECONDS, routing);
+    FLOWMQ_PROBE(publish__routed, message->getTopic().data(), message->getTopic().size(), fanout, routing);
 }
 
 } // namespace MQTT
@@ -4,37 +4,192 @@
 
 #include <set>
 #include <map>
+#include <list>
 #include <unordered_map>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <shared_mutex>
+#include <atomic>
 #include "Trie.h"
 #include "Message.h"
+#include "MessageRef.h"
 #include "Subscription.h"
+#include "SharedGroup.h"
+#include "RetainedStore.h"
+#include "Config.h"
+#include "WriteAheadLog.h"
+#include "SessionRegistry.h"
+#include "ExpiryIndex.h"
+#include "TimerWheel.h"
+#include "SysTopics.h"
+#include "Memory.h"
+#include "RoutingLock.h"
 
 namespace MQTT {
 class Session;
 class Broker {
+    BrokerConfig config;
     std::unique_ptr<Trie> trie;
-    std::unordered_map<std::string, Session*> sessions;
-    std::unordered_map<std::string, std::set<std::string>> subscriptions;
-    std::map<std::string, std::vector<SharedSubscription>> sharedSubscriptions;
+    // Guards the routing index: trie, subscriptions and sharedSubscriptions. Publishers hold it shared
+    // while they match and route; subscribing, unsubscribing and reaping sessions hold it exclusively.
+    // Taken after sessionLock and before any session's lock.
+    mutable RoutingLock routingLock;
+    std::unique_ptr<RetainedStore> retained;
+    SessionRegistry sessions;
+    // topic filter -> subscribed sessions, charged to MemoryTag::SUBSCRIPTIONS along with the filters' text
+    using Subscribers = std::set<SessionHandle, std::less<SessionHandle>,
+                                 TaggedAllocator<SessionHandle, MemoryTag::SUBSCRIPTIONS>>;
+    std::unordered_map<std::string, Subscribers, std::hash<std::string>, std::equal_to<std::string>,
+                       TaggedAllocator<std::pair<const std::string, Subscribers>, MemoryTag::SUBSCRIPTIONS>>
+        subscriptions;
+    // Plain and shared subscriptions together, read by the $SYS publisher on another thread
+    std::atomic<size_t> subscriptionCount{0};
+    // topic filter -> group name -> members
+    std::unordered_map<std::string, std::unordered_map<std::string, std::unique_ptr<SharedGroup>>> sharedSubscriptions;
+    SharedStrategy sharedStrategy = SharedStrategy::ROUND_ROBIN;
+    std::unique_ptr<WriteAheadLog> wal;
+    // QoS state read back from the write-ahead log, waiting for its client to reconnect
+    std::unordered_map<std::string, WriteAheadLog::Recovered> recovered;
+    // Sessions opened through openSession(), connected or parked offline
+    std::unordered_map<std::string, std::unique_ptr<Session>> ownedSessions;
+    // Serializes opening, closing and reaping owned sessions; taken before expiryLock and willLock
+    std::mutex sessionLock;
+    // Signalled under sessionLock when a connection thread detaches from its session
+    std::condition_variable sessionDetached;
+    // Sessions whose queue holds a message expiring at the given time; scheduled from any connection thread
+    ExpiryIndex<SessionHandle> queueExpiry;
+    // Offline sessions with a Session Expiry Interval, by the time they expire
+    TimerWheel<SessionHandle> sessionExpiry;
+    // Offline sessions, the one disconnected the longest first, and the memory they hold together
+    std::list<Session*> offlineSessions;
+    std::atomic<size_t> offlineBytes{0};
+    // Guards queueExpiry, sessionExpiry and offlineSessions
+    std::mutex expiryLock;
+    std::atomic<uint64_t> nextSweepAt{0};
+    // Wills of ended connections waiting out their delay, by client id
+    struct PendingWill {
+        Will will;
+        uint64_t fireAt;
+    };
+    std::unordered_map<std::string, PendingWill> pendingWills;
+    ExpiryIndex<std::string> willTimers;
+    std::mutex willLock;
+    // Earliest time a will may be due, 0 if none is pending; lets fireWills return without locking
+    std::atomic<uint64_t> nextWillAt{0};
+    SysTopics sysTopics{this};
+    std::mutex sysLock;
+    std::atomic<uint64_t> nextSysAt{0};
+
+    bool hasSubscribers(const std::string &topicFilter) const;
+    bool ownsSession(const Session* session) const;
+    // openSession() with sessionLock held; waits on it while a connection thread still uses the session
+    Session* openSessionLocked(std::unique_lock<std::mutex> &guard, const std::string &clientId, bool cleanStart,
+                               bool &sessionPresent);
+    // updateOfflineMemory() with expiryLock held
+    void updateOfflineMemoryLocked(Session* session);
+    // Take a session off the offline LRU and release the memory charged for it; expiryLock must be held
+    void unlinkOffline(Session* session);
+    // Move the will of a session whose connection ended to the pending wills
+    void armWill(Session* session, uint64_t nowMs);
+    // A client coming back with its session cancels a will still waiting out its delay;
+    // one whose session ends instead has its will published right away
+    void settleWill(const std::string &clientId, bool sessionEnded, uint64_t nowMs);
+    // The routing index updates, with routingLock held exclusively
+    void subscribeLocked(SessionHandle handle, const std::string &topicFilter);
+    void unsubscribeLocked(SessionHandle handle, const std::string &topicFilter);
+    void sharedSubscribeLocked(SessionHandle handle, const std::string &topicFilter, const std::string &group);
+    void sharedUnsubscribeLocked(SessionHandle handle, const std::string &topicFilter, const std::string &group);
+    // Route messages already split into their topics' subscribers; routingLock must be held shared
+    void route(const MessageRef &message, const std::vector<std::string> &topicFilters);
+    // Destroy owned sessions, removing their subscriptions with one routing index update per topic filter
+    void removeSessions(const std::vector<Session*> &reaped);
 
 public:
-    explicit Broker();
-    ~Broker() = default;
-    void insertSession(const std::string &clientId, Session* session);
+    explicit Broker(const BrokerConfig &config = BrokerConfig());
+    ~Broker();
+    const BrokerConfig& getConfig() const { return config; }
+
+    // Session for a connecting client: a persistent session is resumed unless
+    // cleanStart is set, and a session still connected elsewhere is taken over
+    Session* openSession(const std::string &clientId, bool cleanStart, bool &sessionPresent);
+    // openSession() for a connection thread, which owns the session until detachSession(). A later
+    // connection for the same client calls onTakeover on the owner's behalf and waits for it to
+    // detach, so the session is neither reaped nor destroyed while the owner still uses it.
+    Session* attachSession(const std::string &clientId, bool cleanStart, bool &sessionPresent,
+                           std::function<void()> onTakeover);
+    // Called when the connection of a session goes away: sessions with a zero expiry
+    // interval are destroyed, others stay subscribed and queue messages until they expire
+    void closeSession(Session* session);
+    // closeSession() for the connection thread that attached the session, clearing its pointer;
+    // a session taken over meanwhile is left to the connection waiting for it
+    void detachSession(Session* &session);
+    // closeSession() with sessionLock held
+    void closeSessionLocked(Session* session);
+
+    // Every session is registered for its whole lifetime, so messages keep being routed to it while offline
+    SessionHandle insertSession(const std::string &clientId, Session* session);
+    // Null if the session is gone; O(1), used on the fan-out path
+    Session* getSession(SessionHandle handle) const { return sessions.get(handle); }
     Session* findSession(const std::string &clientId) const;
-    void removeSession(const std::string &clientId);
+    // Called when a session's client connects or disconnects
+    void activateSession(Session* session);
+    void parkSession(Session* session);
+    // Unregister a session being destroyed; returns once no router can still be using it
     void removeSession(Session* session);
+    // Recharge the offline memory of a session after its queue changed, if it is parked; called on the
+    // publisher's thread with the session's lock held
+    void updateOfflineMemory(Session* session);
+    size_t getOfflineMemoryBytes() const { return offlineBytes.load(std::memory_order_relaxed); }
+    size_t getSessionCount() const { return ownedSessions.size(); }
+    size_t getSubscriptionCount() const { return subscriptionCount.load(std::memory_order_relaxed); }
 
-    void subscribe(const std::string &clientId, const std::string &topicFilter);
-    void unsubscribe(const std::string &clientId, const std::string &topicFilter);
-    void sharedSubscribe(const std::string &clientId, const std::string &topicFilter, const std::string &group);
-    void sharedUnsubscribe(const std::string &clientId, const std::string &topicFilter, const std::string &group);
+    void subscribe(SessionHandle handle, const std::string &topicFilter);
+    void unsubscribe(SessionHandle handle, const std::string &topicFilter);
+    void sharedSubscribe(SessionHandle handle, const std::string &topicFilter, const std::string &group);
+    void sharedUnsubscribe(SessionHandle handle, const std::string &topicFilter, const std::string &group);
+    // A session's plain or "$share/<group>/<filter>" subscription: the routing index and the options
+    // its deliveries read are changed together, so no router sees one without the other
+    void subscribe(Session* session, const std::string &topicFilter, const SubscriptionOptions &options);
+    void unsubscribe(Session* session, const std::string &topicFilter);
     void publish(const Message &message);
+    // Route a message to all matching subscribers; every subscriber shares the same allocation
+    void publish(const MessageRef &message);
+    // Route many messages with a single walk of the subscription trie
+    void publish(const std::vector<MessageRef> &messages);
+    // Publish the wills whose delay ran out at nowMs, as one batch; any connection thread may call it
+    size_t fireWills(uint64_t nowMs);
+    size_t getPendingWillCount();
+    // Publish the broker statistics under $SYS/broker/ that changed since the last time; returns
+    // immediately unless sysIntervalMs passed since then. Any connection thread may call it.
+    size_t publishSys(uint64_t nowMs);
+
+    void setSharedStrategy(SharedStrategy strategy) { sharedStrategy = strategy; }
+    SharedStrategy getSharedStrategy() const { return sharedStrategy; }
 
     int getConnectedClients() const;
     bool isSubscribed(const std::string& clientId, const std::string& topicFilter) const;
     std::set<std::string> getSubscriptions(const std::string &topicFilter);
+    std::vector<MessageRef> getRetained(const std::string &topicFilter) const;
+    size_t getRetainedCount() const;
+    // The group is only safe to use while no session subscribes or unsubscribes; for tests
+    const SharedGroup* findSharedGroup(const std::string &topicFilter, const std::string &group) const;
+
+    // Add a session to the expiry index; called when it queues a message that expires sooner than the rest
+    void scheduleExpiry(SessionHandle handle, uint64_t expiresAt);
+    // Drop expired messages from the queues of offline sessions and from the retained store,
+    // then reap expired sessions and check the memory limits. Returns immediately unless expirySweepIntervalMs passed since
+    // the last sweep; any connection thread may call it, and only one of them sweeps at a time.
+    size_t sweepExpired(uint64_t nowMs);
+    // Destroy the offline sessions expired at nowMs, then the ones disconnected the longest while
+    // offline sessions hold more than offlineSessionMemoryBytes; returns how many went
+    size_t reapSessions(uint64_t nowMs);
+
+    // Null when the broker runs without a data directory
+    WriteAheadLog* getWal() const { return wal.get(); }
+    // Hand over the QoS state recovered for clientId, if any
+    bool takeRecovered(const std::string &clientId, WriteAheadLog::Recovered &state);
 };
 }
 
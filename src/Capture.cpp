@@ -0,0 +1,145 @@
+#include "Capture.h"
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+
+namespace MQTT {
+
+constexpr char Capture::MAGIC[8];
+std::atomic<bool> Capture::active{false};
+
+namespace {
+
+struct CaptureFile {
+    std::mutex lock;
+    FILE *file = nullptr;
+    std::atomic<uint64_t> startedAt{0};
+    std::atomic<uint32_t> nextConnection{0};
+};
+
+CaptureFile& captureFile() {
+    static CaptureFile* instance = new CaptureFile();
+    return *instance;
+}
+
+uint64_t steadyNanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+void Capture::start(const std::string &path) {
+    CaptureFile &capture = captureFile();
+    std::lock_guard<std::mutex> guard(capture.lock);
+    if (capture.file) {
+        throw std::runtime_error("A capture is already running");
+    }
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file || fwrite(MAGIC, sizeof(MAGIC), 1, file) != 1) {
+        if (file) {
+            fclose(file);
+        }
+        throw std::runtime_error("Failed to create capture " + path + ": " + strerror(errno));
+    }
+    capture.file = file;
+    capture.startedAt.store(steadyNanoseconds(), std::memory_order_relaxed);
+    active.store(true, std::memory_order_relaxed);
+}
+
+void Capture::stop() {
+    CaptureFile &capture = captureFile();
+    std::lock_guard<std::mutex> guard(capture.lock);
+    active.store(false, std::memory_order_relaxed);
+    if (capture.file) {
+        fclose(capture.file);
+        capture.file = nullptr;
+    }
+}
+
+std::vector<CaptureRecord> Capture::read(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        throw std::runtime_error("Failed to open capture " + path + ": " + strerror(errno));
+    }
+    char magic[sizeof(MAGIC)];
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+        fclose(file);
+        throw std::runtime_error(path + " is not a capture file");
+    }
+    std::vector<CaptureRecord> records;
+    uint8_t header[HEADER_SIZE];
+    // A broker that was killed may have left the last record half written; it is dropped
+    while (fread(header, sizeof(header), 1, file) == 1) {
+        CaptureRecord record;
+        uint32_t length;
+        memcpy(&record.at, header, 8);
+        memcpy(&record.connection, header + 8, 4);
+        record.event = static_cast<CaptureEvent>(header[12]);
+        memcpy(&length, header + 13, 4);
+        record.bytes.resize(length);
+        if (length && fread(record.bytes.data(), length, 1, file) != 1) {
+            break;
+        }
+        records.push_back(std::move(record));
+    }
+    fclose(file);
+    // Connections write their records in chunks; within one connection they are in order already
+    std::stable_sort(records.begin(), records.end(),
+                     [](const CaptureRecord &a, const CaptureRecord &b) { return a.at < b.at; });
+    return records;
+}
+
+Capture::Stream::Stream() : active(Capture::isActive()) {
+    if (active) {
+        connection = captureFile().nextConnection.fetch_add(1, std::memory_order_relaxed);
+        append(CaptureEvent::OPEN, nullptr, 0);
+    }
+}
+
+Capture::Stream::~Stream() {
+    if (active) {
+        append(CaptureEvent::CLOSE, nullptr, 0);
+        flush();
+    }
+}
+
+void Capture::Stream::append(CaptureEvent event, const uint8_t *data, size_t length) {
+    uint64_t at = steadyNanoseconds() - captureFile().startedAt.load(std::memory_order_relaxed);
+    uint32_t size = static_cast<uint32_t>(length);
+    size_t offset = buffer.size();
+    if (offset == 0) {
+        bufferedAt = at;
+    }
+    buffer.resize(offset + HEADER_SIZE + length);
+    uint8_t *header = buffer.data() + offset;
+    memcpy(header, &at, 8);
+    memcpy(header + 8, &connection, 4);
+    header[12] = static_cast<uint8_t>(event);
+    memcpy(header + 13, &size, 4);
+    if (length) {
+        memcpy(header + HEADER_SIZE, data, length);
+    }
+    if (buffer.size() >= FLUSH_SIZE || at - bufferedAt >= FLUSH_NANOSECONDS) {
+        flush();
+    }
+}
+
+void Capture::Stream::flush() {
+    CaptureFile &capture = captureFile();
+    std::lock_guard<std::mutex> guard(capture.lock);
+    if (capture.file) {
+        // Out of stdio's buffer too, so a broker that is killed loses at most the last second
+        fwrite(buffer.data(), 1, buffer.size(), capture.file);
+        fflush(capture.file);
+    } else {
+        // The capture was stopped
+        active = false;
+    }
+    buffer.clear();
+}
+
+}
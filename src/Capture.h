@@ -0,0 +1,85 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace MQTT {
+
+enum class CaptureEvent : uint8_t {
+    // A client connected; no bytes
+    OPEN,
+    // Bytes one read() returned
+    DATA,
+    // The connection ended; no bytes
+    CLOSE
+};
+
+struct CaptureRecord {
+    // Nanoseconds since the capture was started
+    uint64_t at;
+    uint32_t connection;
+    CaptureEvent event;
+    std::vector<uint8_t> bytes;
+};
+
+// Recording of what clients sent, to be replayed through the broker offline.
+//
+// The file starts with an 8-byte magic and is followed by records of a 17-byte
+// header (timestamp, connection id, event, length, in host byte order) and the
+// bytes read. Each connection appends its records to its own buffer without a
+// lock and writes the buffer out under the file's lock once it holds 64 KiB, a
+// second has passed or the connection ends, so records of different connections
+// are interleaved in chunks; a reader orders them by timestamp.
+class Capture {
+public:
+    static constexpr char MAGIC[8] = {'F', 'M', 'Q', 'C', 'A', 'P', '0', '1'};
+    static constexpr size_t HEADER_SIZE = 17;
+    static constexpr size_t FLUSH_SIZE = 64 * 1024;
+    static constexpr uint64_t FLUSH_NANOSECONDS = 1000000000;
+
+    // Start recording connections opened from now on to path; throws std::runtime_error if it cannot be created
+    static void start(const std::string &path);
+    // Write out and close the file; streams still open stop recording
+    static void stop();
+    static bool isActive() { return active.load(std::memory_order_relaxed); }
+
+    // Every record of a capture file ordered by timestamp; throws std::runtime_error if it is not one
+    static std::vector<CaptureRecord> read(const std::string &path);
+
+    // What one connection records; inactive unless a capture was running when it was created
+    class Stream {
+    public:
+        Stream();
+        ~Stream();
+        Stream(const Stream &) = delete;
+        Stream &operator=(const Stream &) = delete;
+
+        void record(const uint8_t *data, size_t length) {
+            if (active) {
+                append(CaptureEvent::DATA, data, length);
+            }
+        }
+
+    private:
+        bool active;
+        uint32_t connection = 0;
+        std::vector<uint8_t> buffer;
+        // Capture time of the first record still in buffer
+        uint64_t bufferedAt = 0;
+
+        void append(CaptureEvent event, const uint8_t *data, size_t length);
+        void flush();
+    };
+
+private:
+    static std::atomic<bool> active;
+};
+
+}
+
+#endif // CAPTURE_H
@@ -0,0 +1,57 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include "Metrics.h"
+
+namespace MQTT {
+
+struct BrokerConfig {
+    // Directory for on-disk state; empty keeps everything in memory
+    std::string dataDirectory;
+    // Group commit window of the write-ahead log: an fsync waits up to this
+    // long for more records, or until this many bytes are pending
+    uint32_t walCommitIntervalUs = 1000;
+    size_t walCommitBytes = 1024 * 1024;
+    // Bytes of messages a persistent session queues in memory while its client
+    // is offline; the rest spills to <dataDirectory>/queues or is dropped
+    size_t offlineQueueMemoryBytes = 1024 * 1024;
+    // QoS 1/2 publishes a client may have unacknowledged towards the broker, advertised in CONNACK
+    uint16_t receiveMaximum = 1024;
+    // Resend unacknowledged QoS 1/2 messages to MQTT 3.1.1 clients after this
+    // many milliseconds; 0 only resends on reconnect, as MQTT 5 requires
+    uint32_t retransmitIntervalMs = 0;
+    // How often expired messages are swept out of offline queues and the retained store;
+    // until then they are only skipped when read. 0 disables the sweep.
+    uint32_t expirySweepIntervalMs = 1000;
+    // Upper bound on the Session Expiry Interval a client may ask for, in seconds
+    uint32_t maxSessionExpirySeconds = 0xFFFFFFFF;
+    // Memory all offline persistent sessions may hold together; beyond it the ones
+    // disconnected the longest are discarded at the next sweep. 0 means no limit.
+    size_t offlineSessionMemoryBytes = 0;
+    // How often broker statistics are published under $SYS/broker/; 0 disables them
+    uint32_t sysIntervalMs = 10000;
+    // Trace one publish in this many from its publisher's socket to each subscriber's; 0 disables tracing
+    uint32_t traceSampling = 0;
+    // How many of the slowest traced deliveries are kept for GET /traces on the metrics port
+    size_t traceSlowest = 16;
+    // Publishes are counted by the first this many levels of their topic, e.g. "site/7" of "site/7/device/42"
+    size_t statsTopicLevels = 2;
+    // How many of the clients and topic prefixes publishing the most are tracked for GET /top
+    size_t heavyHitters = 32;
+    // File recording every byte clients send, for replay with flowmq_replay; empty disables recording
+    std::string capturePath;
+    // Bytes each subsystem may hold before the broker refuses to take on more of it, see Memory; 0 means no limit
+    size_t memoryLimits[static_cast<int>(MemoryTag::COUNT)] = {};
+    // Loopback port serving Prometheus metrics at /metrics; 0 disables the endpoint
+    uint16_t metricsPort = 0;
+    // Back the slab pools with 2 MiB huge pages when the system has them reserved
+    bool hugePages = false;
+};
+
+}
+
+#endif // CONFIG_H
@@ -2,7 +2,16 @@
 #include "Connection.h"
 #include "Session.h"
 #include "Broker.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Stats.h"
+#include "Memory.h"
+#include "Probes.h"
 #include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <chrono>
+#include <cerrno>
 #include <iostream>
 #include <sstream>
 #include <iomanip>
@@ -11,9 +20,30 @@
 namespace MQTT {
 
 Connection::Connection(int sockfd, Broker* broker)
-    : sockfd(sockfd), state(State::IDLE), broker(broker) { }
+    : sockfd(sockfd), state(State::IDLE), broker(broker) {
+    frame.setArena(&parseArena);
+    Metrics::adjust(Gauge::CONNECTIONS, 1);
+    Stats::attach(&stats);
+    chargeBuffers();
+    FLOWMQ_PROBE(connection__open, sockfd);
+}
+
+Connection::~Connection() {
+    FLOWMQ_PROBE(connection__close, sockfd, stats.messagesIn.load(std::memory_order_relaxed),
+                 stats.messagesOut.load(std::memory_order_relaxed));
+    Stats::detach(&stats);
+    Metrics::adjust(Gauge::CONNECTIONS, -1);
+    Metrics::charge(MemoryTag::BUFFERS, -bufferBytes);
+}
+
+void Connection::chargeBuffers() {
+    int64_t bytes = sizeof(Connection) + incoming.capacity() + deferred.capacity() + writeBuffer.capacity() +
+                    parseArena.getCapacity();
+    Metrics::charge(MemoryTag::BUFFERS, bytes - bufferBytes);
+    bufferBytes = bytes;
+}
 
-static std::string toHexString(const uint8_t *data, size_t length) {
+[[maybe_unused]] static std::string toHexString(const uint8_t *data, size_t length) {
     std::stringstream ss;
     ss << std::hex << std::setfill('0');
     for (size_t i = 0; i < length; ++i) {
@@ -28,22 +58,121 @@ static std::string toHexString(const uint8_t *data, size_t length) {
 
 void Connection::run() {
     ssize_t bytesRead = 0;
-    while ((state != State::DISCONNECTED) && (bytesRead = read(sockfd, buffer, BUFFER_SIZE)) > 0) {
+    // When poll last returned, to time the work done for each wake-up
+    std::chrono::steady_clock::time_point wokeAt;
+    while (state != State::DISCONNECTED && !takenOver) {
+        if (wokeAt.time_since_epoch().count()) {
+            Metrics::record(Histogram::LOOP_NANOSECONDS, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - wokeAt).count());
+            wokeAt = {};
+        }
+        if (session) {
+            stats.inflight.store(session->getInflightCount(), std::memory_order_relaxed);
+            stats.queued.store(session->getQueuedCount(), std::memory_order_relaxed);
+        }
+        chargeBuffers();
+        // The socket and, once connected, the inbox other threads deliver this session's messages to
+        struct pollfd fds[2] = {{sockfd, POLLIN, 0}, {inboxFd, POLLIN, 0}};
+        uint32_t interval = retransmitInterval();
+        int ready = poll(fds, inboxFd >= 0 ? 2 : 1, pollTimeout(interval));
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        wokeAt = std::chrono::steady_clock::now();
         try {
-            std::cout << toHexString(buffer, bytesRead) << std::endl;
-            handleIncoming(frame.parse(buffer, bytesRead));
+            // Whichever connection gets here first once the interval passed does the sweep
+            uint64_t wallClock = MessageBlock::currentTime();
+            broker->sweepExpired(wallClock);
+            broker->fireWills(wallClock);
+            broker->publishSys(wallClock);
+            if (ready == 0) {
+                if (interval > 0) {
+                    uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now().time_since_epoch()).count();
+                    session->retransmitExpired(now, interval);
+                }
+                continue;
+            }
+            if (inboxFd >= 0 && (fds[1].revents & POLLIN) && session) {
+                session->processInbox();
+            }
+            if (!fds[0].revents) {
+                continue;
+            }
+            if ((bytesRead = read(sockfd, buffer, BUFFER_SIZE)) <= 0) {
+                break;
+            }
+            LOG_TRACE("read %zd bytes:\n%s", bytesRead, toHexString(buffer, bytesRead).c_str());
+            Metrics::increment(Counter::BYTES_RECEIVED, bytesRead);
+            capture.record(buffer, bytesRead);
+            ConnectionStats::add(stats.bytesIn, bytesRead);
+            stats.lastActivity.store(wallClock, std::memory_order_relaxed);
+            // Packets of the previous batch were all released once they were handled
+            parseArena.reset();
+            incoming.insert(incoming.end(), buffer, buffer + bytesRead);
+            size_t offset = 0;
+            size_t length;
+            uint32_t sampling = broker->getConfig().traceSampling;
+            while (state != State::DISCONNECTED &&
+                   (length = Frame::packetLength(incoming.data() + offset, incoming.size() - offset)) > 0) {
+                tracing = (incoming[offset] >> 4) == static_cast<uint8_t>(PacketType::PUBLISH) &&
+                          Trace::sample(sampling);
+                auto packet = frame.parse(incoming.data() + offset, length);
+                FLOWMQ_PROBE(packet__parsed, sockfd, static_cast<int>(packet->type), length);
+                if (tracing) {
+                    trace = MessageTrace();
+                    trace[TracePoint::RECEIVED] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        wokeAt.time_since_epoch()).count();
+                    trace[TracePoint::PARSED] = Trace::now();
+                }
+                handleIncoming(std::move(packet));
+                tracing = false;
+                offset += length;
+            }
+            incoming.erase(incoming.begin(), incoming.begin() + offset);
+            // Every publish read in this batch is acked after a single sync
+            flushDeferred();
+            published.flush();
         } catch (const std::exception &e) {
-            std::cerr << "Error processing packet: " << e.what() << std::endl;
+            LOG_WARN("Error processing packet: %s", e.what());
+            Metrics::increment(Counter::PARSE_ERRORS);
             state = State::DISCONNECTED;
         }
     }
+    broker->detachSession(session);
+    // Wills due now are published by whichever thread gets here first, together with the ones
+    // other connections ending at the same moment armed meanwhile
+    broker->fireWills(MessageBlock::currentTime());
 }
 
 bool Connection::isConnected() const {
     return state == State::CONNECTED;
 }
 
+uint32_t Connection::retransmitInterval() const {
+    // MQTT 5 forbids resending other than on reconnect
+    if (state != State::CONNECTED || !session || frame.getVersion() == Version::MQTT5) {
+        return 0;
+    }
+    return broker->getConfig().retransmitIntervalMs;
+}
+
+int Connection::pollTimeout(uint32_t retransmitInterval) const {
+    uint32_t timeout = broker->getConfig().expirySweepIntervalMs;
+    if (retransmitInterval > 0 && (timeout == 0 || retransmitInterval < timeout)) {
+        timeout = retransmitInterval;
+    }
+    return timeout > 0 ? static_cast<int>(timeout) : -1;
+}
+
 void Connection::handleIncoming(std::shared_ptr<Packet> packet) {
+    if (state != State::CONNECTED && packet->type != PacketType::CONNECT) {
+        throw std::runtime_error("Packet received before CONNECT");
+    }
+    Metrics::packetReceived(packet->type);
     switch (packet->type) {
     case PacketType::CONNECT:
         handleConnect(std::static_pointer_cast<ConnectPacket>(packet));
@@ -88,45 +217,101 @@ void Connection::handleConnect(std::shared_ptr<ConnectPacket> connect) {
         throw std::runtime_error("Bad connect packet");
     }
     frame.setVersion(connect->protocolVersion);
-    Session* session;
-    if(connect->cleanStart) {
-        Session* oldSession = broker->findSession(connect->clientId);
-        if(oldSession) {
-            oldSession->discard();
-        }
-        session = new Session(broker, connect->clientId);
-    } else {
-        Session* oldSession = broker->findSession(connect->clientId);
-        if(!oldSession) {
-            session = new Session(broker, connect->clientId);
-        } else {
-            session = oldSession;
-        }
-    }
-    session->setDeliverCallback([this](const Message& message, uint16_t packetId, QoS qos) {
-        handleDeliver(message, packetId, qos);
+    bool sessionPresent = false;
+    session = broker->attachSession(connect->clientId, connect->cleanStart, sessionPresent, [this]() {
+        // Taken over by a new connection, which waits until this thread detaches; the socket is
+        // closed by the server thread
+        takenOver = true;
+        shutdown(sockfd, SHUT_RDWR);
+    });
+    Stats::setClientId(&stats, connect->clientId);
+    published.setClientId(connect->clientId);
+    session->setDeliverCallback([this](const MessageRef& message, uint16_t packetId, QoS qos, bool retain) {
+        handleDeliver(message, packetId, qos, retain);
     });
-    session->setDisconnectCallback([this]() {
-        state = State::DISCONNECTED;
-        close(sockfd); //TODO: ????
+    session->setResendCallback([this](InflightWindow::Entry& entry) {
+        handleResend(entry);
     });
+    // From here on publishers hand messages to this thread instead of writing to the socket themselves
+    inboxFd = session->attachInbox();
+    auto receiveMaximum = connect->getProperty(PropertyID::RECEIVE_MAXIMUM);
+    session->setReceiveMaximum(receiveMaximum ? std::get<uint16_t>(*receiveMaximum) : 65535);
+    // MQTT 3.1.1 persistent sessions never expire unless the broker caps them
+    uint32_t requestedExpiry = connect->cleanStart ? 0 : Session::NEVER_EXPIRES;
+    if (frame.getVersion() == Version::MQTT5) {
+        auto expiry = connect->getProperty(PropertyID::SESSION_EXPIRY_INTERVAL);
+        requestedExpiry = expiry ? std::get<uint32_t>(*expiry) : 0;
+    }
+    uint32_t sessionExpiry = std::min(requestedExpiry, broker->getConfig().maxSessionExpirySeconds);
+    session->setExpiryInterval(sessionExpiry);
+    if (connect->willFlag && connect->willTopic) {
+        std::string payload = connect->willMsg.value_or("");
+        auto will = std::make_unique<Will>(Will{Message(*connect->willTopic, payload, connect->willQos, connect->willRetain)});
+        will->message.publisherId = connect->clientId;
+        if (frame.getVersion() == Version::MQTT5 && connect->willProperties) {
+            const Properties &properties = *connect->willProperties;
+            will->message.properties = forwardedProperties(properties);
+            auto delay = properties.find(PropertyID::WILL_DELAY_INTERVAL);
+            if (delay != properties.end()) {
+                will->delay = std::get<uint32_t>(delay->second);
+            }
+            auto expiry = properties.find(PropertyID::MESSAGE_EXPIRY_INTERVAL);
+            if (expiry != properties.end()) {
+                will->messageExpiry = std::get<uint32_t>(expiry->second);
+            }
+        }
+        session->setWill(std::move(will));
+    }
     session->connect();    
-    this->session = std::shared_ptr<Session>(session);
     state = State::CONNECTED;
-    printf("New client connected: %s\n", connect->clientId.c_str());
-    ConnackPacket connack{PacketType::CONNACK, false, ReasonCode::SUCCESS};
+    LOG_DEBUG("New client connected: %s", connect->clientId.c_str());
+    ConnackPacket connack{PacketType::CONNACK, sessionPresent, ReasonCode::SUCCESS};
+    connack.setProperty(PropertyID::RECEIVE_MAXIMUM, broker->getConfig().receiveMaximum);
+    if (sessionExpiry != requestedExpiry && frame.getVersion() == Version::MQTT5) {
+        connack.setProperty(PropertyID::SESSION_EXPIRY_INTERVAL, sessionExpiry);
+    }
     sendPacket(connack);
+    // A client that got the CONNACK may already have connected again and taken the session over
+    if (takenOver) {
+        return;
+    }
+    // Messages queued while the client was offline follow the CONNACK
+    session->resume();
 }
 
 void Connection::handlePublish(std::shared_ptr<PublishPacket> publish) {
+    if (publish->qos != QoS::QOS_0 && frame.getVersion() == Version::MQTT5 &&
+        deferredQos1 + session->getAwaitingPubrelCount() >= broker->getConfig().receiveMaximum) {
+        disconnect(ReasonCode::RECEIVE_MAXIMUM_EXCEEDED);
+        return;
+    }
+    ConnectionStats::add(stats.messagesIn, 1);
+    published.add(publish->topicName, publish->payload.size());
     Message message{publish->topicName, publish->payload, publish->qos, publish->retain};
-    ReasonCode reason = session->publish(publish->packetId, message);
+    message.publisherId = session->getClientId();
+    if (tracing) {
+        message.trace = &trace;
+    }
+    if (frame.getVersion() == Version::MQTT5) {
+        message.properties = forwardedProperties(publish->properties);
+        auto expiry = publish->getProperty(PropertyID::MESSAGE_EXPIRY_INTERVAL);
+        if (expiry) {
+            message.expiresAt = MessageBlock::currentTime() + uint64_t(std::get<uint32_t>(*expiry)) * 1000;
+        }
+    }
+    // MQTT 5 lets the broker refuse a QoS 1/2 publish; older clients' are taken whatever the limit
+    ReasonCode reason = ReasonCode::QUOTA_EXCEEDED;
+    if (publish->qos == QoS::QOS_0 || frame.getVersion() != Version::MQTT5 ||
+        !Memory::isOverLimit(MemoryTag::MESSAGES)) {
+        reason = session->publish(publish->packetId, message);
+    }
     if (publish->qos == QoS::QOS_1) {    
         PubackPacket puback{publish->packetId, reason};
-        sendPacket(puback);
+        deferPacket(puback);
+        deferredQos1++;
     } else if (publish->qos == QoS::QOS_2) {
         PubrecPacket pubrec{publish->packetId, reason};
-        sendPacket(pubrec);
+        deferPacket(pubrec);
     }
 }
 
@@ -151,21 +336,32 @@ void Connection::handlePubcomp(std::shared_ptr<PubcompPacket> pubcomp) {
 }
 
 void Connection::handleSubscribe(std::shared_ptr<SubscribePacket> subscribe) { 
-    printf("handleSubscribe: %d\n", subscribe->packetId);
+    LOG_DEBUG("handleSubscribe: %d", subscribe->packetId);
+    // A subscription adds to the trie, the broker's index and the session; refused while any is over its limit
+    bool overLimit = Memory::isOverLimit(MemoryTag::TRIE) || Memory::isOverLimit(MemoryTag::SUBSCRIPTIONS) ||
+                     Memory::isOverLimit(MemoryTag::SESSIONS);
+    ReasonCode refused = frame.getVersion() == Version::MQTT5 ? ReasonCode::QUOTA_EXCEEDED
+                                                               : ReasonCode::UNSPECIFIED_ERROR;
     // Add subscriptions to the session
-    for (const auto& subscription : subscribe->subscriptions) {
-        printf("Subscription: %s\n", subscription.first.c_str());
-        session->subscribe(subscription.first, const_cast<MQTT::SubscriptionOptions&>(subscription.second));
-    }
+    std::vector<bool> isNew;
     SubackPacket suback{subscribe->packetId};    
-    printf("Suback packet: %d\n", subscribe->packetId);
-
-    // Accept all subscriptions with QoS 0
-    for (size_t i = 0; i < subscribe->subscriptions.size(); ++i) {   
+    for (const auto& subscription : subscribe->subscriptions) {
+        LOG_DEBUG("Subscription: %s", subscription.first.c_str());
+        if (overLimit) {
+            isNew.push_back(false);
+            suback.reasonCodes.push_back(refused);
+            continue;
+        }
+        isNew.push_back(session->subscribe(subscription.first, const_cast<MQTT::SubscriptionOptions&>(subscription.second)));
+        // Accept all subscriptions with QoS 0
         suback.reasonCodes.push_back(ReasonCode::GRANTED_QOS_0);
     }
     sendPacket(suback);
 
+    // Retained messages follow the SUBACK
+    for (size_t i = 0; i < subscribe->subscriptions.size() && !overLimit; ++i) {
+        session->deliverRetained(subscribe->subscriptions[i].first, isNew[i]);
+    }
 }
 
 void Connection::handleUnsubscribe(std::shared_ptr<UnsubscribePacket> unsubscribe) {
@@ -182,6 +378,10 @@ void Connection::handlePingreq(std::shared_ptr<PingreqPacket> pingreq) {
 }
 
 void Connection::handleDisconnect(std::shared_ptr<DisconnectPacket> disconnect) {
+    // A normal DISCONNECT discards the will unless the client asks for it
+    if (session && disconnect->reasonCode != ReasonCode::DISCONNECT_WITH_WILL_MESSAGE) {
+        session->takeWill();
+    }
     state = State::DISCONNECTED;
 }   
 
@@ -193,15 +393,92 @@ void Connection::handleAuth(std::shared_ptr<AuthPacket> auth) {
     sendPacket(authResp);
 }
 
-void Connection::handleDeliver(const Message& message, uint16_t packetId, QoS qos) {
-    PublishPacket publish{message.topic, message.payload, qos, message.retain};
-    publish.packetId = packetId;
-    printf("Deliver message: %s\n", publish.toString().c_str());
-    sendPacket(publish);
+std::vector<uint8_t> Connection::forwardedProperties(const Properties& source) {
+    // Properties the spec requires the broker to pass on unaltered to every subscriber
+    static const PropertyID forwarded[] = {PropertyID::PAYLOAD_FORMAT_INDICATOR, PropertyID::CONTENT_TYPE,
+                                           PropertyID::RESPONSE_TOPIC, PropertyID::CORRELATION_DATA,
+                                           PropertyID::USER_PROPERTY};
+    Properties properties;
+    for (PropertyID id : forwarded) {
+        auto it = source.find(id);
+        if (it != source.end()) {
+            properties.insert(*it);
+        }
+    }
+    return properties.empty() ? std::vector<uint8_t>() : frame.serializeProperties(properties);
+}
+
+void Connection::handleDeliver(const MessageRef& message, uint16_t packetId, QoS qos, bool retain) {
+    std::string_view topic = message->getTopic();
+    LOG_TRACE("Deliver message: %.*s (packet id %u)", static_cast<int>(topic.size()), topic.data(), packetId);
+    const MessageTrace* shared = message->getTrace();
+    uint64_t dequeuedAt = shared ? Trace::now() : 0;
+    frame.serializePublish(message, qos, retain, packetId, false, writeBuffer);
+    uint64_t encodedAt = shared ? Trace::now() : 0;
+    Metrics::packetSent(PacketType::PUBLISH);
+    ConnectionStats::add(stats.messagesOut, 1);
+    writeSocket(writeBuffer.data(), writeBuffer.size());
+    if (shared) {
+        MessageTrace delivery = *shared;
+        delivery[TracePoint::ENQUEUED] = Trace::getEnqueued(message.get());
+        delivery[TracePoint::DEQUEUED] = dequeuedAt;
+        delivery[TracePoint::ENCODED] = encodedAt;
+        delivery[TracePoint::WRITTEN] = Trace::now();
+        Trace::complete(topic, delivery);
+    }
+}
+
+void Connection::handleResend(InflightWindow::Entry& entry) {
+    if (entry.released) {
+        PubrelPacket pubrel{entry.packetId, ReasonCode::SUCCESS};
+        sendPacket(pubrel);
+        return;
+    }
+    frame.serializePublish(entry.message, entry.qos, entry.retain, entry.packetId, true, writeBuffer);
+    Metrics::packetSent(PacketType::PUBLISH);
+    writeSocket(writeBuffer.data(), writeBuffer.size());
 }
 
 void Connection::sendPacket(Packet& packet) {
     auto data = frame.serialize(packet);
-    write(sockfd, data.data(), data.size());
+    Metrics::packetSent(packet.type);
+    writeSocket(data.data(), data.size());
+}
+
+void Connection::writeSocket(const uint8_t* data, size_t length) {
+    // A socket shut down by a takeover fails the write instead of raising SIGPIPE
+    ssize_t written = send(sockfd, data, length, MSG_NOSIGNAL);
+    FLOWMQ_PROBE(write__complete, sockfd, length, written);
+    if (written > 0) {
+        Metrics::increment(Counter::BYTES_SENT, written);
+        ConnectionStats::add(stats.bytesOut, written);
+    }
+}
+
+void Connection::deferPacket(Packet& packet) {
+    auto data = frame.serialize(packet);
+    Metrics::packetSent(packet.type);
+    deferred.insert(deferred.end(), data.begin(), data.end());
+}
+
+void Connection::flushDeferred() {
+    if (deferred.empty() || !session) {
+        deferred.clear();
+        deferredQos1 = 0;
+        return;
+    }
+    session->sync();
+    writeSocket(deferred.data(), deferred.size());
+    deferred.clear();
+    deferredQos1 = 0;
+}
+
+void Connection::disconnect(ReasonCode reason) {
+    flushDeferred();
+    if (frame.getVersion() == Version::MQTT5) {
+        DisconnectPacket packet{reason};
+        sendPacket(packet);
+    }
+    state = State::DISCONNECTED;
 }   
 } // namespace MQTT
@@ -6,8 +6,15 @@
 #include <cstdint>
 #include "MQTT.h"
 #include "Message.h"
+#include "MessageRef.h"
 #include <memory>
+#include <vector>
+#include <atomic>
 #include "Frame.h"
+#include "InflightWindow.h"
+#include "Trace.h"
+#include "Capture.h"
+#include "Stats.h"
 
 namespace MQTT {
 class Broker;
@@ -22,7 +29,7 @@ class Connection {
 
 public:
     explicit Connection(int sockfd, Broker* broker);
-    ~Connection() = default;
+    ~Connection();
     void run();
     bool isConnected() const;
 
@@ -40,17 +47,58 @@ public:
     void handleDisconnect(std::shared_ptr<DisconnectPacket> packet);
     void handleAuth(std::shared_ptr<AuthPacket> packet);    
 
-    void handleDeliver(const Message& message, uint16_t packetId, QoS qos);
+    void handleDeliver(const MessageRef& message, uint16_t packetId, QoS qos, bool retain);
+    // Write an inflight message again: PUBLISH with DUP set, or PUBREL once PUBREC arrived
+    void handleResend(InflightWindow::Entry& entry);
     void sendPacket(Packet &packet);
+    // Queue an ack until the records it confirms are durable
+    void deferPacket(Packet &packet);
+    void flushDeferred();
+    // Send DISCONNECT with reason (MQTT 5 only) and stop reading
+    void disconnect(ReasonCode reason);
 
 private:
     int sockfd;
     State state;
     Frame frame;
-    std::shared_ptr<Session> session;
+    // Holds the packets parsed from one read; reset before the next
+    Arena parseArena;
+    // Owned by the broker, which keeps it until this thread detaches from it
+    Session* session = nullptr;
+    // Set from the thread of a connection taking the session over; this thread then stops and detaches
+    std::atomic<bool> takenOver{false};
+    // Signals deliveries pending in the session's inbox; -1 until CONNECT
+    int inboxFd = -1;
     Broker* broker;
     static const int BUFFER_SIZE = 1024;
     uint8_t buffer[BUFFER_SIZE];
+    // Bytes of a packet that has not been completely received yet
+    std::vector<uint8_t> incoming;
+    std::vector<uint8_t> deferred;
+    // Reused for every outgoing PUBLISH
+    std::vector<uint8_t> writeBuffer;
+    // QoS 1 publishes whose PUBACK is still deferred; with the QoS 2 ids awaiting PUBREL they count against Receive Maximum
+    uint16_t deferredQos1 = 0;
+    // Stamps of the publish being handled when it was sampled for tracing
+    bool tracing = false;
+    MessageTrace trace;
+    // Bytes read from the client, kept when the broker records a capture
+    Capture::Stream capture;
+    // Counters served by GET /connections, and publishes of the current read for GET /top
+    ConnectionStats stats;
+    PublishBatch published;
+    // What this connection last charged to MemoryTag::BUFFERS
+    int64_t bufferBytes = 0;
+    // Charge the connection and its buffers at their current capacity
+    void chargeBuffers();
+    // Milliseconds between timed resends of unacknowledged messages, 0 if disabled
+    uint32_t retransmitInterval() const;
+    // Wake up for timed resends and the expiry sweep, whichever is due sooner; -1 for neither
+    int pollTimeout(uint32_t retransmitInterval) const;
+    // Encoded MQTT 5 properties of a publish that are passed on to subscribers
+    std::vector<uint8_t> forwardedProperties(const Properties& source);
+    // Write to the socket and count the bytes sent
+    void writeSocket(const uint8_t* data, size_t length);
 };
 } // namespace MQTT
 
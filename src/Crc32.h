@@ -0,0 +1,15 @@
+#ifndef CRC32_H
+#define CRC32_H
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace MQTT {
+
+// CRC-32 (IEEE 802.3) used to detect torn or corrupt records in on-disk logs
+uint32_t crc32(const void *data, size_t length, uint32_t crc = 0);
+
+}
+
+#endif // CRC32_H
@@ -0,0 +1,58 @@
+#include "DeliveryInbox.h"
+#include "SlabPool.h"
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace MQTT {
+
+DeliveryInbox::DeliveryInbox() : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create delivery eventfd");
+    }
+}
+
+DeliveryInbox::~DeliveryInbox() {
+    drain([](Delivery &) {});
+    close(fd);
+}
+
+void* DeliveryInbox::Node::operator new(size_t size) {
+    return SlabPool::allocate(size);
+}
+
+void DeliveryInbox::Node::operator delete(void *pointer, size_t size) {
+    SlabPool::deallocate(pointer, size);
+}
+
+void DeliveryInbox::push(Delivery delivery) {
+    Node *previous = head.load(std::memory_order_relaxed);
+    Node *node = new Node{std::move(delivery), previous};
+    while (!head.compare_exchange_weak(previous, node, std::memory_order_release, std::memory_order_relaxed)) {
+        node->next = previous;
+    }
+    // Only the push onto an empty inbox wakes the consumer; it drains everything behind it too.
+    // The node is the consumer's once published, so its link cannot be read back here.
+    if (previous == nullptr) {
+        eventfd_write(fd, 1);
+    }
+}
+
+void DeliveryInbox::clearWakeup() {
+    // Reset before detaching the stack so that a push landing after the exchange signals again
+    eventfd_t value;
+    eventfd_read(fd, &value);
+}
+
+DeliveryInbox::Node* DeliveryInbox::reverse(Node *node) {
+    Node *reversed = nullptr;
+    while (node) {
+        Node *next = node->next;
+        node->next = reversed;
+        reversed = node;
+        node = next;
+    }
+    return reversed;
+}
+
+}
@@ -0,0 +1,77 @@
+#ifndef DELIVERY_INBOX_H
+#define DELIVERY_INBOX_H
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include "MessageRef.h"
+
+namespace MQTT {
+
+// Messages routed to a session by publishers on other threads, waiting for
+// the I/O thread of the session's connection to pick them up.
+//
+// Producers push onto a lock-free intrusive stack with a single CAS; the
+// consumer detaches the whole stack with one exchange and reverses it, so a
+// drain costs one atomic operation per batch rather than per message. The
+// producer that finds the stack empty writes to an eventfd, which is what the
+// connection polls next to its socket; later producers piggyback on that
+// wakeup until the consumer has drained.
+class DeliveryInbox {
+public:
+    struct Delivery {
+        MessageRef message;
+        QoS qos;
+        bool retain;
+        // Steady-clock nanoseconds it was pushed, for traced messages only
+        uint64_t enqueuedAt = 0;
+    };
+
+    DeliveryInbox();
+    ~DeliveryInbox();
+    DeliveryInbox(const DeliveryInbox&) = delete;
+    DeliveryInbox& operator=(const DeliveryInbox&) = delete;
+
+    // Safe to call from any thread
+    void push(Delivery delivery);
+
+    // Consumer side: hand every pending delivery to visit in arrival order and return how many there were
+    template <typename Visitor>
+    size_t drain(Visitor visit) {
+        clearWakeup();
+        Node *node = reverse(head.exchange(nullptr, std::memory_order_acquire));
+        size_t count = 0;
+        while (node) {
+            Node *next = node->next;
+            visit(node->delivery);
+            delete node;
+            node = next;
+            count++;
+        }
+        return count;
+    }
+
+    bool empty() const { return head.load(std::memory_order_acquire) == nullptr; }
+    // Readable while deliveries are pending
+    int getFd() const { return fd; }
+
+private:
+    struct Node {
+        Delivery delivery;
+        Node *next;
+
+        static void* operator new(size_t size);
+        static void operator delete(void *pointer, size_t size);
+    };
+
+    std::atomic<Node*> head{nullptr};
+    int fd;
+
+    static Node* reverse(Node *node);
+    void clearWakeup();
+};
+
+}
+
+#endif // DELIVERY_INBOX_H
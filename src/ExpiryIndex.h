@@ -0,0 +1,56 @@
+#ifndef EXPIRY_INDEX_H
+#define EXPIRY_INDEX_H
+#pragma once
+
+#include <queue>
+#include <vector>
+#include <cstdint>
+
+namespace MQTT {
+
+// Keys ordered by the time something they hold expires, so a sweep only
+// visits the keys that are due instead of scanning every queue or topic.
+//
+// Entries are never updated in place: a key whose deadline moves is simply
+// scheduled again, and the visitor is expected to ignore stale entries
+// (e.g. by comparing the deadline with the one the key currently holds).
+// Not synchronized; callers hold their own lock.
+template <typename Key>
+class ExpiryIndex {
+public:
+    void schedule(uint64_t expiresAt, Key key) {
+        items.push(Item{expiresAt, std::move(key)});
+    }
+
+    // Remove every entry due at nowMs and visit it, earliest first; returns how many were visited
+    template <typename Visitor>
+    size_t expire(uint64_t nowMs, Visitor visit) {
+        size_t visited = 0;
+        while (!items.empty() && items.top().expiresAt <= nowMs) {
+            Item item = items.top();
+            items.pop();
+            visit(item.expiresAt, item.key);
+            visited++;
+        }
+        return visited;
+    }
+
+    // Earliest deadline, or 0 if nothing is scheduled
+    uint64_t next() const { return items.empty() ? 0 : items.top().expiresAt; }
+    size_t size() const { return items.size(); }
+    bool empty() const { return items.empty(); }
+
+private:
+    struct Item {
+        uint64_t expiresAt;
+        Key key;
+
+        bool operator>(const Item &other) const { return expiresAt > other.expiresAt; }
+    };
+
+    std::priority_queue<Item, std::vector<Item>, std::greater<Item>> items;
+};
+
+}
+
+#endif // EXPIRY_INDEX_H
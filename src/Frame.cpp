@@ -1,10 +1,31 @@
 
 #include "Frame.h"
+#include "SlabPool.h"
+#include "Log.h"
 #include <memory>
 #include <iostream>
 
 namespace MQTT {
 
+// Multi-byte integers are big-endian on the wire regardless of the host
+static uint16_t readUint16(const uint8_t *buffer) {
+    return static_cast<uint16_t>(buffer[0] << 8 | buffer[1]);
+}
+
+static uint32_t readUint32(const uint8_t *buffer) {
+    return static_cast<uint32_t>(buffer[0]) << 24 | static_cast<uint32_t>(buffer[1]) << 16 |
+           static_cast<uint32_t>(buffer[2]) << 8 | buffer[3];
+}
+
+template <typename T>
+std::shared_ptr<Packet> Frame::makePacket(T &&packet) {
+    using Type = std::decay_t<T>;
+    if (arena) {
+        return std::allocate_shared<Type>(ArenaAllocator<Type>(*arena), std::forward<T>(packet));
+    }
+    return makePooled<Type>(std::forward<T>(packet));
+}
+
 std::shared_ptr<Packet> Frame::parse(const uint8_t *buffer, size_t length) {
     if (length < 2) {
         throw std::runtime_error("Insufficient data for a valid MQTT packet");
@@ -14,10 +35,10 @@ std::shared_ptr<Packet> Frame::parse(const uint8_t *buffer, size_t length) {
         throw std::runtime_error("Invalid MQTT packet header");
     }
     if (header.type == PacketType::PINGREQ && length == 2 && buffer[1] == 0) {
-        return std::make_unique<PingreqPacket>();
+        return makePacket(PingreqPacket());
     }
     if (header.type == PacketType::PINGRESP && length == 2 && buffer[1] == 0) {
-        return std::make_unique<PingrespPacket>();
+        return makePacket(PingrespPacket());
     }
     size_t offset = 1;  
     auto [remainingLength, lengthBytes] = decodeRemainingLength(buffer + offset, length - offset);
@@ -28,30 +49,51 @@ std::shared_ptr<Packet> Frame::parse(const uint8_t *buffer, size_t length) {
     
     switch (header.type) {
     case PacketType::CONNECT:
-        return std::make_shared<ConnectPacket>(parseConnect(buffer + offset, remainingLength));
+        return makePacket(parseConnect(buffer + offset, remainingLength));
+    case PacketType::CONNACK:
+        return makePacket(parseConnack(buffer + offset, remainingLength));
     case PacketType::PUBLISH:
-        return std::make_shared<PublishPacket>(parsePublish(header, buffer + offset, remainingLength));
+        return makePacket(parsePublish(header, buffer + offset, remainingLength));
     case PacketType::PUBACK:
-        return std::make_shared<PubackPacket>(parsePuback(buffer + offset, remainingLength));
+        return makePacket(parsePuback(buffer + offset, remainingLength));
     case PacketType::PUBREC:
-        return std::make_shared<PubrecPacket>(parsePubrec(buffer + offset, remainingLength));
+        return makePacket(parsePubrec(buffer + offset, remainingLength));
     case PacketType::PUBREL:
-        return std::make_shared<PubrelPacket>(parsePubrel(buffer + offset, remainingLength));
+        return makePacket(parsePubrel(buffer + offset, remainingLength));
     case PacketType::PUBCOMP:
-        return std::make_shared<PubcompPacket>(parsePubcomp(buffer + offset, remainingLength));
+        return makePacket(parsePubcomp(buffer + offset, remainingLength));
     case PacketType::SUBSCRIBE:
-        return std::make_shared<SubscribePacket>(parseSubscribe(buffer + offset, remainingLength));
+        return makePacket(parseSubscribe(buffer + offset, remainingLength));
+    case PacketType::SUBACK:
+        return makePacket(parseSuback(buffer + offset, remainingLength));
     case PacketType::UNSUBSCRIBE:
-        return std::make_shared<UnsubscribePacket>(parseUnsubscribe(buffer + offset, remainingLength));
+        return makePacket(parseUnsubscribe(buffer + offset, remainingLength));
     case PacketType::DISCONNECT:
-        return std::make_shared<DisconnectPacket>(parseDisconnect(buffer + offset, remainingLength));
+        return makePacket(parseDisconnect(buffer + offset, remainingLength));
     case PacketType::AUTH:
-        return std::make_shared<AuthPacket>(parseAuth(buffer + offset, remainingLength));
+        return makePacket(parseAuth(buffer + offset, remainingLength));
     default:
         throw std::runtime_error("Unsupported packet type");
     }
 }
 
+size_t Frame::packetLength(const uint8_t *buffer, size_t length) {
+    size_t multiplier = 1;
+    size_t remainingLength = 0;
+    for (size_t offset = 1; offset < length; ++offset) {
+        remainingLength += (buffer[offset] & 127) * multiplier;
+        if ((buffer[offset] & 128) == 0) {
+            size_t total = offset + 1 + remainingLength;
+            return length >= total ? total : 0;
+        }
+        if (multiplier > MAX_MULTIPLIER) {
+            throw std::runtime_error("Malformed Variable Byte Integer");
+        }
+        multiplier *= 128;
+    }
+    return 0;
+}
+
 std::pair<size_t, size_t> Frame::decodeRemainingLength(const uint8_t *buffer, size_t length) {
     return decodeVariableByteInteger(buffer, length);
 }
@@ -99,10 +141,9 @@ Properties Frame::doParseProperties(const uint8_t *buffer, size_t length) {
     size_t subscriptionIdentifierBytes;
 
     size_t offset = 0;
-    printf("length: %ld\n", length);
     while (offset < length) {
         auto [id, idBytes] = decodeVariableByteInteger(buffer+offset, length-offset);
-        printf("id: %ld, idBytes: %ld\n", id, idBytes);
+        LOG_TRACE("property id: %zu, idBytes: %zu", size_t(id), size_t(idBytes));
         offset += idBytes;
         PropertyID propertyId = static_cast<PropertyID>(id);
         switch (propertyId) {
@@ -117,7 +158,7 @@ Properties Frame::doParseProperties(const uint8_t *buffer, size_t length) {
                 if (offset + 4 > length) {
                     throw std::runtime_error("Invalid properties: insufficient data");
                 }
-                properties[propertyId] = *reinterpret_cast<const uint32_t*>(buffer + offset);    
+                properties[propertyId] = readUint32(buffer + offset);    
                 offset += 4;
                 break;
             case PropertyID::CONTENT_TYPE:
@@ -153,7 +194,7 @@ Properties Frame::doParseProperties(const uint8_t *buffer, size_t length) {
                 if (offset + 4 > length) {
                     throw std::runtime_error("Invalid properties: insufficient data");
                 }
-                properties[propertyId] = *reinterpret_cast<const uint32_t*>(buffer + offset);;
+                properties[propertyId] = readUint32(buffer + offset);
                 offset += 4;
                 break;
             case PropertyID::ASSIGNED_CLIENT_IDENTIFIER:
@@ -168,7 +209,7 @@ Properties Frame::doParseProperties(const uint8_t *buffer, size_t length) {
                 if (offset + 2 > length) {
                     throw std::runtime_error("Invalid properties: insufficient data");  
                 }   
-                properties[propertyId] = *reinterpret_cast<const uint16_t*>(buffer + offset);;
+                properties[propertyId] = readUint16(buffer + offset);
                 offset += 2;
                 break;
             case PropertyID::AUTHENTICATION_METHOD:
@@ -199,21 +240,21 @@ Properties Frame::doParseProperties(const uint8_t *buffer, size_t length) {
                 if (offset + 2 > length) {
                     throw std::runtime_error("Invalid properties: insufficient data");  
                 }   
-                properties[propertyId] = *reinterpret_cast<const uint16_t*>(buffer + offset);
+                properties[propertyId] = readUint16(buffer + offset);
                 offset += 2;
                 break;
             case PropertyID::TOPIC_ALIAS_MAXIMUM:
                 if (offset + 2 > length) {
                     throw std::runtime_error("Invalid properties: insufficient data");    
                 }   
-                properties[propertyId] = *reinterpret_cast<const uint16_t*>(buffer + offset);
+                properties[propertyId] = readUint16(buffer + offset);
                 offset += 2;
                 break;
             case PropertyID::TOPIC_ALIAS:
                 if (offset + 2 > length) {
                     throw std::runtime_error("Invalid properties: insufficient data");    
                 }   
-                properties[propertyId] = *reinterpret_cast<const uint16_t*>(buffer + offset);    
+                properties[propertyId] = readUint16(buffer + offset);    
                 offset += 2;
                 break;
             case PropertyID::MAXIMUM_QOS:
@@ -227,7 +268,7 @@ Properties Frame::doParseProperties(const uint8_t *buffer, size_t length) {
                 if (offset + 4 > length) {  
                     throw std::runtime_error("Invalid properties: insufficient data");    
                 }   
-                properties[propertyId] = *reinterpret_cast<const uint32_t*>(buffer + offset);
+                properties[propertyId] = readUint32(buffer + offset);
                 offset += 4;
                 break;
             case PropertyID::WILDCARD_SUBSCRIPTION_AVAILABLE:
@@ -263,7 +304,7 @@ std::pair<Properties, size_t> Frame::parseProperties(const uint8_t *buffer, size
         return std::make_pair(Properties(), 1);
     }
     auto [propertyLength, propertyBytes] = decodeVariableByteInteger(buffer, length);
-    printf("propertyLength: %ld, propertyBytes: %ld\n", propertyLength, propertyBytes);
+    LOG_TRACE("propertyLength: %zu, propertyBytes: %zu", size_t(propertyLength), size_t(propertyBytes));
     if(propertyBytes + propertyLength > length) {
         throw std::runtime_error("Not enough data for properperties");
     }     
@@ -276,12 +317,10 @@ std::pair<Properties, size_t> Frame::parseProperties(const uint8_t *buffer, size
 ConnectPacket Frame::parseConnect(const uint8_t *buffer, size_t length) {  
     auto connect = ConnectPacket();
     size_t offset = 0;
-    std::cout << "length: " << length << std::endl;
     // Parse protocol name
     std::string protoName = parseString(buffer, length);
     offset += protoName.length() + 2;
 
-    std::cout << "protoname: " << protoName << std::endl;
 
     Version protoVersion = static_cast<Version>(buffer[offset]);
     connect.protocolName = protoName;
@@ -302,21 +341,20 @@ ConnectPacket Frame::parseConnect(const uint8_t *buffer, size_t length) {
     // Parse keep alive
     connect.keepAlive = (buffer[offset] << 8) | buffer[offset + 1];
     offset += 2;    
-    std::cout << "keepAlive: " << connect.keepAlive << std::endl;
 
-    // Parse properties
-    if(version == Version::MQTT5) {
+    // Parse properties; the frame version is not known until this CONNECT is parsed
+    if(protoVersion == Version::MQTT5) {
         auto [properties, propLength] = parseProperties(buffer+offset, length-offset);
         connect.properties = properties;
         offset += propLength;
     }
-    std::cout << "Properties: " << connect.properties.size() << std::endl;
 
     // Parse client ID
     std::string clientId = parseString(buffer+offset, length-offset);
     connect.clientId = clientId;
     offset += clientId.length() + 2;
-    std::cout << "clientId: " << clientId << std::endl;
+    LOG_TRACE("CONNECT %s: protocol %s, keepAlive %u, %zu properties", clientId.c_str(), protoName.c_str(),
+              unsigned(connect.keepAlive), connect.properties.size());
 
     // Parse will properties and message if present
     if (connect.willFlag) {
@@ -384,6 +422,17 @@ PublishPacket Frame::parsePublish(const FixedHeader &header, const uint8_t *buff
     return publish;
 }
 
+ConnackPacket Frame::parseConnack(const uint8_t *buffer, size_t length) {
+    if (length < 2) {
+        throw std::runtime_error("Invalid CONNACK packet");
+    }
+    auto connack = ConnackPacket(PacketType::CONNACK, (buffer[0] & 0x01) != 0, static_cast<ReasonCode>(buffer[1]));
+    if (version == Version::MQTT5 && length > 2) {
+        connack.properties = parseProperties(buffer + 2, length - 2).first;
+    }
+    return connack;
+}
+
 PubackPacket Frame::parsePuback(const uint8_t *buffer, size_t length) {
     auto puback = PubackPacket();
     size_t offset = 0;
@@ -391,33 +440,36 @@ PubackPacket Frame::parsePuback(const uint8_t *buffer, size_t length) {
     puback.packetId = parsePacketId(buffer, length);
     offset += 2;
 
-    // Parse properties
-    if(version == Version::MQTT5) {
-        auto [properties, propLength] = parseProperties(buffer+offset, length - offset);
+    // Reason code and properties may be left out, meaning success and none
+    if (length > offset) {
+        puback.reasonCode = static_cast<ReasonCode>(buffer[offset]);
+        offset += 1;
+    }
+    if (version == Version::MQTT5 && length > offset) {
+        auto [properties, propLength] = parseProperties(buffer + offset, length - offset);
         puback.properties = properties;
         offset += propLength;
     }
-        
-    // Parse reason code
-    puback.reasonCode = static_cast<ReasonCode>(buffer[offset]);  
-
     return puback;
 }
 
 PubrecPacket Frame::parsePubrec(const uint8_t *buffer, size_t length) {
     auto pubrec = PubrecPacket();
     size_t offset = 0;
-    // Parse packet identifier      
+    // Parse packet identifier
     pubrec.packetId = parsePacketId(buffer, length);
     offset += 2;
-    // Parse properties
-    if(version == Version::MQTT5) {
-        auto [properties, propLength] = parseProperties(buffer+offset, length - offset);
+
+    // Reason code and properties may be left out, meaning success and none
+    if (length > offset) {
+        pubrec.reasonCode = static_cast<ReasonCode>(buffer[offset]);
+        offset += 1;
+    }
+    if (version == Version::MQTT5 && length > offset) {
+        auto [properties, propLength] = parseProperties(buffer + offset, length - offset);
         pubrec.properties = properties;
         offset += propLength;
     }
-    // Parse reason code
-    pubrec.reasonCode = static_cast<ReasonCode>(buffer[offset]);
     return pubrec;
 }
 
@@ -427,34 +479,37 @@ PubrelPacket Frame::parsePubrel(const uint8_t *buffer, size_t length) {
     // Parse packet identifier
     pubrel.packetId = parsePacketId(buffer, length);
     offset += 2;
-    // Parse properties
-    if(version == Version::MQTT5) {
-        auto [properties, propLength] = parseProperties(buffer+offset, length - offset);
+
+    // Reason code and properties may be left out, meaning success and none
+    if (length > offset) {
+        pubrel.reasonCode = static_cast<ReasonCode>(buffer[offset]);
+        offset += 1;
+    }
+    if (version == Version::MQTT5 && length > offset) {
+        auto [properties, propLength] = parseProperties(buffer + offset, length - offset);
         pubrel.properties = properties;
         offset += propLength;
     }
-    // Parse reason code
-    pubrel.reasonCode = static_cast<ReasonCode>(buffer[offset]);   
     return pubrel;
 }
 
 PubcompPacket Frame::parsePubcomp(const uint8_t *buffer, size_t length) {
     auto pubcomp = PubcompPacket();
     size_t offset = 0;
-    // Parse packet identifier  
+    // Parse packet identifier
     pubcomp.packetId = parsePacketId(buffer, length);
-    offset += 2;  
-    
-    // Parse properties
-    if(version == Version::MQTT5) {
-        auto [properties, propLength] = parseProperties(buffer+offset, length - offset);
+    offset += 2;
+
+    // Reason code and properties may be left out, meaning success and none
+    if (length > offset) {
+        pubcomp.reasonCode = static_cast<ReasonCode>(buffer[offset]);
+        offset += 1;
+    }
+    if (version == Version::MQTT5 && length > offset) {
+        auto [properties, propLength] = parseProperties(buffer + offset, length - offset);
         pubcomp.properties = properties;
         offset += propLength;
     }
-
-    // Parse reason code
-    pubcomp.reasonCode = static_cast<ReasonCode>(buffer[offset]);
-
     return pubcomp;
 }
 
@@ -493,6 +548,20 @@ SubscribePacket Frame::parseSubscribe(const uint8_t *buffer, size_t length) {
     return subscribe;
 }
 
+SubackPacket Frame::parseSuback(const uint8_t *buffer, size_t length) {
+    auto suback = SubackPacket(parsePacketId(buffer, length));
+    size_t offset = 2;
+    if (version == Version::MQTT5) {
+        auto [properties, propLength] = parseProperties(buffer + offset, length - offset);
+        suback.properties = properties;
+        offset += propLength;
+    }
+    for (; offset < length; offset++) {
+        suback.reasonCodes.push_back(static_cast<ReasonCode>(buffer[offset]));
+    }
+    return suback;
+}
+
 UnsubscribePacket Frame::parseUnsubscribe(const uint8_t *buffer, size_t length) {
     auto unsubscribe = UnsubscribePacket();
     size_t offset = 0;  
@@ -527,6 +596,10 @@ PingrespPacket Frame::parsePingresp(const uint8_t *buffer, size_t length) {
 }
 
 DisconnectPacket Frame::parseDisconnect(const uint8_t *buffer, size_t length) {
+    // MQTT 5 may add a reason code; without one the disconnect is normal
+    if (version == Version::MQTT5 && length >= 1) {
+        return DisconnectPacket(static_cast<ReasonCode>(buffer[0]));
+    }
     return DisconnectPacket();
 }
 
@@ -613,7 +686,6 @@ std::vector<uint8_t> Frame::serializeConnect(const ConnectPacket &packet) {
 
     // TODO:: Properties
     auto propertiesBuffer = serializeProperties(packet.properties);
-    std::cout << "propertiesBuffer: " << propertiesBuffer.size() << std::endl;
     buffer.insert(buffer.end(), propertiesBuffer.begin(), propertiesBuffer.end());
 
     // Payload
@@ -665,8 +737,16 @@ std::vector<uint8_t> Frame::serializeConnect(const ConnectPacket &packet) {
 std::vector<uint8_t> Frame::serializeConnack(const ConnackPacket &packet) {
     std::vector<uint8_t> buffer;
     buffer.push_back(static_cast<uint8_t>(PacketType::CONNACK) << 4);
-    // Serialize remaining length (2 bytes for the variable header)
-    buffer.push_back(0x02);
+    std::vector<uint8_t> propertiesBytes;
+    std::vector<uint8_t> propertyLengthBytes;
+    if (version == Version::MQTT5) {
+        propertiesBytes = serializeProperties(packet.properties);
+        propertyLengthBytes = encodeRemainingLength(propertiesBytes.size());
+    }
+    // Serialize remaining length (2 bytes for the variable header, then MQTT 5 properties)
+    std::vector<uint8_t> remainingLengthBytes =
+        encodeRemainingLength(2 + propertyLengthBytes.size() + propertiesBytes.size());
+    buffer.insert(buffer.end(), remainingLengthBytes.begin(), remainingLengthBytes.end());
 
     // Serialize variable header
     // Byte 1: Connect Acknowledge Flags
@@ -678,6 +758,8 @@ std::vector<uint8_t> Frame::serializeConnack(const ConnackPacket &packet) {
 
     // Byte 2: Connect Return Code
     buffer.push_back(static_cast<uint8_t>(packet.reasonCode));
+    buffer.insert(buffer.end(), propertyLengthBytes.begin(), propertyLengthBytes.end());
+    buffer.insert(buffer.end(), propertiesBytes.begin(), propertiesBytes.end());
     return buffer;
 }
 
@@ -688,20 +770,21 @@ std::vector<uint8_t> Frame::serializePublish(const PublishPacket &packet) {
     flags |= (static_cast<uint8_t>(packet.qos) << 1);
     flags |= (packet.retain ? 0x01 : 0);
     buffer.push_back(flags);
-    // Serialize properties
-    auto propertiesBuffer = serializeProperties(packet.properties);
-    
+    // Serialize properties (MQTT 5 only)
+    std::vector<uint8_t> propertiesBuffer;
+    if (version == Version::MQTT5) {
+        propertiesBuffer = serializeProperties(packet.properties);
+        auto propertyLengthBytes = encodeRemainingLength(propertiesBuffer.size());
+        propertiesBuffer.insert(propertiesBuffer.begin(), propertyLengthBytes.begin(), propertyLengthBytes.end());
+    }
+
     // Serialize remaining length
     uint32_t remainingLength = 2;                 // Topic Name length (2 bytes)
     remainingLength += packet.topicName.length(); // Topic Name
     if (packet.qos > QoS::QOS_0) {
         remainingLength += 2; // Packet Identifier (2 bytes)
     }
-    if(propertiesBuffer.size() > 0) {
-        remainingLength += propertiesBuffer.size(); // Properties
-    } else {
-        remainingLength += 1; // Property Length
-    }
+    remainingLength += propertiesBuffer.size(); // Property Length + Properties
     remainingLength += packet.payload.size(); // Payload
 
     std::vector<uint8_t> remainingLengthBytes = encodeRemainingLength(remainingLength);
@@ -716,14 +799,89 @@ std::vector<uint8_t> Frame::serializePublish(const PublishPacket &packet) {
         buffer.push_back((packet.packetId >> 8) & 0xFF);
         buffer.push_back(packet.packetId & 0xFF);
     }
-    // Serialize properties
-    buffer.push_back(0);
-    //buffer.insert(buffer.end(), propertiesBuffer.begin(), propertiesBuffer.end());
+    buffer.insert(buffer.end(), propertiesBuffer.begin(), propertiesBuffer.end());
     // Serialize Payload
     buffer.insert(buffer.end(), packet.payload.begin(), packet.payload.end());
     return buffer;
 }
 
+void Frame::encodePublish(const MessageBlock &message, QoS qos, bool retain, EncodedPublish &encoded) {
+    std::string_view topic = message.getTopic();
+    ByteView payload = message.getPayload();
+    ByteView properties = message.getProperties();
+    // The remaining expiry differs per delivery, so it gets a fixed-width slot patched on every copy
+    bool expires = version == Version::MQTT5 && message.getExpiresAt() != 0;
+    size_t expiryLength = expires ? 5 : 0;
+    std::vector<uint8_t> propertyLengthBytes;
+    if (version == Version::MQTT5) {
+        propertyLengthBytes = encodeRemainingLength(expiryLength + properties.size);
+    } else {
+        properties = ByteView();
+    }
+    size_t remainingLength = 2 + topic.size() + (qos > QoS::QOS_0 ? 2 : 0) + propertyLengthBytes.size() +
+                             expiryLength + properties.size + payload.size;
+    std::vector<uint8_t> remainingLengthBytes = encodeRemainingLength(remainingLength);
+
+    encoded.version = version;
+    encoded.qos = qos;
+    encoded.retain = retain;
+    std::vector<uint8_t> &buffer = encoded.bytes;
+    buffer.clear();
+    buffer.reserve(1 + remainingLengthBytes.size() + remainingLength);
+    buffer.push_back(static_cast<uint8_t>(PacketType::PUBLISH) << 4 | static_cast<uint8_t>(qos) << 1 |
+                     (retain ? 0x01 : 0));
+    buffer.insert(buffer.end(), remainingLengthBytes.begin(), remainingLengthBytes.end());
+    buffer.push_back((topic.size() >> 8) & 0xFF);
+    buffer.push_back(topic.size() & 0xFF);
+    buffer.insert(buffer.end(), topic.begin(), topic.end());
+    encoded.packetIdOffset = 0;
+    if (qos > QoS::QOS_0) {
+        encoded.packetIdOffset = buffer.size();
+        buffer.push_back(0);
+        buffer.push_back(0);
+    }
+    buffer.insert(buffer.end(), propertyLengthBytes.begin(), propertyLengthBytes.end());
+    encoded.expiryOffset = 0;
+    if (expires) {
+        buffer.push_back(static_cast<uint8_t>(PropertyID::MESSAGE_EXPIRY_INTERVAL));
+        encoded.expiryOffset = buffer.size();
+        buffer.insert(buffer.end(), 4, 0);
+    }
+    buffer.insert(buffer.end(), properties.begin(), properties.end());
+    buffer.insert(buffer.end(), payload.begin(), payload.end());
+}
+
+void Frame::serializePublish(const MessageRef &message, QoS qos, bool retain, uint16_t packetId, bool dup,
+                             std::vector<uint8_t> &buffer) {
+    const EncodedPublish *encoded = message->getEncoded();
+    std::unique_ptr<EncodedPublish> fresh;
+    if (!encoded || encoded->version != version || encoded->qos != qos || encoded->retain != retain) {
+        fresh = std::make_unique<EncodedPublish>();
+        encodePublish(*message, qos, retain, *fresh);
+        // Only the first encoding is kept; subscribers that differ from it encode their own
+        if (!encoded && message->cacheEncoded(fresh.get())) {
+            encoded = fresh.release();
+        } else {
+            encoded = fresh.get();
+        }
+    }
+    buffer.assign(encoded->bytes.begin(), encoded->bytes.end());
+    if (qos > QoS::QOS_0) {
+        buffer[encoded->packetIdOffset] = (packetId >> 8) & 0xFF;
+        buffer[encoded->packetIdOffset + 1] = packetId & 0xFF;
+    }
+    if (encoded->expiryOffset > 0) {
+        uint32_t remaining = message->getRemainingExpiry(MessageBlock::currentTime());
+        buffer[encoded->expiryOffset] = (remaining >> 24) & 0xFF;
+        buffer[encoded->expiryOffset + 1] = (remaining >> 16) & 0xFF;
+        buffer[encoded->expiryOffset + 2] = (remaining >> 8) & 0xFF;
+        buffer[encoded->expiryOffset + 3] = remaining & 0xFF;
+    }
+    if (dup) {
+        buffer[0] |= 0x08;
+    }
+}
+
 std::vector<uint8_t> Frame::serializeSubscribe(const SubscribePacket &packet) {
     std::vector<uint8_t> buffer;
     buffer.push_back((static_cast<uint8_t>(PacketType::SUBSCRIBE) << 4) | 0x02);
@@ -1022,7 +1180,13 @@ std::vector<uint8_t> Frame::serializeProperties(const Properties &properties) {
                 buffer.push_back(length & 0xFF);
                 buffer.insert(buffer.end(), arg.begin(), arg.end());
             } else if constexpr (std::is_same_v<T, UserProperties>) {
+                bool first = true;
                 for (const auto& [key, val] : arg) {
+                    // Every pair is a property of its own and repeats the identifier
+                    if (!first) {
+                        buffer.push_back(static_cast<uint8_t>(PropertyID::USER_PROPERTY));
+                    }
+                    first = false;
                     uint16_t keyLength = static_cast<uint16_t>(key.length());
                     buffer.push_back((keyLength >> 8) & 0xFF);
                     buffer.push_back(keyLength & 0xFF);
@@ -2,13 +2,20 @@
 #define FRAME_H
 #pragma once
 
+#include <memory>
 #include "MQTT.h"
+#include "Arena.h"
+#include "MessageRef.h"
 
 namespace MQTT {
 
 class Frame {
     Version version = Version::MQTT5;
+    Arena *arena = nullptr;
     Properties doParseProperties(const uint8_t *buffer, size_t length);
+    template <typename T>
+    std::shared_ptr<Packet> makePacket(T &&packet);
+    void encodePublish(const MessageBlock &message, QoS qos, bool retain, EncodedPublish &encoded);
 public:
     static constexpr size_t MAX_MULTIPLIER = 128 * 128 * 128;
     static constexpr size_t MAX_LENGTH = 268435455; 
@@ -16,9 +23,15 @@ public:
     Frame(Version version) : version(version) {}
 
     void setVersion(Version version) { this->version = version; }
+    Version getVersion() const { return version; }
+    // Parsed packets are placed in arena, which the caller resets once they are all released;
+    // without one they come from the slab pool
+    void setArena(Arena *arena) { this->arena = arena; }
 
     // Parse MQTT packets
     std::shared_ptr<Packet> parse(const uint8_t *buffer, size_t length);
+    // Size of the complete packet at the start of buffer, or 0 if more bytes are needed
+    static size_t packetLength(const uint8_t *buffer, size_t length);
 
     // Parse the remaining length field of an MQTT packet
     std::pair<size_t, size_t> decodeRemainingLength(const uint8_t *buffer, size_t length);
@@ -54,6 +67,11 @@ public:
     std::vector<uint8_t> serializeConnect(const ConnectPacket &packet);
     std::vector<uint8_t> serializeConnack(const ConnackPacket &packet);
     std::vector<uint8_t> serializePublish(const PublishPacket &packet);
+    // Write a routed message into buffer. The first encoding is kept on the message and copied
+    // for every later subscriber with the same version, QoS and retain flag, with only the packet
+    // id, DUP bit and remaining Message Expiry Interval patched in.
+    void serializePublish(const MessageRef &message, QoS qos, bool retain, uint16_t packetId, bool dup,
+                          std::vector<uint8_t> &buffer);
     std::vector<uint8_t> serializePuback(const PubackPacket &packet);
     std::vector<uint8_t> serializePubrec(const PubrecPacket &packet);
     std::vector<uint8_t> serializePubrel(const PubrelPacket &packet);
@@ -0,0 +1,140 @@
+#include "InflightWindow.h"
+#include <algorithm>
+
+namespace MQTT {
+
+namespace {
+constexpr size_t INITIAL_CAPACITY = 16;
+}
+
+static_assert(sizeof(InflightWindow::Entry) <= 16, "inflight entries should stay a pointer plus packet state");
+
+InflightWindow::InflightWindow(uint16_t limit)
+    : slots(INITIAL_CAPACITY), links(INITIAL_CAPACITY), used(1, 1), limit(limit ? limit : 65535) {}
+
+void InflightWindow::setLimit(uint16_t limit) {
+    this->limit = limit ? limit : 65535;
+}
+
+void InflightWindow::reserve(uint32_t required) {
+    if (required <= slots.size()) {
+        return;
+    }
+    size_t capacity = slots.size();
+    while (capacity < required) {
+        capacity *= 2;
+    }
+    // Entries stay at their packet id, so growing never moves one to another slot
+    slots.resize(capacity);
+    links.resize(capacity);
+    used.resize((capacity + 63) / 64);
+}
+
+void InflightWindow::insert(uint16_t packetId, MessageRef message, QoS qos) {
+    reserve(uint32_t(packetId) + 1);
+    used[packetId / 64] |= uint64_t(1) << (packetId % 64);
+    Entry &entry = slots[packetId];
+    entry = Entry();
+    entry.message = std::move(message);
+    entry.packetId = packetId;
+    entry.qos = qos;
+    entry.occupied = true;
+    // Appended as the newest
+    Link &head = links[0];
+    links[packetId] = Link{head.older, 0};
+    links[head.older].newer = packetId;
+    head.older = packetId;
+    count++;
+}
+
+uint16_t InflightWindow::push(MessageRef message, QoS qos, bool retain) {
+    while (freeWord < used.size() && used[freeWord] == ~uint64_t(0)) {
+        freeWord++;
+    }
+    // Past the bitmap every id is free; fewer than 65535 are in use, so the lowest one fits 16 bits
+    uint32_t id = freeWord * 64 + (freeWord < used.size() ? __builtin_ctzll(~used[freeWord]) : 0);
+    insert(static_cast<uint16_t>(id), std::move(message), qos);
+    slots[id].retain = retain;
+    return static_cast<uint16_t>(id);
+}
+
+void InflightWindow::restore(uint16_t packetId, MessageRef message, QoS qos, bool released) {
+    insert(packetId, std::move(message), qos);
+    slots[packetId].released = released;
+}
+
+InflightWindow::Entry* InflightWindow::find(uint16_t packetId) {
+    if (packetId == 0 || packetId >= slots.size()) {
+        return nullptr;
+    }
+    Entry &entry = slots[packetId];
+    return entry.occupied ? &entry : nullptr;
+}
+
+bool InflightWindow::release(uint16_t packetId) {
+    Entry *entry = find(packetId);
+    if (!entry || entry->qos != QoS::QOS_2) {
+        return false;
+    }
+    entry->message.reset();
+    entry->released = true;
+    return true;
+}
+
+bool InflightWindow::erase(uint16_t packetId) {
+    Entry *entry = find(packetId);
+    if (!entry) {
+        return false;
+    }
+    *entry = Entry();
+    const Link &link = links[packetId];
+    links[link.older].newer = link.newer;
+    links[link.newer].older = link.older;
+    links[packetId] = Link();
+    used[packetId / 64] &= ~(uint64_t(1) << (packetId % 64));
+    freeWord = std::min<size_t>(freeWord, packetId / 64);
+    count--;
+    return true;
+}
+
+void InflightWindow::clear() {
+    slots.assign(INITIAL_CAPACITY, Entry());
+    links.assign(INITIAL_CAPACITY, Link());
+    used.assign(1, 1);
+    count = 0;
+    freeWord = 0;
+}
+
+bool PacketIdSet::insert(uint16_t packetId) {
+    if (bits.empty()) {
+        bits.resize(65536 / 64);
+    }
+    uint64_t bit = uint64_t(1) << (packetId % 64);
+    uint64_t &word = bits[packetId / 64];
+    if (word & bit) {
+        return false;
+    }
+    word |= bit;
+    count++;
+    return true;
+}
+
+bool PacketIdSet::erase(uint16_t packetId) {
+    if (!contains(packetId)) {
+        return false;
+    }
+    bits[packetId / 64] &= ~(uint64_t(1) << (packetId % 64));
+    count--;
+    return true;
+}
+
+bool PacketIdSet::contains(uint16_t packetId) const {
+    return !bits.empty() && (bits[packetId / 64] >> (packetId % 64)) & 1;
+}
+
+void PacketIdSet::clear() {
+    bits.clear();
+    count = 0;
+}
+
+}
@@ -0,0 +1,110 @@
+#ifndef INFLIGHT_WINDOW_H
+#define INFLIGHT_WINDOW_H
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "MessageRef.h"
+#include "Memory.h"
+
+namespace MQTT {
+
+// Outgoing QoS 1/2 messages awaiting acknowledgement, indexed by packet id.
+//
+// Each new message takes the lowest free packet id, found in a bitmap of the
+// ids in use, and its entry lives in slot p of an array indexed by id. As at
+// most the peer's Receive Maximum are inflight, ids never exceed it and the
+// array only grows (by doubling) up to the most messages ever inflight at
+// once, however long an unacknowledged one holds its id. Entries are also
+// linked in the order they were sent, which is the order they must be
+// retransmitted in, so acks arriving out of order unlink them in O(1).
+class InflightWindow {
+public:
+    // A shared message reference plus the per-subscriber state, 16 bytes per slot
+    struct Entry {
+        MessageRef message;
+        uint16_t packetId = 0;
+        QoS qos = QoS::QOS_0;
+        bool occupied : 1;
+        // QoS 2 after PUBREC: the message is gone but the id is held until PUBCOMP
+        bool released : 1;
+        bool retain : 1;
+        // Low 32 bits of the steady clock in milliseconds when the entry was last written
+        uint32_t sentAt = 0;
+
+        Entry() : occupied(false), released(false), retain(false) {}
+    };
+
+    explicit InflightWindow(uint16_t limit = 65535);
+
+    // Receive Maximum of the peer: at most limit entries are inflight at once
+    void setLimit(uint16_t limit);
+    uint16_t getLimit() const { return limit; }
+
+    bool full() const { return count >= limit; }
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    // Bytes of the slots and their index; the messages are shared with other subscribers and not counted
+    size_t getMemoryBytes() const {
+        return slots.capacity() * sizeof(Entry) + links.capacity() * sizeof(Link) + used.capacity() * sizeof(uint64_t);
+    }
+
+    // Store a message under the lowest free packet id and return it; the window must not be full
+    uint16_t push(MessageRef message, QoS qos, bool retain = false);
+    // Store a message under a known packet id, e.g. when restoring state; ids must be restored in send order
+    void restore(uint16_t packetId, MessageRef message, QoS qos, bool released = false);
+    Entry* find(uint16_t packetId);
+    bool release(uint16_t packetId);
+    bool erase(uint16_t packetId);
+    void clear();
+
+    // Visit entries in the order they were sent
+    template <typename Visitor>
+    void forEach(Visitor visit) {
+        for (uint16_t id = links[0].newer; id != 0; id = links[id].newer) {
+            visit(slots[id]);
+        }
+    }
+
+private:
+    // Neighbours of an id in send order; links[0] heads the list, as id 0 is never handed out
+    struct Link {
+        uint16_t older = 0;
+        uint16_t newer = 0;
+    };
+
+    template <typename T>
+    using Tagged = std::vector<T, TaggedAllocator<T, MemoryTag::SESSIONS>>;
+    Tagged<Entry> slots;
+    Tagged<Link> links;
+    // Bit p is set while packet id p is in use; bit 0 always is
+    Tagged<uint64_t> used;
+    uint16_t limit;
+    size_t count = 0;
+    // No word of used below this one has a free id
+    size_t freeWord = 0;
+
+    void reserve(uint32_t required);
+    void insert(uint16_t packetId, MessageRef message, QoS qos);
+};
+
+// Packet ids of incoming QoS 2 publishes awaiting PUBREL, kept in a bitmap
+// that is only allocated once the client sends QoS 2.
+class PacketIdSet {
+public:
+    bool insert(uint16_t packetId);
+    bool erase(uint16_t packetId);
+    bool contains(uint16_t packetId) const;
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear();
+
+private:
+    std::vector<uint64_t> bits;
+    size_t count = 0;
+};
+
+}
+
+#endif // INFLIGHT_WINDOW_H
@@ -4,6 +4,7 @@
 #include <stdexcept>
 #include <iostream>
 #include "Listener.h"
+#include "Log.h"
 
 namespace MQTT {
 
@@ -26,10 +27,16 @@ void Listener::start() {
     if (bind(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
         throw std::runtime_error("Failed to bind to a port");
     }
-    if (listen(sockfd, 10) < 0) {
+    // Room for connect storms: thousands of clients coming back at once after an outage
+    if (listen(sockfd, SOMAXCONN) < 0) {
         throw std::runtime_error("Failed to listen on socket");
     }
-    std::cout << "MQTT listener on port " << port << std::endl;
+    socklen_t length = sizeof(address);
+    if (getsockname(sockfd, (struct sockaddr *)&address, &length) < 0) {
+        throw std::runtime_error("Failed to read the listening port");
+    }
+    port = ntohs(address.sin_port);
+    LOG_INFO("MQTT listener on port %d", port);
 }
 
 int Listener::acceptConnection() {
@@ -11,10 +11,12 @@ class Listener {
     int sockfd;
     struct sockaddr_in address;
 public:
+    // Port 0 picks a free one, see getPort()
     Listener(int port);
     ~Listener();
 
     void start();
+    int getPort() const { return port; }
     int acceptConnection();
     void stop();
 };
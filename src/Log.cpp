@@ -0,0 +1,186 @@
+#include "Log.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdlib>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace MQTT {
+
+std::atomic<uint8_t> Log::threshold{static_cast<uint8_t>(LogLevel::INFO)};
+
+namespace {
+
+struct Record {
+    uint64_t timeMs;
+    LogLevel level;
+    uint16_t length;
+    char text[Log::RECORD_SIZE - 12];
+};
+
+// Single producer (the owning thread), single consumer (whoever holds the writer's lock)
+struct Ring {
+    Record records[Log::RING_RECORDS];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    // Set when the owning thread exits; the ring goes once it is drained
+    std::atomic<bool> abandoned{false};
+    uint32_t threadId = 0;
+};
+
+const char* levelName(LogLevel level) {
+    static const char* names[] = {"TRACE", "DEBUG", "INFO", "WARN", "ERROR", "OFF"};
+    return names[static_cast<int>(level)];
+}
+
+class Writer {
+public:
+    Writer() {
+        // The writer is never destroyed, so threads still logging at exit find it alive
+        std::atexit([] { Log::flush(); });
+    }
+
+    Ring* attach() {
+        std::lock_guard<std::mutex> guard(lock);
+        rings.push_back(std::make_unique<Ring>());
+        rings.back()->threadId = ++threadCount;
+        if (!started) {
+            std::thread([this] { run(); }).detach();
+            started = true;
+        }
+        return rings.back().get();
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> guard(lock);
+        drainLocked();
+    }
+
+    std::atomic<FILE*> output{stderr};
+    std::atomic<uint64_t> dropped{0};
+
+private:
+    std::mutex lock;
+    std::vector<std::unique_ptr<Ring>> rings;
+    bool started = false;
+    uint32_t threadCount = 0;
+    uint64_t reportedDrops = 0;
+
+    void run() {
+        for (;;) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            drain();
+        }
+    }
+
+    void drainLocked() {
+        FILE* out = output.load(std::memory_order_relaxed);
+        bool wrote = false;
+        for (size_t i = 0; i < rings.size();) {
+            Ring &ring = *rings[i];
+            // Read before draining, so no record is left behind once the ring is seen abandoned
+            bool abandoned = ring.abandoned.load(std::memory_order_acquire);
+            uint64_t head = ring.head.load(std::memory_order_relaxed);
+            uint64_t tail = ring.tail.load(std::memory_order_acquire);
+            for (; head != tail; head++) {
+                writeRecord(out, ring.records[head % Log::RING_RECORDS], ring.threadId);
+                wrote = true;
+            }
+            ring.head.store(head, std::memory_order_release);
+            if (abandoned) {
+                rings[i] = std::move(rings.back());
+                rings.pop_back();
+            } else {
+                i++;
+            }
+        }
+        uint64_t drops = dropped.load(std::memory_order_relaxed);
+        if (drops != reportedDrops) {
+            fprintf(out, "WARN  %llu log records dropped\n", static_cast<unsigned long long>(drops - reportedDrops));
+            reportedDrops = drops;
+            wrote = true;
+        }
+        if (wrote) {
+            fflush(out);
+        }
+    }
+
+    static void writeRecord(FILE* out, const Record &record, uint32_t threadId) {
+        time_t seconds = static_cast<time_t>(record.timeMs / 1000);
+        struct tm utc;
+        gmtime_r(&seconds, &utc);
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &utc);
+        fprintf(out, "%s.%03u %-5s [%u] %.*s\n", stamp, static_cast<unsigned>(record.timeMs % 1000),
+                levelName(record.level), threadId, static_cast<int>(record.length), record.text);
+    }
+};
+
+Writer& writer() {
+    static Writer* instance = new Writer();
+    return *instance;
+}
+
+struct ThreadRing {
+    Ring* ring = nullptr;
+    ~ThreadRing() {
+        if (ring) {
+            ring->abandoned.store(true, std::memory_order_release);
+        }
+    }
+};
+
+thread_local ThreadRing threadRing;
+
+}
+
+LogLevel Log::parseLevel(const std::string &name) {
+    static const char* names[] = {"trace", "debug", "info", "warn", "error", "off"};
+    for (int i = 0; i <= static_cast<int>(LogLevel::OFF); i++) {
+        if (name == names[i]) {
+            return static_cast<LogLevel>(i);
+        }
+    }
+    throw std::runtime_error("Unknown log level: " + name);
+}
+
+void Log::setOutput(FILE *output) {
+    writer().output.store(output, std::memory_order_relaxed);
+}
+
+void Log::write(LogLevel level, const char *format, ...) {
+    Ring* ring = threadRing.ring;
+    if (!ring) {
+        ring = threadRing.ring = writer().attach();
+    }
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (tail - ring->head.load(std::memory_order_acquire) >= RING_RECORDS) {
+        writer().dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    Record &record = ring->records[tail % RING_RECORDS];
+    record.timeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    record.level = level;
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(record.text, sizeof(record.text), format, args);
+    va_end(args);
+    record.length = static_cast<uint16_t>(length < 0 ? 0 : std::min<size_t>(length, sizeof(record.text) - 1));
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+void Log::flush() {
+    writer().drain();
+}
+
+uint64_t Log::getDroppedCount() {
+    return writer().dropped.load(std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,83 @@
+#ifndef LOG_H
+#define LOG_H
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Statements below this level are compiled out; set through the FLOWMQ_LOG_LEVEL CMake cache variable
+#ifndef FLOWMQ_LOG_LEVEL
+#define FLOWMQ_LOG_LEVEL 0
+#endif
+
+namespace MQTT {
+
+enum class LogLevel : uint8_t {
+    TRACE = 0,
+    DEBUG = 1,
+    INFO = 2,
+    WARN = 3,
+    ERROR = 4,
+    OFF = 5,
+};
+
+// Logging that keeps stdio and its locks off the threads doing the work.
+//
+// A statement below the runtime level costs a relaxed load and a branch, and
+// its arguments are not evaluated. An enabled one is formatted by the calling
+// thread straight into a fixed-size record of that thread's own ring, with no
+// lock and no allocation once the ring exists; a background thread drains the
+// rings and writes the records out. When a ring is full the record is dropped
+// and counted rather than making the caller wait. Records of one thread stay
+// in order; records of different threads are only ordered by their timestamps.
+class Log {
+public:
+    // Longer messages are truncated
+    static constexpr size_t RECORD_SIZE = 256;
+    static constexpr size_t RING_RECORDS = 64;
+    // Lowest level compiled in. Compared as a LogLevel so that at TRACE the check is not an
+    // integer comparison against 0, which -Wtype-limits reports as always true
+    static constexpr LogLevel COMPILED_LEVEL = static_cast<LogLevel>(FLOWMQ_LOG_LEVEL);
+
+    static constexpr bool compiledIn(LogLevel level) { return level >= COMPILED_LEVEL; }
+
+    static bool enabled(LogLevel level) {
+        return static_cast<uint8_t>(level) >= threshold.load(std::memory_order_relaxed);
+    }
+    static void setLevel(LogLevel level) { threshold.store(static_cast<uint8_t>(level), std::memory_order_relaxed); }
+    static LogLevel getLevel() { return static_cast<LogLevel>(threshold.load(std::memory_order_relaxed)); }
+    // "trace", "debug", "info", "warn", "error" or "off"; throws std::runtime_error otherwise
+    static LogLevel parseLevel(const std::string &name);
+    // Where records are written, stderr by default
+    static void setOutput(FILE *output);
+
+    static void write(LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+    // Write out every record logged so far, on the calling thread
+    static void flush();
+    // Records lost to full rings
+    static uint64_t getDroppedCount();
+
+private:
+    static std::atomic<uint8_t> threshold;
+};
+
+}
+
+#define FLOWMQ_LOG(level, ...)                                  \
+    do {                                                        \
+        if constexpr (::MQTT::Log::compiledIn(level)) {         \
+            if (::MQTT::Log::enabled(level)) {                  \
+                ::MQTT::Log::write(level, __VA_ARGS__);         \
+            }                                                   \
+        }                                                       \
+    } while (0)
+
+#define LOG_TRACE(...) FLOWMQ_LOG(::MQTT::LogLevel::TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) FLOWMQ_LOG(::MQTT::LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) FLOWMQ_LOG(::MQTT::LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...) FLOWMQ_LOG(::MQTT::LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) FLOWMQ_LOG(::MQTT::LogLevel::ERROR, __VA_ARGS__)
+
+#endif // LOG_H
@@ -1,14 +1,61 @@
-
 #include "Server.h"
+#include "Log.h"
+#include "Memory.h"
 #include <iostream>
+#include <cstring>
+
+static void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [-p port] [-d data-directory] [-H] [-m metrics-port] [-t trace-one-in-n] [-c capture-file] [-M subsystem=bytes] [-l trace|debug|info|warn|error|off]" << std::endl;
+}
 
 int main(int argc, char* argv[]) {
+    int port = 1883; // Default MQTT port
+    MQTT::BrokerConfig config;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            config.dataDirectory = argv[++i];
+        } else if (std::strcmp(argv[i], "-H") == 0) {
+            config.hugePages = true;
+        } else if (std::strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            config.metricsPort = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            config.traceSampling = std::atoi(argv[++i]);
+        } else if (std::strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            config.capturePath = argv[++i];
+        } else if (std::strcmp(argv[i], "-M") == 0 && i + 1 < argc) {
+            // e.g. -M trie=67108864, once per subsystem
+            std::string limit = argv[++i];
+            size_t equals = limit.find('=');
+            try {
+                if (equals == std::string::npos) {
+                    throw std::runtime_error("Expected subsystem=bytes: " + limit);
+                }
+                MQTT::MemoryTag tag = MQTT::Memory::parseTag(limit.substr(0, equals));
+                config.memoryLimits[static_cast<int>(tag)] = std::stoull(limit.substr(equals + 1));
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            try {
+                MQTT::Log::setLevel(MQTT::Log::parseLevel(argv[++i]));
+            } catch (const std::exception& e) {
+                std::cerr << "Error: " << e.what() << std::endl;
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
      try {
-        MQTT::Server server(1883); // Default MQTT port
+        MQTT::Server server(port, config);
         server.start();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
     return 0;
-}
\ No newline at end of file
+}
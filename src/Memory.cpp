@@ -0,0 +1,76 @@
+#include "Memory.h"
+#include "Log.h"
+#include "SlabPool.h"
+#include <cstdio>
+#include <stdexcept>
+
+namespace MQTT {
+
+std::atomic<uint32_t> Memory::overLimit{0};
+
+namespace {
+
+constexpr int TAGS = static_cast<int>(MemoryTag::COUNT);
+
+std::atomic<size_t> limits[TAGS];
+
+}
+
+MemoryTag Memory::parseTag(const std::string &name) {
+    for (int i = 0; i < TAGS; i++) {
+        if (name == Metrics::memoryTagName(static_cast<MemoryTag>(i))) {
+            return static_cast<MemoryTag>(i);
+        }
+    }
+    throw std::runtime_error("Unknown memory subsystem: " + name);
+}
+
+void Memory::setLimit(MemoryTag tag, size_t bytes) {
+    limits[static_cast<int>(tag)].store(bytes, std::memory_order_relaxed);
+}
+
+size_t Memory::getLimit(MemoryTag tag) {
+    return limits[static_cast<int>(tag)].load(std::memory_order_relaxed);
+}
+
+void Memory::checkLimits() {
+    uint32_t over = 0;
+    int64_t bytes[TAGS];
+    for (int i = 0; i < TAGS; i++) {
+        size_t limit = limits[i].load(std::memory_order_relaxed);
+        bytes[i] = Metrics::getMemory(static_cast<MemoryTag>(i));
+        if (limit && bytes[i] > static_cast<int64_t>(limit)) {
+            over |= 1u << i;
+        }
+    }
+    uint32_t previous = overLimit.exchange(over, std::memory_order_relaxed);
+    for (int i = 0; i < TAGS; i++) {
+        uint32_t bit = 1u << i;
+        const char* name = Metrics::memoryTagName(static_cast<MemoryTag>(i));
+        if ((over & bit) && !(previous & bit)) {
+            LOG_WARN("Memory of %s is over its limit: %lld of %zu bytes", name, static_cast<long long>(bytes[i]),
+                     limits[i].load(std::memory_order_relaxed));
+        } else if (!(over & bit) && (previous & bit)) {
+            LOG_INFO("Memory of %s is back under its limit: %lld bytes", name, static_cast<long long>(bytes[i]));
+        }
+    }
+}
+
+std::string Memory::format() {
+    std::string text;
+    char line[128];
+    for (int i = 0; i < TAGS; i++) {
+        MemoryTag tag = static_cast<MemoryTag>(i);
+        snprintf(line, sizeof(line), "%s bytes=%lld limit=%zu\n", Metrics::memoryTagName(tag),
+                 static_cast<long long>(Metrics::getMemory(tag)), getLimit(tag));
+        text += line;
+    }
+    // What the pools took from the system, whichever subsystem the objects in them belong to
+    SlabPool::Stats slabs = SlabPool::getStats();
+    snprintf(line, sizeof(line), "slab_pools slabs=%llu bytes=%llu\n", static_cast<unsigned long long>(slabs.slabs),
+             static_cast<unsigned long long>(slabs.slabBytes));
+    text += line;
+    return text;
+}
+
+}
@@ -0,0 +1,83 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include "Metrics.h"
+
+namespace MQTT {
+
+// Standard allocator over the heap that charges what a container allocates to a subsystem
+template <typename T, MemoryTag Tag>
+struct TaggedAllocator {
+    using value_type = T;
+    // Not deduced by std::allocator_traits because of the non-type parameter
+    template <typename U>
+    struct rebind {
+        using other = TaggedAllocator<U, Tag>;
+    };
+
+    TaggedAllocator() noexcept = default;
+    template <typename U>
+    TaggedAllocator(const TaggedAllocator<U, Tag>&) noexcept {}
+
+    T* allocate(size_t n) {
+        T* pointer = std::allocator<T>().allocate(n);
+        Metrics::charge(Tag, static_cast<int64_t>(n * sizeof(T)));
+        return pointer;
+    }
+    void deallocate(T* pointer, size_t n) noexcept {
+        Metrics::charge(Tag, -static_cast<int64_t>(n * sizeof(T)));
+        std::allocator<T>().deallocate(pointer, n);
+    }
+
+    template <typename U>
+    bool operator==(const TaggedAllocator<U, Tag>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const TaggedAllocator<U, Tag>&) const noexcept { return false; }
+};
+
+// Bytes a string holds outside its own object: none while it fits the inline buffer
+inline size_t heapBytes(const std::string &text) {
+    return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+}
+
+// Memory held by each subsystem and the limits operators put on it.
+//
+// Containers charge their subsystem through TaggedAllocator; objects and the
+// strings they own charge Metrics::charge explicitly when they are created,
+// resized and destroyed. The totals are gauges like the others, so reading
+// them merges every thread's deltas and is kept off the hot paths: limits are
+// compared at each expiry sweep and the outcome cached for isOverLimit().
+//
+// Limits are soft. Crossing one is logged, and the broker refuses what would
+// add to that subsystem where the protocol lets it say no: new subscriptions
+// while the trie or the subscription index is over, QoS 1/2 publishes from
+// MQTT 5 clients while messages are. Nothing already held is freed.
+class Memory {
+public:
+    // Subsystem of a memoryTagName(), e.g. "trie"; throws std::runtime_error for other names
+    static MemoryTag parseTag(const std::string &name);
+    // 0 removes the limit
+    static void setLimit(MemoryTag tag, size_t bytes);
+    static size_t getLimit(MemoryTag tag);
+    // Whether the subsystem was over its limit at the last check
+    static bool isOverLimit(MemoryTag tag) {
+        return overLimit.load(std::memory_order_relaxed) & (1u << static_cast<int>(tag));
+    }
+    // Compare every subsystem with its limit, warning about the ones that crossed it since the last check
+    static void checkLimits();
+    // Bytes and limit of every subsystem and the size of the slab pools, served by GET /memory
+    static std::string format();
+
+private:
+    static std::atomic<uint32_t> overLimit;
+};
+
+}
+
+#endif // MEMORY_H
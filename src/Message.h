@@ -7,12 +7,22 @@
 #include "MQTT.h"
 
 namespace MQTT {
+struct MessageTrace;
 
 struct Message {
     std::string topic;
     std::vector<uint8_t> payload;
     QoS qos = QoS::QOS_0;
     bool retain = false;
+    std::string publisherId;
+    // Position of the message in the write-ahead log; 0 if it was never logged
+    uint64_t id = 0;
+    // MQTT 5 properties to forward to subscribers, encoded without the length prefix
+    std::vector<uint8_t> properties;
+    // Milliseconds since the epoch after which the message must not be delivered; 0 for never
+    uint64_t expiresAt = 0;
+    // Stamps of a publish sampled for tracing, copied into the block it is routed as; not owned
+    const MessageTrace* trace = nullptr;
 
     Message(const std::string &t, const std::vector<uint8_t> &p, QoS q = QoS::QOS_0, bool r = false)
         : topic(t), payload(std::move(p)), qos(q), retain(r) {}
@@ -24,6 +34,15 @@ struct Message {
     std::string toString() const;
 };
 
+// Will Message of a connection, kept with its session until the connection ends
+struct Will {
+    Message message;
+    // Will Delay Interval: seconds between the connection ending and the will being published
+    uint32_t delay = 0;
+    // Message Expiry Interval in seconds, counted from when the will is published; 0 for none
+    uint32_t messageExpiry = 0;
+};
+
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,108 @@
+#include "MessageRef.h"
+#include "SlabPool.h"
+#include "Trace.h"
+#include "Metrics.h"
+#include <chrono>
+#include <cstring>
+#include <new>
+
+namespace MQTT {
+
+uint64_t MessageBlock::currentTime() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// An encoding's bytes never change once it is cached, so what it is charged on caching is what it frees
+static size_t encodedBytes(const EncodedPublish &encoding) {
+    return sizeof(EncodedPublish) + encoding.bytes.capacity();
+}
+
+uint32_t MessageBlock::getRemainingExpiry(uint64_t nowMs) const {
+    if (expiresAt <= nowMs) {
+        return 1;
+    }
+    return static_cast<uint32_t>((expiresAt - nowMs + 999) / 1000);
+}
+
+bool MessageBlock::cacheEncoded(EncodedPublish *encoding) const {
+    EncodedPublish *expected = nullptr;
+    if (!encoded.compare_exchange_strong(expected, encoding, std::memory_order_acq_rel)) {
+        return false;
+    }
+    Metrics::charge(MemoryTag::MESSAGES, encodedBytes(*encoding));
+    return true;
+}
+
+Message MessageBlock::toMessage() const {
+    Message message(std::string(getTopic()), getPayload().toVector(), qos, retain);
+    message.publisherId = std::string(getPublisherId());
+    message.properties = getProperties().toVector();
+    message.id = id;
+    message.expiresAt = expiresAt;
+    return message;
+}
+
+MessageRef MessageRef::allocate(std::string_view topic, ByteView payload, std::string_view publisherId,
+                                ByteView properties) {
+    size_t size = sizeof(MessageBlock) + topic.size() + publisherId.size() + properties.size + payload.size;
+    MessageBlock *block = new (SlabPool::allocate(size)) MessageBlock();
+    Metrics::charge(MemoryTag::MESSAGES, size);
+    block->topicLength = topic.size();
+    block->publisherIdLength = publisherId.size();
+    block->propertiesLength = properties.size;
+    block->payloadLength = payload.size;
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(block + 1);
+    std::memcpy(bytes, topic.data(), topic.size());
+    bytes += topic.size();
+    std::memcpy(bytes, publisherId.data(), publisherId.size());
+    bytes += publisherId.size();
+    if (properties.size > 0) {
+        std::memcpy(bytes, properties.data, properties.size);
+        bytes += properties.size;
+    }
+    if (payload.size > 0) {
+        std::memcpy(bytes, payload.data, payload.size);
+    }
+    block->receivedAt = MessageBlock::currentTime();
+    MessageRef ref;
+    ref.block = block;
+    return ref;
+}
+
+MessageRef MessageRef::create(const Message &message) {
+    MessageRef ref = allocate(message.topic, message.payload, message.publisherId, message.properties);
+    ref.block->qos = message.qos;
+    ref.block->retain = message.retain;
+    ref.block->id = message.id;
+    ref.block->expiresAt = message.expiresAt;
+    if (message.trace) {
+        ref.block->trace = new MessageTrace(*message.trace);
+    }
+    return ref;
+}
+
+MessageRef MessageRef::create(std::string_view topic, ByteView payload, QoS qos, bool retain,
+                              std::string_view publisherId, uint64_t id, uint64_t expiresAt, ByteView properties) {
+    MessageRef ref = allocate(topic, payload, publisherId, properties);
+    ref.block->qos = qos;
+    ref.block->retain = retain;
+    ref.block->id = id;
+    ref.block->expiresAt = expiresAt;
+    return ref;
+}
+
+void MessageRef::destroy(MessageBlock *block) {
+    size_t size = block->allocationSize();
+    size_t charged = size;
+    if (EncodedPublish *encoding = block->encoded.load(std::memory_order_acquire)) {
+        charged += encodedBytes(*encoding);
+        delete encoding;
+    }
+    delete block->trace;
+    block->~MessageBlock();
+    SlabPool::deallocate(block, size);
+    Metrics::charge(MemoryTag::MESSAGES, -static_cast<int64_t>(charged));
+}
+
+}
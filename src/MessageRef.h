@@ -0,0 +1,159 @@
+#ifndef MESSAGE_REF_H
+#define MESSAGE_REF_H
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "MQTT.h"
+#include "Message.h"
+
+namespace MQTT {
+struct MessageTrace;
+
+// Read-only view of a byte range
+struct ByteView {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    ByteView() = default;
+    ByteView(const uint8_t *data, size_t size) : data(data), size(size) {}
+    ByteView(const std::vector<uint8_t> &bytes) : data(bytes.data()), size(bytes.size()) {}
+
+    const uint8_t* begin() const { return data; }
+    const uint8_t* end() const { return data + size; }
+    bool empty() const { return size == 0; }
+    std::vector<uint8_t> toVector() const { return std::vector<uint8_t>(begin(), end()); }
+};
+
+// A PUBLISH as written to subscribers, with packet id 0 and DUP clear
+struct EncodedPublish {
+    Version version;
+    QoS qos;
+    bool retain;
+    // Where the packet id goes; 0 for QoS 0
+    size_t packetIdOffset;
+    // Where the 4-byte remaining Message Expiry Interval goes; 0 if the message does not expire
+    size_t expiryOffset;
+    std::vector<uint8_t> bytes;
+};
+
+// A routed message: one immutable allocation holding the header fields
+// followed by topic, publisher id, properties and payload. Every subscriber,
+// queue and retained slot shares it through a MessageRef.
+class MessageBlock {
+public:
+    std::string_view getTopic() const { return {reinterpret_cast<const char*>(bytes()), topicLength}; }
+    std::string_view getPublisherId() const {
+        return {reinterpret_cast<const char*>(bytes()) + topicLength, publisherIdLength};
+    }
+    // MQTT 5 properties forwarded to subscribers, encoded without the length prefix
+    ByteView getProperties() const { return {bytes() + topicLength + publisherIdLength, propertiesLength}; }
+    ByteView getPayload() const {
+        return {bytes() + topicLength + publisherIdLength + propertiesLength, payloadLength};
+    }
+    QoS getQos() const { return qos; }
+    bool isRetain() const { return retain; }
+    // Position in the write-ahead log; 0 if it was never logged
+    uint64_t getId() const { return id; }
+    // Milliseconds since the epoch when the broker received the message
+    uint64_t getReceivedAt() const { return receivedAt; }
+    // Milliseconds since the epoch after which the message must not be delivered; 0 for never
+    uint64_t getExpiresAt() const { return expiresAt; }
+    bool isExpired(uint64_t nowMs) const { return expiresAt != 0 && nowMs >= expiresAt; }
+    // Message Expiry Interval to send on, in whole seconds rounded up and at least 1
+    uint32_t getRemainingExpiry(uint64_t nowMs) const;
+    // Milliseconds since the epoch on the clock receive and expiry times are taken from
+    static uint64_t currentTime();
+
+    // The first encoding built for this message, shared by every subscriber that needs the same one
+    const EncodedPublish* getEncoded() const { return encoded.load(std::memory_order_acquire); }
+    // Install encoding unless another thread got there first; on success the block owns it
+    bool cacheEncoded(EncodedPublish *encoding) const;
+
+    // Stamps of a publish sampled for tracing, null for the rest; only the publisher's thread writes them
+    MessageTrace* getTrace() const { return trace; }
+
+    // Copy out into a mutable Message, e.g. to log it
+    Message toMessage() const;
+
+private:
+    friend class MessageRef;
+
+    mutable std::atomic<uint32_t> refs{1};
+    uint32_t topicLength = 0;
+    uint32_t payloadLength = 0;
+    uint32_t propertiesLength = 0;
+    uint16_t publisherIdLength = 0;
+    QoS qos = QoS::QOS_0;
+    bool retain = false;
+    uint64_t id = 0;
+    uint64_t receivedAt = 0;
+    uint64_t expiresAt = 0;
+    mutable std::atomic<EncodedPublish*> encoded{nullptr};
+    MessageTrace* trace = nullptr;
+
+    MessageBlock() = default;
+    const uint8_t* bytes() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+    size_t allocationSize() const {
+        return sizeof(MessageBlock) + topicLength + publisherIdLength + propertiesLength + payloadLength;
+    }
+};
+
+// Counted reference to a MessageBlock.
+//
+// The count lives in the block, so a reference is a single pointer and
+// copying one is a relaxed atomic increment. References handed between
+// threads (delivery inboxes, queues drained by the reconnecting client's
+// thread, the retained store) can be released anywhere, so the count is
+// always atomic; the fan-out path passes references by const& and only
+// takes a count where one is stored.
+class MessageRef {
+public:
+    MessageRef() = default;
+    MessageRef(std::nullptr_t) {}
+    MessageRef(const MessageRef &other) : block(other.block) {
+        if (block) {
+            block->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    MessageRef(MessageRef &&other) noexcept : block(other.block) { other.block = nullptr; }
+    MessageRef& operator=(MessageRef other) noexcept {
+        std::swap(block, other.block);
+        return *this;
+    }
+    ~MessageRef() { reset(); }
+
+    static MessageRef create(const Message &message);
+    static MessageRef create(std::string_view topic, ByteView payload, QoS qos, bool retain,
+                             std::string_view publisherId = {}, uint64_t id = 0, uint64_t expiresAt = 0,
+                             ByteView properties = {});
+
+    void reset() {
+        if (block && block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            destroy(block);
+        }
+        block = nullptr;
+    }
+
+    const MessageBlock* get() const { return block; }
+    const MessageBlock* operator->() const { return block; }
+    const MessageBlock& operator*() const { return *block; }
+    explicit operator bool() const { return block != nullptr; }
+    bool operator==(const MessageRef &other) const { return block == other.block; }
+    bool operator!=(const MessageRef &other) const { return block != other.block; }
+    uint32_t useCount() const { return block ? block->refs.load(std::memory_order_relaxed) : 0; }
+
+private:
+    MessageBlock *block = nullptr;
+
+    static MessageRef allocate(std::string_view topic, ByteView payload, std::string_view publisherId,
+                               ByteView properties);
+    static void destroy(MessageBlock *block);
+};
+
+}
+
+#endif // MESSAGE_REF_H
@@ -0,0 +1,273 @@
+#include "Metrics.h"
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <cstdio>
+
+namespace MQTT {
+
+thread_local Metrics::ThreadBlock Metrics::threadBlock;
+
+namespace {
+
+struct Registry {
+    std::mutex lock;
+    // Every block ever attached, none of them freed
+    std::vector<Metrics::Block*> blocks;
+    // Blocks whose thread exited, still counted and waiting for a new thread
+    std::vector<Metrics::Block*> idle;
+};
+
+Registry& registry() {
+    // Never destroyed: threads may still exit after static destruction began
+    static Registry* instance = new Registry();
+    return *instance;
+}
+
+template <typename T>
+void fold(std::atomic<T> &into, const std::atomic<T> &from) {
+    into.store(into.load(std::memory_order_relaxed) + from.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+void merge(Metrics::Block &into, const Metrics::Block &from) {
+    for (int i = 0; i < static_cast<int>(Counter::COUNT); i++) {
+        fold(into.counters[i], from.counters[i]);
+    }
+    for (int i = 0; i < 16; i++) {
+        fold(into.packetsReceived[i], from.packetsReceived[i]);
+        fold(into.packetsSent[i], from.packetsSent[i]);
+    }
+    for (int i = 0; i < static_cast<int>(Gauge::COUNT); i++) {
+        fold(into.gauges[i], from.gauges[i]);
+    }
+    for (int i = 0; i < static_cast<int>(MemoryTag::COUNT); i++) {
+        fold(into.memory[i], from.memory[i]);
+    }
+    for (int h = 0; h < static_cast<int>(Histogram::COUNT); h++) {
+        for (int i = 0; i < Metrics::BUCKETS; i++) {
+            fold(into.buckets[h][i], from.buckets[h][i]);
+        }
+        fold(into.sums[h], from.sums[h]);
+    }
+}
+
+// Blocks are never freed, so they may be read once the lock that lists them is released
+std::vector<Metrics::Block*> blocks() {
+    Registry &metrics = registry();
+    std::lock_guard<std::mutex> guard(metrics.lock);
+    return metrics.blocks;
+}
+
+// Sum of every block
+Metrics::Block* snapshot() {
+    auto* total = new Metrics::Block();
+    for (Metrics::Block* block : blocks()) {
+        merge(*total, *block);
+    }
+    return total;
+}
+
+template <typename Field>
+auto total(Field field) {
+    decltype(field(std::declval<Metrics::Block&>()).load()) sum = 0;
+    for (Metrics::Block* block : blocks()) {
+        sum += field(*block).load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+const char* packetNames[16] = {"reserved", "connect", "connack", "publish", "puback", "pubrec", "pubrel", "pubcomp",
+                               "subscribe", "suback", "unsubscribe", "unsuback", "pingreq", "pingresp", "disconnect",
+                               "auth"};
+
+struct Description {
+    const char* name;
+    const char* help;
+};
+
+const Description counterDescriptions[] = {
+    {"flowmq_bytes_received_total", "Bytes read from client connections."},
+    {"flowmq_bytes_sent_total", "Bytes written to client connections."},
+    {"flowmq_publishes_routed_total", "Published messages that matched at least one subscription."},
+    {"flowmq_publishes_dropped_total", "Published messages that matched no subscription."},
+    {"flowmq_deliveries_dropped_total", "Deliveries lost to a full offline queue or to message expiry."},
+    {"flowmq_parse_errors_total", "Connections closed because a packet could not be parsed or handled."},
+    {"flowmq_allocations_total", "Allocations made through the slab pools."},
+};
+
+const Description gaugeDescriptions[] = {
+    {"flowmq_connections", "Open client connections."},
+    {"flowmq_inflight_messages", "QoS 1/2 messages sent and not yet acknowledged."},
+    {"flowmq_queued_messages", "Messages waiting in session queues."},
+};
+
+const char* memoryNames[] = {"trie", "subscriptions", "sessions", "messages", "buffers"};
+
+struct HistogramDescription {
+    const char* name;
+    const char* help;
+    // Unit of the exposed bounds per recorded unit, and the largest power of two given its own bucket
+    double scale;
+    int maxPower;
+};
+
+const HistogramDescription histogramDescriptions[] = {
+    {"flowmq_fanout", "Sessions a published message was delivered to.", 1.0, 20},
+    {"flowmq_route_duration_seconds", "Time spent routing a published message to its subscribers.", 1e-9, 36},
+    {"flowmq_loop_duration_seconds", "Time a connection thread spends on one wake-up of its poll loop.", 1e-9, 36},
+    {"flowmq_trace_parse_seconds", "Traced publishes: from the publisher's connection waking up to the packet parsed.", 1e-9, 36},
+    {"flowmq_trace_publish_seconds", "Traced publishes: from parsed to subscription matching starting.", 1e-9, 36},
+    {"flowmq_trace_match_seconds", "Traced publishes: matching the topic against subscriptions.", 1e-9, 36},
+    {"flowmq_trace_fanout_seconds", "Traced publishes: from matched to handed to the subscriber's session.", 1e-9, 36},
+    {"flowmq_trace_queue_seconds", "Traced publishes: waiting for the subscriber's connection thread.", 1e-9, 36},
+    {"flowmq_trace_encode_seconds", "Traced publishes: encoding the PUBLISH for the subscriber.", 1e-9, 36},
+    {"flowmq_trace_write_seconds", "Traced publishes: writing the PUBLISH to the subscriber's socket.", 1e-9, 36},
+    {"flowmq_trace_total_seconds", "Traced publishes: from the publisher's connection waking up to written to a subscriber.", 1e-9, 36},
+};
+
+void appendHeader(std::string &text, const char* name, const char* help, const char* type) {
+    text += "# HELP ";
+    text += name;
+    text += ' ';
+    text += help;
+    text += "\n# TYPE ";
+    text += name;
+    text += ' ';
+    text += type;
+    text += '\n';
+}
+
+void appendSample(std::string &text, const char* name, const std::string &labels, double value) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s%s %.17g\n", name, labels.c_str(), value);
+    text += line;
+}
+
+}
+
+Metrics::Block& Metrics::attach() {
+    Registry &metrics = registry();
+    std::lock_guard<std::mutex> guard(metrics.lock);
+    Block* block;
+    if (metrics.idle.empty()) {
+        block = new Block();
+        metrics.blocks.push_back(block);
+    } else {
+        // Counting on from what the exited thread left keeps the totals right
+        block = metrics.idle.back();
+        metrics.idle.pop_back();
+    }
+    threadBlock.block = block;
+    return *block;
+}
+
+Metrics::ThreadBlock::~ThreadBlock() {
+    if (!block) {
+        return;
+    }
+    Registry &metrics = registry();
+    std::lock_guard<std::mutex> guard(metrics.lock);
+    metrics.idle.push_back(block);
+}
+
+uint64_t Metrics::getCounter(Counter counter) {
+    return total([counter](Block &block) -> auto& { return block.counters[static_cast<int>(counter)]; });
+}
+
+uint64_t Metrics::getPacketsReceived(PacketType type) {
+    return total([type](Block &block) -> auto& { return block.packetsReceived[static_cast<int>(type) & 15]; });
+}
+
+uint64_t Metrics::getPacketsSent(PacketType type) {
+    return total([type](Block &block) -> auto& { return block.packetsSent[static_cast<int>(type) & 15]; });
+}
+
+int64_t Metrics::getGauge(Gauge gauge) {
+    return total([gauge](Block &block) -> auto& { return block.gauges[static_cast<int>(gauge)]; });
+}
+
+int64_t Metrics::getMemory(MemoryTag tag) {
+    return total([tag](Block &block) -> auto& { return block.memory[static_cast<int>(tag)]; });
+}
+
+const char* Metrics::memoryTagName(MemoryTag tag) {
+    return memoryNames[static_cast<int>(tag)];
+}
+
+uint64_t Metrics::getHistogramCount(Histogram histogram) {
+    uint64_t count = 0;
+    for (uint64_t bucket : getHistogram(histogram)) {
+        count += bucket;
+    }
+    return count;
+}
+
+std::vector<uint64_t> Metrics::getHistogram(Histogram histogram) {
+    std::unique_ptr<Block> sum(snapshot());
+    std::vector<uint64_t> buckets(BUCKETS);
+    for (int i = 0; i < BUCKETS; i++) {
+        buckets[i] = sum->buckets[static_cast<int>(histogram)][i].load(std::memory_order_relaxed);
+    }
+    return buckets;
+}
+
+std::string Metrics::scrape() {
+    std::unique_ptr<Block> sum(snapshot());
+    std::string text;
+    for (int i = 0; i < static_cast<int>(Counter::COUNT); i++) {
+        appendHeader(text, counterDescriptions[i].name, counterDescriptions[i].help, "counter");
+        appendSample(text, counterDescriptions[i].name, "", sum->counters[i].load(std::memory_order_relaxed));
+    }
+    struct PacketFamily {
+        const char* name;
+        const char* help;
+        std::atomic<uint64_t>* values;
+    };
+    for (const PacketFamily &family : {PacketFamily{"flowmq_packets_received_total", "MQTT packets received, by type.",
+                                                    sum->packetsReceived},
+                                       PacketFamily{"flowmq_packets_sent_total", "MQTT packets sent, by type.",
+                                                    sum->packetsSent}}) {
+        appendHeader(text, family.name, family.help, "counter");
+        for (int type = 1; type < 16; type++) {
+            appendSample(text, family.name, std::string("{type=\"") + packetNames[type] + "\"}",
+                         family.values[type].load(std::memory_order_relaxed));
+        }
+    }
+    for (int i = 0; i < static_cast<int>(Gauge::COUNT); i++) {
+        appendHeader(text, gaugeDescriptions[i].name, gaugeDescriptions[i].help, "gauge");
+        appendSample(text, gaugeDescriptions[i].name, "", sum->gauges[i].load(std::memory_order_relaxed));
+    }
+    appendHeader(text, "flowmq_memory_bytes", "Bytes allocated on behalf of each subsystem.", "gauge");
+    for (int i = 0; i < static_cast<int>(MemoryTag::COUNT); i++) {
+        appendSample(text, "flowmq_memory_bytes", std::string("{subsystem=\"") + memoryNames[i] + "\"}",
+                     sum->memory[i].load(std::memory_order_relaxed));
+    }
+    for (int h = 0; h < static_cast<int>(Histogram::COUNT); h++) {
+        const HistogramDescription &description = histogramDescriptions[h];
+        appendHeader(text, description.name, description.help, "histogram");
+        std::string bucketName = std::string(description.name) + "_bucket";
+        // A sub-bucket never straddles a power of two, so "below 2^k" is exact: le is 2^k - 1 recorded units
+        uint64_t cumulative = 0;
+        int next = 0;
+        for (int power = 0; power <= description.maxPower; power++) {
+            int end = bucketOf(uint64_t(1) << power);
+            for (; next < end; next++) {
+                cumulative += sum->buckets[h][next].load(std::memory_order_relaxed);
+            }
+            char labels[64];
+            snprintf(labels, sizeof(labels), "{le=\"%.10g\"}", double((uint64_t(1) << power) - 1) * description.scale);
+            appendSample(text, bucketName.c_str(), labels, cumulative);
+        }
+        for (; next < BUCKETS; next++) {
+            cumulative += sum->buckets[h][next].load(std::memory_order_relaxed);
+        }
+        appendSample(text, bucketName.c_str(), "{le=\"+Inf\"}", cumulative);
+        appendSample(text, (std::string(description.name) + "_sum").c_str(), "",
+                     sum->sums[h].load(std::memory_order_relaxed) * description.scale);
+        appendSample(text, (std::string(description.name) + "_count").c_str(), "", cumulative);
+    }
+    return text;
+}
+
+}
@@ -0,0 +1,175 @@
+#ifndef METRICS_H
+#define METRICS_H
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "MQTT.h"
+
+namespace MQTT {
+
+enum class Counter : uint8_t {
+    BYTES_RECEIVED,
+    BYTES_SENT,
+    // Publishes that matched at least one subscription, and ones that matched none
+    PUBLISHES_ROUTED,
+    PUBLISHES_DROPPED,
+    // Deliveries lost because an offline queue was full or the message expired
+    DELIVERIES_DROPPED,
+    PARSE_ERRORS,
+    // Slab pool allocations, including the ones too large for a slab
+    ALLOCATIONS,
+    COUNT
+};
+
+// Gauges are kept as per-thread deltas: one thread may raise a gauge another lowers, the sum is right
+enum class Gauge : uint8_t {
+    CONNECTIONS,
+    INFLIGHT_MESSAGES,
+    QUEUED_MESSAGES,
+    COUNT
+};
+
+// Subsystems memory is charged to, see Memory.h; kept as per-thread deltas like the gauges
+enum class MemoryTag : uint8_t {
+    // Trie nodes, their child maps and the level and filter strings they hold
+    TRIE,
+    // The broker's topic filter -> subscribers index
+    SUBSCRIPTIONS,
+    // Sessions, their subscription lists, inflight windows and offline queue entries
+    SESSIONS,
+    // Routed and retained messages and their cached encodings
+    MESSAGES,
+    // Connection objects with their receive, parse and send buffers
+    BUFFERS,
+    COUNT
+};
+
+enum class Histogram : uint8_t {
+    // Sessions a publish was delivered to
+    FANOUT,
+    // Nanoseconds spent routing a publish to its subscribers
+    ROUTE_NANOSECONDS,
+    // Nanoseconds a connection thread spends on one wake-up of its poll loop
+    LOOP_NANOSECONDS,
+    // Nanoseconds a traced publish spent in each stage on its way to a subscriber, see Trace
+    TRACE_PARSE_NANOSECONDS,
+    TRACE_PUBLISH_NANOSECONDS,
+    TRACE_MATCH_NANOSECONDS,
+    TRACE_FANOUT_NANOSECONDS,
+    TRACE_QUEUE_NANOSECONDS,
+    TRACE_ENCODE_NANOSECONDS,
+    TRACE_WRITE_NANOSECONDS,
+    TRACE_TOTAL_NANOSECONDS,
+    COUNT
+};
+
+// Broker metrics, kept per thread and only merged when scraped.
+//
+// Every thread updates its own block, so an update is a plain load, add and
+// store: the values are relaxed atomics only so the scraper may read them
+// while the owner writes, and no locked instruction is ever issued. Blocks are
+// never freed: one whose thread exited keeps its counts and is handed to the
+// next thread that starts, so totals never go back and a scrape can sum the
+// blocks without holding the registry lock.
+//
+// Histograms are log-linear like HDR histograms, but at one significant digit
+// rather than HDR's usual three: each power of two is split into four
+// sub-buckets, so any value is recorded within 25% of its size. Three digits
+// would take 2048 sub-buckets per power of two and megabytes per thread; the
+// exposition only tells powers of two apart anyway. Values from 2^MAX_MAGNITUDE
+// up, over 18 minutes in nanoseconds, share the last bucket, which keeps a
+// thread's block near 14 KB.
+class Metrics {
+public:
+    static constexpr int SUB_BUCKET_BITS = 2;
+    static constexpr int MAX_MAGNITUDE = 40;
+    static constexpr int BUCKETS = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+    struct Block {
+        std::atomic<uint64_t> counters[static_cast<int>(Counter::COUNT)];
+        std::atomic<uint64_t> packetsReceived[16];
+        std::atomic<uint64_t> packetsSent[16];
+        std::atomic<int64_t> gauges[static_cast<int>(Gauge::COUNT)];
+        std::atomic<int64_t> memory[static_cast<int>(MemoryTag::COUNT)];
+        std::atomic<uint64_t> buckets[static_cast<int>(Histogram::COUNT)][BUCKETS];
+        std::atomic<uint64_t> sums[static_cast<int>(Histogram::COUNT)];
+    };
+
+    static void increment(Counter counter, uint64_t value = 1) {
+        add(local().counters[static_cast<int>(counter)], value);
+    }
+    static void packetReceived(PacketType type) { add(local().packetsReceived[static_cast<int>(type) & 15], 1); }
+    static void packetSent(PacketType type) { add(local().packetsSent[static_cast<int>(type) & 15], 1); }
+    static void adjust(Gauge gauge, int64_t delta) {
+        auto &value = local().gauges[static_cast<int>(gauge)];
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    // Bytes allocated (positive) or freed (negative) on behalf of a subsystem
+    static void charge(MemoryTag tag, int64_t delta) {
+        auto &value = local().memory[static_cast<int>(tag)];
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    static void record(Histogram histogram, uint64_t value) {
+        Block &block = local();
+        add(block.buckets[static_cast<int>(histogram)][bucketOf(value)], 1);
+        add(block.sums[static_cast<int>(histogram)], value);
+    }
+
+    // Bucket a value is counted in; values below 2^SUB_BUCKET_BITS get one each
+    static int bucketOf(uint64_t value) {
+        if (value < (1u << SUB_BUCKET_BITS)) {
+            return static_cast<int>(value);
+        }
+        value = std::min(value, (uint64_t(1) << MAX_MAGNITUDE) - 1);
+        int magnitude = 63 - __builtin_clzll(value);
+        int shift = magnitude - SUB_BUCKET_BITS;
+        return ((shift + 1) << SUB_BUCKET_BITS) + static_cast<int>((value >> shift) & ((1u << SUB_BUCKET_BITS) - 1));
+    }
+
+    // Smallest value counted in a bucket
+    static uint64_t bucketLowerBound(int bucket) {
+        if (bucket < (1 << SUB_BUCKET_BITS)) {
+            return static_cast<uint64_t>(bucket);
+        }
+        int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+        return static_cast<uint64_t>((1 << SUB_BUCKET_BITS) + (bucket & ((1 << SUB_BUCKET_BITS) - 1))) << shift;
+    }
+
+    // Totals over every thread, for tests and the exposition below
+    static uint64_t getCounter(Counter counter);
+    static uint64_t getPacketsReceived(PacketType type);
+    static uint64_t getPacketsSent(PacketType type);
+    static int64_t getGauge(Gauge gauge);
+    static int64_t getMemory(MemoryTag tag);
+    // Label of a subsystem in the exposition and the memory dump, e.g. "trie"
+    static const char* memoryTagName(MemoryTag tag);
+    static uint64_t getHistogramCount(Histogram histogram);
+    // Per-bucket counts of a histogram over every thread, BUCKETS entries
+    static std::vector<uint64_t> getHistogram(Histogram histogram);
+    // Everything in the Prometheus text exposition format
+    static std::string scrape();
+
+private:
+    static void add(std::atomic<uint64_t> &value, uint64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+    static Block& local() {
+        Block* block = threadBlock.block;
+        return block ? *block : attach();
+    }
+    static Block& attach();
+
+    struct ThreadBlock {
+        Block* block = nullptr;
+        ~ThreadBlock();
+    };
+    static thread_local ThreadBlock threadBlock;
+};
+
+}
+
+#endif // METRICS_H
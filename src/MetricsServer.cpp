@@ -0,0 +1,116 @@
+#include "MetricsServer.h"
+#include "Metrics.h"
+#include "Trace.h"
+#include "Stats.h"
+#include "Memory.h"
+#include "MessageRef.h"
+#include "Log.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace MQTT {
+
+MetricsServer::MetricsServer(int port) : port(port) {}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+void MetricsServer::start() {
+    sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        throw std::runtime_error("Failed to create metrics socket");
+    }
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t length = sizeof(address);
+    if (bind(sockfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(sockfd, 4) < 0 ||
+        getsockname(sockfd, reinterpret_cast<sockaddr*>(&address), &length) < 0) {
+        close(sockfd);
+        sockfd = -1;
+        throw std::runtime_error("Failed to listen on metrics port");
+    }
+    port = ntohs(address.sin_port);
+    running = true;
+    thread = std::thread([this] { run(); });
+    LOG_INFO("Metrics on http://127.0.0.1:%d/metrics", port);
+}
+
+void MetricsServer::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    thread.join();
+    close(sockfd);
+    sockfd = -1;
+}
+
+void MetricsServer::run() {
+    while (running) {
+        // Wakes up now and then to notice stop()
+        struct pollfd fd = {sockfd, POLLIN, 0};
+        if (poll(&fd, 1, 200) <= 0) {
+            continue;
+        }
+        int clientSocket = accept(sockfd, nullptr, nullptr);
+        if (clientSocket < 0) {
+            continue;
+        }
+        handle(clientSocket);
+        close(clientSocket);
+    }
+}
+
+void MetricsServer::handle(int clientSocket) {
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        struct pollfd fd = {clientSocket, POLLIN, 0};
+        if (poll(&fd, 1, 1000) <= 0) {
+            return;
+        }
+        ssize_t bytesRead = read(clientSocket, buffer, sizeof(buffer));
+        if (bytesRead <= 0) {
+            return;
+        }
+        request.append(buffer, bytesRead);
+    }
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0) {
+        body = Metrics::scrape();
+    } else if (request.compare(0, 12, "GET /traces ") == 0) {
+        body = Trace::formatSlowest();
+    } else if (request.compare(0, 17, "GET /connections ") == 0) {
+        body = Stats::formatConnections(MessageBlock::currentTime());
+    } else if (request.compare(0, 9, "GET /top ") == 0) {
+        body = Stats::formatTop();
+    } else if (request.compare(0, 12, "GET /memory ") == 0) {
+        body = Memory::format();
+    } else {
+        status = "404 Not Found";
+        body = "Not found\n";
+    }
+    std::string response = "HTTP/1.1 " + status + "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    size_t written = 0;
+    while (written < response.size()) {
+        ssize_t result = write(clientSocket, response.data() + written, response.size() - written);
+        if (result <= 0) {
+            return;
+        }
+        written += result;
+    }
+}
+
+}
@@ -0,0 +1,34 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+#pragma once
+
+#include <atomic>
+#include <thread>
+
+namespace MQTT {
+
+// Serves Metrics::scrape() as GET /metrics, and the slowest traced deliveries as GET /traces, on a loopback port, one request at a time on its own thread.
+// Never on the broker's listener: scrapes stay local and cannot be starved by client traffic.
+class MetricsServer {
+public:
+    // Port 0 picks a free one, see getPort()
+    explicit MetricsServer(int port);
+    ~MetricsServer();
+
+    void start();
+    void stop();
+    int getPort() const { return port; }
+
+private:
+    int port;
+    int sockfd = -1;
+    std::atomic<bool> running{false};
+    std::thread thread;
+
+    void run();
+    void handle(int clientSocket);
+};
+
+}
+
+#endif // METRICS_SERVER_H
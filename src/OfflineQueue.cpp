@@ -0,0 +1,296 @@
+#include "OfflineQueue.h"
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace MQTT {
+
+namespace {
+
+// Followed by topic, publisher id, properties and payload, as in the MessageBlock
+struct SpillHeader {
+    uint32_t payloadLength;
+    uint16_t topicLength;
+    uint8_t qos;
+    uint8_t flags;
+    uint64_t expiresAt;
+    uint32_t propertiesLength;
+    uint16_t publisherIdLength;
+    uint16_t reserved;
+};
+static_assert(sizeof(SpillHeader) == 24, "SpillHeader must be packed");
+
+size_t recordSize(const SpillHeader &header) {
+    return sizeof(SpillHeader) + header.topicLength + header.publisherIdLength + header.propertiesLength +
+           header.payloadLength;
+}
+
+constexpr uint8_t FLAG_RETAIN = 0x01;
+constexpr uint8_t FLAG_MESSAGE_RETAIN = 0x02;
+constexpr uint8_t FLAG_MESSAGE_QOS_SHIFT = 2;
+constexpr size_t WRITE_BUFFER_SIZE = 64 * 1024;
+
+}
+
+OfflineQueue::OfflineQueue(size_t memoryLimit, const std::string &spillDirectory)
+    : memoryLimit(memoryLimit), spillDirectory(spillDirectory) {}
+
+OfflineQueue::~OfflineQueue() {
+    closeSegments();
+    if (!spillDirectory.empty()) {
+        std::error_code error;
+        std::filesystem::remove(spillDirectory, error);
+    }
+}
+
+size_t OfflineQueue::footprint(const Entry &entry) {
+    const MessageBlock &message = *entry.message;
+    return sizeof(Entry) + message.getTopic().size() + message.getPublisherId().size() +
+           message.getProperties().size + message.getPayload().size;
+}
+
+std::string OfflineQueue::segmentPath(uint64_t segment) const {
+    char name[40];
+    std::snprintf(name, sizeof(name), "queue-%016llu.seg", static_cast<unsigned long long>(segment));
+    return spillDirectory + "/" + name;
+}
+
+bool OfflineQueue::push(Entry entry) {
+    size_t bytes = footprint(entry);
+    // Once anything is on disk, newer entries must follow it there to keep the order
+    if (spilledCount == 0 && (memory.empty() || memoryBytes + bytes <= memoryLimit)) {
+        memoryBytes += bytes;
+        memory.push_back(std::move(entry));
+        return true;
+    }
+    if (spillDirectory.empty()) {
+        droppedCount++;
+        return false;
+    }
+    spill(entry);
+    return true;
+}
+
+bool OfflineQueue::pop(Entry &entry) {
+    skipExpired();
+    if (memory.empty()) {
+        return false;
+    }
+    entry = std::move(memory.front());
+    memory.pop_front();
+    memoryBytes -= footprint(entry);
+    return true;
+}
+
+const OfflineQueue::Entry* OfflineQueue::front() {
+    skipExpired();
+    return memory.empty() ? nullptr : &memory.front();
+}
+
+void OfflineQueue::skipExpired() {
+    uint64_t now = 0;
+    while (true) {
+        if (memory.empty() && spilledCount > 0) {
+            refill();
+        }
+        if (memory.empty() || memory.front().message->getExpiresAt() == 0) {
+            return;
+        }
+        if (now == 0) {
+            now = MessageBlock::currentTime();
+        }
+        if (!memory.front().message->isExpired(now)) {
+            return;
+        }
+        memoryBytes -= footprint(memory.front());
+        memory.pop_front();
+        expiredCount++;
+    }
+}
+
+size_t OfflineQueue::removeExpired(uint64_t nowMs, uint64_t &nextExpiry) {
+    size_t removed = 0;
+    nextExpiry = 0;
+    auto kept = memory.begin();
+    for (auto it = memory.begin(); it != memory.end(); ++it) {
+        const MessageBlock &message = *it->message;
+        if (message.isExpired(nowMs)) {
+            memoryBytes -= footprint(*it);
+            removed++;
+            continue;
+        }
+        if (message.getExpiresAt() && (nextExpiry == 0 || message.getExpiresAt() < nextExpiry)) {
+            nextExpiry = message.getExpiresAt();
+        }
+        if (kept != it) {
+            *kept = std::move(*it);
+        }
+        ++kept;
+    }
+    memory.erase(kept, memory.end());
+    expiredCount += removed;
+    return removed;
+}
+
+void OfflineQueue::clear() {
+    memory.clear();
+    memoryBytes = 0;
+    closeSegments();
+}
+
+void OfflineQueue::spill(const Entry &entry) {
+    if (writeFd < 0) {
+        std::filesystem::create_directories(spillDirectory);
+        writeFd = open(segmentPath(writeSegment).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (writeFd < 0) {
+            throw std::runtime_error("Failed to create queue segment " + segmentPath(writeSegment));
+        }
+    }
+    const MessageBlock &message = *entry.message;
+    std::string_view topic = message.getTopic();
+    std::string_view publisherId = message.getPublisherId();
+    ByteView properties = message.getProperties();
+    ByteView payload = message.getPayload();
+    SpillHeader header{};
+    header.payloadLength = payload.size;
+    header.topicLength = topic.size();
+    header.publisherIdLength = publisherId.size();
+    header.propertiesLength = properties.size;
+    header.qos = static_cast<uint8_t>(entry.qos);
+    header.flags = (entry.retain ? FLAG_RETAIN : 0) | (message.isRetain() ? FLAG_MESSAGE_RETAIN : 0) |
+                   static_cast<uint8_t>(message.getQos()) << FLAG_MESSAGE_QOS_SHIFT;
+    header.expiresAt = message.getExpiresAt();
+
+    const uint8_t *headerBytes = reinterpret_cast<const uint8_t *>(&header);
+    writeBuffer.insert(writeBuffer.end(), headerBytes, headerBytes + sizeof(header));
+    writeBuffer.insert(writeBuffer.end(), topic.begin(), topic.end());
+    writeBuffer.insert(writeBuffer.end(), publisherId.begin(), publisherId.end());
+    writeBuffer.insert(writeBuffer.end(), properties.begin(), properties.end());
+    writeBuffer.insert(writeBuffer.end(), payload.begin(), payload.end());
+    writeOffset += recordSize(header);
+    spilledCount++;
+
+    if (writeBuffer.size() >= WRITE_BUFFER_SIZE) {
+        flush();
+    }
+    // Records never straddle segments, so a finished segment can be deleted as soon as it is read
+    if (writeOffset >= SEGMENT_SIZE) {
+        flush();
+        close(writeFd);
+        writeFd = -1;
+        writeSegment++;
+        writeOffset = 0;
+    }
+}
+
+void OfflineQueue::flush() {
+    const uint8_t *data = writeBuffer.data();
+    size_t length = writeBuffer.size();
+    while (length > 0) {
+        ssize_t written = ::write(writeFd, data, length);
+        if (written < 0) {
+            throw std::runtime_error("Failed to write queue segment: " + std::string(strerror(errno)));
+        }
+        data += written;
+        length -= written;
+    }
+    writeBuffer.clear();
+}
+
+bool OfflineQueue::readMore() {
+    readBuffer.erase(readBuffer.begin(), readBuffer.begin() + readPosition);
+    readPosition = 0;
+    while (true) {
+        if (readFd < 0) {
+            readFd = open(segmentPath(readSegment).c_str(), O_RDONLY | O_CLOEXEC);
+            if (readFd < 0) {
+                throw std::runtime_error("Failed to open queue segment " + segmentPath(readSegment));
+            }
+        }
+        size_t offset = readBuffer.size();
+        readBuffer.resize(offset + READ_CHUNK);
+        ssize_t bytesRead = ::read(readFd, readBuffer.data() + offset, READ_CHUNK);
+        readBuffer.resize(offset + std::max<ssize_t>(bytesRead, 0));
+        if (bytesRead > 0) {
+            return true;
+        }
+        if (bytesRead < 0 || readSegment == writeSegment) {
+            return false;
+        }
+        // Fully consumed segment that is no longer written to
+        close(readFd);
+        readFd = -1;
+        std::remove(segmentPath(readSegment).c_str());
+        readSegment++;
+    }
+}
+
+void OfflineQueue::refill() {
+    if (!writeBuffer.empty()) {
+        flush();
+    }
+    while (spilledCount > 0 && (memory.empty() || memoryBytes < memoryLimit)) {
+        SpillHeader header;
+        if (readBuffer.size() - readPosition < sizeof(header)) {
+            if (!readMore()) {
+                break;
+            }
+            continue;
+        }
+        std::memcpy(&header, readBuffer.data() + readPosition, sizeof(header));
+        size_t size = recordSize(header);
+        if (readBuffer.size() - readPosition < size) {
+            if (!readMore()) {
+                break;
+            }
+            continue;
+        }
+        const uint8_t *topic = readBuffer.data() + readPosition + sizeof(header);
+        const uint8_t *publisherId = topic + header.topicLength;
+        const uint8_t *properties = publisherId + header.publisherIdLength;
+        const uint8_t *payload = properties + header.propertiesLength;
+        MessageRef message = MessageRef::create(
+            std::string_view(reinterpret_cast<const char *>(topic), header.topicLength),
+            ByteView(payload, header.payloadLength),
+            static_cast<QoS>((header.flags >> FLAG_MESSAGE_QOS_SHIFT) & 0x03),
+            (header.flags & FLAG_MESSAGE_RETAIN) != 0,
+            std::string_view(reinterpret_cast<const char *>(publisherId), header.publisherIdLength), 0,
+            header.expiresAt, ByteView(properties, header.propertiesLength));
+        readPosition += size;
+        spilledCount--;
+
+        Entry entry{std::move(message), static_cast<QoS>(header.qos), (header.flags & FLAG_RETAIN) != 0};
+        memoryBytes += footprint(entry);
+        memory.push_back(std::move(entry));
+    }
+    if (spilledCount > 0 && memory.empty()) {
+        throw std::runtime_error("Queue segment " + segmentPath(readSegment) + " is truncated");
+    }
+}
+
+void OfflineQueue::closeSegments() {
+    if (readFd >= 0) {
+        close(readFd);
+        readFd = -1;
+    }
+    if (writeFd >= 0) {
+        close(writeFd);
+        writeFd = -1;
+    }
+    if (!spillDirectory.empty()) {
+        for (uint64_t segment = readSegment; segment <= writeSegment; ++segment) {
+            std::remove(segmentPath(segment).c_str());
+        }
+    }
+    writeBuffer.clear();
+    readBuffer.clear();
+    readPosition = 0;
+    spilledCount = 0;
+    writeOffset = 0;
+    readSegment = writeSegment = writeSegment + 1;
+}
+
+}
@@ -0,0 +1,89 @@
+#ifndef OFFLINE_QUEUE_H
+#define OFFLINE_QUEUE_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <cstdint>
+#include "MessageRef.h"
+#include "Memory.h"
+
+namespace MQTT {
+
+// Messages routed to a session that cannot send them yet: its client is
+// offline, or its inflight window (the client's Receive Maximum) is full.
+//
+// Up to memoryLimit bytes are kept in memory. Past that, new messages are
+// appended to segment files in spillDirectory and read back in large
+// sequential chunks as the in-memory head drains, so order is preserved
+// and a long outage costs disk rather than broker memory. Without a spill
+// directory, messages past the limit are dropped. Spill files are scratch
+// space and are removed with the queue.
+class OfflineQueue {
+public:
+    struct Entry {
+        MessageRef message;
+        QoS qos;
+        bool retain;
+    };
+
+    static constexpr uint64_t SEGMENT_SIZE = 16 * 1024 * 1024;
+    static constexpr size_t READ_CHUNK = 1024 * 1024;
+
+    explicit OfflineQueue(size_t memoryLimit, const std::string &spillDirectory = "");
+    ~OfflineQueue();
+
+    // Returns false if the message was dropped because the queue is full
+    bool push(Entry entry);
+    // Expired messages at the head are discarded on the way
+    bool pop(Entry &entry);
+    // Oldest unexpired entry, or null if the queue is empty
+    const Entry* front();
+    void clear();
+    // Drop the in-memory entries whose message expired at nowMs and set nextExpiry to the earliest
+    // expiry among the rest (0 if none). Spilled entries are dropped as they are read back.
+    size_t removeExpired(uint64_t nowMs, uint64_t &nextExpiry);
+
+    bool empty() const { return size() == 0; }
+    size_t size() const { return memory.size() + spilledCount; }
+    size_t getMemoryBytes() const { return memoryBytes; }
+    size_t getSpilledCount() const { return spilledCount; }
+    uint64_t getDroppedCount() const { return droppedCount; }
+    uint64_t getExpiredCount() const { return expiredCount; }
+
+private:
+    size_t memoryLimit;
+    std::string spillDirectory;
+
+    // Entries here; the messages they point to are charged to MemoryTag::MESSAGES
+    std::deque<Entry, TaggedAllocator<Entry, MemoryTag::SESSIONS>> memory;
+    size_t memoryBytes = 0;
+    uint64_t droppedCount = 0;
+    uint64_t expiredCount = 0;
+
+    // Spilled entries live in segments [readSegment, writeSegment]
+    size_t spilledCount = 0;
+    uint64_t readSegment = 0;
+    uint64_t writeSegment = 0;
+    int readFd = -1;
+    int writeFd = -1;
+    uint64_t writeOffset = 0;
+    std::vector<uint8_t> writeBuffer;
+    std::vector<uint8_t> readBuffer;
+    size_t readPosition = 0;
+
+    static size_t footprint(const Entry &entry);
+    void skipExpired();
+    std::string segmentPath(uint64_t segment) const;
+    void spill(const Entry &entry);
+    void flush();
+    void refill();
+    bool readMore();
+    void closeSegments();
+};
+
+}
+
+#endif // OFFLINE_QUEUE_H
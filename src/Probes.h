@@ -0,0 +1,40 @@
+#ifndef PROBES_H
+#define PROBES_H
+#pragma once
+
+// USDT probes of provider "flowmq" at the broker's hot-path boundaries, for bpftrace and perf.
+//
+// Each probe is a single nop in the instruction stream plus a note in the
+// binary; a tracer that attaches patches in a breakpoint, so an untraced broker
+// pays only for computing the arguments, which are all at hand already. Strings
+// are passed as pointer and length where they are not NUL-terminated, e.g.
+//
+//   bpftrace -e 'usdt:./flowmq:flowmq:match__start { @s[tid] = nsecs; }
+//                usdt:./flowmq:flowmq:match__end /@s[tid]/ { @ns = hist(nsecs - @s[tid]); @fanout = hist(arg2); }'
+//
+// Probes and their arguments:
+//   connection__open      fd
+//   connection__close     fd, messages in, messages out
+//   packet__parsed        fd, packet type, length
+//   match__start          topic, topic length
+//   match__end            topic, topic length, matching filters
+//   match__batch__start   topics
+//   match__batch__end     topics
+//   publish__routed       topic, topic length, sessions delivered to, nanoseconds routing
+//   session__deliver      client id, topic, topic length, QoS
+//   inflight__ack         client id, packet id, packet type (PUBACK or PUBCOMP)
+//   write__complete       fd, bytes to write, bytes written or -1
+//
+// They are compiled in when CMake finds sys/sdt.h (systemtap-sdt-dev) and
+// FLOWMQ_USDT is on; otherwise FLOWMQ_PROBE expands to nothing and its
+// arguments are not evaluated.
+#if FLOWMQ_USDT
+#include <sys/sdt.h>
+#define FLOWMQ_PROBE(name, ...) STAP_PROBEV(flowmq, name, __VA_ARGS__)
+#else
+#define FLOWMQ_PROBE(name, ...) \
+    do {                        \
+    } while (0)
+#endif
+
+#endif // PROBES_H
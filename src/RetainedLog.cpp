@@ -0,0 +1,405 @@
+#include "RetainedLog.h"
+#include "Crc32.h"
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace MQTT {
+
+namespace {
+
+struct RecordHeader {
+    uint32_t crc;
+    uint32_t payloadLength;
+    uint16_t topicLength;
+    uint8_t flags;
+    uint8_t reserved;
+};
+static_assert(sizeof(RecordHeader) == 12, "RecordHeader must be packed");
+
+constexpr uint8_t FLAG_QOS_MASK = 0x03;
+constexpr uint8_t FLAG_TOMBSTONE = 0x04;
+// The header is followed by a uint64 expiry time (ms since the epoch) before the topic
+constexpr uint8_t FLAG_EXPIRES = 0x08;
+// Followed by RecordAttributes, and the topic by the publisher id and properties they size
+constexpr uint8_t FLAG_ATTRIBUTES = 0x10;
+
+struct RecordAttributes {
+    uint16_t publisherIdLength;
+    uint16_t reserved;
+    uint32_t propertiesLength;
+};
+static_assert(sizeof(RecordAttributes) == 8, "RecordAttributes must be packed");
+
+size_t attributesOffset(const RecordHeader &header) {
+    return sizeof(RecordHeader) + (header.flags & FLAG_EXPIRES ? sizeof(uint64_t) : 0);
+}
+
+size_t topicOffset(const RecordHeader &header) {
+    return attributesOffset(header) + (header.flags & FLAG_ATTRIBUTES ? sizeof(RecordAttributes) : 0);
+}
+
+// Records written before attributes were added have none
+RecordAttributes readAttributes(const RecordHeader &header, const uint8_t *record) {
+    RecordAttributes attributes{};
+    if (header.flags & FLAG_ATTRIBUTES) {
+        std::memcpy(&attributes, record + attributesOffset(header), sizeof(attributes));
+    }
+    return attributes;
+}
+
+uint32_t recordSize(const RecordHeader &header, const uint8_t *record) {
+    RecordAttributes attributes = readAttributes(header, record);
+    return topicOffset(header) + header.topicLength + attributes.publisherIdLength + attributes.propertiesLength +
+           header.payloadLength;
+}
+
+uint64_t readExpiry(const RecordHeader &header, const uint8_t *record) {
+    uint64_t expiresAt = 0;
+    if (header.flags & FLAG_EXPIRES) {
+        std::memcpy(&expiresAt, record + sizeof(RecordHeader), sizeof(expiresAt));
+    }
+    return expiresAt;
+}
+
+void writeAll(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            throw std::runtime_error("Failed to write retained segment: " + std::string(strerror(errno)));
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Make the creation, renaming and removal of segment files durable
+void syncDirectory(const std::string &directory) {
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open retained directory " + directory);
+    }
+    fsync(fd);
+    close(fd);
+}
+
+// Decode the record at offset; returns false at the end of the segment or on a torn/corrupt record
+bool decodeRecord(const uint8_t *data, uint64_t size, uint64_t offset, RecordHeader &header) {
+    if (offset + sizeof(RecordHeader) > size) {
+        return false;
+    }
+    std::memcpy(&header, data + offset, sizeof(RecordHeader));
+    if (offset + topicOffset(header) > size) {
+        return false;
+    }
+    uint64_t length = recordSize(header, data + offset);
+    if (offset + length > size) {
+        return false;
+    }
+    const uint8_t *body = data + offset + sizeof(header.crc);
+    return crc32(body, length - sizeof(header.crc)) == header.crc;
+}
+
+}
+
+struct RetainedLog::Segment {
+    uint64_t id = 0;
+    std::string path;
+    int fd = -1;
+    uint64_t size = 0;
+    const uint8_t *data = nullptr;
+
+    ~Segment() {
+        if (data) {
+            munmap(const_cast<uint8_t *>(data), size);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Sealed segments never change again, so they are read through a shared mapping
+    void map() {
+        if (data || size == 0) {
+            return;
+        }
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            throw std::runtime_error("Failed to mmap retained segment " + path);
+        }
+        madvise(mapped, size, MADV_RANDOM);
+        data = static_cast<const uint8_t *>(mapped);
+    }
+};
+
+RetainedLog::RetainedLog(const std::string &directory) : directory(directory) {
+    std::filesystem::create_directories(directory);
+    uint64_t lastId = 0;
+    for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+        const std::string name = entry.path().filename().string();
+        if (entry.path().extension() == ".tmp") {
+            // Leftover of a compaction that did not finish
+            std::filesystem::remove(entry.path());
+            continue;
+        }
+        unsigned long long id;
+        if (std::sscanf(name.c_str(), "retained-%llu.seg", &id) != 1) {
+            continue;
+        }
+        if (entry.file_size() == 0) {
+            std::filesystem::remove(entry.path());
+            continue;
+        }
+        auto segment = std::make_unique<Segment>();
+        segment->id = id;
+        segment->path = entry.path().string();
+        segment->fd = open(segment->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (segment->fd < 0) {
+            throw std::runtime_error("Failed to open retained segment " + segment->path);
+        }
+        segment->size = entry.file_size();
+        segment->map();
+        lastId = std::max<uint64_t>(lastId, id);
+        segments[id] = std::move(segment);
+    }
+    // Active ids advance by two so a compaction of everything sealed can take the id in between
+    active = openActive(lastId + 2);
+}
+
+RetainedLog::~RetainedLog() = default;
+
+std::string RetainedLog::segmentPath(uint64_t id) const {
+    char name[40];
+    std::snprintf(name, sizeof(name), "retained-%016llu.seg", static_cast<unsigned long long>(id));
+    return directory + "/" + name;
+}
+
+RetainedLog::Segment *RetainedLog::openActive(uint64_t id) {
+    auto segment = std::make_unique<Segment>();
+    segment->id = id;
+    segment->path = segmentPath(id);
+    segment->fd = open(segment->path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (segment->fd < 0) {
+        throw std::runtime_error("Failed to create retained segment " + segment->path);
+    }
+    Segment *raw = segment.get();
+    segments[id] = std::move(segment);
+    return raw;
+}
+
+void RetainedLog::replay(const std::function<void(const std::string &, Location, bool, uint64_t)> &apply) {
+    for (const auto &[id, segment] : segments) {
+        if (segment.get() == active) {
+            continue;
+        }
+        RecordHeader header;
+        uint64_t offset = 0;
+        while (decodeRecord(segment->data, segment->size, offset, header)) {
+            const uint8_t *record = segment->data + offset;
+            uint32_t size = recordSize(header, record);
+            std::string topic(reinterpret_cast<const char *>(record + topicOffset(header)), header.topicLength);
+            bool tombstone = header.flags & FLAG_TOMBSTONE;
+            totalBytes += size;
+            if (!tombstone) {
+                liveBytes += size;
+            }
+            apply(topic, Location{segment.get(), offset, size}, tombstone, readExpiry(header, record));
+            offset += size;
+        }
+    }
+}
+
+RetainedLog::Location RetainedLog::append(std::string_view topic, ByteView payload, QoS qos, uint64_t expiresAt,
+                                          std::string_view publisherId, ByteView properties) {
+    bool tombstone = payload.empty();
+    RecordHeader header{};
+    header.payloadLength = payload.size;
+    header.topicLength = topic.size();
+    header.flags = static_cast<uint8_t>(qos) & FLAG_QOS_MASK;
+    RecordAttributes attributes{};
+    if (tombstone) {
+        header.flags |= FLAG_TOMBSTONE;
+    } else {
+        if (expiresAt != 0) {
+            header.flags |= FLAG_EXPIRES;
+        }
+        if (!publisherId.empty() || !properties.empty()) {
+            header.flags |= FLAG_ATTRIBUTES;
+            attributes.publisherIdLength = publisherId.size();
+            attributes.propertiesLength = properties.size;
+        }
+    }
+
+    size_t topicStart = topicOffset(header);
+    uint32_t size = topicStart + header.topicLength + attributes.publisherIdLength + attributes.propertiesLength +
+                    header.payloadLength;
+    std::vector<uint8_t> record(size);
+    std::memcpy(record.data(), &header, sizeof(RecordHeader));
+    if (header.flags & FLAG_EXPIRES) {
+        std::memcpy(record.data() + sizeof(RecordHeader), &expiresAt, sizeof(expiresAt));
+    }
+    if (header.flags & FLAG_ATTRIBUTES) {
+        std::memcpy(record.data() + attributesOffset(header), &attributes, sizeof(attributes));
+    }
+    uint8_t *bytes = record.data() + topicStart;
+    std::memcpy(bytes, topic.data(), header.topicLength);
+    bytes += header.topicLength;
+    if (attributes.publisherIdLength > 0) {
+        std::memcpy(bytes, publisherId.data(), attributes.publisherIdLength);
+        bytes += attributes.publisherIdLength;
+    }
+    if (attributes.propertiesLength > 0) {
+        std::memcpy(bytes, properties.data, attributes.propertiesLength);
+        bytes += attributes.propertiesLength;
+    }
+    if (header.payloadLength > 0) {
+        std::memcpy(bytes, payload.data, header.payloadLength);
+    }
+    header.crc = crc32(record.data() + sizeof(header.crc), size - sizeof(header.crc));
+    std::memcpy(record.data(), &header.crc, sizeof(header.crc));
+
+    writeAll(active->fd, record.data(), record.size());
+    Location location{active, active->size, size};
+    active->size += size;
+    totalBytes += size;
+    if (!tombstone) {
+        liveBytes += size;
+    }
+    if (active->size >= SEGMENT_SIZE) {
+        rotate();
+    }
+    return location;
+}
+
+MessageRef RetainedLog::read(Location location) const {
+    std::vector<uint8_t> buffer;
+    const uint8_t *record;
+    if (location.segment->data) {
+        record = location.segment->data + location.offset;
+    } else {
+        // The active segment is still growing and is read with pread instead of a mapping
+        buffer.resize(location.size);
+        if (pread(location.segment->fd, buffer.data(), location.size, location.offset) != static_cast<ssize_t>(location.size)) {
+            throw std::runtime_error("Failed to read retained segment " + location.segment->path);
+        }
+        record = buffer.data();
+    }
+    RecordHeader header;
+    std::memcpy(&header, record, sizeof(RecordHeader));
+    RecordAttributes attributes = readAttributes(header, record);
+    const uint8_t *topic = record + topicOffset(header);
+    const uint8_t *publisherId = topic + header.topicLength;
+    const uint8_t *properties = publisherId + attributes.publisherIdLength;
+    const uint8_t *payload = properties + attributes.propertiesLength;
+    return MessageRef::create(std::string_view(reinterpret_cast<const char *>(topic), header.topicLength),
+                              ByteView(payload, header.payloadLength), static_cast<QoS>(header.flags & FLAG_QOS_MASK),
+                              true, std::string_view(reinterpret_cast<const char *>(publisherId),
+                                                     attributes.publisherIdLength),
+                              0, readExpiry(header, record), ByteView(properties, attributes.propertiesLength));
+}
+
+void RetainedLog::release(Location location) {
+    liveBytes -= location.size;
+}
+
+bool RetainedLog::needsCompaction() const {
+    return totalBytes >= MIN_COMPACT_BYTES && liveBytes * 2 < totalBytes;
+}
+
+void RetainedLog::rotate() {
+    fdatasync(active->fd);
+    active->map();
+    active = openActive(active->id + 2);
+    syncDirectory(directory);
+}
+
+RetainedLog::Sealed RetainedLog::seal() {
+    rotate();
+    Sealed sealed;
+    for (const auto &[id, segment] : segments) {
+        if (segment.get() != active) {
+            sealed.sources.push_back(segment.get());
+        }
+    }
+    // Sorts after every source and before the active segment, whatever rotates while compacting
+    sealed.compactedId = active->id - 1;
+    return sealed;
+}
+
+RetainedLog::Segment *RetainedLog::compact(const Sealed &sealed,
+                                           const std::function<bool(const std::string &, Location)> &isLive,
+                                           std::vector<Moved> &moved) {
+    const std::vector<Segment *> &sources = sealed.sources;
+    auto compacted = std::make_unique<Segment>();
+    compacted->id = sealed.compactedId;
+    compacted->path = segmentPath(compacted->id);
+    const std::string tmpPath = compacted->path + ".tmp";
+    compacted->fd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (compacted->fd < 0) {
+        throw std::runtime_error("Failed to create compacted segment " + tmpPath);
+    }
+
+    std::vector<uint8_t> buffer;
+    auto flush = [&]() {
+        writeAll(compacted->fd, buffer.data(), buffer.size());
+        buffer.clear();
+    };
+    // Tombstones are dropped: every older record of their topic is in sources too
+    for (Segment *source : sources) {
+        RecordHeader header;
+        uint64_t offset = 0;
+        while (decodeRecord(source->data, source->size, offset, header)) {
+            uint32_t size = recordSize(header, source->data + offset);
+            Location from{source, offset, size};
+            if (!(header.flags & FLAG_TOMBSTONE)) {
+                std::string topic(reinterpret_cast<const char *>(source->data + offset + topicOffset(header)),
+                                  header.topicLength);
+                if (isLive(topic, from)) {
+                    Location to{compacted.get(), compacted->size, size};
+                    buffer.insert(buffer.end(), source->data + offset, source->data + offset + size);
+                    compacted->size += size;
+                    moved.push_back(Moved{std::move(topic), from, to});
+                    if (buffer.size() >= 1024 * 1024) {
+                        flush();
+                    }
+                }
+            }
+            offset += size;
+        }
+    }
+    flush();
+    fdatasync(compacted->fd);
+    compacted->map();
+    return compacted.release();
+}
+
+void RetainedLog::retire(const std::vector<Segment *> &sources, Segment *compacted) {
+    std::unique_ptr<Segment> owned(compacted);
+    const std::string tmpPath = compacted->path + ".tmp";
+    if (compacted->size > 0) {
+        if (std::rename(tmpPath.c_str(), compacted->path.c_str()) != 0) {
+            throw std::runtime_error("Failed to install compacted segment " + compacted->path);
+        }
+    } else {
+        std::remove(tmpPath.c_str());
+    }
+    // Oldest first: whatever survives a crash here is always a suffix of the sources,
+    // so a tombstone can never be deleted before the record it shadows
+    for (Segment *source : sources) {
+        std::remove(source->path.c_str());
+        totalBytes -= source->size;
+        segments.erase(source->id);
+    }
+    syncDirectory(directory);
+    if (compacted->size > 0) {
+        totalBytes += compacted->size;
+        segments[compacted->id] = std::move(owned);
+    }
+}
+
+}
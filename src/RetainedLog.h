@@ -0,0 +1,106 @@
+#ifndef RETAINED_LOG_H
+#define RETAINED_LOG_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include "MessageRef.h"
+
+namespace MQTT {
+
+// Append-only segment files backing the retained message store.
+//
+// Each retained publish appends one record to the active segment; an empty
+// payload appends a tombstone. Sealed segments are mmapped read-only and
+// records are decoded from the mapping only when a subscriber needs them,
+// so the in-memory index holds a location rather than the payload.
+//
+// Record layout (host byte order):
+//   uint32 crc | uint32 payloadLength | uint16 topicLength | uint8 flags | uint8 reserved |
+//   [uint64 expiresAt] | [uint16 publisherIdLength | uint16 reserved | uint32 propertiesLength] |
+//   topic | [publisherId | properties] | payload
+// where expiresAt is only present for messages with a Message Expiry Interval, and the
+// publisher id and MQTT 5 properties for messages that have either, each flagged in flags.
+// The CRC covers everything after itself so a torn tail is detected on replay.
+//
+// Segments are synced to disk when they are rotated and compacted ones before
+// they replace their sources. The active segment is not: after a power loss
+// (but not a broker crash) the retained changes of up to its last
+// SEGMENT_SIZE bytes may be lost, and replay stops at the torn tail.
+class RetainedLog {
+public:
+    struct Segment;
+
+    struct Location {
+        Segment *segment = nullptr;
+        uint64_t offset = 0;
+        uint32_t size = 0;
+
+        explicit operator bool() const { return segment != nullptr; }
+        bool operator==(const Location &other) const { return segment == other.segment && offset == other.offset; }
+        bool operator!=(const Location &other) const { return !(*this == other); }
+    };
+
+    // Sealed segments to compact and the id reserved for the result
+    struct Sealed {
+        std::vector<Segment *> sources;
+        uint64_t compactedId = 0;
+    };
+
+    struct Moved {
+        std::string topic;
+        Location from;
+        Location to;
+    };
+
+    static constexpr uint64_t SEGMENT_SIZE = 256 * 1024 * 1024;
+    static constexpr uint64_t MIN_COMPACT_BYTES = 64 * 1024 * 1024;
+
+    explicit RetainedLog(const std::string &directory);
+    ~RetainedLog();
+
+    // Replay every record of the segments present at open, oldest first
+    void replay(const std::function<void(const std::string &topic, Location location, bool tombstone,
+                                         uint64_t expiresAt)> &apply);
+
+    // An empty payload appends a tombstone
+    Location append(std::string_view topic, ByteView payload, QoS qos, uint64_t expiresAt = 0,
+                    std::string_view publisherId = {}, ByteView properties = {});
+    MessageRef read(Location location) const;
+    // Account a record as garbage once the index no longer points at it
+    void release(Location location);
+
+    bool needsCompaction() const;
+    // Rotate the active segment and hand back every sealed segment for compaction
+    Sealed seal();
+    // Copy the live records of the sealed segments into a new segment, without holding the index lock.
+    // isLive is called per record; moved receives the relocations to apply to the index.
+    Segment *compact(const Sealed &sealed,
+                     const std::function<bool(const std::string &topic, Location location)> &isLive,
+                     std::vector<Moved> &moved);
+    // Replace sources by the compacted segment on disk and release them
+    void retire(const std::vector<Segment *> &sources, Segment *compacted);
+
+    uint64_t getTotalBytes() const { return totalBytes; }
+    uint64_t getLiveBytes() const { return liveBytes; }
+
+private:
+    std::string directory;
+    std::map<uint64_t, std::unique_ptr<Segment>> segments;
+    Segment *active = nullptr;
+    uint64_t totalBytes = 0;
+    uint64_t liveBytes = 0;
+
+    std::string segmentPath(uint64_t id) const;
+    Segment *openActive(uint64_t id);
+    // Sync and seal the active segment and start the next one
+    void rotate();
+};
+
+}
+
+#endif // RETAINED_LOG_H
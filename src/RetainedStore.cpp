@@ -0,0 +1,341 @@
+#include "RetainedStore.h"
+#include "Topic.h"
+#include "Log.h"
+#include <functional>
+#include <iostream>
+
+namespace MQTT {
+
+RetainedStore::RetainedStore(const std::string &directory)
+    : root(std::make_unique<RetainedNode>()), log(std::make_unique<RetainedLog>(directory)), loaded(false)
+{
+    loader = std::thread([this]() {
+        std::unique_lock<std::mutex> guard(lock);
+        // Records indexed before the lock is given up for a moment
+        const size_t batch = 4096;
+        size_t indexed = 0;
+        try {
+            log->replay([&](const std::string &topic, RetainedLog::Location location, bool tombstone,
+                            uint64_t expiresAt) {
+                if (++indexed % batch == 0) {
+                    guard.unlock();
+                    guard.lock();
+                }
+                if (tombstone) {
+                    removeLocked(topic);
+                    return;
+                }
+                RetainedNode *node = insertNode(topic);
+                if (node->location) {
+                    log->release(node->location);
+                } else {
+                    count++;
+                }
+                node->location = location;
+                setExpiry(topic, node, expiresAt);
+            });
+        } catch (const std::exception &e) {
+            LOG_ERROR("Failed to load retained messages: %s", e.what());
+        }
+        loaded = true;
+        loadedCondition.notify_all();
+    });
+}
+
+RetainedStore::~RetainedStore()
+{
+    if (loader.joinable()) {
+        loader.join();
+    }
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+}
+
+void RetainedStore::waitLoaded(std::unique_lock<std::mutex> &guard) const
+{
+    loadedCondition.wait(guard, [this]() { return loaded.load(); });
+}
+
+size_t RetainedStore::size() const
+{
+    std::unique_lock<std::mutex> guard(lock);
+    waitLoaded(guard);
+    return count;
+}
+
+RetainedStore::RetainedNode *RetainedStore::findNode(const std::string &topic) const
+{
+    RetainedNode *current = root.get();
+    for (const auto &level : Topic::split(topic)) {
+        auto it = current->children.find(level);
+        if (it == current->children.end()) {
+            return nullptr;
+        }
+        current = it->second.get();
+    }
+    return current;
+}
+
+RetainedStore::RetainedNode *RetainedStore::insertNode(const std::string &topic)
+{
+    RetainedNode *current = root.get();
+    for (const auto &level : Topic::split(topic)) {
+        auto &child = current->children[level];
+        if (!child) {
+            child = std::make_unique<RetainedNode>();
+        }
+        current = child.get();
+    }
+    return current;
+}
+
+void RetainedStore::store(MessageRef message)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    waitLoaded(guard);
+    RetainedLog::Location location;
+    if (log) {
+        location = log->append(message->getTopic(), message->getPayload(), message->getQos(),
+                               message->getExpiresAt(), message->getPublisherId(), message->getProperties());
+    }
+    if (message->getPayload().empty()) {
+        removeLocked(std::string(message->getTopic()));
+    } else {
+        RetainedNode *node = insertNode(std::string(message->getTopic()));
+        if (!node->isRetained()) {
+            count++;
+        }
+        if (node->location) {
+            log->release(node->location);
+        }
+        // A persistent store reads payloads back from the log instead of holding them
+        node->location = location;
+        setExpiry(std::string(message->getTopic()), node, message->getExpiresAt());
+        node->message = log ? MessageRef() : std::move(message);
+    }
+    guard.unlock();
+    maybeCompact();
+}
+
+void RetainedStore::remove(const std::string &topic)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    waitLoaded(guard);
+    if (log) {
+        log->append(topic, ByteView(), QoS::QOS_0);
+    }
+    removeLocked(topic);
+}
+
+void RetainedStore::removeLocked(const std::string &topic)
+{
+    std::vector<std::string> levels = Topic::split(topic);
+    std::vector<RetainedNode *> path;
+    RetainedNode *current = root.get();
+
+    for (const auto &level : levels) {
+        auto it = current->children.find(level);
+        if (it == current->children.end()) {
+            return;
+        }
+        path.push_back(current);
+        current = it->second.get();
+    }
+    if (!current->isRetained()) {
+        return;
+    }
+    if (current->location) {
+        log->release(current->location);
+    }
+    current->message.reset();
+    current->location = RetainedLog::Location();
+    current->expiresAt = 0;
+    count--;
+
+    // Prune branches that no longer lead to a retained message
+    for (int i = path.size() - 1; i >= 0; --i) {
+        if (!current->children.empty() || current->isRetained()) {
+            break;
+        }
+        path[i]->children.erase(levels[i]);
+        current = path[i];
+    }
+}
+
+MessageRef RetainedStore::load(const RetainedNode *node) const
+{
+    return node->message ? node->message : log->read(node->location);
+}
+
+MessageRef RetainedStore::find(const std::string &topic) const
+{
+    std::unique_lock<std::mutex> guard(lock);
+    waitLoaded(guard);
+    const RetainedNode *node = findNode(topic);
+    if (!node || !node->isRetained() || (node->expiresAt && node->expiresAt <= MessageBlock::currentTime())) {
+        return MessageRef();
+    }
+    return load(node);
+}
+
+void RetainedStore::collect(const RetainedNode *node, std::vector<const RetainedNode *> &matches) const
+{
+    if (node->isRetained()) {
+        matches.push_back(node);
+    }
+    for (const auto &[level, child] : node->children) {
+        collect(child.get(), matches);
+    }
+}
+
+std::vector<MessageRef> RetainedStore::match(const std::string &topicFilter) const
+{
+    std::vector<const RetainedNode *> nodes;
+    std::vector<std::string> filterLevels = Topic::split(topicFilter);
+
+    // Wildcards in the first level never match topics starting with '$'
+    auto skip = [](size_t level, const std::string &name) { return level == 0 && !name.empty() && name[0] == '$'; };
+
+    std::function<void(const RetainedNode *, size_t)> dfs = [&](const RetainedNode *node, size_t level) {
+        if (level == filterLevels.size()) {
+            if (node->isRetained()) {
+                nodes.push_back(node);
+            }
+            return;
+        }
+
+        const std::string &filterLevel = filterLevels[level];
+        if (filterLevel == "#") {
+            // '#' also matches the parent level itself
+            if (node->isRetained() && level > 0) {
+                nodes.push_back(node);
+            }
+            for (const auto &[name, child] : node->children) {
+                if (!skip(level, name)) {
+                    collect(child.get(), nodes);
+                }
+            }
+        } else if (filterLevel == "+") {
+            for (const auto &[name, child] : node->children) {
+                if (!skip(level, name)) {
+                    dfs(child.get(), level + 1);
+                }
+            }
+        } else {
+            auto it = node->children.find(filterLevel);
+            if (it != node->children.end()) {
+                dfs(it->second.get(), level + 1);
+            }
+        }
+    };
+
+    std::unique_lock<std::mutex> guard(lock);
+    waitLoaded(guard);
+    dfs(root.get(), 0);
+    std::vector<MessageRef> matches;
+    matches.reserve(nodes.size());
+    uint64_t now = MessageBlock::currentTime();
+    for (const RetainedNode *node : nodes) {
+        // Expired but not swept yet
+        if (node->expiresAt && node->expiresAt <= now) {
+            continue;
+        }
+        matches.push_back(load(node));
+    }
+    return matches;
+}
+
+void RetainedStore::setExpiry(const std::string &topic, RetainedNode *node, uint64_t expiresAt)
+{
+    node->expiresAt = expiresAt;
+    if (expiresAt) {
+        expiry.schedule(expiresAt, topic);
+    }
+}
+
+size_t RetainedStore::sweepExpired(uint64_t nowMs)
+{
+    if (!loaded) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    size_t removed = 0;
+    expiry.expire(nowMs, [&](uint64_t expiresAt, const std::string &topic) {
+        // The topic may have been overwritten or cleared since it was scheduled
+        RetainedNode *node = findNode(topic);
+        if (node && node->isRetained() && node->expiresAt == expiresAt) {
+            removeLocked(topic);
+            removed++;
+        }
+    });
+    return removed;
+}
+
+void RetainedStore::maybeCompact()
+{
+    if (!log || compacting) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!log->needsCompaction()) {
+            return;
+        }
+    }
+    bool expected = false;
+    if (!compacting.compare_exchange_strong(expected, true)) {
+        return;
+    }
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+    compactor = std::thread([this]() {
+        try {
+            compact();
+        } catch (const std::exception &e) {
+            LOG_ERROR("Retained compaction failed: %s", e.what());
+        }
+        compacting = false;
+    });
+}
+
+void RetainedStore::compact()
+{
+    if (!log) {
+        return;
+    }
+    std::lock_guard<std::mutex> compactionGuard(compactionLock);
+    RetainedLog::Sealed sealed;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        waitLoaded(guard);
+        sealed = log->seal();
+    }
+
+    // Copy live records without holding the index lock; publishes keep appending to the new active segment
+    std::vector<RetainedLog::Moved> moved;
+    RetainedLog::Segment *compacted = log->compact(sealed, [this](const std::string &topic, RetainedLog::Location location) {
+        std::lock_guard<std::mutex> guard(lock);
+        const RetainedNode *node = findNode(topic);
+        return node && node->location == location;
+    }, moved);
+
+    // Repoint the index in small batches so publishers are never stalled for long.
+    // Entries overwritten since the copy keep their newer location.
+    const size_t batch = 4096;
+    for (size_t i = 0; i < moved.size(); i += batch) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t j = i; j < std::min(i + batch, moved.size()); ++j) {
+            RetainedNode *node = findNode(moved[j].topic);
+            if (node && node->location == moved[j].from) {
+                node->location = moved[j].to;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    log->retire(sealed.sources, compacted);
+}
+
+}
@@ -0,0 +1,93 @@
+#ifndef RETAINED_STORE_H
+#define RETAINED_STORE_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include "MessageRef.h"
+#include "RetainedLog.h"
+#include "ExpiryIndex.h"
+
+namespace MQTT {
+
+// Retained messages keyed by topic.
+//
+// Topics are stored level by level in a trie so that a subscription with a
+// wildcard filter walks only the branches it can match ('+' fans out over
+// one level, '#' collects a subtree) instead of testing every retained topic.
+//
+// When opened on a directory the store is backed by a RetainedLog: nodes
+// hold the location of their record instead of the message, the index is
+// rebuilt from the segments on a background thread, and compaction runs on
+// its own thread while publishes keep appending to a fresh segment.
+class RetainedStore {
+private:
+    struct RetainedNode {
+        std::unordered_map<std::string, std::unique_ptr<RetainedNode>> children;
+        MessageRef message;
+        RetainedLog::Location location;
+        // Milliseconds since the epoch when the message expires, 0 for never
+        uint64_t expiresAt = 0;
+
+        bool isRetained() const { return message || location; }
+    };
+
+    std::unique_ptr<RetainedNode> root;
+    // Changed under lock, read without it for statistics
+    std::atomic<size_t> count{0};
+    std::unique_ptr<RetainedLog> log;
+    // Topics with an expiring message, swept by sweepExpired()
+    ExpiryIndex<std::string> expiry;
+
+    mutable std::mutex lock;
+    mutable std::condition_variable loadedCondition;
+    // Set under lock once the loader is done; read without it by the checks that must not wait for it
+    std::atomic<bool> loaded{true};
+    std::thread loader;
+    std::thread compactor;
+    std::atomic<bool> compacting{false};
+    std::mutex compactionLock;
+
+    RetainedNode *findNode(const std::string& topic) const;
+    RetainedNode *insertNode(const std::string& topic);
+    void removeLocked(const std::string& topic);
+    void setExpiry(const std::string& topic, RetainedNode *node, uint64_t expiresAt);
+    void waitLoaded(std::unique_lock<std::mutex>& guard) const;
+    MessageRef load(const RetainedNode *node) const;
+    void collect(const RetainedNode *node, std::vector<const RetainedNode *> &matches) const;
+    void maybeCompact();
+
+public:
+    RetainedStore() : root(std::make_unique<RetainedNode>()) {}
+    // Persistent store; returns immediately and indexes existing segments in the background
+    explicit RetainedStore(const std::string& directory);
+    ~RetainedStore();
+
+    // Store message as the retained message of its topic; an empty payload clears it.
+    // Expired messages are no longer returned, and are removed by the next sweep.
+    void store(MessageRef message);
+    void remove(const std::string& topic);
+    MessageRef find(const std::string& topic) const;
+    // All retained messages whose topic matches topicFilter
+    std::vector<MessageRef> match(const std::string& topicFilter) const;
+    size_t size() const;
+    // Messages indexed so far, without waiting for the segments to load
+    size_t loadedSize() const { return count; }
+    // Remove the retained messages expired at nowMs; only topics due in the expiry index are visited.
+    // Does nothing while the segments are loading, so a sweep never waits for the loader.
+    size_t sweepExpired(uint64_t nowMs);
+
+    bool isLoaded() const { return loaded; }
+    // Rewrite the segments keeping only live records; normally triggered by store()
+    void compact();
+};
+
+}
+
+#endif // RETAINED_STORE_H
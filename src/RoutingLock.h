@@ -0,0 +1,43 @@
+#ifndef ROUTING_LOCK_H
+#define ROUTING_LOCK_H
+#pragma once
+
+#include <pthread.h>
+
+namespace MQTT {
+
+// A reader/writer lock that stops admitting readers once a writer waits.
+//
+// std::shared_mutex prefers readers on glibc, so a few publishers routing
+// back to back keep it held shared and a subscribe or a reap never gets in.
+// Usable with std::shared_lock and std::unique_lock. Readers must not take it
+// recursively: a second shared lock queued behind a waiting writer deadlocks.
+class RoutingLock {
+public:
+    RoutingLock() {
+        pthread_rwlockattr_t attributes;
+        pthread_rwlockattr_init(&attributes);
+        pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&rwlock, &attributes);
+        pthread_rwlockattr_destroy(&attributes);
+    }
+    ~RoutingLock() { pthread_rwlock_destroy(&rwlock); }
+
+    RoutingLock(const RoutingLock&) = delete;
+    RoutingLock& operator=(const RoutingLock&) = delete;
+
+    void lock() { pthread_rwlock_wrlock(&rwlock); }
+    bool try_lock() { return pthread_rwlock_trywrlock(&rwlock) == 0; }
+    void unlock() { pthread_rwlock_unlock(&rwlock); }
+
+    void lock_shared() { pthread_rwlock_rdlock(&rwlock); }
+    bool try_lock_shared() { return pthread_rwlock_tryrdlock(&rwlock) == 0; }
+    void unlock_shared() { pthread_rwlock_unlock(&rwlock); }
+
+private:
+    pthread_rwlock_t rwlock;
+};
+
+} // namespace MQTT
+
+#endif // ROUTING_LOCK_H
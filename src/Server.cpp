@@ -1,6 +1,12 @@
 #include "Topic.h"
 #include "Server.h"
 #include "Connection.h"
+#include "SlabPool.h"
+#include "Log.h"
+#include "Trace.h"
+#include "Capture.h"
+#include "Stats.h"
+#include "Memory.h"
 #include <stdexcept>
 #include <cstring>
 #include <unistd.h>
@@ -9,9 +15,21 @@
 #include <thread>
 
 namespace MQTT {
-Server::Server(int port) {
+Server::Server(int port, const BrokerConfig &config) {
+    SlabPool::setHugePages(config.hugePages);
+    Trace::setSlowestCapacity(config.traceSampling ? config.traceSlowest : 0);
+    Stats::configure(config.statsTopicLevels, config.heavyHitters);
+    for (int i = 0; i < static_cast<int>(MemoryTag::COUNT); i++) {
+        Memory::setLimit(static_cast<MemoryTag>(i), config.memoryLimits[i]);
+    }
+    if (!config.capturePath.empty()) {
+        Capture::start(config.capturePath);
+    }
     listener = std::make_unique<Listener>(port);
-    broker = new Broker();
+    if (config.metricsPort) {
+        metrics = std::make_unique<MetricsServer>(config.metricsPort);
+    }
+    broker = new Broker(config);
 }
 
 Server::~Server() {
@@ -20,7 +38,10 @@ Server::~Server() {
 
 void Server::start() {   
     listener->start();
-    std::cout << "MQTT Server is started" << std::endl;
+    if (metrics) {
+        metrics->start();
+    }
+    LOG_INFO("MQTT Server is started");
     run();
 }
 
@@ -28,7 +49,7 @@ void Server::run() {
     while (true) {
         int clientSocket = listener->acceptConnection();
         if (clientSocket < 0) {
-            std::cerr << "Failed to accept connection" << std::endl;
+            LOG_ERROR("Failed to accept connection");
             continue;
         }
 
@@ -51,11 +72,14 @@ void Server::stop() {
     if (listener) {
         listener->stop();
     }
+    if (metrics) {
+        metrics->stop();
+    }
 
     // Signal all client threads to stop
     // This is a placeholder and should be implemented based on how you manage client threads
 
-    std::cout << "Server stopped" << std::endl;
+    LOG_INFO("Server stopped");
 }
 
 }
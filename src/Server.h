@@ -2,13 +2,14 @@
 #include <string>
 #include "Listener.h"
 #include "Broker.h"
+#include "MetricsServer.h"
 
 namespace MQTT {
 
 class Broker;
 class Server {
 public:
-    explicit Server(int port);
+    explicit Server(int port, const BrokerConfig &config = BrokerConfig());
     ~Server();
 
     void start();
@@ -20,6 +21,7 @@ private:
     void run();
     Broker* broker;
     std::unique_ptr<Listener> listener;
+    std::unique_ptr<MetricsServer> metrics;
     
 };
 
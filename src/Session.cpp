@@ -3,114 +3,471 @@
 #include <string>
 #include <functional>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 #include "MQTT.h"
 #include "Topic.h"
 #include "Session.h"
 #include "Broker.h"
 #include "Message.h"
+#include "SlabPool.h"
+#include "Log.h"
+#include "Metrics.h"
+#include "Memory.h"
+#include "Trace.h"
+#include "Probes.h"
 
 namespace MQTT {
+
+static uint64_t steadyMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A std::map node: the key/value pair, three links and the color, plus the filter text
+static size_t subscriptionFootprint(const std::string &topicFilter) {
+    return sizeof(std::pair<const std::string, SubscriptionOptions>) + 4 * sizeof(void*) + topicFilter.size();
+}
+
 Session::Session(Broker *broker, const std::string &clientId, bool cleanStart)
-    : broker(broker), clientId(clientId), connected(false), cleanStart(cleanStart) {}
+    : broker(broker), clientId(clientId), connected(false), cleanStart(cleanStart) {
+    Metrics::charge(MemoryTag::SESSIONS, sizeof(Session) + heapBytes(this->clientId));
+    expiryInterval = cleanStart ? 0 : NEVER_EXPIRES;
+    handle = broker->insertSession(clientId, this);
+    WriteAheadLog *wal = broker->getWal();
+    if (!wal) {
+        return;
+    }
+    WriteAheadLog::Recovered state;
+    bool found = broker->takeRecovered(clientId, state);
+    if (cleanStart) {
+        wal->logDiscard(clientId);
+    } else if (found) {
+        for (const auto &[id, recovered] : state.inflight) {
+            inflight.restore(id, recovered.message, recovered.qos);
+        }
+        Metrics::adjust(Gauge::INFLIGHT_MESSAGES, inflight.size());
+        for (uint16_t id : state.awaitingPubrel) {
+            awaitingPubrel.insert(id);
+        }
+    }
+}
 
 Session::~Session() {
-    std::cout << "Session::~Session: " << clientId << std::endl;
+    LOG_DEBUG("Session::~Session: %s", clientId.c_str());
+    std::vector<std::string> topicFilters;
+    for (const auto &[topicFilter, options] : subscriptions) {
+        topicFilters.push_back(topicFilter);
+    }
+    for (const auto &topicFilter : topicFilters) {
+        unsubscribe(topicFilter);
+    }
+    // Handles still held elsewhere go stale from here on
     broker->removeSession(this);
+    Metrics::adjust(Gauge::INFLIGHT_MESSAGES, -static_cast<int64_t>(inflight.size()));
+    Metrics::adjust(Gauge::QUEUED_MESSAGES, -static_cast<int64_t>(getQueuedCount()));
+    if (cleanStart && broker->getWal()) {
+        broker->getWal()->logDiscard(clientId);
+    }
+    Metrics::charge(MemoryTag::SESSIONS, -static_cast<int64_t>(sizeof(Session) + heapBytes(clientId)));
+}
+
+void* Session::operator new(size_t size) {
+    return SlabPool::allocate(size);
+}
+
+void Session::operator delete(void *pointer, size_t size) {
+    SlabPool::deallocate(pointer, size);
 }
 
 void Session::connect() {
-    connected = true;
-    broker->insertSession(clientId, this);
-    printf("Session::connect: %s\n", clientId.c_str());
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        connected = true;
+        expiresAt = 0;
+        backpressured = inflight.full();
+        updateSharedAvailable();
+        broker->activateSession(this);
+    }
+    LOG_DEBUG("Session::connect: %s", clientId.c_str());
 }
 
 void Session::discard() {
-    printf("Session::discard: %s\n", clientId.c_str());
+    LOG_DEBUG("Session::discard: %s", clientId.c_str());
     disconnect();
 }
 
 void Session::disconnect() {
-    broker->removeSession(this);
-    connected = false;
-    onDisconnect();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        connected = false;
+        updateSharedAvailable();
+        uint64_t now = MessageBlock::currentTime();
+        expiresAt = expiryInterval != 0 && expiryInterval != NEVER_EXPIRES ? now + uint64_t(expiryInterval) * 1000 : 0;
+        // The sweep skipped this session while it was connected
+        if (queue) {
+            uint64_t nextExpiry;
+            dropExpired(queue->removeExpired(now, nextExpiry));
+            queueExpiry = 0;
+            scheduleExpiry(nextExpiry);
+        }
+        broker->parkSession(this);
+    }
+    if (onDisconnect) {
+        onDisconnect();
+    }
 }
 
 ReasonCode Session::publish(uint16_t packetId, const Message &message) {
-    broker->publish(message);
+    // A retransmitted QoS 2 publish was already routed when it was first received
+    if (message.qos == QoS::QOS_2 && awaitingPubrel.contains(packetId)) {
+        return ReasonCode::SUCCESS;
+    }
+    WriteAheadLog *wal = broker->getWal();
+    if (wal && message.qos > QoS::QOS_0) {
+        Message logged = message;
+        wal->logMessage(logged);
+        broker->publish(MessageRef::create(logged));
+        if (message.qos == QoS::QOS_2) {
+            wal->logReceived(clientId, packetId);
+        }
+        // Also covers the deliveries logged inline; those handed to an inbox are logged when sent
+        requiredLsn = wal->getAppendedLsn();
+    } else {
+        broker->publish(message);
+    }
     if (message.qos == QoS::QOS_2) {
         awaitingPubrel.insert(packetId);
     }
     return ReasonCode::SUCCESS;
 }
 
+void Session::sync() {
+    WriteAheadLog *wal = broker->getWal();
+    if (wal && requiredLsn > 0) {
+        wal->sync(requiredLsn);
+    }
+}
+
 void Session::puback(uint16_t packetId) {
-    inflightMessages.erase(packetId);
+    if (!inflight.erase(packetId)) {
+        return;
+    }
+    FLOWMQ_PROBE(inflight__ack, clientId.c_str(), packetId, static_cast<int>(PacketType::PUBACK));
+    Metrics::adjust(Gauge::INFLIGHT_MESSAGES, -1);
+    if (broker->getWal()) {
+        broker->getWal()->logAck(clientId, packetId);
+    }
+    drain();
 }
 
 ReasonCode Session::pubrec(uint16_t packetId) {
-    inflightMessages.erase(packetId);
+    // The packet id stays in use until PUBCOMP
+    if (!inflight.release(packetId)) {
+        return ReasonCode::PACKET_IDENTIFIER_NOT_FOUND;
+    }
+    if (broker->getWal()) {
+        broker->getWal()->logAck(clientId, packetId);
+    }
     return ReasonCode::SUCCESS;
 }
 
 ReasonCode Session::pubrel(uint16_t packetId) {
-    awaitingPubrel.erase(packetId);
+    if (!awaitingPubrel.erase(packetId)) {
+        return ReasonCode::PACKET_IDENTIFIER_NOT_FOUND;
+    }
+    if (broker->getWal()) {
+        broker->getWal()->logReleased(clientId, packetId);
+    }
     return ReasonCode::SUCCESS;
 }
 
 void Session::pubcomp(uint16_t packetId) {
-    // broker->pubcomp(packet);
+    if (inflight.erase(packetId)) {
+        FLOWMQ_PROBE(inflight__ack, clientId.c_str(), packetId, static_cast<int>(PacketType::PUBCOMP));
+        Metrics::adjust(Gauge::INFLIGHT_MESSAGES, -1);
+        drain();
+    }
 }
 
-void Session::subscribe(const std::string &topicFilter, SubscriptionOptions &options) {
-    if (Topic::isShared(topicFilter)) {
-        auto [group, realTopicFilter] = Topic::splitShared(topicFilter);
-        broker->sharedSubscribe(clientId, realTopicFilter, group);
-        subscriptions[realTopicFilter] = options;
-    }
-    else {
-        broker->subscribe(clientId, topicFilter);
-        subscriptions[topicFilter] = options;
+bool Session::subscribe(const std::string &topicFilter, SubscriptionOptions &options) {
+    bool isNew = subscriptions.find(topicFilter) == subscriptions.end();
+    if (isNew) {
+        subscriptionBytes += subscriptionFootprint(topicFilter);
+        Metrics::charge(MemoryTag::SESSIONS, subscriptionFootprint(topicFilter));
     }
+    // Shared subscriptions are keyed by their full "$share/<group>/<filter>"
+    // name so they don't collide with a plain subscription on the same filter
+    broker->subscribe(this, topicFilter, options);
+    return isNew;
 }
 
 void Session::unsubscribe(const std::string &topicFilter) {
-    if (Topic::isShared(topicFilter)) {
-        auto [group, realTopicFilter] = Topic::splitShared(topicFilter);
-        broker->sharedUnsubscribe(clientId, realTopicFilter, group);
-        subscriptions.erase(realTopicFilter);
-    } else {
-        broker->unsubscribe(clientId, topicFilter);
-        subscriptions.erase(topicFilter);
+    if (subscriptions.count(topicFilter)) {
+        subscriptionBytes -= subscriptionFootprint(topicFilter);
+        Metrics::charge(MemoryTag::SESSIONS, -static_cast<int64_t>(subscriptionFootprint(topicFilter)));
     }
+    broker->unsubscribe(this, topicFilter);
 }
 
-void Session::setDeliverCallback(std::function<void(const Message &, uint16_t, QoS)> callback) {
+std::map<std::string, SubscriptionOptions> Session::takeSubscriptions() {
+    Metrics::charge(MemoryTag::SESSIONS, -static_cast<int64_t>(subscriptionBytes));
+    subscriptionBytes = 0;
+    return std::move(subscriptions);
+}
+
+size_t Session::getMemoryBytes() const {
+    size_t bytes = sizeof(Session) + clientId.capacity() + subscriptionBytes + inflight.getMemoryBytes();
+    if (queue) {
+        bytes += sizeof(OfflineQueue) + queue->getMemoryBytes();
+    }
+    return bytes;
+}
+
+void Session::setDeliverCallback(std::function<void(const MessageRef &, uint16_t, QoS, bool)> callback) {
     onDeliver = callback;
 }
 
-void Session::deliver(const std::string &topic, const Message &message) {
-    printf("session deliver to %s\n", topic.c_str());
-    QoS qos = message.qos;
-    if (subscriptions.find(topic) != subscriptions.end()) {
-        SubscriptionOptions options = subscriptions[topic];
-        qos = options.maximumQos;
+void Session::deliver(const std::string &topic, const MessageRef &message) {
+    LOG_TRACE("session deliver to %s", topic.c_str());
+    QoS qos = message->getQos();
+    bool retain = false;
+    auto it = subscriptions.find(topic);
+    if (it != subscriptions.end()) {
+        qos = std::min(qos, it->second.maximumQos);
+        retain = it->second.retainAsPublished && message->isRetain();
+    }
+    FLOWMQ_PROBE(session__deliver, clientId.c_str(), message->getTopic().data(), message->getTopic().size(),
+                 static_cast<int>(qos));
+    uint64_t enqueuedAt = message->getTrace() ? Trace::now() : 0;
+    if (inboxAttached.load(std::memory_order_acquire)) {
+        inbox->push(DeliveryInbox::Delivery{message, qos, retain, enqueuedAt});
+        // Detached meanwhile, possibly after the connection drained the inbox for the last time
+        if (!inboxAttached.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!inboxAttached.load(std::memory_order_relaxed)) {
+                processInbox();
+            }
+        }
+        return;
+    }
+    // Other publishers and the expiry sweep may be at the queue too
+    std::unique_lock<std::mutex> guard(lock);
+    if (inboxAttached.load(std::memory_order_relaxed)) {
+        guard.unlock();
+        inbox->push(DeliveryInbox::Delivery{message, qos, retain, enqueuedAt});
+        return;
+    }
+    if (enqueuedAt) {
+        Trace::setEnqueued(message.get(), enqueuedAt);
+        dispatch(message, qos, retain);
+        Trace::setEnqueued(nullptr, 0);
+        return;
+    }
+    dispatch(message, qos, retain);
+}
+
+int Session::attachInbox() {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!inbox) {
+        inbox = std::make_unique<DeliveryInbox>();
+    }
+    inboxAttached.store(true, std::memory_order_release);
+    return inbox->getFd();
+}
+
+void Session::detachInbox() {
+    std::lock_guard<std::mutex> guard(lock);
+    inboxAttached.store(false, std::memory_order_release);
+    processInbox();
+}
+
+size_t Session::processInbox() {
+    if (!inbox) {
+        return 0;
+    }
+    return inbox->drain([this](DeliveryInbox::Delivery &delivery) {
+        if (delivery.enqueuedAt) {
+            Trace::setEnqueued(delivery.message.get(), delivery.enqueuedAt);
+            dispatch(delivery.message, delivery.qos, delivery.retain);
+            Trace::setEnqueued(nullptr, 0);
+            return;
+        }
+        dispatch(delivery.message, delivery.qos, delivery.retain);
+    });
+}
+
+void Session::dispatch(const MessageRef &message, QoS qos, bool retain) {
+    if (message->getExpiresAt() && message->isExpired(MessageBlock::currentTime())) {
+        Metrics::increment(Counter::DELIVERIES_DROPPED);
+        return;
+    }
+    if (!connected || (queue && !queue->empty()) || (qos > QoS::QOS_0 && inflight.full())) {
+        enqueue(message, qos, retain);
+        return;
+    }
+    send(message, qos, retain);
+}
+
+void Session::enqueue(const MessageRef &message, QoS qos, bool retain) {
+    if (!queue) {
+        const BrokerConfig &config = broker->getConfig();
+        std::string spillDirectory;
+        if (!config.dataDirectory.empty()) {
+            // Client ids may contain any character, so the directory name is their hex encoding
+            static const char digits[] = "0123456789abcdef";
+            spillDirectory = config.dataDirectory + "/queues/";
+            for (unsigned char c : clientId) {
+                spillDirectory += digits[c >> 4];
+                spillDirectory += digits[c & 0x0f];
+            }
+        }
+        queue = std::make_unique<OfflineQueue>(config.offlineQueueMemoryBytes, spillDirectory);
+    }
+    if (queue->push(OfflineQueue::Entry{message, qos, retain})) {
+        Metrics::adjust(Gauge::QUEUED_MESSAGES, 1);
+        scheduleExpiry(message->getExpiresAt());
+        if (!connected) {
+            broker->updateOfflineMemory(this);
+        }
+    } else {
+        Metrics::increment(Counter::DELIVERIES_DROPPED);
+    }
+}
+
+void Session::scheduleExpiry(uint64_t expiresAt) {
+    // The index only needs the earliest expiry; later ones are found when that one is swept
+    if (expiresAt && (queueExpiry == 0 || expiresAt < queueExpiry)) {
+        queueExpiry = expiresAt;
+        broker->scheduleExpiry(handle, expiresAt);
+    }
+}
+
+size_t Session::purgeExpired(uint64_t nowMs, uint64_t expiresAt) {
+    std::lock_guard<std::mutex> guard(lock);
+    // Connected sessions drop expired messages as they drain and reschedule when they disconnect;
+    // entries superseded by an earlier expiry are stale
+    if (connected || inboxAttached.load(std::memory_order_relaxed) || queueExpiry != expiresAt) {
+        return 0;
+    }
+    if (!queue) {
+        queueExpiry = 0;
+        return 0;
+    }
+    uint64_t nextExpiry;
+    size_t removed = queue->removeExpired(nowMs, nextExpiry);
+    dropExpired(removed);
+    queueExpiry = 0;
+    scheduleExpiry(nextExpiry);
+    broker->updateOfflineMemory(this);
+    return removed;
+}
+
+void Session::dropExpired(size_t count) {
+    Metrics::adjust(Gauge::QUEUED_MESSAGES, -static_cast<int64_t>(count));
+    Metrics::increment(Counter::DELIVERIES_DROPPED, count);
+}
+
+void Session::resume() {
+    // Unacknowledged messages go out again before anything new
+    retransmit();
+    drain();
+    // Left over if a publisher raced the previous connection going away
+    processInbox();
+}
+
+void Session::retransmit() {
+    inflight.forEach([this](InflightWindow::Entry &entry) { resend(entry); });
+}
+
+void Session::retransmitExpired(uint64_t nowMs, uint64_t intervalMs) {
+    inflight.forEach([&](InflightWindow::Entry &entry) {
+        // sentAt keeps the low 32 bits of the clock, so compare the wrapped difference
+        if (static_cast<uint32_t>(nowMs) - entry.sentAt >= intervalMs) {
+            resend(entry);
+        }
+    });
+}
+
+void Session::resend(InflightWindow::Entry &entry) {
+    if (!onResend) {
+        return;
+    }
+    onResend(entry);
+    entry.sentAt = steadyMs();
+}
+
+void Session::drain() {
+    if (queue) {
+        OfflineQueue::Entry entry;
+        const OfflineQueue::Entry *next;
+        size_t sent = 0;
+        size_t expired = queue->getExpiredCount();
+        while (connected && (next = queue->front()) && (next->qos == QoS::QOS_0 || !inflight.full())) {
+            queue->pop(entry);
+            send(entry.message, entry.qos, entry.retain);
+            sent++;
+        }
+        Metrics::adjust(Gauge::QUEUED_MESSAGES, -static_cast<int64_t>(sent));
+        // Expired messages the queue skipped over on the way
+        dropExpired(queue->getExpiredCount() - expired);
+        if (queue->empty()) {
+            queue.reset();
+            queueExpiry = 0;
+        }
+    }
+    // Shared subscriptions skip members whose window is full
+    if (backpressured && !inflight.full()) {
+        backpressured = false;
+        updateSharedAvailable();
     }
+}
+
+void Session::setReceiveMaximum(uint16_t receiveMaximum) {
+    inflight.setLimit(receiveMaximum);
+}
+
+void Session::deliverRetained(const std::string &topic, bool isNew) {
+    // Retained messages are never sent for shared subscriptions
+    auto it = subscriptions.find(topic);
+    if (it == subscriptions.end() || Topic::isShared(topic)) {
+        return;
+    }
+    const SubscriptionOptions &options = it->second;
+    if (options.retainHandling == RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES ||
+        (options.retainHandling == RetainHandling::SEND_RETAINED_MESSAGES_AT_SUBSCRIBE_IF_NEW && !isNew)) {
+        return;
+    }
+    for (const auto &message : broker->getRetained(topic)) {
+        dispatch(message, std::min(message->getQos(), options.maximumQos), true);
+    }
+}
+
+void Session::send(const MessageRef &message, QoS qos, bool retain) {
+    uint16_t id = 0;
     if (qos > QoS::QOS_0) {
-        packetId = nextPacketId();
-        inflightMessages[packetId] = std::make_shared<Message>(message);
+        id = inflight.push(message, qos, retain);
+        Metrics::adjust(Gauge::INFLIGHT_MESSAGES, 1);
+        inflight.find(id)->sentAt = steadyMs();
+        if (broker->getWal()) {
+            broker->getWal()->logDeliver(clientId, id, message, qos);
+        }
+        if (inflight.full() && !backpressured) {
+            backpressured = true;
+            updateSharedAvailable();
+        }
+    }
+    if (onDeliver) {
+        onDeliver(message, id, qos, retain);
     }
-    onDeliver(message, packetId, qos);
 }
 
 void Session::setDisconnectCallback(std::function<void()> callback) {
     onDisconnect = callback;
 }
 
-inline uint16_t Session::nextPacketId() {
-    if (packetId++ > UINT16_MAX) {
-        packetId = 1;
-    }
-    return packetId;
+void Session::setResendCallback(std::function<void(InflightWindow::Entry&)> callback) {
+    onResend = callback;
 }
 
 }
\ No newline at end of file
@@ -3,11 +3,17 @@
 #pragma once
 
 #include <string>
-#include <queue>
 #include <functional>
+#include <atomic>
+#include <list>
+#include <mutex>
 #include "Message.h"
+#include "MessageRef.h"
 #include "MQTT.h"
 #include "Broker.h"
+#include "OfflineQueue.h"
+#include "InflightWindow.h"
+#include "DeliveryInbox.h"
 
 namespace MQTT {
 
@@ -15,40 +21,139 @@ class Broker;
 
 class Session {
 public:
+    // Session Expiry Interval that keeps a session until it is discarded explicitly
+    static constexpr uint32_t NEVER_EXPIRES = 0xFFFFFFFF;
+
     Session(Broker* broker, const std::string& clientId, bool cleanStart = true);
     ~Session();
+    // Sessions come from the slab pool
+    static void* operator new(size_t size);
+    static void operator delete(void* pointer, size_t size);
 
     const std::string& getClientId() const { return clientId; }
+    SessionHandle getHandle() const { return handle; }
     bool isConnected() const { return connected; }
+    bool isCleanStart() const { return cleanStart; }
+    // True while the inflight window is full
+    bool isBackpressured() const { return backpressured; }
+    // Whether a shared subscription may pick this session: connected with room in its inflight window.
+    // Read by publishers on any thread.
+    bool isSharedAvailable() const { return sharedAvailable.load(std::memory_order_relaxed); }
+    size_t getInflightCount() const { return inflight.size(); }
+    size_t getQueuedCount() const { return queue ? queue->size() : 0; }
+    size_t getAwaitingPubrelCount() const { return awaitingPubrel.size(); }
+    size_t getExpiredCount() const { return queue ? queue->getExpiredCount() : 0; }
+    // Earliest expiry the session is scheduled under in the broker's expiry index, 0 if none
+    uint64_t getQueueExpiry() const { return queueExpiry; }
+    // Receive Maximum of the client: QoS 1/2 deliveries beyond it wait in the session queue
+    void setReceiveMaximum(uint16_t receiveMaximum);
+    // Seconds the session outlives its connection: 0 ends it with the connection, NEVER_EXPIRES keeps it.
+    // Defaults to 0 for clean sessions and NEVER_EXPIRES for persistent ones, as in MQTT 3.1.1.
+    void setExpiryInterval(uint32_t seconds) { expiryInterval = seconds; }
+    uint32_t getExpiryInterval() const { return expiryInterval; }
+    // When the offline session expires, 0 while connected or if it never does
+    uint64_t getExpiresAt() const { return expiresAt; }
+    // Will Message published if the current connection ends without a normal DISCONNECT
+    void setWill(std::unique_ptr<Will> will) { this->will = std::move(will); }
+    std::unique_ptr<Will> takeWill() { return std::move(will); }
+    bool hasWill() const { return will != nullptr; }
+    // Estimated bytes held by the session: itself, its subscriptions, inflight window and queued messages.
+    // Messages shared with other sessions are counted by every queue holding them.
+    size_t getMemoryBytes() const;
 
     void connect();
     void disconnect();
     void discard();
-    //void resume();
+    // Resend the inflight messages, then the ones queued while the client was offline
+    void resume();
+    // Resend every inflight message in send order: PUBLISH with DUP, or PUBREL once PUBREC arrived
+    void retransmit();
+    // Resend the inflight messages last sent more than intervalMs before nowMs
+    void retransmitExpired(uint64_t nowMs, uint64_t intervalMs);
+    // Send queued messages while the inflight window has room
+    void drain();
+    // Drop the queued messages expired at nowMs and reschedule the queue's next expiry; called by the
+    // expiry sweep for the entry due at expiresAt, which is stale unless it is still the queue's earliest
+    size_t purgeExpired(uint64_t nowMs, uint64_t expiresAt);
     ReasonCode publish(uint16_t packetId,const Message& message);
-    void subscribe(const std::string& topic, SubscriptionOptions& options);
+    // Returns true if the subscription did not exist before
+    bool subscribe(const std::string& topic, SubscriptionOptions& options);
     void unsubscribe(const std::string& topic);
+    // Hand the subscriptions over without touching the routing index; the broker removes
+    // the subscriptions of many expired sessions at once before destroying them; called with the broker's routing lock held
+    std::map<std::string, SubscriptionOptions> takeSubscriptions();
     void puback(uint16_t packetId);
     ReasonCode pubrec(uint16_t packetId);
     ReasonCode pubrel(uint16_t packetId);
     void pubcomp(uint16_t packetId);
-    void setDeliverCallback(std::function<void(const Message&, uint16_t, QoS)> callback);
+    void setDeliverCallback(std::function<void(const MessageRef&, uint16_t, QoS, bool)> callback);
     void setDisconnectCallback(std::function<void()> callback);
-    void deliver(const std::string& topic, const Message& message);
+    void setResendCallback(std::function<void(InflightWindow::Entry&)> callback);
+    // Called on the publisher's thread: with an inbox attached the message is handed to the
+    // connection's thread, otherwise (no connection, or in tests) it is dispatched right away
+    // under the session's lock
+    void deliver(const std::string& topic, const MessageRef& message);
+    // Route deliveries through the inbox from now on and return the fd that signals pending ones
+    int attachInbox();
+    // Stop routing through the inbox and dispatch whatever is still in it
+    void detachInbox();
+    // Dispatch the deliveries pending in the inbox; called by the connection's thread
+    size_t processInbox();
+    // Send the retained messages matching a subscription, honoring its RetainHandling
+    void deliverRetained(const std::string& topic, bool isNew);
+    // Block until every record this session logged is durable; call before acking a publish
+    void sync();
 
 private:
+    friend class Broker;
+
     std::string clientId;
-    bool connected = false;
+    SessionHandle handle = INVALID_SESSION;
+    // Changed under lock; read without it by a connection taking the session over
+    std::atomic<bool> connected{false};
     bool cleanStart = true; 
-    uint16_t packetId = 1;
-    std::set<uint16_t> awaitingPubrel;
+    PacketIdSet awaitingPubrel;
     std::map<std::string, SubscriptionOptions> subscriptions;
-    std::map<uint16_t, std::shared_ptr<Message>> inflightMessages;       
-    std::queue<Message*> outgoingMessages;
-    std::function<void(const Message&, uint16_t, QoS)> onDeliver;
+    size_t subscriptionBytes = 0;
+    InflightWindow inflight;
+    // Messages not sent yet because the client is offline or its window is full
+    std::unique_ptr<OfflineQueue> queue;
+    // Created by the first connection and kept for the session's lifetime, as publishers may still hold it
+    std::unique_ptr<DeliveryInbox> inbox;
+    std::atomic<bool> inboxAttached{false};
+    // Held by whoever touches the queue, the inflight window and the connection state while no
+    // connection thread owns them: publishers dispatching, the expiry sweep, connect and disconnect
+    std::mutex lock;
+    bool backpressured = false;
+    // connected && !backpressured, kept for publishers picking shared subscribers
+    std::atomic<bool> sharedAvailable{false};
+    uint64_t queueExpiry = 0;
+    uint32_t expiryInterval;
+    uint64_t expiresAt = 0;
+    std::unique_ptr<Will> will;
+    // Owned by the broker: place in its offline LRU and the memory charged there, while parked
+    std::list<Session*>::iterator offlinePosition;
+    bool parked = false;
+    size_t chargedBytes = 0;
+    // Owned by the broker under its sessionLock: a connection thread is using the session, and
+    // another connection is waiting for that thread to let go of it
+    bool attached = false;
+    bool takenOver = false;
+    // Write-ahead log position the next PUBACK/PUBREC depends on
+    uint64_t requiredLsn = 0;
+    std::function<void(const MessageRef&, uint16_t, QoS, bool)> onDeliver;
     std::function<void()> onDisconnect;
+    std::function<void(InflightWindow::Entry&)> onResend;
     Broker* broker;
-    uint16_t nextPacketId();
+    void send(const MessageRef& message, QoS qos, bool retain);
+    void updateSharedAvailable() { sharedAvailable.store(connected && !backpressured, std::memory_order_relaxed); }
+    void enqueue(const MessageRef& message, QoS qos, bool retain);
+    // Send now if the window allows and nothing is queued ahead, otherwise queue
+    void dispatch(const MessageRef& message, QoS qos, bool retain);
+    void resend(InflightWindow::Entry& entry);
+    void scheduleExpiry(uint64_t expiresAt);
+    // Account for messages that expired in the queue
+    void dropExpired(size_t count);
 };
 
 }
@@ -0,0 +1,152 @@
+#include "SessionRegistry.h"
+#include "Session.h"
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace MQTT {
+
+namespace {
+
+std::atomic<uint64_t> currentEpoch{1};
+
+// Epoch a thread announced, 0 while it holds no ReadGuard. Never freed, so waitForReaders can
+// watch one without a lock; a thread that exits hands its slot to the next new reader.
+struct ReaderSlot {
+    std::atomic<uint64_t> epoch{0};
+    bool inUse = false;
+};
+
+struct Readers {
+    std::mutex lock;
+    std::vector<ReaderSlot*> slots;
+};
+
+Readers& readers() {
+    // Never destroyed: threads may still exit after static destruction began
+    static Readers* instance = new Readers();
+    return *instance;
+}
+
+struct LocalReader {
+    ReaderSlot* slot = nullptr;
+    uint32_t depth = 0;
+
+    ~LocalReader() {
+        if (slot) {
+            Readers &all = readers();
+            std::lock_guard<std::mutex> guard(all.lock);
+            slot->inUse = false;
+        }
+    }
+};
+
+thread_local LocalReader localReader;
+
+ReaderSlot* acquireSlot() {
+    Readers &all = readers();
+    std::lock_guard<std::mutex> guard(all.lock);
+    auto it = std::find_if(all.slots.begin(), all.slots.end(), [](ReaderSlot* slot) { return !slot->inUse; });
+    ReaderSlot* slot = it != all.slots.end() ? *it : all.slots.emplace_back(new ReaderSlot());
+    slot->inUse = true;
+    return slot;
+}
+
+}
+
+SessionRegistry::ReadGuard::ReadGuard() {
+    LocalReader &reader = localReader;
+    if (reader.depth++ > 0) {
+        return;
+    }
+    if (!reader.slot) {
+        reader.slot = acquireSlot();
+    }
+    reader.slot->epoch.store(currentEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    // Pairs with the fence in waitForReaders: either it sees this epoch or this thread sees the handle erased
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+SessionRegistry::ReadGuard::~ReadGuard() {
+    LocalReader &reader = localReader;
+    if (--reader.depth == 0) {
+        reader.slot->epoch.store(0, std::memory_order_release);
+    }
+}
+
+void SessionRegistry::waitForReaders() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t epoch = currentEpoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+    std::vector<ReaderSlot*> slots;
+    {
+        Readers &all = readers();
+        std::lock_guard<std::mutex> guard(all.lock);
+        slots = all.slots;
+    }
+    // Slots added since belong to readers that started after the erase
+    for (ReaderSlot* slot : slots) {
+        uint64_t seen;
+        while ((seen = slot->epoch.load(std::memory_order_acquire)) != 0 && seen < epoch) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+SessionRegistry::~SessionRegistry() {
+    for (auto &chunk : chunks) {
+        delete[] chunk.load(std::memory_order_relaxed);
+    }
+}
+
+SessionHandle SessionRegistry::insert(const std::string &clientId, Session *session) {
+    uint32_t index;
+    if (!freeSlots.empty()) {
+        index = freeSlots.front();
+        freeSlots.pop_front();
+    } else {
+        index = used.load(std::memory_order_relaxed);
+        if (index == MAX_SESSIONS) {
+            throw std::runtime_error("Session registry is full");
+        }
+        std::atomic<Slot*> &chunk = chunks[index >> CHUNK_BITS];
+        if (!chunk.load(std::memory_order_relaxed)) {
+            chunk.store(new Slot[CHUNK_SIZE], std::memory_order_release);
+        }
+        used.store(index + 1, std::memory_order_release);
+    }
+    Slot &slot = slotAt(index);
+    slot.session.store(session, std::memory_order_release);
+    count.fetch_add(1, std::memory_order_relaxed);
+    SessionHandle handle = slot.generation.load(std::memory_order_relaxed) << INDEX_BITS | index;
+    byClientId[clientId] = handle;
+    return handle;
+}
+
+bool SessionRegistry::erase(SessionHandle handle) {
+    Session *session = get(handle);
+    if (!session) {
+        return false;
+    }
+    // Another session may have been registered under the same client id since
+    auto it = byClientId.find(session->getClientId());
+    if (it != byClientId.end() && it->second == handle) {
+        byClientId.erase(it);
+    }
+    uint32_t index = handle & INDEX_MASK;
+    Slot &slot = slotAt(index);
+    // Generation 0 is skipped so that no live handle is ever INVALID_SESSION
+    uint32_t generation = (slot.generation.load(std::memory_order_relaxed) + 1) & GENERATION_MASK;
+    slot.generation.store(generation ? generation : 1, std::memory_order_release);
+    slot.session.store(nullptr, std::memory_order_release);
+    freeSlots.push_back(index);
+    count.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+SessionHandle SessionRegistry::find(const std::string &clientId) const {
+    auto it = byClientId.find(clientId);
+    return it != byClientId.end() ? it->second : INVALID_SESSION;
+}
+
+}
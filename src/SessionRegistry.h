@@ -0,0 +1,123 @@
+#ifndef SESSION_REGISTRY_H
+#define SESSION_REGISTRY_H
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <cstdint>
+
+namespace MQTT {
+
+class Session;
+
+// 32-bit reference to a registered session: slot index in the low bits and
+// the generation of that slot in the high bits. Zero is never handed out.
+using SessionHandle = uint32_t;
+constexpr SessionHandle INVALID_SESSION = 0;
+
+// Dense table of live sessions addressed by SessionHandle.
+//
+// Routing structures store handles instead of client id strings, so fan-out
+// resolves a subscriber with an array index rather than a hash lookup. A
+// slot's generation is bumped whenever its session goes away, which makes a
+// handle kept by a stale subscription resolve to null instead of to whichever
+// session reuses the slot. Freed slots are reused oldest first so generations
+// wrap as late as possible.
+//
+// Routers call get() without a lock while connection threads register and
+// remove sessions under the broker's session lock. Slots live in fixed-size
+// chunks that never move once allocated, reached through a fixed table of
+// chunk pointers, and their fields are atomics, so a reader never sees a slot
+// being reallocated or half written.
+//
+// A session a router resolved must also outlive its use. Routers hold a
+// ReadGuard, which announces the current epoch in a per-thread slot, and
+// whoever destroys a session first erases its handle and then calls
+// waitForReaders(), which moves the epoch on and waits for the routers that
+// announced an older one: any that started later cannot resolve the handle.
+class SessionRegistry {
+public:
+    // Marks the calling thread as using sessions it resolves until destroyed; may nest
+    class ReadGuard {
+    public:
+        ReadGuard();
+        ~ReadGuard();
+        ReadGuard(const ReadGuard &) = delete;
+        ReadGuard &operator=(const ReadGuard &) = delete;
+    };
+    // Wait until every ReadGuard that was held when this was called is released.
+    // Called after erasing a handle and before freeing its session; must not hold a ReadGuard.
+    static void waitForReaders();
+
+    static constexpr uint32_t INDEX_BITS = 20;
+    static constexpr uint32_t INDEX_MASK = (1u << INDEX_BITS) - 1;
+    static constexpr uint32_t GENERATION_MASK = (1u << (32 - INDEX_BITS)) - 1;
+    static constexpr size_t MAX_SESSIONS = INDEX_MASK + 1;
+    static constexpr uint32_t CHUNK_BITS = 10;
+    static constexpr uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+
+    SessionRegistry() = default;
+    ~SessionRegistry();
+    SessionRegistry(const SessionRegistry &) = delete;
+    SessionRegistry &operator=(const SessionRegistry &) = delete;
+
+    // Register a session and make it the one found under clientId; inserts and erases must not run concurrently
+    SessionHandle insert(const std::string &clientId, Session *session);
+    // Returns false if the handle is stale
+    bool erase(SessionHandle handle);
+
+    // Null if the handle is stale; safe to call while another thread inserts or erases
+    Session* get(SessionHandle handle) const {
+        uint32_t index = handle & INDEX_MASK;
+        const Slot* chunk = chunks[index >> CHUNK_BITS].load(std::memory_order_acquire);
+        if (!chunk) {
+            return nullptr;
+        }
+        const Slot &slot = chunk[index & (CHUNK_SIZE - 1)];
+        uint32_t generation = handle >> INDEX_BITS;
+        if (slot.generation.load(std::memory_order_acquire) != generation) {
+            return nullptr;
+        }
+        Session* session = slot.session.load(std::memory_order_acquire);
+        // Erased and reused between the two loads: the session is another handle's
+        return slot.generation.load(std::memory_order_acquire) == generation ? session : nullptr;
+    }
+    bool valid(SessionHandle handle) const { return get(handle) != nullptr; }
+    SessionHandle find(const std::string &clientId) const;
+
+    size_t size() const { return count.load(std::memory_order_relaxed); }
+
+    template <typename Visitor>
+    void forEach(Visitor visit) const {
+        uint32_t end = used.load(std::memory_order_acquire);
+        for (uint32_t index = 0; index < end; index++) {
+            const Slot* chunk = chunks[index >> CHUNK_BITS].load(std::memory_order_acquire);
+            if (Session* session = chunk[index & (CHUNK_SIZE - 1)].session.load(std::memory_order_acquire)) {
+                visit(session);
+            }
+        }
+    }
+
+private:
+    struct Slot {
+        std::atomic<Session*> session{nullptr};
+        std::atomic<uint32_t> generation{1};
+    };
+
+    std::atomic<Slot*> chunks[MAX_SESSIONS / CHUNK_SIZE] = {};
+    // Slots handed out so far; the ones below it are all in allocated chunks
+    std::atomic<uint32_t> used{0};
+    std::deque<uint32_t> freeSlots;
+    std::atomic<size_t> count{0};
+
+    Slot &slotAt(uint32_t index) { return chunks[index >> CHUNK_BITS].load(std::memory_order_relaxed)[index & (CHUNK_SIZE - 1)]; }
+    // Only used when a client connects, never while routing
+    std::unordered_map<std::string, SessionHandle> byClientId;
+};
+
+}
+
+#endif // SESSION_REGISTRY_H
@@ -0,0 +1,134 @@
+#include "SharedGroup.h"
+#include <random>
+
+namespace MQTT {
+
+namespace {
+
+std::minstd_rand& generator() {
+    thread_local std::minstd_rand rng(std::random_device{}());
+    return rng;
+}
+
+// Lamping and Veach's jump consistent hash: a bucket in [0, buckets) that only changes for
+// about 1/buckets of the keys when a bucket is added or the last one removed
+size_t jumpHash(uint64_t key, size_t buckets) {
+    int64_t bucket = -1;
+    int64_t next = 0;
+    while (next < static_cast<int64_t>(buckets)) {
+        bucket = next;
+        key = key * 2862933555777941757ULL + 1;
+        next = static_cast<int64_t>((bucket + 1) * (double(1LL << 31) / double((key >> 33) + 1)));
+    }
+    return static_cast<size_t>(bucket);
+}
+
+}
+
+SharedGroup::SharedGroup(const std::string &group, const std::string &topicFilter)
+    : group(group), topicFilter(topicFilter), shareName("$share/" + group + "/" + topicFilter) {}
+
+bool SharedGroup::contains(SessionHandle member) const {
+    return positions.find(member) != positions.end();
+}
+
+bool SharedGroup::add(SessionHandle member) {
+    if (contains(member)) {
+        return false;
+    }
+    positions[member] = members.size();
+    members.push_back(member);
+    return true;
+}
+
+bool SharedGroup::remove(SessionHandle member) {
+    auto it = positions.find(member);
+    if (it == positions.end()) {
+        return false;
+    }
+    // The last member takes the place of the removed one
+    size_t pos = it->second;
+    members[pos] = members.back();
+    positions[members[pos]] = pos;
+    members.pop_back();
+    positions.erase(member);
+    SessionHandle expected = member;
+    sticky.compare_exchange_strong(expected, INVALID_SESSION, std::memory_order_relaxed);
+    return true;
+}
+
+size_t SharedGroup::randomMember() const {
+    return std::uniform_int_distribution<size_t>(0, members.size() - 1)(generator());
+}
+
+size_t SharedGroup::firstAvailable(size_t start, const std::function<bool(SessionHandle)> &available) const {
+    size_t count = members.size();
+    for (size_t step = 0; step < count; step++) {
+        size_t i = start + step < count ? start + step : start + step - count;
+        if (available(members[i])) {
+            return i;
+        }
+    }
+    return count;
+}
+
+SessionHandle SharedGroup::pick(SharedStrategy strategy, std::string_view publisherId, std::string_view topic,
+                                const std::function<bool(SessionHandle)> &available,
+                                const std::function<size_t(SessionHandle)> &inflight) {
+    size_t count = members.size();
+    if (count == 0) {
+        return INVALID_SESSION;
+    }
+    auto from = [&](size_t start) {
+        size_t i = firstAvailable(start, available);
+        return i < count ? members[i] : INVALID_SESSION;
+    };
+    auto stillAvailable = [&](SessionHandle member) {
+        return member != INVALID_SESSION && contains(member) && available(member);
+    };
+    switch (strategy) {
+    case SharedStrategy::ROUND_ROBIN:
+        return from(cursor.fetch_add(1, std::memory_order_relaxed) % count);
+    case SharedStrategy::RANDOM:
+        return from(randomMember());
+    case SharedStrategy::STICKY: {
+        SessionHandle current = sticky.load(std::memory_order_relaxed);
+        if (stillAvailable(current)) {
+            return current;
+        }
+        SessionHandle chosen = from(randomMember());
+        if (chosen == INVALID_SESSION) {
+            return INVALID_SESSION;
+        }
+        // Publishers racing here agree on whichever member was stored first
+        if (!sticky.compare_exchange_strong(current, chosen, std::memory_order_relaxed) && stillAvailable(current)) {
+            return current;
+        }
+        return chosen;
+    }
+    case SharedStrategy::HASH_CLIENT_ID:
+        return from(jumpHash(std::hash<std::string_view>{}(publisherId), count));
+    case SharedStrategy::HASH_TOPIC:
+        return from(jumpHash(std::hash<std::string_view>{}(topic), count));
+    case SharedStrategy::LEAST_INFLIGHT: {
+        size_t first = firstAvailable(randomMember(), available);
+        if (first == count || count == 1 || !inflight) {
+            return first < count ? members[first] : INVALID_SESSION;
+        }
+        // Two random choices: nearly as even as scanning every member, at a constant cost
+        size_t offset = std::uniform_int_distribution<size_t>(1, count - 1)(generator());
+        size_t second = firstAvailable(first + offset < count ? first + offset : first + offset - count, available);
+        if (second == first) {
+            // Wrapped around to the first choice: any other available member follows it
+            second = firstAvailable(first + 1 < count ? first + 1 : 0, available);
+            if (second == first) {
+                return members[first];
+            }
+        }
+        return inflight(members[second]) < inflight(members[first]) ? members[second] : members[first];
+    }
+    }
+    return INVALID_SESSION;
+}
+
+}
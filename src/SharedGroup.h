@@ -0,0 +1,83 @@
+#ifndef SHARED_GROUP_H
+#define SHARED_GROUP_H
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include "SessionRegistry.h"
+
+namespace MQTT {
+
+// How a shared subscription group picks the member that receives a message
+enum class SharedStrategy {
+    ROUND_ROBIN,
+    RANDOM,
+    STICKY,
+    HASH_CLIENT_ID,
+    HASH_TOPIC,
+    LEAST_INFLIGHT
+};
+
+// Members of one (topic filter, group) pair.
+//
+// Members are kept in a dense vector with an index of their positions, so
+// add and remove are O(1) swaps. Whether a member can take a message (it is
+// connected and its inflight window has room) is a flag on its session that
+// pick() reads through a callback; flipping it never reorders the group, so
+// availability can change on any thread while publishers pick.
+//
+// pick() may run on many publisher threads at once: the round-robin cursor
+// and the sticky member are atomics and random choices come from a
+// per-thread generator. add() and remove() must not run concurrently with
+// picks or each other; the broker holds its routing lock exclusively for them.
+class SharedGroup {
+public:
+    SharedGroup(const std::string& group, const std::string& topicFilter);
+
+    const std::string& getGroup() const { return group; }
+    const std::string& getTopicFilter() const { return topicFilter; }
+    // "$share/<group>/<topicFilter>", the key the member sessions subscribed with
+    const std::string& getShareName() const { return shareName; }
+
+    bool add(SessionHandle member);
+    bool remove(SessionHandle member);
+    bool contains(SessionHandle member) const;
+
+    bool empty() const { return members.empty(); }
+    size_t size() const { return members.size(); }
+
+    // Pick the available member that should receive a message published by
+    // publisherId on topic, or INVALID_SESSION if no member is available.
+    // Each strategy picks among all members and, when its choice is
+    // unavailable, moves on to the next members in turn: O(1) while most
+    // members are available, O(n) only when nearly all of them are not.
+    // inflight is only consulted by LEAST_INFLIGHT, which takes the less loaded
+    // of two members sampled at random. The hashes map keys to members with a
+    // jump consistent hash, so a member joining or leaving only moves the keys
+    // of the members it displaces rather than nearly all of them.
+    SessionHandle pick(SharedStrategy strategy, std::string_view publisherId, std::string_view topic,
+                       const std::function<bool(SessionHandle)>& available,
+                       const std::function<size_t(SessionHandle)>& inflight);
+
+private:
+    std::string group;
+    std::string topicFilter;
+    std::string shareName;
+    std::vector<SessionHandle> members;
+    std::unordered_map<SessionHandle, size_t> positions;
+    std::atomic<size_t> cursor{0};
+    std::atomic<SessionHandle> sticky{INVALID_SESSION};
+
+    // Index of a uniformly chosen member
+    size_t randomMember() const;
+    // Index of the first available member from start on, wrapping around; members.size() if there is none
+    size_t firstAvailable(size_t start, const std::function<bool(SessionHandle)>& available) const;
+};
+
+}
+
+#endif // SHARED_GROUP_H
@@ -0,0 +1,178 @@
+#include "SlabPool.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <sys/mman.h>
+
+namespace MQTT {
+namespace SlabPool {
+
+namespace {
+
+constexpr size_t CLASSES = MAX_SIZE / GRANULARITY;
+
+struct FreeNode {
+    FreeNode *next;
+};
+
+struct FreeList {
+    FreeNode *head = nullptr;
+    size_t count = 0;
+};
+
+std::atomic<bool> hugePages{false};
+std::atomic<uint64_t> slabCount{0};
+std::atomic<uint64_t> slabBytes{0};
+
+// Batches of free objects handed back by threads, per class: a thread that frees more than
+// it allocates, e.g. a subscriber releasing what publishers allocated, passes its surplus on
+struct Depot {
+    std::mutex lock;
+    std::vector<FreeList> batches[CLASSES];
+};
+
+Depot& depot() {
+    // Never destroyed: objects may still be released after static destruction began
+    static Depot* instance = new Depot();
+    return *instance;
+}
+
+size_t classOf(size_t size) {
+    return (size + GRANULARITY - 1) / GRANULARITY - 1;
+}
+
+// Objects moved to or from the depot at once: 32 KiB worth, and at least 8
+size_t batchSize(size_t index) {
+    size_t objectSize = (index + 1) * GRANULARITY;
+    return std::max<size_t>(8, 32 * 1024 / objectSize);
+}
+
+void* mapSlab(size_t &size) {
+    if (hugePages.load(std::memory_order_relaxed)) {
+        void *slab = mmap(nullptr, HUGE_SLAB_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED) {
+            size = HUGE_SLAB_SIZE;
+            return slab;
+        }
+    }
+    void *slab = mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    size = SLAB_SIZE;
+    return slab;
+}
+
+// Trivially destructible, so the lists stay usable for objects released during thread or program teardown
+thread_local FreeList lists[CLASSES];
+
+// Hands a thread's free objects to the depot when the thread exits
+struct DepotReturn {
+    ~DepotReturn() {
+        Depot &shared = depot();
+        std::lock_guard<std::mutex> guard(shared.lock);
+        for (size_t i = 0; i < CLASSES; i++) {
+            if (lists[i].head) {
+                shared.batches[i].push_back(lists[i]);
+                lists[i] = FreeList();
+            }
+        }
+    }
+};
+thread_local DepotReturn depotReturn;
+
+// Keep the batch most recently freed, still warm in cache, of a list that grew to two and pass the rest on
+void spill(size_t index) {
+    FreeList &list = lists[index];
+    size_t keep = batchSize(index);
+    FreeNode *last = list.head;
+    for (size_t i = 1; i < keep; i++) {
+        last = last->next;
+    }
+    FreeList batch{last->next, list.count - keep};
+    last->next = nullptr;
+    list.count = keep;
+    Depot &shared = depot();
+    std::lock_guard<std::mutex> guard(shared.lock);
+    shared.batches[index].push_back(batch);
+}
+
+void refill(size_t index) {
+    // Touching it registers its destructor for this thread
+    (void)&depotReturn;
+    FreeList &list = lists[index];
+    {
+        Depot &shared = depot();
+        std::lock_guard<std::mutex> guard(shared.lock);
+        if (!shared.batches[index].empty()) {
+            list = shared.batches[index].back();
+            shared.batches[index].pop_back();
+            return;
+        }
+    }
+    size_t size;
+    uint8_t *slab = static_cast<uint8_t *>(mapSlab(size));
+    slabCount.fetch_add(1, std::memory_order_relaxed);
+    slabBytes.fetch_add(size, std::memory_order_relaxed);
+    size_t objectSize = (index + 1) * GRANULARITY;
+    // Thread the slab back to front so objects are handed out in address order
+    for (size_t offset = (size / objectSize - 1) * objectSize;; offset -= objectSize) {
+        FreeNode *node = reinterpret_cast<FreeNode *>(slab + offset);
+        node->next = list.head;
+        list.head = node;
+        list.count++;
+        if (offset == 0) {
+            break;
+        }
+    }
+}
+
+}
+
+void* allocate(size_t size) {
+    Metrics::increment(Counter::ALLOCATIONS);
+    if (size == 0 || size > MAX_SIZE) {
+        return ::operator new(size);
+    }
+    size_t index = classOf(size);
+    FreeList &list = lists[index];
+    if (!list.head) {
+        refill(index);
+    }
+    FreeNode *node = list.head;
+    list.head = node->next;
+    list.count--;
+    return node;
+}
+
+void deallocate(void *pointer, size_t size) {
+    if (!pointer) {
+        return;
+    }
+    if (size == 0 || size > MAX_SIZE) {
+        ::operator delete(pointer);
+        return;
+    }
+    size_t index = classOf(size);
+    FreeList &list = lists[index];
+    FreeNode *node = static_cast<FreeNode *>(pointer);
+    node->next = list.head;
+    list.head = node;
+    if (++list.count >= 2 * batchSize(index)) {
+        spill(index);
+    }
+}
+
+void setHugePages(bool enabled) {
+    hugePages.store(enabled, std::memory_order_relaxed);
+}
+
+Stats getStats() {
+    return Stats{slabCount.load(std::memory_order_relaxed), slabBytes.load(std::memory_order_relaxed)};
+}
+
+}
+}
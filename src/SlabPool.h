@@ -0,0 +1,76 @@
+#ifndef SLAB_POOL_H
+#define SLAB_POOL_H
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <memory>
+
+namespace MQTT {
+
+// Allocator for the small fixed-size objects the hot path churns through:
+// messages, packets, sessions and inbox nodes.
+//
+// Sizes are rounded up to a 16-byte class. Each thread keeps a free list per
+// class, so allocation and release are a pointer pop/push with no locking
+// and no call into malloc. Free lists are refilled by carving a fresh slab
+// (64 KiB, or a 2 MiB huge page when enabled and available). Objects may be
+// released on a different thread than the one that allocated them; the
+// memory joins that thread's list. A list that grows past two batches (32 KiB
+// of objects each) passes one batch to a shared depot, as do the lists of a
+// thread that exits, and threads refill from the depot a batch at a time
+// before carving new slabs. So memory one thread keeps freeing for another
+// flows back to it. Slabs are never returned to the system.
+namespace SlabPool {
+
+constexpr size_t GRANULARITY = 16;
+constexpr size_t MAX_SIZE = 1024;
+constexpr size_t SLAB_SIZE = 64 * 1024;
+constexpr size_t HUGE_SLAB_SIZE = 2 * 1024 * 1024;
+
+// Larger sizes fall through to operator new
+void* allocate(size_t size);
+void deallocate(void* pointer, size_t size);
+
+// Back new slabs with huge pages when the system has them reserved
+void setHugePages(bool enabled);
+
+struct Stats {
+    uint64_t slabs;
+    uint64_t slabBytes;
+};
+Stats getStats();
+
+}
+
+// Standard allocator over SlabPool, for std::allocate_shared and containers
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() noexcept = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(SlabPool::allocate(n * sizeof(T)));
+    }
+    void deallocate(T* pointer, size_t n) noexcept {
+        SlabPool::deallocate(pointer, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
+
+template <typename T, typename... Args>
+std::shared_ptr<T> makePooled(Args&&... args) {
+    return std::allocate_shared<T>(PoolAllocator<T>(), std::forward<Args>(args)...);
+}
+
+}
+
+#endif // SLAB_POOL_H
@@ -0,0 +1,49 @@
+#include "SpaceSaving.h"
+#include <algorithm>
+
+namespace MQTT {
+
+void SpaceSaving::offer(std::string_view key, uint64_t count, uint64_t bytes) {
+    if (capacity == 0) {
+        return;
+    }
+    auto it = slots.find(std::string(key));
+    if (it != slots.end()) {
+        entries[it->second].count += count;
+        entries[it->second].bytes += bytes;
+        return;
+    }
+    if (entries.size() < capacity) {
+        slots.emplace(key, entries.size());
+        entries.push_back(Entry{std::string(key), count, 0, bytes});
+        return;
+    }
+    // Capacities are small, so finding the minimum by a scan beats keeping the entries ordered
+    size_t minimum = 0;
+    for (size_t i = 1; i < entries.size(); i++) {
+        if (entries[i].count < entries[minimum].count) {
+            minimum = i;
+        }
+    }
+    Entry &entry = entries[minimum];
+    slots.erase(entry.key);
+    slots.emplace(key, minimum);
+    entry.key = std::string(key);
+    entry.error = entry.count;
+    entry.count += count;
+    entry.bytes = bytes;
+}
+
+std::vector<SpaceSaving::Entry> SpaceSaving::top() const {
+    std::vector<Entry> sorted = entries;
+    std::sort(sorted.begin(), sorted.end(), [](const Entry &a, const Entry &b) { return a.count > b.count; });
+    return sorted;
+}
+
+void SpaceSaving::reset(size_t capacity) {
+    this->capacity = capacity;
+    entries.clear();
+    slots.clear();
+}
+
+}
@@ -0,0 +1,48 @@
+#ifndef SPACE_SAVING_H
+#define SPACE_SAVING_H
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace MQTT {
+
+// Heavy hitters of a stream of keys in bounded memory (Metwally et al., "space-saving").
+//
+// At most capacity keys are counted. A key that is not counted takes the slot
+// of the one with the lowest count and inherits that count as its error, so a
+// count never underestimates and overestimates by at most error. Every key
+// whose true count exceeds total / capacity is guaranteed to be kept.
+class SpaceSaving {
+public:
+    struct Entry {
+        std::string key;
+        uint64_t count = 0;
+        // How much of count the key may not have earned
+        uint64_t error = 0;
+        // Bytes counted since the key took its slot
+        uint64_t bytes = 0;
+    };
+
+    explicit SpaceSaving(size_t capacity) : capacity(capacity) {}
+
+    void offer(std::string_view key, uint64_t count = 1, uint64_t bytes = 0);
+    // Heaviest first
+    std::vector<Entry> top() const;
+    size_t size() const { return entries.size(); }
+    size_t getCapacity() const { return capacity; }
+    // Forget every key and count up to capacity from now on
+    void reset(size_t capacity);
+
+private:
+    size_t capacity;
+    std::vector<Entry> entries;
+    std::unordered_map<std::string, size_t> slots;
+};
+
+}
+
+#endif // SPACE_SAVING_H
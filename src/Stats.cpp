@@ -0,0 +1,195 @@
+#include "Stats.h"
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+
+namespace MQTT {
+
+std::atomic<size_t> Stats::topicLevels{2};
+
+namespace {
+
+struct Registered {
+    ConnectionStats *stats;
+    std::string clientId;
+};
+
+struct Registry {
+    std::mutex lock;
+    std::vector<Registered> connections;
+};
+
+struct HeavyHitters {
+    std::mutex lock;
+    SpaceSaving clients{32};
+    SpaceSaving prefixes{32};
+};
+
+Registry& registry() {
+    // Never destroyed: connection threads may still exit after static destruction began
+    static Registry* instance = new Registry();
+    return *instance;
+}
+
+HeavyHitters& heavyHitters() {
+    static HeavyHitters* instance = new HeavyHitters();
+    return *instance;
+}
+
+}
+
+void PublishBatch::add(std::string_view topic, size_t size) {
+    std::string_view prefix = Stats::prefixOf(topic);
+    auto it = std::find_if(prefixes.begin(), prefixes.end(), [prefix](const Prefix &entry) { return entry.prefix == prefix; });
+    if (it == prefixes.end()) {
+        if (prefixes.size() == MAX_PREFIXES) {
+            flush();
+        }
+        it = prefixes.insert(prefixes.end(), Prefix{std::string(prefix), 0, 0});
+    }
+    it->count++;
+    it->bytes += size;
+    count++;
+    bytes += size;
+}
+
+void PublishBatch::flush() {
+    if (count == 0) {
+        return;
+    }
+    Stats::offer(*this);
+    prefixes.clear();
+    count = 0;
+    bytes = 0;
+}
+
+void Stats::configure(size_t levels, size_t capacity) {
+    topicLevels.store(std::max<size_t>(levels, 1), std::memory_order_relaxed);
+    HeavyHitters &tracked = heavyHitters();
+    std::lock_guard<std::mutex> guard(tracked.lock);
+    tracked.clients.reset(capacity);
+    tracked.prefixes.reset(capacity);
+}
+
+std::string_view Stats::prefixOf(std::string_view topic) {
+    size_t levels = topicLevels.load(std::memory_order_relaxed);
+    size_t end = 0;
+    while (levels-- > 0) {
+        end = topic.find('/', end);
+        if (end == std::string_view::npos) {
+            return topic;
+        }
+        end++;
+    }
+    return topic.substr(0, end - 1);
+}
+
+void Stats::offer(const PublishBatch &batch) {
+    HeavyHitters &tracked = heavyHitters();
+    std::lock_guard<std::mutex> guard(tracked.lock);
+    tracked.clients.offer(batch.clientId, batch.count, batch.bytes);
+    for (const PublishBatch::Prefix &prefix : batch.prefixes) {
+        tracked.prefixes.offer(prefix.prefix, prefix.count, prefix.bytes);
+    }
+}
+
+void Stats::attach(ConnectionStats *stats) {
+    Registry &connections = registry();
+    std::lock_guard<std::mutex> guard(connections.lock);
+    connections.connections.push_back(Registered{stats, std::string()});
+}
+
+void Stats::detach(ConnectionStats *stats) {
+    Registry &connections = registry();
+    std::lock_guard<std::mutex> guard(connections.lock);
+    auto &list = connections.connections;
+    list.erase(std::remove_if(list.begin(), list.end(),
+                              [stats](const Registered &registered) { return registered.stats == stats; }),
+               list.end());
+}
+
+void Stats::setClientId(ConnectionStats *stats, const std::string &clientId) {
+    Registry &connections = registry();
+    std::lock_guard<std::mutex> guard(connections.lock);
+    for (Registered &registered : connections.connections) {
+        if (registered.stats == stats) {
+            registered.clientId = clientId;
+        }
+    }
+}
+
+std::vector<Stats::Connection> Stats::getConnections() {
+    std::vector<Connection> result;
+    {
+        Registry &connections = registry();
+        std::lock_guard<std::mutex> guard(connections.lock);
+        for (const Registered &registered : connections.connections) {
+            const ConnectionStats &stats = *registered.stats;
+            result.push_back(Connection{registered.clientId,
+                                        stats.messagesIn.load(std::memory_order_relaxed),
+                                        stats.bytesIn.load(std::memory_order_relaxed),
+                                        stats.messagesOut.load(std::memory_order_relaxed),
+                                        stats.bytesOut.load(std::memory_order_relaxed),
+                                        stats.inflight.load(std::memory_order_relaxed),
+                                        stats.queued.load(std::memory_order_relaxed),
+                                        stats.lastActivity.load(std::memory_order_relaxed)});
+        }
+    }
+    std::sort(result.begin(), result.end(),
+              [](const Connection &a, const Connection &b) { return a.messagesIn > b.messagesIn; });
+    return result;
+}
+
+std::vector<SpaceSaving::Entry> Stats::getTopClients() {
+    HeavyHitters &tracked = heavyHitters();
+    std::lock_guard<std::mutex> guard(tracked.lock);
+    return tracked.clients.top();
+}
+
+std::vector<SpaceSaving::Entry> Stats::getTopPrefixes() {
+    HeavyHitters &tracked = heavyHitters();
+    std::lock_guard<std::mutex> guard(tracked.lock);
+    return tracked.prefixes.top();
+}
+
+std::string Stats::formatConnections(uint64_t nowMs) {
+    std::string text;
+    for (const Connection &connection : getConnections()) {
+        char line[256];
+        uint64_t idle = connection.lastActivity && nowMs > connection.lastActivity ? nowMs - connection.lastActivity : 0;
+        snprintf(line, sizeof(line),
+                 "messages_in=%llu bytes_in=%llu messages_out=%llu bytes_out=%llu inflight=%u queued=%u idle_ms=%llu",
+                 static_cast<unsigned long long>(connection.messagesIn),
+                 static_cast<unsigned long long>(connection.bytesIn),
+                 static_cast<unsigned long long>(connection.messagesOut),
+                 static_cast<unsigned long long>(connection.bytesOut), connection.inflight, connection.queued,
+                 static_cast<unsigned long long>(idle));
+        text += line;
+        // Last, as client ids may contain spaces
+        text += " client=";
+        text += connection.clientId;
+        text += '\n';
+    }
+    return text;
+}
+
+static void formatEntries(std::string &text, const char *kind, const std::vector<SpaceSaving::Entry> &entries) {
+    for (const SpaceSaving::Entry &entry : entries) {
+        char line[128];
+        snprintf(line, sizeof(line), "%s count=%llu error=%llu bytes=%llu ", kind,
+                 static_cast<unsigned long long>(entry.count), static_cast<unsigned long long>(entry.error),
+                 static_cast<unsigned long long>(entry.bytes));
+        text += line;
+        text += entry.key;
+        text += '\n';
+    }
+}
+
+std::string Stats::formatTop() {
+    std::string text;
+    formatEntries(text, "client", getTopClients());
+    formatEntries(text, "topic", getTopPrefixes());
+    return text;
+}
+
+}
@@ -0,0 +1,94 @@
+#ifndef STATS_H
+#define STATS_H
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "SpaceSaving.h"
+
+namespace MQTT {
+
+// Counters of one connection. Only the connection's thread writes them, so an
+// update is a relaxed load and store; GET /connections reads them from the metrics thread.
+struct ConnectionStats {
+    std::atomic<uint64_t> messagesIn{0};
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> messagesOut{0};
+    std::atomic<uint64_t> bytesOut{0};
+    std::atomic<uint32_t> inflight{0};
+    std::atomic<uint32_t> queued{0};
+    // Milliseconds since the epoch of the last read from the client
+    std::atomic<uint64_t> lastActivity{0};
+
+    static void add(std::atomic<uint64_t> &value, uint64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+};
+
+// Publishes one connection read in a batch, handed to the heavy-hitter trackers together
+class PublishBatch {
+public:
+    static constexpr size_t MAX_PREFIXES = 16;
+
+    void setClientId(const std::string &clientId) { this->clientId = clientId; }
+    void add(std::string_view topic, size_t bytes);
+    void flush();
+
+private:
+    friend class Stats;
+    struct Prefix {
+        std::string prefix;
+        uint64_t count;
+        uint64_t bytes;
+    };
+    std::string clientId;
+    std::vector<Prefix> prefixes;
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+// Who is sending what: live per-connection counters, and the clients and topic
+// prefixes publishing the most since the broker started.
+//
+// The heavy hitters are two space-saving summaries shared by every connection,
+// so their memory stays bounded however many clients and topics there are. A
+// connection hands over what it read in one batch under a single lock.
+class Stats {
+public:
+    // How many topic levels make a prefix, and how many clients and prefixes are tracked
+    static void configure(size_t topicLevels, size_t capacity);
+    // The first levels of topic, by which publishes are counted
+    static std::string_view prefixOf(std::string_view topic);
+
+    static void attach(ConnectionStats *stats);
+    static void detach(ConnectionStats *stats);
+    static void setClientId(ConnectionStats *stats, const std::string &clientId);
+
+    struct Connection {
+        std::string clientId;
+        uint64_t messagesIn, bytesIn, messagesOut, bytesOut;
+        uint32_t inflight, queued;
+        uint64_t lastActivity;
+    };
+    // Connections publishing the most first
+    static std::vector<Connection> getConnections();
+    static std::vector<SpaceSaving::Entry> getTopClients();
+    static std::vector<SpaceSaving::Entry> getTopPrefixes();
+
+    // One line per connection, for GET /connections on the metrics port
+    static std::string formatConnections(uint64_t nowMs);
+    // One line per heavy hitter, for GET /top
+    static std::string formatTop();
+
+private:
+    friend class PublishBatch;
+    static void offer(const PublishBatch &batch);
+    static std::atomic<size_t> topicLevels;
+};
+
+}
+
+#endif // STATS_H
@@ -0,0 +1,100 @@
+#include "SysTopics.h"
+#include "Broker.h"
+#include "Metrics.h"
+#include "SlabPool.h"
+#include <cstdio>
+
+namespace MQTT {
+
+namespace {
+
+std::string formatRate(uint64_t count, uint64_t elapsedMs) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.2f", double(count) * 1000.0 / double(elapsedMs));
+    return text;
+}
+
+// Lower bound of the bucket holding the given quantile, 0 if nothing was recorded
+uint64_t quantile(const std::vector<uint64_t> &buckets, uint64_t total, double q) {
+    uint64_t rank = static_cast<uint64_t>(q * double(total - 1)) + 1;
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        cumulative += buckets[i];
+        if (cumulative >= rank) {
+            return Metrics::bucketLowerBound(static_cast<int>(i));
+        }
+    }
+    return 0;
+}
+
+}
+
+SysTopics::SysTopics(Broker* broker)
+    : broker(broker), startedAt(MessageBlock::currentTime()), lastAt(startedAt),
+      lastLoop(Metrics::BUCKETS, 0) {}
+
+size_t SysTopics::publish(uint64_t nowMs) {
+    std::vector<std::pair<std::string, std::string>> values = {
+        {"clients/connected", std::to_string(Metrics::getGauge(Gauge::CONNECTIONS))},
+        {"sessions", std::to_string(broker->getSessionCount())},
+        {"subscriptions/count", std::to_string(broker->getSubscriptionCount())},
+        {"retained/count", std::to_string(broker->getRetainedCount())},
+        {"memory/slab_bytes", std::to_string(SlabPool::getStats().slabBytes)},
+        {"memory/offline_sessions", std::to_string(broker->getOfflineMemoryBytes())},
+        {"uptime", std::to_string((nowMs - startedAt) / 1000)},
+    };
+    for (int i = 0; i < static_cast<int>(MemoryTag::COUNT); i++) {
+        MemoryTag tag = static_cast<MemoryTag>(i);
+        values.emplace_back(std::string("memory/") + Metrics::memoryTagName(tag), std::to_string(Metrics::getMemory(tag)));
+    }
+
+    uint64_t received = Metrics::getPacketsReceived(PacketType::PUBLISH);
+    uint64_t sent = Metrics::getPacketsSent(PacketType::PUBLISH);
+    uint64_t bytesReceived = Metrics::getCounter(Counter::BYTES_RECEIVED);
+    uint64_t bytesSent = Metrics::getCounter(Counter::BYTES_SENT);
+    values.emplace_back("messages/received", std::to_string(received));
+    values.emplace_back("messages/sent", std::to_string(sent));
+    if (nowMs > lastAt) {
+        uint64_t elapsed = nowMs - lastAt;
+        values.emplace_back("load/messages/received", formatRate(received - lastReceived, elapsed));
+        values.emplace_back("load/messages/sent", formatRate(sent - lastSent, elapsed));
+        values.emplace_back("load/bytes/received", formatRate(bytesReceived - lastBytesReceived, elapsed));
+        values.emplace_back("load/bytes/sent", formatRate(bytesSent - lastBytesSent, elapsed));
+        lastAt = nowMs;
+        lastReceived = received;
+        lastSent = sent;
+        lastBytesReceived = bytesReceived;
+        lastBytesSent = bytesSent;
+    }
+
+    // Latency of the connection threads' poll loops over the interval, in microseconds
+    std::vector<uint64_t> loop = Metrics::getHistogram(Histogram::LOOP_NANOSECONDS);
+    uint64_t wakeups = 0;
+    for (size_t i = 0; i < loop.size(); i++) {
+        uint64_t count = loop[i];
+        loop[i] -= lastLoop[i];
+        lastLoop[i] = count;
+        wakeups += loop[i];
+    }
+    if (wakeups > 0) {
+        values.emplace_back("loop/latency/p50", std::to_string(quantile(loop, wakeups, 0.5) / 1000));
+        values.emplace_back("loop/latency/p99", std::to_string(quantile(loop, wakeups, 0.99) / 1000));
+    }
+
+    std::vector<MessageRef> batch;
+    for (auto &[name, value] : values) {
+        std::string topic = "$SYS/broker/" + name;
+        auto it = published.find(topic);
+        if (it != published.end() && it->second == value) {
+            continue;
+        }
+        batch.push_back(MessageRef::create(Message(topic, value, QoS::QOS_0, true)));
+        published[topic] = std::move(value);
+    }
+    if (!batch.empty()) {
+        broker->publish(batch);
+    }
+    return batch.size();
+}
+
+}
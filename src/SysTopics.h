@@ -0,0 +1,40 @@
+#ifndef SYS_TOPICS_H
+#define SYS_TOPICS_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+namespace MQTT {
+class Broker;
+
+// Broker statistics published as retained messages under $SYS/broker/.
+//
+// Each call gathers every statistic but only publishes the ones whose value
+// changed since it was last published, so idle brokers send next to nothing.
+// Rates and loop latency cover the time since the previous call.
+class SysTopics {
+public:
+    explicit SysTopics(Broker* broker);
+    // Publish the statistics that changed as one batch; returns how many went out
+    size_t publish(uint64_t nowMs);
+
+private:
+    Broker* broker;
+    uint64_t startedAt;
+    // Readings of the previous call, for the rates and the latency of the interval
+    uint64_t lastAt;
+    uint64_t lastReceived = 0;
+    uint64_t lastSent = 0;
+    uint64_t lastBytesReceived = 0;
+    uint64_t lastBytesSent = 0;
+    std::vector<uint64_t> lastLoop;
+    // topic -> payload last published
+    std::unordered_map<std::string, std::string> published;
+};
+
+}
+
+#endif // SYS_TOPICS_H
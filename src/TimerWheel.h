@@ -0,0 +1,93 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace MQTT {
+
+// Hashed timer wheel: a deadline lands in slot (deadline / tickMs) % slots, so
+// scheduling is O(1) however many timers are pending, and advancing only looks
+// at the slots whose ticks elapsed. Deadlines more than one revolution away
+// stay in their slot until the wheel comes round to them again.
+//
+// Like ExpiryIndex, entries are never cancelled: a key whose deadline moves is
+// scheduled again and the visitor ignores the stale entry. Not synchronized.
+template <typename Key>
+class TimerWheel {
+public:
+    explicit TimerWheel(size_t slotCount = 4096, uint64_t tickMs = 1000)
+        : slots(slotCount), tickMs(tickMs) {}
+
+    void schedule(uint64_t deadlineMs, Key key) {
+        uint64_t tick = deadlineMs / tickMs;
+        // Already due: the next advance visits the current slot
+        if (started && tick < currentTick) {
+            tick = currentTick;
+        }
+        slots[tick % slots.size()].push_back(Item{deadlineMs, std::move(key)});
+        count++;
+    }
+
+    // Remove every entry due at nowMs and visit it; returns how many were visited
+    template <typename Visitor>
+    size_t advance(uint64_t nowMs, Visitor visit) {
+        uint64_t nowTick = nowMs / tickMs;
+        size_t visited = 0;
+        if (!started || nowTick >= currentTick + slots.size()) {
+            // First advance, or a whole revolution elapsed: every slot is due once
+            for (auto &slot : slots) {
+                visited += expireSlot(slot, nowMs, visit);
+            }
+        } else {
+            // The current slot is visited again, as part of its entries may be due later in the tick
+            for (uint64_t tick = currentTick; tick <= nowTick; tick++) {
+                visited += expireSlot(slots[tick % slots.size()], nowMs, visit);
+            }
+        }
+        if (!started || nowTick > currentTick) {
+            currentTick = nowTick;
+            started = true;
+        }
+        return visited;
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+private:
+    struct Item {
+        uint64_t deadlineMs;
+        Key key;
+    };
+
+    std::vector<std::vector<Item>> slots;
+    uint64_t tickMs;
+    uint64_t currentTick = 0;
+    bool started = false;
+    size_t count = 0;
+
+    template <typename Visitor>
+    size_t expireSlot(std::vector<Item> &slot, uint64_t nowMs, Visitor &visit) {
+        size_t visited = 0;
+        for (size_t i = 0; i < slot.size();) {
+            if (slot[i].deadlineMs > nowMs) {
+                i++;
+                continue;
+            }
+            Item item = std::move(slot[i]);
+            slot[i] = std::move(slot.back());
+            slot.pop_back();
+            count--;
+            visit(item.deadlineMs, item.key);
+            visited++;
+        }
+        return visited;
+    }
+};
+
+}
+
+#endif // TIMER_WHEEL_H
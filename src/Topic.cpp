@@ -6,14 +6,26 @@ namespace MQTT {
 // Split an MQTT topic into a vector of topic levels
 std::vector<std::string> Topic::split(const std::string &topic) {
     std::vector<std::string> result;
-    std::string level;
-    std::istringstream topicStream(topic);
+    split(topic, result);
+    return result;
+}
 
-    while (std::getline(topicStream, level, '/')) {
-        result.push_back(level);
+void Topic::split(const std::string &topic, std::vector<std::string> &levels) {
+    // Assigning into the existing strings reuses their buffers when levels is kept across calls
+    size_t count = 0;
+    size_t start = 0;
+    while (start < topic.size()) {
+        size_t end = topic.find('/', start);
+        if (end == std::string::npos) {
+            end = topic.size();
+        }
+        if (count == levels.size()) {
+            levels.emplace_back();
+        }
+        levels[count++].assign(topic, start, end - start);
+        start = end + 1;
     }
-
-    return result;
+    levels.resize(count);
 }
 
 // Join a vector of topic levels into a single MQTT topic
@@ -78,7 +90,7 @@ bool Topic::match(const std::string &topic, const std::string &topicFilter) {
 
 bool Topic::isShared(const std::string& topic) {
     // Check if the topic starts with "$share/"
-    if (topic.length() < 7) {
+    if (topic.length() <= 7) {
         return false;
     }
     return (topic.substr(0, 7) == "$share/");
@@ -86,7 +98,7 @@ bool Topic::isShared(const std::string& topic) {
 
 std::pair<std::string, std::string> Topic::splitShared(const std::string& topic) {
     // Check if the topic is a shared subscription
-    if (!isShared(topic)) {
+    if (topic.compare(0, 7, "$share/") != 0) {
         return {"", topic};
     }
 
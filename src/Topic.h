@@ -10,6 +10,8 @@ namespace Topic {
 
 // Split an MQTT topic into a vector of topic levels
 std::vector<std::string> split(const std::string& topic);
+// Same, into levels, whose strings are reused
+void split(const std::string& topic, std::vector<std::string>& levels);
 
 // Join a vector of topic levels into a single MQTT topic
 std::string join(const std::vector<std::string>& topicLevels);
@@ -0,0 +1,116 @@
+#include "Trace.h"
+#include "Metrics.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+
+namespace MQTT {
+
+thread_local uint32_t Trace::countdown = 0;
+thread_local const MessageBlock* Trace::enqueuedMessage = nullptr;
+thread_local uint64_t Trace::enqueuedStamp = 0;
+
+namespace {
+
+constexpr int STAGES = static_cast<int>(TracePoint::COUNT) - 1;
+
+// Stage i runs from point i to point i + 1
+const char* stageNames[STAGES] = {"parse", "publish", "match", "fanout", "queue", "encode", "write"};
+
+uint64_t totalOf(const MessageTrace &trace) {
+    return trace[TracePoint::WRITTEN] - trace[TracePoint::RECEIVED];
+}
+
+// Only sampled deliveries get here, so a lock is cheap enough
+struct Slowest {
+    std::mutex lock;
+    size_t capacity = 0;
+    // Min-heap on the total, so the fastest of the kept ones is the one replaced
+    std::vector<Trace::Slow> heap;
+};
+
+Slowest& slowest() {
+    static Slowest* instance = new Slowest();
+    return *instance;
+}
+
+bool fasterFirst(const Trace::Slow &a, const Trace::Slow &b) {
+    return totalOf(a.trace) > totalOf(b.trace);
+}
+
+}
+
+uint64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::complete(std::string_view topic, const MessageTrace &trace) {
+    for (uint64_t stamp : trace.stamps) {
+        if (stamp == 0) {
+            return;
+        }
+    }
+    for (int i = 0; i < STAGES; i++) {
+        uint64_t from = trace.stamps[i];
+        uint64_t to = trace.stamps[i + 1];
+        Metrics::record(static_cast<Histogram>(static_cast<int>(Histogram::TRACE_PARSE_NANOSECONDS) + i),
+                        to > from ? to - from : 0);
+    }
+    uint64_t total = totalOf(trace);
+    Metrics::record(Histogram::TRACE_TOTAL_NANOSECONDS, total);
+
+    Slowest &kept = slowest();
+    std::lock_guard<std::mutex> guard(kept.lock);
+    if (kept.capacity == 0) {
+        return;
+    }
+    if (kept.heap.size() == kept.capacity) {
+        if (totalOf(kept.heap.front().trace) >= total) {
+            return;
+        }
+        std::pop_heap(kept.heap.begin(), kept.heap.end(), fasterFirst);
+        kept.heap.pop_back();
+    }
+    kept.heap.push_back(Slow{std::string(topic), trace});
+    std::push_heap(kept.heap.begin(), kept.heap.end(), fasterFirst);
+}
+
+void Trace::setSlowestCapacity(size_t capacity) {
+    Slowest &kept = slowest();
+    std::lock_guard<std::mutex> guard(kept.lock);
+    kept.capacity = capacity;
+    kept.heap.clear();
+}
+
+std::vector<Trace::Slow> Trace::getSlowest() {
+    Slowest &kept = slowest();
+    std::vector<Slow> traces;
+    {
+        std::lock_guard<std::mutex> guard(kept.lock);
+        traces = kept.heap;
+    }
+    std::sort(traces.begin(), traces.end(), fasterFirst);
+    return traces;
+}
+
+std::string Trace::formatSlowest() {
+    std::string text;
+    for (const Slow &slow : getSlowest()) {
+        char line[64];
+        snprintf(line, sizeof(line), "total=%.1fus", totalOf(slow.trace) / 1000.0);
+        text += line;
+        for (int i = 0; i < STAGES; i++) {
+            snprintf(line, sizeof(line), " %s=%.1fus", stageNames[i],
+                     static_cast<int64_t>(slow.trace.stamps[i + 1] - slow.trace.stamps[i]) / 1000.0);
+            text += line;
+        }
+        text += " topic=";
+        text += slow.topic;
+        text += '\n';
+    }
+    return text;
+}
+
+}
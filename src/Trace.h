@@ -0,0 +1,90 @@
+#ifndef TRACE_H
+#define TRACE_H
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace MQTT {
+class MessageBlock;
+
+// Points a sampled publish is stamped at on its way from the publisher's socket to a subscriber's
+enum class TracePoint : uint8_t {
+    // The publisher's connection woke up to read it
+    RECEIVED,
+    PARSED,
+    MATCH_START,
+    MATCH_END,
+    // Handed to a subscriber's session, and picked up by that subscriber's connection thread
+    ENQUEUED,
+    DEQUEUED,
+    ENCODED,
+    WRITTEN,
+    COUNT
+};
+
+// Steady-clock nanoseconds of each point; the ones up to MATCH_END are shared by every delivery
+struct MessageTrace {
+    uint64_t stamps[static_cast<int>(TracePoint::COUNT)] = {};
+
+    uint64_t& operator[](TracePoint point) { return stamps[static_cast<int>(point)]; }
+    uint64_t operator[](TracePoint point) const { return stamps[static_cast<int>(point)]; }
+};
+
+// Sampled publish-to-deliver tracing.
+//
+// The publisher's connection picks one publish in every n to trace; its
+// stamps travel with the message block, so a publish that is not sampled
+// costs a countdown on its connection thread and a null check at each stage.
+// Each delivery of a sampled publish that is written out is recorded as the
+// time spent between consecutive points, into one histogram per stage, and
+// the slowest of them are kept whole for inspection.
+class Trace {
+public:
+    static uint64_t now();
+    // True for one call in every rate on the calling thread; never when rate is 0
+    static bool sample(uint32_t rate) {
+        if (rate == 0) {
+            return false;
+        }
+        if (countdown == 0 || countdown > rate) {
+            countdown = rate;
+        }
+        return --countdown == 0;
+    }
+
+    // When the delivery of message being dispatched on this thread was enqueued; cleared with 0
+    static void setEnqueued(const MessageBlock* message, uint64_t enqueuedAt) {
+        enqueuedMessage = message;
+        enqueuedStamp = enqueuedAt;
+    }
+    static uint64_t getEnqueued(const MessageBlock* message) {
+        return message == enqueuedMessage ? enqueuedStamp : 0;
+    }
+
+    // Record a delivery written out; ones that waited in an offline queue are left out
+    static void complete(std::string_view topic, const MessageTrace &trace);
+
+    struct Slow {
+        std::string topic;
+        MessageTrace trace;
+    };
+    // How many of the slowest deliveries are kept; 0 keeps none
+    static void setSlowestCapacity(size_t capacity);
+    // Slowest first
+    static std::vector<Slow> getSlowest();
+    // One line per slow delivery with the time spent in each stage
+    static std::string formatSlowest();
+
+private:
+    static thread_local uint32_t countdown;
+    static thread_local const MessageBlock* enqueuedMessage;
+    static thread_local uint64_t enqueuedStamp;
+};
+
+}
+
+#endif // TRACE_H
@@ -1,58 +1,144 @@
 #include "Trie.h"
 #include "Topic.h"
 #include <sstream>
-#include <functional>
+#include <numeric>
+#include <algorithm>
 
 namespace MQTT {
 
+Trie::TrieNode::~TrieNode()
+{
+    int64_t bytes = sizeof(TrieNode) + (topicFilter ? heapBytes(*topicFilter) : 0);
+    for (const auto &child : children) {
+        bytes += heapBytes(child.first);
+    }
+    Metrics::charge(MemoryTag::TRIE, -bytes);
+}
+
+void Trie::TrieNode::setTopicFilter(std::optional<std::string> filter)
+{
+    int64_t delta = (filter ? heapBytes(*filter) : 0) - (topicFilter ? heapBytes(*topicFilter) : 0);
+    topicFilter = std::move(filter);
+    Metrics::charge(MemoryTag::TRIE, delta);
+}
+
 void Trie::insert(const std::string &topicFilter)
 {
     TrieNode *current = root.get();
     auto levels = Topic::split(topicFilter);
     for (const auto &level : levels) {
-        if (current->children.find(level) == current->children.end()) {
-            current->children[level] = std::make_unique<TrieNode>();
+        auto it = current->children.find(level);
+        if (it == current->children.end()) {
+            it = current->children.emplace(level, std::make_unique<TrieNode>()).first;
+            Metrics::charge(MemoryTag::TRIE, heapBytes(it->first));
         }
-        current = current->children[level].get();
+        current = it->second.get();
     }
-    current->topicFilter = topicFilter;
+    current->setTopicFilter(topicFilter);
 }
 
 std::vector<std::string> Trie::match(const std::string &topic)
 {
     std::vector<std::string> matches;
-    std::vector<std::string> topicLevels = Topic::split(topic);
+    // Kept per thread so that splitting a topic allocates nothing once warmed up
+    thread_local std::vector<std::string> topicLevels;
+    Topic::split(topic, topicLevels);
+    match(root.get(), topicLevels, 0, matches);
+    return matches;
+}
+
+void Trie::match(TrieNode *node, const std::vector<std::string> &topicLevels, size_t level,
+                 std::vector<std::string> &matches)
+{
+    if (level == topicLevels.size()) {
+        if (node->topicFilter.has_value()) {
+            matches.push_back(node->topicFilter.value());
+        }
+        return;
+    }
+
+    // Check for exact match
+    auto it = node->children.find(topicLevels[level]);
+    if (it != node->children.end()) {
+        match(it->second.get(), topicLevels, level + 1, matches);
+    }
+
+    // Topics starting with '$' are not matched by wildcards at the first level, e.g. "#" misses "$SYS/..."
+    if (level == 0 && !topicLevels[0].empty() && topicLevels[0][0] == '$') {
+        return;
+    }
+
+    // Check for '+' wildcard
+    it = node->children.find("+");
+    if (it != node->children.end()) {
+        match(it->second.get(), topicLevels, level + 1, matches);
+    }
 
-    // Helper function to perform DFS on the trie
-    std::function<void(TrieNode *, size_t)> dfs = [&](TrieNode *node, size_t level) {
-        if (level == topicLevels.size()) {
+    // Check for '#' wildcard
+    it = node->children.find("#");
+    if (it != node->children.end()) {
+        matches.push_back(it->second->topicFilter.value());
+    }
+}
+
+std::vector<std::vector<std::string>> Trie::matchBatch(const std::vector<std::string> &topics)
+{
+    std::vector<std::vector<std::string>> matches(topics.size());
+    std::vector<std::vector<std::string>> topicLevels(topics.size());
+    for (size_t i = 0; i < topics.size(); i++) {
+        Topic::split(topics[i], topicLevels[i]);
+    }
+    // Sorted by levels, the topics reaching a node with the same next level sit next to each other
+    std::vector<uint32_t> order(topics.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return topicLevels[a] < topicLevels[b]; });
+    matchBatch(root.get(), topicLevels, 0, order.data(), order.data() + order.size(), matches);
+    return matches;
+}
+
+void Trie::matchBatch(TrieNode *node, const std::vector<std::vector<std::string>> &topicLevels, size_t level,
+                      const uint32_t *first, const uint32_t *last, std::vector<std::vector<std::string>> &matches)
+{
+    auto plus = node->children.find("+");
+    auto hash = node->children.find("#");
+    // Topics with more levels to go; those ending here are matched by the node itself
+    std::vector<uint32_t> deeper;
+    for (const uint32_t *topic = first; topic != last;) {
+        const auto &levels = topicLevels[*topic];
+        if (level == levels.size()) {
             if (node->topicFilter.has_value()) {
-                matches.push_back(node->topicFilter.value());
+                matches[*topic].push_back(node->topicFilter.value());
             }
-            return;
+            topic++;
+            continue;
         }
-
-        // Check for exact match
-        auto it = node->children.find(topicLevels[level]);
-        if (it != node->children.end()) {
-            dfs(it->second.get(), level + 1);
+        // The run of topics with the same level here shares one child lookup
+        const uint32_t *runEnd = topic + 1;
+        while (runEnd != last && topicLevels[*runEnd].size() > level && topicLevels[*runEnd][level] == levels[level]) {
+            runEnd++;
         }
-
-        // Check for '+' wildcard
-        it = node->children.find("+");
+        auto it = node->children.find(levels[level]);
         if (it != node->children.end()) {
-            dfs(it->second.get(), level + 1);
+            matchBatch(it->second.get(), topicLevels, level + 1, topic, runEnd, matches);
         }
-
-        // Check for '#' wildcard
-        it = node->children.find("#");
-        if (it != node->children.end()) {
-            matches.push_back(it->second->topicFilter.value());
+        // As in match(), root wildcards skip topics starting with '$'
+        if (level == 0 && !levels[0].empty() && levels[0][0] == '$') {
+            topic = runEnd;
+            continue;
         }
-    };
-
-    dfs(root.get(), 0);
-    return matches;
+        for (const uint32_t *deep = topic; deep != runEnd; deep++) {
+            if (hash != node->children.end()) {
+                matches[*deep].push_back(hash->second->topicFilter.value());
+            }
+            if (plus != node->children.end()) {
+                deeper.push_back(*deep);
+            }
+        }
+        topic = runEnd;
+    }
+    if (!deeper.empty()) {
+        matchBatch(plus->second.get(), topicLevels, level + 1, deeper.data(), deeper.data() + deeper.size(), matches);
+    }
 }
 
 void Trie::remove(const std::string &topicFilter)
@@ -72,7 +158,7 @@ void Trie::remove(const std::string &topicFilter)
     }
 
     // Clear the topicFilter of the leaf node
-    current->topicFilter = std::nullopt;
+    current->setTopicFilter(std::nullopt);
 
     // Remove unnecessary nodes
     for (int i = path.size() - 1; i >= 0; --i) {
@@ -80,7 +166,9 @@ void Trie::remove(const std::string &topicFilter)
         const auto &level = levels[i];
 
         if (current->children.empty() && !current->topicFilter.has_value()) {
-            parent->children.erase(level);
+            auto it = parent->children.find(level);
+            Metrics::charge(MemoryTag::TRIE, -static_cast<int64_t>(heapBytes(it->first)));
+            parent->children.erase(it);
             current = parent;
         } else {
             break;
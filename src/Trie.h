@@ -6,26 +6,43 @@
 #include <unordered_map>
 #include <memory>
 #include <optional>
+#include <vector>
+#include <cstdint>
+#include "Memory.h"
 
 namespace MQTT { 
 
 class Trie {
 private:
     struct TrieNode {
-        std::unordered_map<std::string, std::unique_ptr<TrieNode>> children;
+        // Buckets and entries are charged to MemoryTag::TRIE by the allocator, the rest by the node
+        std::unordered_map<std::string, std::unique_ptr<TrieNode>, std::hash<std::string>, std::equal_to<std::string>,
+                           TaggedAllocator<std::pair<const std::string, std::unique_ptr<TrieNode>>, MemoryTag::TRIE>>
+            children;
         std::optional<std::string> topicFilter;
 
-        TrieNode() : topicFilter(std::nullopt) {}
+        TrieNode() : topicFilter(std::nullopt) { Metrics::charge(MemoryTag::TRIE, sizeof(TrieNode)); }
+        ~TrieNode();
+        void setTopicFilter(std::optional<std::string> filter);
     };
 
     std::unique_ptr<TrieNode> root;
 
+    void match(TrieNode* node, const std::vector<std::string>& topicLevels, size_t level,
+               std::vector<std::string>& matches);
+    // topics[first, last) are indexes into topicLevels of the topics that reached node
+    void matchBatch(TrieNode* node, const std::vector<std::vector<std::string>>& topicLevels, size_t level,
+                    const uint32_t* first, const uint32_t* last, std::vector<std::vector<std::string>>& matches);
+
 public:
     Trie() : root(std::make_unique<TrieNode>()) {}
 
     void insert(const std::string& topicFilter);
     void remove(const std::string& topicFilter);
     std::vector<std::string> match(const std::string& topic);
+    // Same as match() for each topic, in one walk: topics sharing a prefix look up each
+    // node on it once between them instead of once each
+    std::vector<std::vector<std::string>> matchBatch(const std::vector<std::string>& topics);
 };
 
 }
@@ -0,0 +1,581 @@
+#include "WriteAheadLog.h"
+#include "Crc32.h"
+#include "Log.h"
+#include <filesystem>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace MQTT {
+
+namespace {
+
+enum RecordType : uint8_t {
+    MESSAGE = 1,
+    DELIVER = 2,
+    ACK = 3,
+    RECEIVED = 4,
+    RELEASED = 5,
+    DISCARD = 6
+};
+
+struct WalRecordHeader {
+    uint32_t crc;
+    uint32_t length;
+    uint8_t type;
+    uint8_t qos;
+    uint8_t retain;
+    uint8_t reserved;
+    uint16_t packetId;
+    uint16_t clientIdLength;
+    uint64_t messageId;
+    uint16_t topicLength;
+    uint16_t reserved2;
+    uint32_t reserved3;
+};
+static_assert(sizeof(WalRecordHeader) == 32, "WalRecordHeader must be packed");
+
+void writeAll(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = ::write(fd, data, length);
+        if (written < 0) {
+            throw std::runtime_error("Failed to write WAL segment: " + std::string(strerror(errno)));
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+void syncFile(int fd, const std::string &path) {
+    if (fdatasync(fd) != 0) {
+        throw std::runtime_error("Failed to sync " + path + ": " + std::string(strerror(errno)));
+    }
+}
+
+// Make a new segment file's directory entry as durable as the records written to it
+void syncDirectory(const std::string &directory) {
+    int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open WAL directory " + directory);
+    }
+    int result = fsync(fd);
+    close(fd);
+    if (result != 0) {
+        throw std::runtime_error("Failed to sync WAL directory " + directory);
+    }
+}
+
+bool decodeRecord(const uint8_t *data, uint64_t size, uint64_t offset, WalRecordHeader &header) {
+    if (offset + sizeof(WalRecordHeader) > size) {
+        return false;
+    }
+    std::memcpy(&header, data + offset, sizeof(WalRecordHeader));
+    if (offset + sizeof(WalRecordHeader) + header.length > size ||
+        header.clientIdLength + header.topicLength > header.length) {
+        return false;
+    }
+    const uint8_t *body = data + offset + sizeof(header.crc);
+    return crc32(body, sizeof(WalRecordHeader) - sizeof(header.crc) + header.length) == header.crc;
+}
+
+MessageRef decodeMessage(const WalRecordHeader &header, const uint8_t *body, uint64_t messageId) {
+    const char *clientId = reinterpret_cast<const char *>(body);
+    const char *topic = clientId + header.clientIdLength;
+    const uint8_t *payload = body + header.clientIdLength + header.topicLength;
+    size_t payloadLength = header.length - header.clientIdLength - header.topicLength;
+    return MessageRef::create(std::string_view(topic, header.topicLength), ByteView(payload, payloadLength),
+                              static_cast<QoS>(header.qos), header.retain != 0,
+                              std::string_view(clientId, header.clientIdLength), messageId);
+}
+
+}
+
+WriteAheadLog::WriteAheadLog(const std::string &directory, uint32_t commitIntervalUs, size_t commitBytes,
+                             uint64_t segmentSize)
+    : directory(directory), commitIntervalUs(commitIntervalUs), commitBytes(commitBytes), segmentSize(segmentSize) {
+    std::filesystem::create_directories(directory);
+    replay();
+    current = appendedLsn;
+    segments[current] = Segment{current, 0, 0};
+    durableLsn = appendedLsn;
+    committer = std::thread(&WriteAheadLog::run, this);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    commitCondition.notify_all();
+    committer.join();
+}
+
+std::string WriteAheadLog::segmentPath(uint64_t start) const {
+    char name[40];
+    std::snprintf(name, sizeof(name), "wal-%020llu.log", static_cast<unsigned long long>(start));
+    return directory + "/" + name;
+}
+
+void WriteAheadLog::replay() {
+    std::vector<uint64_t> starts;
+    for (const auto &entry : std::filesystem::directory_iterator(directory)) {
+        unsigned long long start;
+        if (std::sscanf(entry.path().filename().string().c_str(), "wal-%llu.log", &start) == 1) {
+            starts.push_back(start);
+        }
+    }
+    std::sort(starts.begin(), starts.end());
+
+    std::unordered_map<uint64_t, MessageRef> messages;
+    for (uint64_t start : starts) {
+        const std::string path = segmentPath(start);
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open WAL segment " + path);
+        }
+        std::vector<uint8_t> data(std::filesystem::file_size(path));
+        if (!data.empty() && pread(fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size())) {
+            close(fd);
+            throw std::runtime_error("Failed to read WAL segment " + path);
+        }
+
+        segments[start] = Segment{start, 0, 0};
+        uint64_t offset = 0;
+        WalRecordHeader header;
+        while (decodeRecord(data.data(), data.size(), offset, header)) {
+            const uint8_t *body = data.data() + offset + sizeof(WalRecordHeader);
+            std::string clientId(reinterpret_cast<const char *>(body), header.clientIdLength);
+            uint64_t lsn = start + offset;
+            switch (header.type) {
+            case MESSAGE:
+                messages[lsn + 1] = decodeMessage(header, body, lsn + 1);
+                break;
+            case DELIVER:
+                if (messages.count(header.messageId)) {
+                    ack(clientId, header.packetId);
+                    deliveries[clientId][header.packetId] = Delivery{header.messageId, start, static_cast<QoS>(header.qos)};
+                    pin(start);
+                    pin(segmentOf(header.messageId - 1));
+                }
+                break;
+            case ACK:
+                ack(clientId, header.packetId);
+                break;
+            case RECEIVED:
+                release(clientId, header.packetId);
+                receives[clientId][header.packetId] = start;
+                pin(start);
+                break;
+            case RELEASED:
+                release(clientId, header.packetId);
+                break;
+            case DISCARD:
+                discard(clientId);
+                break;
+            }
+            offset += sizeof(WalRecordHeader) + header.length;
+        }
+        // Drop a torn tail left by a crash in the middle of a write
+        if (offset < data.size() && ftruncate(fd, offset) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to truncate WAL segment " + path);
+        }
+        close(fd);
+        segments[start].size = offset;
+        appendedLsn = start + offset;
+    }
+
+    for (const auto &[clientId, inflight] : deliveries) {
+        for (const auto &[packetId, delivery] : inflight) {
+            recovered[clientId].inflight[packetId] = Inflight{messages[delivery.messageId], delivery.qos};
+        }
+    }
+    for (const auto &[clientId, packetIds] : receives) {
+        for (const auto &[packetId, segment] : packetIds) {
+            recovered[clientId].awaitingPubrel.insert(packetId);
+        }
+    }
+}
+
+std::unordered_map<std::string, WriteAheadLog::Recovered> WriteAheadLog::recover() {
+    std::lock_guard<std::mutex> guard(lock);
+    return std::move(recovered);
+}
+
+uint64_t WriteAheadLog::append(uint8_t type, std::string_view clientId, uint16_t packetId, QoS qos, bool retain,
+                               uint64_t messageId, std::string_view topic, ByteView payload) {
+    // Nothing is written any more; sync() reports the failure to whoever needs durability
+    if (!failure.empty()) {
+        return appendedLsn;
+    }
+    WalRecordHeader header{};
+    header.length = clientId.size() + topic.size() + payload.size;
+    header.type = type;
+    header.qos = static_cast<uint8_t>(qos);
+    header.retain = retain;
+    header.packetId = packetId;
+    header.clientIdLength = clientId.size();
+    header.messageId = messageId;
+    header.topicLength = topic.size();
+    size_t recordSize = sizeof(WalRecordHeader) + header.length;
+
+    if (segments[current].size > 0 && segments[current].size + recordSize > segmentSize) {
+        current = appendedLsn;
+        segments[current] = Segment{current, 0, 0};
+    }
+    if (pending.empty() || pending.back().segment != current) {
+        pending.push_back(Chunk{current, {}});
+    }
+    std::vector<uint8_t> &bytes = pending.back().bytes;
+    size_t offset = bytes.size();
+    bytes.resize(offset + recordSize);
+    uint8_t *record = bytes.data() + offset;
+    std::memcpy(record + sizeof(WalRecordHeader), clientId.data(), clientId.size());
+    std::memcpy(record + sizeof(WalRecordHeader) + clientId.size(), topic.data(), topic.size());
+    if (!payload.empty()) {
+        std::memcpy(record + sizeof(WalRecordHeader) + clientId.size() + topic.size(), payload.data, payload.size);
+    }
+    std::memcpy(record, &header, sizeof(WalRecordHeader));
+    header.crc = crc32(record + sizeof(header.crc), recordSize - sizeof(header.crc));
+    std::memcpy(record, &header.crc, sizeof(header.crc));
+
+    uint64_t start = appendedLsn;
+    appendedLsn += recordSize;
+    segments[current].size += recordSize;
+    pendingBytes += recordSize;
+    if (pendingBytes >= commitBytes) {
+        commitCondition.notify_one();
+    }
+    return start;
+}
+
+uint64_t WriteAheadLog::segmentOf(uint64_t lsn) const {
+    auto it = segments.upper_bound(lsn);
+    if (it == segments.begin()) {
+        return UINT64_MAX;
+    }
+    return (--it)->first;
+}
+
+void WriteAheadLog::pin(uint64_t segment) {
+    segments[segment].pins++;
+}
+
+void WriteAheadLog::unpin(uint64_t segment) {
+    auto it = segments.find(segment);
+    if (it != segments.end() && it->second.pins > 0) {
+        it->second.pins--;
+    }
+}
+
+uint64_t WriteAheadLog::logMessage(Message &message) {
+    std::lock_guard<std::mutex> guard(lock);
+    // New QoS 1/2 publishes are refused rather than acked without being durable
+    if (!failure.empty()) {
+        throw std::runtime_error("Write-ahead log failed: " + failure);
+    }
+    uint64_t start = append(MESSAGE, message.publisherId, 0, message.qos, message.retain, 0, message.topic, message.payload);
+    message.id = start + 1;
+    return appendedLsn;
+}
+
+uint64_t WriteAheadLog::logDeliver(const std::string &clientId, uint16_t packetId, const MessageRef &message, QoS qos) {
+    std::lock_guard<std::mutex> guard(lock);
+    uint64_t messageId = message->getId();
+    // Messages that were never logged (e.g. retained) or whose segment is gone are logged again inline
+    if (messageId == 0 || segmentOf(messageId - 1) == UINT64_MAX) {
+        messageId = append(MESSAGE, message->getPublisherId(), 0, message->getQos(), message->isRetain(), 0,
+                           message->getTopic(), message->getPayload()) + 1;
+    }
+    append(DELIVER, clientId, packetId, qos, false, messageId, "", {});
+    ack(clientId, packetId);
+    deliveries[clientId][packetId] = Delivery{messageId, current, qos};
+    pin(current);
+    pin(segmentOf(messageId - 1));
+    return appendedLsn;
+}
+
+uint64_t WriteAheadLog::logAck(const std::string &clientId, uint16_t packetId) {
+    std::lock_guard<std::mutex> guard(lock);
+    append(ACK, clientId, packetId, QoS::QOS_0, false, 0, "", {});
+    ack(clientId, packetId);
+    return appendedLsn;
+}
+
+uint64_t WriteAheadLog::logReceived(const std::string &clientId, uint16_t packetId) {
+    std::lock_guard<std::mutex> guard(lock);
+    append(RECEIVED, clientId, packetId, QoS::QOS_2, false, 0, "", {});
+    release(clientId, packetId);
+    receives[clientId][packetId] = current;
+    pin(current);
+    return appendedLsn;
+}
+
+uint64_t WriteAheadLog::logReleased(const std::string &clientId, uint16_t packetId) {
+    std::lock_guard<std::mutex> guard(lock);
+    append(RELEASED, clientId, packetId, QoS::QOS_2, false, 0, "", {});
+    release(clientId, packetId);
+    return appendedLsn;
+}
+
+uint64_t WriteAheadLog::logDiscard(const std::string &clientId) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (deliveries.find(clientId) == deliveries.end() && receives.find(clientId) == receives.end()) {
+        return appendedLsn;
+    }
+    append(DISCARD, clientId, 0, QoS::QOS_0, false, 0, "", {});
+    discard(clientId);
+    return appendedLsn;
+}
+
+void WriteAheadLog::ack(const std::string &clientId, uint16_t packetId) {
+    auto it = deliveries.find(clientId);
+    if (it == deliveries.end()) {
+        return;
+    }
+    auto deliveryIt = it->second.find(packetId);
+    if (deliveryIt == it->second.end()) {
+        return;
+    }
+    unpin(deliveryIt->second.segment);
+    unpin(segmentOf(deliveryIt->second.messageId - 1));
+    it->second.erase(deliveryIt);
+    if (it->second.empty()) {
+        deliveries.erase(it);
+    }
+}
+
+void WriteAheadLog::release(const std::string &clientId, uint16_t packetId) {
+    auto it = receives.find(clientId);
+    if (it == receives.end()) {
+        return;
+    }
+    auto receiveIt = it->second.find(packetId);
+    if (receiveIt == it->second.end()) {
+        return;
+    }
+    unpin(receiveIt->second);
+    it->second.erase(receiveIt);
+    if (it->second.empty()) {
+        receives.erase(it);
+    }
+}
+
+void WriteAheadLog::discard(const std::string &clientId) {
+    auto it = deliveries.find(clientId);
+    if (it != deliveries.end()) {
+        for (const auto &[packetId, delivery] : it->second) {
+            unpin(delivery.segment);
+            unpin(segmentOf(delivery.messageId - 1));
+        }
+        deliveries.erase(it);
+    }
+    auto receiveIt = receives.find(clientId);
+    if (receiveIt != receives.end()) {
+        for (const auto &[packetId, segment] : receiveIt->second) {
+            unpin(segment);
+        }
+        receives.erase(receiveIt);
+    }
+}
+
+MessageRef WriteAheadLog::readMessage(uint64_t messageId) const {
+    uint64_t start = segmentOf(messageId - 1);
+    const std::string path = segmentPath(start);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open WAL segment " + path);
+    }
+    WalRecordHeader header;
+    uint64_t offset = messageId - 1 - start;
+    std::vector<uint8_t> body;
+    bool ok = pread(fd, &header, sizeof(header), offset) == sizeof(header);
+    if (ok) {
+        body.resize(header.length);
+        ok = pread(fd, body.data(), body.size(), offset + sizeof(header)) == static_cast<ssize_t>(body.size());
+    }
+    close(fd);
+    if (!ok || header.type != MESSAGE) {
+        throw std::runtime_error("Corrupt WAL message record in " + path);
+    }
+    return decodeMessage(header, body.data(), messageId);
+}
+
+void WriteAheadLog::truncateFront() {
+    while (segments.size() > 1) {
+        auto it = segments.begin();
+        const Segment &segment = it->second;
+        if (it->first == current || segment.pins > 0 || segment.start + segment.size > durableLsn) {
+            break;
+        }
+        std::remove(segmentPath(it->first).c_str());
+        segments.erase(it);
+    }
+}
+
+void WriteAheadLog::carryForward() {
+    if (segments.size() <= MAX_SEGMENTS) {
+        return;
+    }
+    auto oldestIt = segments.begin();
+    uint64_t oldest = oldestIt->first;
+    if (oldest == current || oldestIt->second.pins == 0 ||
+        oldestIt->second.start + oldestIt->second.size > durableLsn) {
+        return;
+    }
+
+    // Re-log what the oldest segment still pins so it can be dropped
+    for (auto &[clientId, inflight] : deliveries) {
+        for (auto &[packetId, delivery] : inflight) {
+            uint64_t messageSegment = segmentOf(delivery.messageId - 1);
+            if (delivery.segment != oldest && messageSegment != oldest) {
+                continue;
+            }
+            MessageRef message = readMessage(delivery.messageId);
+            uint64_t messageId = append(MESSAGE, message->getPublisherId(), 0, message->getQos(), message->isRetain(),
+                                        0, message->getTopic(), message->getPayload()) + 1;
+            append(DELIVER, clientId, packetId, delivery.qos, false, messageId, "", {});
+            unpin(delivery.segment);
+            unpin(messageSegment);
+            delivery = Delivery{messageId, current, delivery.qos};
+            pin(current);
+            pin(segmentOf(messageId - 1));
+        }
+    }
+    for (auto &[clientId, packetIds] : receives) {
+        for (auto &[packetId, segment] : packetIds) {
+            if (segment == oldest) {
+                append(RECEIVED, clientId, packetId, QoS::QOS_2, false, 0, "", {});
+                unpin(segment);
+                segment = current;
+                pin(current);
+            }
+        }
+    }
+}
+
+void WriteAheadLog::sync(uint64_t lsn) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (lsn <= durableLsn) {
+        return;
+    }
+    requestedLsn = std::max(requestedLsn, lsn);
+    commitCondition.notify_one();
+    durableCondition.wait(guard, [&]() { return durableLsn >= lsn || !failure.empty(); });
+    if (durableLsn < lsn) {
+        throw std::runtime_error("Write-ahead log failed: " + failure);
+    }
+}
+
+uint64_t WriteAheadLog::getAppendedLsn() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return appendedLsn;
+}
+
+uint64_t WriteAheadLog::getDurableLsn() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return durableLsn;
+}
+
+uint64_t WriteAheadLog::getSyncCount() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return syncCount;
+}
+
+size_t WriteAheadLog::getSegmentCount() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return segments.size();
+}
+
+bool WriteAheadLog::hasFailed() const {
+    std::lock_guard<std::mutex> guard(lock);
+    return !failure.empty();
+}
+
+void WriteAheadLog::fail(const std::string &error) {
+    LOG_ERROR("Write-ahead log failed, refusing QoS 1/2 publishes from now on: %s", error.c_str());
+    failure = error;
+    pending.clear();
+    pendingBytes = 0;
+    durableCondition.notify_all();
+}
+
+void WriteAheadLog::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    int fd = -1;
+    uint64_t fdSegment = UINT64_MAX;
+    while (true) {
+        commitCondition.wait(guard, [this]() {
+            return stopping || (failure.empty() && (requestedLsn > durableLsn || pendingBytes >= commitBytes));
+        });
+        if (pending.empty()) {
+            if (stopping) {
+                break;
+            }
+            continue;
+        }
+        // Group commit: give other connections the window to join this fsync
+        if (commitIntervalUs > 0 && !stopping && pendingBytes < commitBytes) {
+            commitCondition.wait_for(guard, std::chrono::microseconds(commitIntervalUs),
+                                     [this]() { return stopping || pendingBytes >= commitBytes; });
+        }
+        std::vector<Chunk> chunks;
+        chunks.swap(pending);
+        pendingBytes = 0;
+        uint64_t target = appendedLsn;
+        guard.unlock();
+
+        // An error fails the waiters instead of the broker; the connections they serve are closed
+        std::string error;
+        try {
+            for (const Chunk &chunk : chunks) {
+                if (chunk.segment != fdSegment) {
+                    if (fd >= 0) {
+                        syncFile(fd, segmentPath(fdSegment));
+                        close(fd);
+                        fd = -1;
+                    }
+                    fd = open(segmentPath(chunk.segment).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+                    if (fd < 0) {
+                        throw std::runtime_error("Failed to open WAL segment " + segmentPath(chunk.segment));
+                    }
+                    fdSegment = chunk.segment;
+                    syncDirectory(directory);
+                }
+                writeAll(fd, chunk.bytes.data(), chunk.bytes.size());
+            }
+            syncFile(fd, segmentPath(fdSegment));
+        } catch (const std::exception &e) {
+            error = e.what();
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+            fdSegment = UINT64_MAX;
+        }
+
+        guard.lock();
+        if (!error.empty()) {
+            fail(error);
+            continue;
+        }
+        durableLsn = target;
+        syncCount++;
+        durableCondition.notify_all();
+        try {
+            carryForward();
+            truncateFront();
+        } catch (const std::exception &e) {
+            fail(e.what());
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+}
@@ -0,0 +1,149 @@
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include "Message.h"
+#include "MessageRef.h"
+
+namespace MQTT {
+
+// Write-ahead log for QoS 1/2 state.
+//
+// Accepted QoS>0 publishes, the deliveries made from them and every ack
+// state transition are appended to an in-memory buffer and written by a
+// single committer thread. Callers that must not proceed before their
+// records are durable (PUBACK/PUBREC to a publisher) call sync() with the
+// LSN they need; the committer waits up to the commit interval or until
+// commitBytes are pending and covers every waiter with one fdatasync.
+//
+// The log is split into segments. A segment stays pinned while it holds a
+// delivery or QoS 2 receive that has not been acknowledged; unpinned
+// segments are deleted from the front, and live entries of an old pinned
+// segment are carried forward so one slow subscriber cannot hold the whole
+// log.
+//
+// Only the MESSAGE record of a publish is durable before the publisher is
+// acked. DELIVER records are written when a subscriber's connection sends
+// the message, which may be after that ack, and messages waiting in an
+// offline queue or a delivery inbox have none. A crash therefore recovers
+// the messages in flight to subscribers, not those still queued for them.
+//
+// If writing or syncing fails, the log stops writing: sync() throws for
+// every record not yet durable, so the connection waiting on it is closed
+// without its acks, and logMessage() refuses new publishes.
+class WriteAheadLog {
+public:
+    struct Inflight {
+        MessageRef message;
+        QoS qos;
+    };
+
+    // QoS state of one client rebuilt from the log
+    struct Recovered {
+        std::map<uint16_t, Inflight> inflight;
+        std::set<uint16_t> awaitingPubrel;
+    };
+
+    static constexpr uint64_t SEGMENT_SIZE = 64 * 1024 * 1024;
+    static constexpr size_t MAX_SEGMENTS = 8;
+
+    WriteAheadLog(const std::string &directory, uint32_t commitIntervalUs, size_t commitBytes,
+                  uint64_t segmentSize = SEGMENT_SIZE);
+    ~WriteAheadLog();
+
+    // State left by the previous run, keyed by client id
+    std::unordered_map<std::string, Recovered> recover();
+
+    // Each append returns the LSN that must be durable for the record to survive a crash
+    uint64_t logMessage(Message &message);
+    uint64_t logDeliver(const std::string &clientId, uint16_t packetId, const MessageRef &message, QoS qos);
+    uint64_t logAck(const std::string &clientId, uint16_t packetId);
+    uint64_t logReceived(const std::string &clientId, uint16_t packetId);
+    uint64_t logReleased(const std::string &clientId, uint16_t packetId);
+    uint64_t logDiscard(const std::string &clientId);
+
+    // Block until everything up to lsn is on disk; throws std::runtime_error if the log failed first
+    void sync(uint64_t lsn);
+    bool hasFailed() const;
+
+    uint64_t getAppendedLsn() const;
+    uint64_t getDurableLsn() const;
+    uint64_t getSyncCount() const;
+    size_t getSegmentCount() const;
+
+private:
+    struct Segment {
+        uint64_t start = 0;
+        uint64_t size = 0;
+        size_t pins = 0;
+    };
+
+    struct Delivery {
+        uint64_t messageId;
+        uint64_t segment;
+        QoS qos;
+    };
+
+    struct Chunk {
+        uint64_t segment;
+        std::vector<uint8_t> bytes;
+    };
+
+    std::string directory;
+    uint32_t commitIntervalUs;
+    size_t commitBytes;
+    uint64_t segmentSize;
+
+    mutable std::mutex lock;
+    std::condition_variable commitCondition;
+    std::condition_variable durableCondition;
+    std::thread committer;
+    bool stopping = false;
+    // Why the committer stopped writing; empty while the log is healthy
+    std::string failure;
+
+    std::map<uint64_t, Segment> segments;
+    uint64_t current = 0;
+    std::vector<Chunk> pending;
+    size_t pendingBytes = 0;
+    uint64_t appendedLsn = 0;
+    uint64_t durableLsn = 0;
+    uint64_t requestedLsn = 0;
+    uint64_t syncCount = 0;
+    std::unordered_map<std::string, Recovered> recovered;
+
+    // Live entries and the segments they pin
+    std::unordered_map<std::string, std::unordered_map<uint16_t, Delivery>> deliveries;
+    std::unordered_map<std::string, std::unordered_map<uint16_t, uint64_t>> receives;
+
+    std::string segmentPath(uint64_t start) const;
+    void replay();
+    uint64_t append(uint8_t type, std::string_view clientId, uint16_t packetId, QoS qos, bool retain,
+                    uint64_t messageId, std::string_view topic, ByteView payload);
+    uint64_t segmentOf(uint64_t lsn) const;
+    void pin(uint64_t segment);
+    void unpin(uint64_t segment);
+    void ack(const std::string &clientId, uint16_t packetId);
+    void release(const std::string &clientId, uint16_t packetId);
+    void discard(const std::string &clientId);
+    MessageRef readMessage(uint64_t messageId) const;
+    void truncateFront();
+    void carryForward();
+    // Stop writing and wake every waiter to report error; lock must be held
+    void fail(const std::string &error);
+    void run();
+};
+
+}
+
+#endif // WRITE_AHEAD_LOG_H
@@ -0,0 +1,41 @@
+#include <gtest/gtest.h>
+#include "../src/Arena.h"
+#include "../src/Frame.h"
+
+namespace MQTT {
+
+TEST(ArenaTest, BumpsAndAligns) {
+    Arena arena;
+    uint8_t *a = static_cast<uint8_t *>(arena.allocate(3, 1));
+    uint8_t *b = static_cast<uint8_t *>(arena.allocate(8, 8));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(b) % 8, 0);
+    EXPECT_GE(b, a + 3);
+    EXPECT_EQ(arena.getUsedBytes(), 11);
+}
+
+TEST(ArenaTest, ResetReusesChunks) {
+    Arena arena;
+    void *first = arena.allocate(100);
+    arena.allocate(Arena::CHUNK_SIZE);
+    size_t capacity = arena.getCapacity();
+    arena.reset();
+    EXPECT_EQ(arena.getUsedBytes(), 0);
+    EXPECT_EQ(arena.allocate(100), first);
+    arena.allocate(Arena::CHUNK_SIZE);
+    EXPECT_EQ(arena.getCapacity(), capacity);
+}
+
+TEST(ArenaTest, FrameParsesIntoArena) {
+    Arena arena;
+    Frame frame;
+    frame.setArena(&arena);
+    const uint8_t pingreq[] = {0xc0, 0x00};
+    {
+        auto packet = frame.parse(pingreq, sizeof(pingreq));
+        EXPECT_EQ(packet->type, PacketType::PINGREQ);
+        EXPECT_GT(arena.getUsedBytes(), 0);
+    }
+    arena.reset();
+}
+
+}
@@ -1,4 +1,8 @@
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include "Broker.h"
 #include "Session.h"
 
@@ -30,21 +34,692 @@ TEST_F(BrokerTest, DisconnectClientTest)
 
 TEST_F(BrokerTest, PublishMessageTest)
 {
-    //broker.connectClient("subscriber");
-    broker->subscribe("subscriber", "test/topic");
+    MQTT::Session session(broker, "subscriber");
+    broker->subscribe(session.getHandle(), "test/topic");
     MQTT::Message message("test/topic", "Hello, MQTT!");
     broker->publish(message);
 }
 
 TEST_F(BrokerTest, SubscribeTest)
 {
-    broker->subscribe("client1", "test/topic");
+    MQTT::Session session(broker, "client1");
+    broker->subscribe(session.getHandle(), "test/topic");
     EXPECT_TRUE(broker->isSubscribed("client1", "test/topic"));
 }
 
 TEST_F(BrokerTest, UnsubscribeTest)
 {
-    broker->subscribe("client1", "test/topic");
-    broker->unsubscribe("client1", "test/topic");
+    MQTT::Session session(broker, "client1");
+    broker->subscribe(session.getHandle(), "test/topic");
+    broker->unsubscribe(session.getHandle(), "test/topic");
     EXPECT_FALSE(broker->isSubscribed("client1", "test/topic"));
 }
+
+TEST_F(BrokerTest, SharedGroupsEachReceiveMessage)
+{
+    int receivedA = 0, receivedB = 0;
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::SEND_RETAINED_MESSAGES_AT_SUBSCRIBE};
+    MQTT::Session sessionA(broker, "clientA");
+    MQTT::Session sessionB(broker, "clientB");
+    sessionA.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { receivedA++; });
+    sessionB.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { receivedB++; });
+    sessionA.connect();
+    sessionB.connect();
+    sessionA.subscribe("$share/groupA/test/topic", options);
+    sessionB.subscribe("$share/groupB/test/topic", options);
+
+    broker->publish(MQTT::Message("test/topic", "Hello, MQTT!"));
+    EXPECT_EQ(receivedA, 1);
+    EXPECT_EQ(receivedB, 1);
+}
+
+TEST_F(BrokerTest, SharedGroupSkipsOfflineMember)
+{
+    int receivedA = 0, receivedB = 0;
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::SEND_RETAINED_MESSAGES_AT_SUBSCRIBE};
+    MQTT::Session sessionA(broker, "clientA");
+    MQTT::Session sessionB(broker, "clientB");
+    sessionA.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { receivedA++; });
+    sessionB.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { receivedB++; });
+    sessionA.connect();
+    sessionB.connect();
+    sessionA.subscribe("$share/group/test/topic", options);
+    sessionB.subscribe("$share/group/test/topic", options);
+    sessionB.disconnect();
+
+    for (int i = 0; i < 4; i++) {
+        broker->publish(MQTT::Message("test/topic", "Hello, MQTT!"));
+    }
+    EXPECT_EQ(receivedA, 4);
+    EXPECT_EQ(receivedB, 0);
+    EXPECT_TRUE(sessionA.isSharedAvailable());
+    EXPECT_FALSE(sessionB.isSharedAvailable());
+}
+
+TEST_F(BrokerTest, SharedUnsubscribeKeepsPlainSubscription)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::SEND_RETAINED_MESSAGES_AT_SUBSCRIBE};
+    int received = 0;
+    MQTT::Session session(broker, "client1");
+    session.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { received++; });
+    session.connect();
+    session.subscribe("test/topic", options);
+    session.subscribe("$share/group/test/topic", options);
+    session.unsubscribe("$share/group/test/topic");
+
+    EXPECT_EQ(broker->findSharedGroup("test/topic", "group"), nullptr);
+    broker->publish(MQTT::Message("test/topic", "Hello, MQTT!"));
+    EXPECT_EQ(received, 1);
+}
+
+TEST_F(BrokerTest, RetainedMessageDeliveredOnSubscribe)
+{
+    std::vector<std::string> received;
+    std::vector<bool> retainFlags;
+    MQTT::Session session(broker, "client1");
+    session.setDeliverCallback([&](const MQTT::MessageRef& message, uint16_t, MQTT::QoS, bool retain) {
+        received.push_back(std::string(message->getTopic()));
+        retainFlags.push_back(retain);
+    });
+    session.connect();
+
+    broker->publish(MQTT::Message("site/1/status", "on", MQTT::QoS::QOS_0, true));
+    broker->publish(MQTT::Message("site/2/status", "on", MQTT::QoS::QOS_0, true));
+    broker->publish(MQTT::Message("site/2/status", "", MQTT::QoS::QOS_0, true));
+    EXPECT_EQ(broker->getRetainedCount(), 1);
+
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::SEND_RETAINED_MESSAGES_AT_SUBSCRIBE_IF_NEW};
+    EXPECT_TRUE(session.subscribe("site/+/status", options));
+    session.deliverRetained("site/+/status", true);
+    ASSERT_EQ(received.size(), 1);
+    EXPECT_EQ(received[0], "site/1/status");
+    EXPECT_TRUE(retainFlags[0]);
+
+    // Re-subscribing does not resend with SEND_RETAINED_MESSAGES_AT_SUBSCRIBE_IF_NEW
+    EXPECT_FALSE(session.subscribe("site/+/status", options));
+    session.deliverRetained("site/+/status", false);
+    EXPECT_EQ(received.size(), 1);
+
+    // Live messages are forwarded without the retain flag unless retainAsPublished
+    broker->publish(MQTT::Message("site/1/status", "off", MQTT::QoS::QOS_0, true));
+    ASSERT_EQ(received.size(), 2);
+    EXPECT_FALSE(retainFlags[1]);
+}
+
+TEST_F(BrokerTest, RetainHandlingDoNotSend)
+{
+    int received = 0;
+    MQTT::Session session(broker, "client1");
+    session.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { received++; });
+    session.connect();
+    broker->publish(MQTT::Message("site/1/status", "on", MQTT::QoS::QOS_0, true));
+
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    session.subscribe("site/#", options);
+    session.deliverRetained("site/#", true);
+    EXPECT_EQ(received, 0);
+}
+
+TEST_F(BrokerTest, PersistentSessionQueuesWhileOffline)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    bool sessionPresent = true;
+    MQTT::Session* session = broker->openSession("client1", false, sessionPresent);
+    EXPECT_FALSE(sessionPresent);
+    session->connect();
+    session->subscribe("queue/#", options);
+    broker->closeSession(session);
+    EXPECT_EQ(broker->getConnectedClients(), 0);
+
+    for (int i = 0; i < 3; i++) {
+        broker->publish(MQTT::Message("queue/" + std::to_string(i), "payload", MQTT::QoS::QOS_1));
+    }
+    EXPECT_EQ(session->getQueuedCount(), 3);
+
+    std::vector<std::string> received;
+    EXPECT_EQ(broker->openSession("client1", false, sessionPresent), session);
+    EXPECT_TRUE(sessionPresent);
+    session->setDeliverCallback([&](const MQTT::MessageRef& message, uint16_t, MQTT::QoS, bool) {
+        received.push_back(std::string(message->getTopic()));
+    });
+    session->connect();
+    session->resume();
+    EXPECT_EQ(received, (std::vector<std::string>{"queue/0", "queue/1", "queue/2"}));
+    EXPECT_EQ(session->getQueuedCount(), 0);
+    EXPECT_EQ(session->getInflightCount(), 3);
+}
+
+TEST_F(BrokerTest, CleanStartDiscardsPersistentSession)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    bool sessionPresent;
+    MQTT::Session* session = broker->openSession("client1", false, sessionPresent);
+    session->connect();
+    session->subscribe("queue/#", options);
+    broker->closeSession(session);
+
+    session = broker->openSession("client1", true, sessionPresent);
+    EXPECT_FALSE(sessionPresent);
+    EXPECT_FALSE(broker->isSubscribed("client1", "queue/#"));
+    session->connect();
+    broker->closeSession(session);
+    EXPECT_EQ(broker->findSession("client1"), nullptr);
+}
+
+TEST_F(BrokerTest, SessionTakeoverDisconnectsPreviousConnection)
+{
+    bool disconnected = false;
+    bool sessionPresent;
+    MQTT::Session* session = broker->openSession("client1", false, sessionPresent);
+    session->setDisconnectCallback([&]() { disconnected = true; });
+    session->connect();
+
+    EXPECT_EQ(broker->openSession("client1", false, sessionPresent), session);
+    EXPECT_TRUE(disconnected);
+    EXPECT_TRUE(sessionPresent);
+}
+
+TEST_F(BrokerTest, ReceiveMaximumQueuesBeyondWindow)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    std::vector<uint16_t> packetIds;
+    MQTT::Session session(broker, "client1");
+    session.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t packetId, MQTT::QoS, bool) {
+        packetIds.push_back(packetId);
+    });
+    session.setReceiveMaximum(2);
+    session.connect();
+    session.subscribe("window/#", options);
+
+    for (int i = 0; i < 5; i++) {
+        broker->publish(MQTT::Message("window/" + std::to_string(i), "payload", MQTT::QoS::QOS_1));
+    }
+    EXPECT_EQ(packetIds.size(), 2);
+    EXPECT_EQ(session.getInflightCount(), 2);
+    EXPECT_EQ(session.getQueuedCount(), 3);
+
+    // QoS 0 is not limited by the window but keeps its place behind queued messages
+    broker->publish(MQTT::Message("window/5", "payload", MQTT::QoS::QOS_0));
+    EXPECT_EQ(session.getQueuedCount(), 4);
+
+    session.puback(packetIds[0]);
+    EXPECT_EQ(packetIds.size(), 3);
+    session.puback(packetIds[1]);
+    session.puback(packetIds[2]);
+    EXPECT_EQ(packetIds.size(), 6);
+    EXPECT_EQ(packetIds.back(), 0);
+    EXPECT_EQ(session.getQueuedCount(), 0);
+}
+
+TEST_F(BrokerTest, SharedGroupSkipsMemberWithFullWindow)
+{
+    int receivedA = 0, receivedB = 0;
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::SEND_RETAINED_MESSAGES_AT_SUBSCRIBE};
+    MQTT::Session sessionA(broker, "clientA");
+    MQTT::Session sessionB(broker, "clientB");
+    sessionA.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { receivedA++; });
+    sessionB.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { receivedB++; });
+    sessionA.setReceiveMaximum(1);
+    sessionA.connect();
+    sessionB.connect();
+    sessionA.subscribe("$share/group/test/topic", options);
+    sessionB.subscribe("$share/group/test/topic", options);
+
+    for (int i = 0; i < 4; i++) {
+        broker->publish(MQTT::Message("test/topic", "Hello, MQTT!", MQTT::QoS::QOS_1));
+    }
+    EXPECT_EQ(receivedA, 1);
+    EXPECT_EQ(receivedB, 3);
+    EXPECT_EQ(sessionA.getQueuedCount(), 0);
+}
+
+TEST_F(BrokerTest, ResumeRetransmitsInflightBeforeQueued)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_2, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    std::vector<uint16_t> packetIds;
+    bool sessionPresent;
+    MQTT::Session* session = broker->openSession("client1", false, sessionPresent);
+    session->setDeliverCallback([&](const MQTT::MessageRef&, uint16_t packetId, MQTT::QoS, bool) {
+        packetIds.push_back(packetId);
+    });
+    session->connect();
+    session->subscribe("resend/#", options);
+    broker->publish(MQTT::Message("resend/0", "payload", MQTT::QoS::QOS_1));
+    broker->publish(MQTT::Message("resend/1", "payload", MQTT::QoS::QOS_2));
+    broker->publish(MQTT::Message("resend/2", "payload", MQTT::QoS::QOS_1));
+    session->pubrec(packetIds[1]);
+    broker->closeSession(session);
+    broker->publish(MQTT::Message("resend/3", "payload", MQTT::QoS::QOS_1));
+
+    std::vector<std::string> events;
+    broker->openSession("client1", false, sessionPresent);
+    session->setDeliverCallback([&](const MQTT::MessageRef& message, uint16_t, MQTT::QoS, bool) {
+        events.push_back("deliver " + std::string(message->getTopic()));
+    });
+    session->setResendCallback([&](MQTT::InflightWindow::Entry& entry) {
+        if (entry.released) {
+            events.push_back("pubrel " + std::to_string(entry.packetId));
+        } else {
+            events.push_back("resend " + std::string(entry.message->getTopic()));
+        }
+    });
+    session->connect();
+    session->resume();
+    EXPECT_EQ(events, (std::vector<std::string>{"resend resend/0", "pubrel " + std::to_string(packetIds[1]),
+                                                "resend resend/2", "deliver resend/3"}));
+
+    // Timed resends only touch entries older than the interval
+    events.clear();
+    uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    session->retransmitExpired(now, 1000);
+    EXPECT_TRUE(events.empty());
+    session->retransmitExpired(now + 1000, 1000);
+    EXPECT_EQ(events.size(), 4);
+}
+
+TEST_F(BrokerTest, StaleHandleIsNotDelivered)
+{
+    MQTT::SessionHandle stale;
+    {
+        MQTT::Session session(broker, "client1");
+        stale = session.getHandle();
+        EXPECT_EQ(broker->getSession(stale), &session);
+    }
+    EXPECT_EQ(broker->getSession(stale), nullptr);
+    // A subscription left behind under the old handle reaches nobody, not the slot's next owner
+    broker->subscribe(stale, "test/topic");
+    int received = 0;
+    MQTT::Session session(broker, "client2");
+    session.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { received++; });
+    session.connect();
+    EXPECT_NE(session.getHandle(), stale);
+    broker->publish(MQTT::Message("test/topic", "Hello, MQTT!"));
+    EXPECT_EQ(received, 0);
+}
+
+TEST_F(BrokerTest, AttachedInboxDefersDeliveryToOwner)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    std::vector<std::string> received;
+    MQTT::Session session(broker, "client1");
+    session.setDeliverCallback([&](const MQTT::MessageRef& message, uint16_t, MQTT::QoS, bool) {
+        received.push_back(std::string(message->getTopic()));
+    });
+    session.connect();
+    session.subscribe("inbox/#", options);
+    session.attachInbox();
+
+    broker->publish(MQTT::Message("inbox/0", "payload", MQTT::QoS::QOS_1));
+    broker->publish(MQTT::Message("inbox/1", "payload", MQTT::QoS::QOS_0));
+    EXPECT_TRUE(received.empty());
+    EXPECT_EQ(session.getInflightCount(), 0);
+
+    EXPECT_EQ(session.processInbox(), 2);
+    EXPECT_EQ(received, (std::vector<std::string>{"inbox/0", "inbox/1"}));
+    EXPECT_EQ(session.getInflightCount(), 1);
+
+    // Once detached, publishers dispatch directly again
+    broker->publish(MQTT::Message("inbox/2", "payload", MQTT::QoS::QOS_0));
+    EXPECT_EQ(received.size(), 2);
+    session.detachInbox();
+    EXPECT_EQ(received.size(), 3);
+    broker->publish(MQTT::Message("inbox/3", "payload", MQTT::QoS::QOS_0));
+    EXPECT_EQ(received.size(), 4);
+}
+
+TEST_F(BrokerTest, SweepDropsExpiredMessagesOfOfflineSessions)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    bool sessionPresent;
+    MQTT::Session* session = broker->openSession("client1", false, sessionPresent);
+    session->subscribe("expiry/#", options);
+    broker->closeSession(session);
+
+    uint64_t now = MQTT::MessageBlock::currentTime();
+    for (int i = 0; i < 4; i++) {
+        MQTT::Message message("expiry/" + std::to_string(i), "payload", MQTT::QoS::QOS_1);
+        message.expiresAt = now + 1000 * (i + 1);
+        broker->publish(message);
+    }
+    broker->publish(MQTT::Message("expiry/forever", "payload", MQTT::QoS::QOS_1));
+    EXPECT_EQ(session->getQueuedCount(), 5);
+    EXPECT_EQ(session->getQueueExpiry(), now + 1000);
+
+    EXPECT_EQ(broker->sweepExpired(now + 2500), 2);
+    EXPECT_EQ(session->getQueuedCount(), 3);
+    // Rescheduled under the next message to expire
+    EXPECT_EQ(session->getQueueExpiry(), now + 3000);
+    // Rate limited by expirySweepIntervalMs
+    EXPECT_EQ(broker->sweepExpired(now + 3000), 0);
+
+    std::vector<std::string> received;
+    broker->openSession("client1", false, sessionPresent);
+    session->setDeliverCallback([&](const MQTT::MessageRef& message, uint16_t, MQTT::QoS, bool) {
+        received.push_back(std::string(message->getTopic()));
+    });
+    session->connect();
+    session->resume();
+    EXPECT_EQ(received, (std::vector<std::string>{"expiry/2", "expiry/3", "expiry/forever"}));
+}
+
+TEST_F(BrokerTest, ExpiredSessionsAreReapedWithTheirSubscriptions)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    bool sessionPresent;
+    MQTT::Session* expiring = broker->openSession("expiring", false, sessionPresent);
+    expiring->setExpiryInterval(1);
+    expiring->connect();
+    expiring->subscribe("reap/#", options);
+    expiring->subscribe("reap/only", options);
+    MQTT::Session* persistent = broker->openSession("persistent", false, sessionPresent);
+    persistent->connect();
+    persistent->subscribe("reap/#", options);
+
+    uint64_t now = MQTT::MessageBlock::currentTime();
+    broker->closeSession(expiring);
+    broker->closeSession(persistent);
+    EXPECT_EQ(broker->getSessionCount(), 2);
+    EXPECT_GE(expiring->getExpiresAt(), now + 1000);
+    EXPECT_EQ(persistent->getExpiresAt(), 0);
+    EXPECT_EQ(broker->reapSessions(now), 0);
+
+    EXPECT_EQ(broker->reapSessions(now + 2000), 1);
+    EXPECT_EQ(broker->findSession("expiring"), nullptr);
+    EXPECT_EQ(broker->getSessionCount(), 1);
+    EXPECT_TRUE(broker->getSubscriptions("reap/only").empty());
+    EXPECT_EQ(broker->getSubscriptions("reap/#"), std::set<std::string>{"persistent"});
+    // Nothing is routed to the reaped session any more
+    broker->publish(MQTT::Message("reap/only", "payload", MQTT::QoS::QOS_1));
+    EXPECT_EQ(persistent->getQueuedCount(), 1);
+}
+
+TEST_F(BrokerTest, PublishersRouteWhileSessionsExpire)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    std::atomic<bool> done{false};
+    std::vector<std::thread> publishers;
+    for (int t = 0; t < 3; t++) {
+        publishers.emplace_back([&, t]() {
+            for (int i = 0; !done; i++) {
+                broker->publish(MQTT::Message("reap/" + std::to_string(t) + "/" + std::to_string(i % 8), "payload"));
+            }
+        });
+    }
+    // Another connection subscribing and unsubscribing at the same time
+    bool sessionPresent;
+    MQTT::Session* subscriberSession = broker->openSession("subscriber", true, sessionPresent);
+    subscriberSession->connect();
+    std::thread subscriber([&]() {
+        while (!done) {
+            subscriberSession->subscribe("reap/+/1", options);
+            subscriberSession->subscribe("$share/group/reap/#", options);
+            subscriberSession->unsubscribe("reap/+/1");
+            subscriberSession->unsubscribe("$share/group/reap/#");
+        }
+    });
+    for (int round = 0; round < 50; round++) {
+        uint64_t now = MQTT::MessageBlock::currentTime();
+        for (int i = 0; i < 20; i++) {
+            MQTT::Session* session = broker->openSession("expiring" + std::to_string(i), false, sessionPresent);
+            session->setExpiryInterval(1);
+            session->connect();
+            session->subscribe("reap/" + std::to_string(i % 3) + "/#", options);
+            session->subscribe("reap/+/" + std::to_string(i % 8), options);
+            session->subscribe("$share/group" + std::to_string(i % 2) + "/reap/#", options);
+            broker->closeSession(session);
+        }
+        EXPECT_EQ(broker->reapSessions(now + 2000), 20);
+    }
+    done = true;
+    for (std::thread &publisher : publishers) {
+        publisher.join();
+    }
+    subscriber.join();
+    EXPECT_EQ(broker->getSubscriptionCount(), 0);
+    EXPECT_TRUE(broker->getSubscriptions("reap/+/1").empty());
+}
+
+TEST_F(BrokerTest, ConcurrentPublishersQueueForOfflineSession)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    bool sessionPresent;
+    MQTT::Session* session = broker->openSession("client1", false, sessionPresent);
+    session->subscribe("offline/#", options);
+    broker->closeSession(session);
+
+    // Each publisher's messages expire later than the last, so the queue's expiry keeps moving under the sweep
+    uint64_t now = MQTT::MessageBlock::currentTime();
+    std::vector<std::thread> publishers;
+    for (int t = 0; t < 4; t++) {
+        publishers.emplace_back([this, t, now]() {
+            for (int i = 0; i < 500; i++) {
+                MQTT::Message message("offline/" + std::to_string(t), "payload", MQTT::QoS::QOS_1);
+                message.expiresAt = now + 600000 + i;
+                broker->publish(message);
+            }
+        });
+    }
+    for (int i = 0; i < 100; i++) {
+        broker->sweepExpired(now + i * broker->getConfig().expirySweepIntervalMs);
+    }
+    for (auto &publisher : publishers) {
+        publisher.join();
+    }
+    EXPECT_EQ(session->getQueuedCount(), 2000);
+    EXPECT_EQ(session->getQueueExpiry(), now + 600000);
+}
+
+TEST_F(BrokerTest, ReconnectedSessionIsNotReaped)
+{
+    bool sessionPresent;
+    MQTT::Session* session = broker->openSession("client1", false, sessionPresent);
+    session->setExpiryInterval(1);
+    session->connect();
+    uint64_t now = MQTT::MessageBlock::currentTime();
+    broker->closeSession(session);
+
+    EXPECT_EQ(broker->openSession("client1", false, sessionPresent), session);
+    EXPECT_TRUE(sessionPresent);
+    session->connect();
+    EXPECT_EQ(broker->reapSessions(now + 2000), 0);
+    EXPECT_EQ(broker->findSession("client1"), session);
+}
+
+TEST_F(BrokerTest, ConnectionThreadsOpenAndCloseSessionsWhileReaping)
+{
+    std::atomic<bool> done{false};
+    uint64_t later = MQTT::MessageBlock::currentTime() + 5000;
+    std::thread reaper([&]() {
+        while (!done) {
+            broker->reapSessions(later);
+        }
+    });
+    std::vector<std::thread> connections;
+    for (int t = 0; t < 4; t++) {
+        connections.emplace_back([this, t]() {
+            bool sessionPresent;
+            for (int i = 0; i < 5000; i++) {
+                // Shared between the threads, so some connections take over another's session
+                std::string clientId = "client" + std::to_string((t * 7 + i) % 200);
+                MQTT::Session* session = broker->attachSession(clientId, i % 3 == 0, sessionPresent, []() {});
+                // Half of them stay parked until the reaper gets to them
+                session->setExpiryInterval(i % 2);
+                session->connect();
+                broker->detachSession(session);
+                EXPECT_EQ(session, nullptr);
+            }
+        });
+    }
+    for (std::thread &connection : connections) {
+        connection.join();
+    }
+    done = true;
+    reaper.join();
+    broker->reapSessions(later);
+    EXPECT_EQ(broker->getSessionCount(), 0);
+}
+
+TEST_F(BrokerTest, TakeoverWaitsForThePreviousConnectionToDetach)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    bool sessionPresent;
+    std::atomic<bool> takenOver{false};
+    MQTT::Session* previous = broker->attachSession("client", false, sessionPresent, [&]() { takenOver = true; });
+    previous->setExpiryInterval(60);
+    previous->connect();
+
+    std::atomic<bool> attached{false};
+    MQTT::Session* session = nullptr;
+    bool resumed = true;
+    std::thread connection([&]() {
+        session = broker->attachSession("client", true, resumed, []() {});
+        attached = true;
+    });
+    while (!takenOver) {
+        std::this_thread::yield();
+    }
+    // The previous connection still uses its session after being told to let go
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(attached);
+    EXPECT_FALSE(previous->isConnected());
+    previous->subscribe("takeover/topic", options);
+    broker->detachSession(previous);
+    connection.join();
+
+    EXPECT_TRUE(attached);
+    EXPECT_FALSE(resumed);
+    EXPECT_EQ(broker->getSessionCount(), 1);
+    EXPECT_TRUE(broker->getSubscriptions("takeover/topic").empty());
+    broker->detachSession(session);
+    EXPECT_EQ(broker->getSessionCount(), 0);
+}
+
+TEST_F(BrokerTest, OfflineSessionsBeyondMemoryLimitAreEvictedOldestFirst)
+{
+    MQTT::BrokerConfig config;
+    config.offlineSessionMemoryBytes = 64 * 1024;
+    MQTT::Broker limited(config);
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    bool sessionPresent;
+    for (const char *clientId : {"first", "second", "third"}) {
+        MQTT::Session* session = limited.openSession(clientId, false, sessionPresent);
+        session->connect();
+        session->subscribe("bulk", options);
+        limited.closeSession(session);
+    }
+    size_t idle = limited.getOfflineMemoryBytes();
+    EXPECT_GT(idle, 0);
+    EXPECT_EQ(limited.reapSessions(MQTT::MessageBlock::currentTime()), 0);
+
+    // Every queue is charged for the message, well past the limit together
+    limited.publish(MQTT::Message("bulk", std::string(40 * 1024, 'x'), MQTT::QoS::QOS_1));
+    EXPECT_GT(limited.getOfflineMemoryBytes(), idle + 3 * 40 * 1024);
+    EXPECT_EQ(limited.reapSessions(MQTT::MessageBlock::currentTime()), 2);
+    EXPECT_EQ(limited.findSession("first"), nullptr);
+    EXPECT_EQ(limited.findSession("second"), nullptr);
+    ASSERT_NE(limited.findSession("third"), nullptr);
+    EXPECT_EQ(limited.getOfflineMemoryBytes(), limited.findSession("third")->getMemoryBytes());
+}
+
+static std::unique_ptr<MQTT::Will> makeWill(const std::string &topic, uint32_t delay)
+{
+    auto will = std::make_unique<MQTT::Will>(MQTT::Will{MQTT::Message(topic, "gone", MQTT::QoS::QOS_1)});
+    will->delay = delay;
+    return will;
+}
+
+TEST_F(BrokerTest, WillIsPublishedAfterDelayUnlessSessionResumes)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    MQTT::Session watcher(broker, "watcher");
+    watcher.subscribe("wills/#", options);
+
+    bool sessionPresent;
+    MQTT::Session* resumed = broker->openSession("resumed", false, sessionPresent);
+    resumed->connect();
+    resumed->setWill(makeWill("wills/resumed", 5));
+    MQTT::Session* lost = broker->openSession("lost", false, sessionPresent);
+    lost->connect();
+    lost->setWill(makeWill("wills/lost", 5));
+
+    uint64_t now = MQTT::MessageBlock::currentTime();
+    broker->closeSession(resumed);
+    broker->closeSession(lost);
+    EXPECT_EQ(broker->getPendingWillCount(), 2);
+    EXPECT_EQ(broker->fireWills(now + 1000), 0);
+
+    broker->openSession("resumed", false, sessionPresent);
+    EXPECT_EQ(broker->getPendingWillCount(), 1);
+    EXPECT_EQ(broker->fireWills(now + 6000), 1);
+    EXPECT_EQ(watcher.getQueuedCount(), 1);
+    EXPECT_EQ(broker->getPendingWillCount(), 0);
+}
+
+TEST_F(BrokerTest, WillOfEndedSessionIsPublishedRightAway)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_1, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    MQTT::Session watcher(broker, "watcher");
+    watcher.subscribe("wills/#", options);
+
+    bool sessionPresent;
+    // A clean session ends with its connection, so the delay does not apply
+    MQTT::Session* clean = broker->openSession("clean", true, sessionPresent);
+    clean->connect();
+    clean->setWill(makeWill("wills/clean", 60));
+    MQTT::Session* restarted = broker->openSession("restarted", false, sessionPresent);
+    restarted->connect();
+    restarted->setWill(makeWill("wills/restarted", 60));
+
+    uint64_t now = MQTT::MessageBlock::currentTime();
+    broker->closeSession(clean);
+    broker->closeSession(restarted);
+    // Coming back with a clean start ends the old session
+    broker->openSession("restarted", true, sessionPresent);
+    EXPECT_EQ(broker->fireWills(now + 1000), 2);
+    EXPECT_EQ(watcher.getQueuedCount(), 2);
+}
+
+TEST_F(BrokerTest, MassDisconnectWillsArePublishedAsOneBatch)
+{
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    MQTT::Session watcher(broker, "watcher");
+    watcher.subscribe("tower/+/will", options);
+    std::vector<std::string> received;
+    watcher.setDeliverCallback([&](const MQTT::MessageRef& message, uint16_t, MQTT::QoS, bool) {
+        received.push_back(std::string(message->getTopic()));
+    });
+    watcher.connect();
+
+    bool sessionPresent;
+    for (int i = 0; i < 100; i++) {
+        std::string clientId = "device" + std::to_string(i);
+        MQTT::Session* session = broker->openSession(clientId, true, sessionPresent);
+        session->connect();
+        session->setWill(makeWill("tower/" + clientId + "/will", 0));
+        broker->closeSession(session);
+    }
+    EXPECT_EQ(broker->getPendingWillCount(), 100);
+    EXPECT_EQ(broker->fireWills(MQTT::MessageBlock::currentTime()), 100);
+    EXPECT_EQ(received.size(), 100);
+}
@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include "../src/Capture.h"
+
+namespace MQTT {
+
+class CaptureTest : public ::testing::Test {
+protected:
+    std::string path;
+
+    void SetUp() override {
+        path = (std::filesystem::temp_directory_path() /
+                ("flowmq-capture-" + std::to_string(::testing::UnitTest::GetInstance()->random_seed()) + "-" +
+                 ::testing::UnitTest::GetInstance()->current_test_info()->name())).string();
+    }
+
+    void TearDown() override {
+        Capture::stop();
+        std::filesystem::remove(path);
+    }
+};
+
+TEST_F(CaptureTest, RecordsEachConnectionInOrder) {
+    Capture::start(path);
+    {
+        Capture::Stream first;
+        Capture::Stream second;
+        const uint8_t connect[] = {0x10, 0x00};
+        const uint8_t ping[] = {0xC0, 0x00};
+        first.record(connect, sizeof(connect));
+        second.record(connect, sizeof(connect));
+        first.record(ping, sizeof(ping));
+    }
+    Capture::stop();
+
+    std::vector<CaptureRecord> records = Capture::read(path);
+    ASSERT_EQ(records.size(), 7u);
+    std::vector<CaptureEvent> events[2];
+    for (size_t i = 0; i < records.size(); i++) {
+        ASSERT_LT(records[i].connection, 2u);
+        events[records[i].connection].push_back(records[i].event);
+        if (i > 0) {
+            EXPECT_LE(records[i - 1].at, records[i].at);
+        }
+    }
+    std::vector<CaptureEvent> expected{CaptureEvent::OPEN, CaptureEvent::DATA, CaptureEvent::DATA, CaptureEvent::CLOSE};
+    EXPECT_EQ(events[0], expected);
+    EXPECT_EQ(events[1].size(), 3u);
+    auto ping = std::find_if(records.begin(), records.end(), [](const CaptureRecord &record) {
+        return record.event == CaptureEvent::DATA && record.bytes[0] == 0xC0;
+    });
+    ASSERT_NE(ping, records.end());
+    EXPECT_EQ(ping->bytes, (std::vector<uint8_t>{0xC0, 0x00}));
+}
+
+TEST_F(CaptureTest, ConnectionsOpenedBeforeStartAreNotRecorded) {
+    Capture::Stream earlier;
+    Capture::start(path);
+    const uint8_t ping[] = {0xC0, 0x00};
+    earlier.record(ping, sizeof(ping));
+    Capture::stop();
+    EXPECT_TRUE(Capture::read(path).empty());
+}
+
+TEST_F(CaptureTest, RejectsOtherFilesAndKeepsWholeRecords) {
+    std::ofstream(path) << "not a capture";
+    EXPECT_THROW(Capture::read(path), std::runtime_error);
+
+    Capture::start(path);
+    {
+        Capture::Stream stream;
+        const uint8_t ping[] = {0xC0, 0x00};
+        stream.record(ping, sizeof(ping));
+    }
+    Capture::stop();
+    // A broker killed mid-write leaves a partial record at the end
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+    std::vector<CaptureRecord> records = Capture::read(path);
+    ASSERT_EQ(records.size(), 2u);
+    EXPECT_EQ(records[1].event, CaptureEvent::DATA);
+}
+
+}
@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+#include "../src/DeliveryInbox.h"
+#include <poll.h>
+#include <thread>
+#include <vector>
+
+namespace MQTT {
+
+static bool readable(int fd) {
+    struct pollfd pfd{fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1;
+}
+
+static DeliveryInbox::Delivery delivery(const std::string &topic) {
+    return DeliveryInbox::Delivery{MessageRef::create(Message(topic, "payload")), QoS::QOS_1, false};
+}
+
+TEST(DeliveryInboxTest, DrainsInArrivalOrder) {
+    DeliveryInbox inbox;
+    EXPECT_TRUE(inbox.empty());
+    EXPECT_FALSE(readable(inbox.getFd()));
+    inbox.push(delivery("a"));
+    inbox.push(delivery("b"));
+    inbox.push(delivery("c"));
+    EXPECT_TRUE(readable(inbox.getFd()));
+
+    std::vector<std::string> topics;
+    EXPECT_EQ(inbox.drain([&](DeliveryInbox::Delivery &d) { topics.push_back(std::string(d.message->getTopic())); }), 3);
+    EXPECT_EQ(topics, (std::vector<std::string>{"a", "b", "c"}));
+    EXPECT_TRUE(inbox.empty());
+    EXPECT_FALSE(readable(inbox.getFd()));
+
+    // The next push after a drain wakes the consumer again
+    inbox.push(delivery("d"));
+    EXPECT_TRUE(readable(inbox.getFd()));
+}
+
+TEST(DeliveryInboxTest, ConcurrentProducersKeepPerProducerOrder) {
+    constexpr int producers = 4;
+    constexpr int perProducer = 10000;
+    DeliveryInbox inbox;
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&inbox, p]() {
+            for (int i = 0; i < perProducer; i++) {
+                inbox.push(delivery(std::to_string(p) + "/" + std::to_string(i)));
+            }
+        });
+    }
+
+    std::vector<int> next(producers, 0);
+    size_t received = 0;
+    auto consume = [&](DeliveryInbox::Delivery &d) {
+        const std::string topic(d.message->getTopic());
+        size_t slash = topic.find('/');
+        int p = std::stoi(topic.substr(0, slash));
+        EXPECT_EQ(std::stoi(topic.substr(slash + 1)), next[p]++);
+    };
+    while (received < producers * perProducer) {
+        received += inbox.drain(consume);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_TRUE(inbox.empty());
+}
+
+}
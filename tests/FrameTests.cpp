@@ -41,6 +41,90 @@ TEST_F(FrameTest, ParseConnectPacket)
     EXPECT_EQ(packet.clientId, "abc");
 }
 
+TEST_F(FrameTest, ParseConnectPropertiesBigEndian)
+{
+    std::vector<uint8_t> payload = {
+        0x00, 0x04, 'M', 'Q', 'T', 'T',  // Protocol name
+        0x05,                            // Protocol version
+        0b00000000,                      // Connect flags
+        0x00, 0x3C,                      // Keep alive
+        0x08,                            // Properties length
+        0x21, 0x01, 0x02,                // Receive Maximum: 258
+        0x11, 0x00, 0x01, 0x00, 0x00,    // Session Expiry Interval: 65536
+        0x00, 0x03, 'a', 'b', 'c'        // Client ID
+    };
+
+    auto packet = frame->parseConnect(payload.data(), payload.size());
+
+    EXPECT_FALSE(packet.cleanStart);
+    EXPECT_EQ(std::get<uint16_t>(*packet.getProperty(PropertyID::RECEIVE_MAXIMUM)), 258);
+    EXPECT_EQ(std::get<uint32_t>(*packet.getProperty(PropertyID::SESSION_EXPIRY_INTERVAL)), 65536);
+    EXPECT_EQ(packet.clientId, "abc");
+}
+
+TEST_F(FrameTest, ParseConnectMqtt311HasNoProperties)
+{
+    std::vector<uint8_t> payload = {
+        0x00, 0x04, 'M', 'Q', 'T', 'T',  // Protocol name
+        0x04,                            // Protocol version
+        0b00000010,                      // Connect flags
+        0x00, 0x3C,                      // Keep alive
+        0x00, 0x03, 'a', 'b', 'c'        // Client ID
+    };
+
+    auto packet = frame->parseConnect(payload.data(), payload.size());
+
+    EXPECT_EQ(packet.protocolVersion, Version::MQTT311);
+    EXPECT_EQ(packet.clientId, "abc");
+}
+
+TEST_F(FrameTest, SerializeConnackWithReceiveMaximum)
+{
+    ConnackPacket connack{PacketType::CONNACK, true, ReasonCode::SUCCESS};
+    connack.setProperty(PropertyID::RECEIVE_MAXIMUM, static_cast<uint16_t>(1024));
+    EXPECT_EQ(frame->serialize(connack), (std::vector<uint8_t>{0x20, 0x06, 0x01, 0x00, 0x03, 0x21, 0x04, 0x00}));
+
+    Frame mqtt311(Version::MQTT311);
+    EXPECT_EQ(mqtt311.serialize(connack), (std::vector<uint8_t>{0x20, 0x02, 0x01, 0x00}));
+}
+
+TEST_F(FrameTest, ParseAcknowledgementsSentToClients)
+{
+    Frame mqtt311(Version::MQTT311);
+    ConnackPacket connack{PacketType::CONNACK, true, ReasonCode::SUCCESS};
+    std::vector<uint8_t> bytes = mqtt311.serialize(connack);
+    auto parsedConnack = std::static_pointer_cast<ConnackPacket>(mqtt311.parse(bytes.data(), bytes.size()));
+    EXPECT_TRUE(parsedConnack->sessionPresent);
+    EXPECT_EQ(parsedConnack->reasonCode, ReasonCode::SUCCESS);
+
+    SubackPacket suback{9};
+    suback.reasonCodes = {ReasonCode::GRANTED_QOS_1, ReasonCode::GRANTED_QOS_0};
+    bytes = mqtt311.serialize(suback);
+    auto parsedSuback = std::static_pointer_cast<SubackPacket>(mqtt311.parse(bytes.data(), bytes.size()));
+    EXPECT_EQ(parsedSuback->packetId, 9);
+    EXPECT_EQ(parsedSuback->reasonCodes, suback.reasonCodes);
+
+    // A PUBACK without a reason code means success; nothing past the packet may be read
+    std::vector<uint8_t> puback = {0x40, 0x02, 0x00, 0x05};
+    auto parsedPuback = std::static_pointer_cast<PubackPacket>(frame->parse(puback.data(), puback.size()));
+    EXPECT_EQ(parsedPuback->packetId, 5);
+    EXPECT_EQ(parsedPuback->reasonCode, ReasonCode::SUCCESS);
+    std::vector<uint8_t> pubrec = {0x50, 0x03, 0x00, 0x06, 0x10};
+    auto parsedPubrec = std::static_pointer_cast<PubrecPacket>(frame->parse(pubrec.data(), pubrec.size()));
+    EXPECT_EQ(parsedPubrec->reasonCode, ReasonCode::NO_MATCHING_SUBSCRIBERS);
+}
+
+TEST_F(FrameTest, PacketLength)
+{
+    std::vector<uint8_t> pingreq = {0xC0, 0x00, 0xC0};
+    EXPECT_EQ(Frame::packetLength(pingreq.data(), pingreq.size()), 2);
+    EXPECT_EQ(Frame::packetLength(pingreq.data(), 1), 0);
+
+    std::vector<uint8_t> partial = {0x30, 0x80, 0x01, 0x00};
+    EXPECT_EQ(Frame::packetLength(partial.data(), partial.size()), 0);
+    EXPECT_EQ(Frame::packetLength(partial.data(), 2), 0);
+}
+
 TEST_F(FrameTest, ParsePublishPacket) 
 {
     FixedHeader header;
@@ -166,6 +250,17 @@ TEST_F(FrameTest, SerializePublishPacket)
     // ... Add more specific checks for the serialized packet
 }
 
+TEST_F(FrameTest, SerializePublishMqtt311HasNoProperties)
+{
+    PublishPacket packet{"a/b", {'x'}, QoS::QOS_1, false};
+    packet.packetId = 7;
+    packet.dup = true;
+
+    Frame mqtt311(Version::MQTT311);
+    EXPECT_EQ(mqtt311.serialize(packet),
+              (std::vector<uint8_t>{0x3a, 0x08, 0x00, 0x03, 'a', '/', 'b', 0x00, 0x07, 'x'}));
+}
+
 TEST_F(FrameTest, DecodeRemainingLength) 
 {
     std::vector<uint8_t> input = {0x7F};
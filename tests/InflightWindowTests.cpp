@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+#include "InflightWindow.h"
+
+using namespace MQTT;
+
+static MessageRef message(int i) {
+    return MessageRef::create(Message("inflight/" + std::to_string(i), "payload", QoS::QOS_1));
+}
+
+static std::vector<uint16_t> packetIds(InflightWindow& window) {
+    std::vector<uint16_t> ids;
+    window.forEach([&](const InflightWindow::Entry& entry) { ids.push_back(entry.packetId); });
+    return ids;
+}
+
+TEST(InflightWindowTest, AllocatesSequentialIds) {
+    InflightWindow window;
+    EXPECT_EQ(window.push(message(1), QoS::QOS_1), 1);
+    EXPECT_EQ(window.push(message(2), QoS::QOS_1), 2);
+    EXPECT_EQ(window.push(message(3), QoS::QOS_2), 3);
+    EXPECT_EQ(window.size(), 3);
+    ASSERT_NE(window.find(2), nullptr);
+    EXPECT_EQ(window.find(2)->message->getTopic(), "inflight/2");
+    EXPECT_EQ(window.find(4), nullptr);
+    EXPECT_EQ(window.find(0), nullptr);
+}
+
+TEST(InflightWindowTest, AckOutOfOrderKeepsSendOrder) {
+    InflightWindow window;
+    for (int i = 0; i < 100; i++) {
+        window.push(message(i), QoS::QOS_1);
+    }
+    EXPECT_TRUE(window.erase(50));
+    EXPECT_FALSE(window.erase(50));
+    EXPECT_TRUE(window.erase(1));
+    std::vector<uint16_t> ids = packetIds(window);
+    ASSERT_EQ(ids.size(), 98);
+    EXPECT_EQ(ids.front(), 2);
+    EXPECT_EQ(ids[48], 51);
+    EXPECT_EQ(ids.back(), 100);
+}
+
+TEST(InflightWindowTest, RespectsLimit) {
+    InflightWindow window(2);
+    window.push(message(1), QoS::QOS_1);
+    EXPECT_FALSE(window.full());
+    window.push(message(2), QoS::QOS_1);
+    EXPECT_TRUE(window.full());
+    window.erase(1);
+    EXPECT_FALSE(window.full());
+    EXPECT_EQ(window.push(message(3), QoS::QOS_1), 1);
+}
+
+TEST(InflightWindowTest, RestoredIdsKeepSendOrder) {
+    InflightWindow window;
+    window.restore(65534, message(1), QoS::QOS_1);
+    window.restore(3, message(2), QoS::QOS_1);
+    EXPECT_EQ(window.push(message(3), QoS::QOS_1), 1);
+    EXPECT_EQ(window.push(message(4), QoS::QOS_1), 2);
+    EXPECT_EQ(window.push(message(5), QoS::QOS_1), 4);
+    EXPECT_EQ(packetIds(window), (std::vector<uint16_t>{65534, 3, 1, 2, 4}));
+
+    for (uint16_t id : {65534, 3, 1, 2, 4}) {
+        EXPECT_TRUE(window.erase(id));
+    }
+    EXPECT_TRUE(window.empty());
+    EXPECT_EQ(window.push(message(6), QoS::QOS_1), 1);
+}
+
+TEST(InflightWindowTest, OutOfOrderAcksFreeTheirIds) {
+    InflightWindow window(10);
+    for (int i = 1; i <= 10; i++) {
+        window.push(message(i), QoS::QOS_1);
+    }
+    EXPECT_TRUE(window.full());
+    for (uint16_t id : {7, 3, 9}) {
+        EXPECT_TRUE(window.erase(id));
+    }
+    EXPECT_FALSE(window.full());
+    EXPECT_EQ(window.push(message(11), QoS::QOS_1), 3);
+    EXPECT_EQ(window.push(message(12), QoS::QOS_1), 7);
+    EXPECT_EQ(window.push(message(13), QoS::QOS_1), 9);
+    EXPECT_TRUE(window.full());
+    EXPECT_EQ(packetIds(window), (std::vector<uint16_t>{1, 2, 4, 5, 6, 8, 10, 3, 7, 9}));
+    EXPECT_EQ(window.find(7)->message->getTopic(), "inflight/12");
+}
+
+TEST(InflightWindowTest, UnackedMessageDoesNotStallTheWindow) {
+    InflightWindow window(10);
+    uint16_t held = window.push(message(0), QoS::QOS_2);
+    window.release(held);
+    size_t bytes = window.getMemoryBytes();
+    // The ids in use never spread beyond the Receive Maximum, however long one is held
+    for (int i = 1; i <= 100000; i++) {
+        ASSERT_FALSE(window.full());
+        uint16_t id = window.push(message(i), QoS::QOS_1);
+        EXPECT_LE(id, 10);
+        if (i % 9 == 0) {
+            for (int j = 2; j <= 10; j++) {
+                window.erase(j);
+            }
+        }
+    }
+    EXPECT_EQ(window.getMemoryBytes(), bytes);
+    EXPECT_NE(window.find(held), nullptr);
+}
+
+TEST(InflightWindowTest, ReleasedQos2HoldsId) {
+    InflightWindow window;
+    uint16_t qos1 = window.push(message(1), QoS::QOS_1);
+    uint16_t qos2 = window.push(message(2), QoS::QOS_2);
+    EXPECT_FALSE(window.release(qos1));
+    EXPECT_TRUE(window.release(qos2));
+    ASSERT_NE(window.find(qos2), nullptr);
+    EXPECT_TRUE(window.find(qos2)->released);
+    EXPECT_EQ(window.find(qos2)->message, nullptr);
+    EXPECT_EQ(window.size(), 2);
+    EXPECT_TRUE(window.erase(qos2));
+    EXPECT_EQ(window.size(), 1);
+}
+
+TEST(InflightWindowTest, GrowsBeyondInitialCapacity) {
+    InflightWindow window;
+    for (int i = 1; i <= 1000; i++) {
+        EXPECT_EQ(window.push(message(i), QoS::QOS_1), i);
+    }
+    for (int i = 1; i <= 1000; i++) {
+        ASSERT_NE(window.find(i), nullptr);
+        EXPECT_EQ(window.find(i)->message->getTopic(), "inflight/" + std::to_string(i));
+    }
+}
+
+TEST(PacketIdSetTest, InsertAndErase) {
+    PacketIdSet ids;
+    EXPECT_FALSE(ids.contains(7));
+    EXPECT_TRUE(ids.insert(7));
+    EXPECT_FALSE(ids.insert(7));
+    EXPECT_TRUE(ids.insert(65535));
+    EXPECT_TRUE(ids.contains(65535));
+    EXPECT_EQ(ids.size(), 2);
+    EXPECT_TRUE(ids.erase(7));
+    EXPECT_FALSE(ids.erase(7));
+    EXPECT_EQ(ids.size(), 1);
+}
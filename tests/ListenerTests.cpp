@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <chrono>
+#include <vector>
+#include "../src/Listener.h"
+#include "../src/Log.h"
+
+namespace MQTT {
+
+class ListenerTest : public ::testing::Test {
+protected:
+    // The listener logs its port; keep that out of the test output
+    void SetUp() override {
+        Log::setLevel(LogLevel::WARN);
+    }
+
+    void TearDown() override {
+        Log::setLevel(LogLevel::INFO);
+    }
+};
+
+TEST_F(ListenerTest, BacklogHoldsAConnectStorm) {
+    Listener listener(0);
+    listener.start();
+    ASSERT_GT(listener.getPort(), 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(listener.getPort());
+
+    // Nobody accepts: every handshake has to wait in the backlog
+    std::vector<pollfd> clients;
+    for (int i = 0; i < 100; i++) {
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        ASSERT_GE(sockfd, 0);
+        fcntl(sockfd, F_SETFL, O_NONBLOCK);
+        connect(sockfd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+        clients.push_back({sockfd, POLLOUT, 0});
+    }
+    // A dropped SYN is only sent again after a second
+    std::vector<int> sockets;
+    for (const pollfd &client : clients) {
+        sockets.push_back(client.fd);
+    }
+    size_t connected = 0;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+    while (connected < clients.size() && std::chrono::steady_clock::now() < deadline) {
+        poll(clients.data(), clients.size(), 50);
+        for (pollfd &client : clients) {
+            if (client.fd >= 0 && client.revents) {
+                int error = 0;
+                socklen_t length = sizeof(error);
+                getsockopt(client.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+                connected += error == 0;
+                // Negative descriptors are skipped by poll()
+                client.fd = -1;
+            }
+        }
+    }
+    for (int sockfd : sockets) {
+        close(sockfd);
+    }
+    EXPECT_EQ(connected, clients.size());
+    listener.stop();
+}
+
+}
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <string>
+#include "../src/Log.h"
+
+namespace MQTT {
+
+class LogTest : public ::testing::Test {
+protected:
+    FILE *output = tmpfile();
+
+    void SetUp() override {
+        Log::flush();
+        Log::setOutput(output);
+    }
+
+    void TearDown() override {
+        Log::flush();
+        Log::setOutput(stderr);
+        Log::setLevel(LogLevel::INFO);
+        fclose(output);
+    }
+
+    std::string written() {
+        Log::flush();
+        std::string text;
+        char chunk[256];
+        rewind(output);
+        size_t length;
+        while ((length = fread(chunk, 1, sizeof(chunk), output)) > 0) {
+            text.append(chunk, length);
+        }
+        return text;
+    }
+};
+
+TEST_F(LogTest, DisabledStatementsDoNotEvaluateArguments) {
+    Log::setLevel(LogLevel::WARN);
+    int evaluated = 0;
+    auto argument = [&] { return ++evaluated; };
+    LOG_DEBUG("debug %d", argument());
+    EXPECT_EQ(evaluated, 0);
+    LOG_WARN("warn %d", argument());
+    EXPECT_EQ(evaluated, 1);
+    std::string text = written();
+    EXPECT_EQ(text.find("debug"), std::string::npos);
+    EXPECT_NE(text.find(" WARN  ["), std::string::npos) << text;
+    EXPECT_NE(text.find("] warn 1\n"), std::string::npos) << text;
+}
+
+TEST_F(LogTest, RecordsOfAThreadKeepTheirOrder) {
+    LOG_INFO("first");
+    LOG_ERROR("second %s", "record");
+    LOG_INFO("third");
+    std::string text = written();
+    size_t first = text.find("] first\n");
+    size_t second = text.find("] second record\n");
+    size_t third = text.find("] third\n");
+    ASSERT_NE(first, std::string::npos) << text;
+    ASSERT_NE(second, std::string::npos) << text;
+    ASSERT_NE(third, std::string::npos) << text;
+    EXPECT_LT(first, second);
+    EXPECT_LT(second, third);
+}
+
+TEST_F(LogTest, LongMessagesAreTruncated) {
+    LOG_INFO("%s", std::string(2 * Log::RECORD_SIZE, 'x').c_str());
+    std::string text = written();
+    size_t start = text.find("x");
+    ASSERT_NE(start, std::string::npos);
+    EXPECT_LT(text.size() - start, Log::RECORD_SIZE);
+}
+
+TEST_F(LogTest, ParseLevel) {
+    EXPECT_EQ(Log::parseLevel("trace"), LogLevel::TRACE);
+    EXPECT_EQ(Log::parseLevel("off"), LogLevel::OFF);
+    EXPECT_THROW(Log::parseLevel("verbose"), std::runtime_error);
+}
+
+}
@@ -0,0 +1,132 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "../src/Memory.h"
+#include "../src/Trie.h"
+#include "../src/Broker.h"
+#include "../src/Session.h"
+#include "../src/Frame.h"
+#include "../src/Log.h"
+
+namespace MQTT {
+
+// Long enough that every level and filter string lives on the heap
+static const std::string FILTER = "building-with-a-long-name/floor-with-a-long-name/+/temperature";
+
+TEST(MemoryTest, ContainersChargeWhatTheyHold) {
+    int64_t before = Metrics::getMemory(MemoryTag::BUFFERS);
+    {
+        std::vector<uint64_t, TaggedAllocator<uint64_t, MemoryTag::BUFFERS>> values;
+        values.reserve(100);
+        EXPECT_EQ(Metrics::getMemory(MemoryTag::BUFFERS), before + 800);
+        values.reserve(200);
+        EXPECT_EQ(Metrics::getMemory(MemoryTag::BUFFERS), before + 1600);
+    }
+    EXPECT_EQ(Metrics::getMemory(MemoryTag::BUFFERS), before);
+}
+
+TEST(MemoryTest, TrieGivesBackWhatFiltersTook) {
+    int64_t before = Metrics::getMemory(MemoryTag::TRIE);
+    {
+        Trie trie;
+        EXPECT_GT(Metrics::getMemory(MemoryTag::TRIE), before);
+        // Maps keep their buckets once emptied, which is memory still held
+        trie.insert(FILTER);
+        trie.remove(FILTER);
+        int64_t empty = Metrics::getMemory(MemoryTag::TRIE);
+        trie.insert(FILTER);
+        trie.insert(FILTER + "/sensor-with-a-long-name");
+        int64_t filled = Metrics::getMemory(MemoryTag::TRIE);
+        // Five nodes, their levels and the two filters
+        EXPECT_GT(filled, empty + 2 * static_cast<int64_t>(FILTER.size()));
+        trie.remove(FILTER);
+        EXPECT_LT(Metrics::getMemory(MemoryTag::TRIE), filled);
+        EXPECT_GT(Metrics::getMemory(MemoryTag::TRIE), empty);
+        trie.remove(FILTER + "/sensor-with-a-long-name");
+        EXPECT_EQ(Metrics::getMemory(MemoryTag::TRIE), empty);
+        // Nodes still in the trie when it goes are given back too
+        trie.insert(FILTER);
+    }
+    EXPECT_EQ(Metrics::getMemory(MemoryTag::TRIE), before);
+}
+
+TEST(MemoryTest, SubscriptionsAreChargedToTheirSubsystems) {
+    int64_t before[static_cast<int>(MemoryTag::COUNT)];
+    for (int i = 0; i < static_cast<int>(MemoryTag::COUNT); i++) {
+        before[i] = Metrics::getMemory(static_cast<MemoryTag>(i));
+    }
+    {
+        Broker broker;
+        SubscriptionOptions options{QoS::QOS_1, false, false, RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+        Session warmup(&broker, "warmup");
+        warmup.subscribe(FILTER, options);
+        warmup.unsubscribe(FILTER);
+        int64_t trie = Metrics::getMemory(MemoryTag::TRIE);
+        int64_t index = Metrics::getMemory(MemoryTag::SUBSCRIPTIONS);
+        Session session(&broker, "a-client-id-longer-than-the-inline-buffer");
+        int64_t sessions = Metrics::getMemory(MemoryTag::SESSIONS);
+        EXPECT_GE(sessions, before[static_cast<int>(MemoryTag::SESSIONS)] + static_cast<int64_t>(sizeof(Session)));
+
+        session.subscribe(FILTER, options);
+        EXPECT_GT(Metrics::getMemory(MemoryTag::TRIE), trie);
+        EXPECT_GT(Metrics::getMemory(MemoryTag::SUBSCRIPTIONS), index + static_cast<int64_t>(FILTER.size()));
+        EXPECT_GT(Metrics::getMemory(MemoryTag::SESSIONS), sessions);
+
+        session.unsubscribe(FILTER);
+        EXPECT_EQ(Metrics::getMemory(MemoryTag::TRIE), trie);
+        EXPECT_EQ(Metrics::getMemory(MemoryTag::SUBSCRIPTIONS), index);
+        EXPECT_EQ(Metrics::getMemory(MemoryTag::SESSIONS), sessions);
+    }
+    for (MemoryTag tag : {MemoryTag::TRIE, MemoryTag::SUBSCRIPTIONS, MemoryTag::SESSIONS}) {
+        EXPECT_EQ(Metrics::getMemory(tag), before[static_cast<int>(tag)]) << Metrics::memoryTagName(tag);
+    }
+}
+
+TEST(MemoryTest, MessagesAndTheirEncodingsAreCharged) {
+    int64_t before = Metrics::getMemory(MemoryTag::MESSAGES);
+    {
+        MessageRef message = MessageRef::create(Message("sensors/1", std::string(1000, 'x'), QoS::QOS_1, false));
+        int64_t created = Metrics::getMemory(MemoryTag::MESSAGES);
+        EXPECT_GE(created, before + 1000);
+        // The first encoding is cached on the message for the next subscribers
+        Frame frame;
+        std::vector<uint8_t> buffer;
+        frame.serializePublish(message, QoS::QOS_1, false, 7, false, buffer);
+        EXPECT_GE(Metrics::getMemory(MemoryTag::MESSAGES), created + 1000);
+    }
+    EXPECT_EQ(Metrics::getMemory(MemoryTag::MESSAGES), before);
+}
+
+class MemoryLimitTest : public ::testing::Test {
+protected:
+    // Crossing a limit is logged; keep that out of the test output
+    void SetUp() override {
+        Log::setLevel(LogLevel::OFF);
+    }
+
+    void TearDown() override {
+        Memory::setLimit(MemoryTag::TRIE, 0);
+        Memory::checkLimits();
+        Log::setLevel(LogLevel::INFO);
+    }
+};
+
+TEST_F(MemoryLimitTest, LimitsAreCheckedAndDumped) {
+    EXPECT_EQ(Memory::parseTag("subscriptions"), MemoryTag::SUBSCRIPTIONS);
+    EXPECT_THROW(Memory::parseTag("heap"), std::runtime_error);
+
+    Trie trie;
+    trie.insert(FILTER);
+    Memory::setLimit(MemoryTag::TRIE, 1);
+    EXPECT_FALSE(Memory::isOverLimit(MemoryTag::TRIE));
+    Memory::checkLimits();
+    EXPECT_TRUE(Memory::isOverLimit(MemoryTag::TRIE));
+    EXPECT_FALSE(Memory::isOverLimit(MemoryTag::MESSAGES));
+    EXPECT_NE(Memory::format().find("trie bytes=" + std::to_string(Metrics::getMemory(MemoryTag::TRIE)) + " limit=1\n"),
+              std::string::npos);
+
+    Memory::setLimit(MemoryTag::TRIE, 0);
+    Memory::checkLimits();
+    EXPECT_FALSE(Memory::isOverLimit(MemoryTag::TRIE));
+}
+
+}
@@ -0,0 +1,132 @@
+#include <gtest/gtest.h>
+#include "../src/MessageRef.h"
+#include "../src/Frame.h"
+#include <thread>
+#include <vector>
+
+namespace MQTT {
+
+TEST(MessageRefTest, BlockHoldsEveryField) {
+    Message message("sensor/1", "payload", QoS::QOS_1, true);
+    message.publisherId = "publisher";
+    message.properties = {0x01, 0x01};
+    message.id = 42;
+    message.expiresAt = 1000;
+    MessageRef ref = MessageRef::create(message);
+    EXPECT_EQ(ref->getTopic(), "sensor/1");
+    EXPECT_EQ(std::string(ref->getPayload().begin(), ref->getPayload().end()), "payload");
+    EXPECT_EQ(ref->getPublisherId(), "publisher");
+    EXPECT_EQ(ref->getProperties().toVector(), message.properties);
+    EXPECT_EQ(ref->getQos(), QoS::QOS_1);
+    EXPECT_TRUE(ref->isRetain());
+    EXPECT_EQ(ref->getId(), 42);
+    EXPECT_EQ(ref->getExpiresAt(), 1000);
+    EXPECT_GT(ref->getReceivedAt(), 0);
+    // Strings and bytes follow the header in the same allocation
+    const uint8_t *header = reinterpret_cast<const uint8_t *>(ref.get());
+    EXPECT_EQ(reinterpret_cast<const uint8_t *>(ref->getTopic().data()), header + sizeof(MessageBlock));
+    EXPECT_EQ(ref->getPayload().end(), header + sizeof(MessageBlock) + 8 + 9 + 2 + 7);
+}
+
+TEST(MessageRefTest, CopiesShareOneBlock) {
+    MessageRef ref = MessageRef::create("a/b", Message("a/b", "x").payload, QoS::QOS_0, false);
+    EXPECT_EQ(ref.useCount(), 1);
+    MessageRef copy = ref;
+    EXPECT_EQ(copy, ref);
+    EXPECT_EQ(ref.useCount(), 2);
+    MessageRef moved = std::move(copy);
+    EXPECT_FALSE(copy);
+    EXPECT_EQ(ref.useCount(), 2);
+    moved.reset();
+    EXPECT_EQ(ref.useCount(), 1);
+}
+
+TEST(MessageRefTest, ReleasedOnOtherThreads) {
+    MessageRef ref = MessageRef::create(Message("a/b", "payload", QoS::QOS_1));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([copy = ref]() mutable {
+            for (int j = 0; j < 10000; j++) {
+                MessageRef inner = copy;
+            }
+            copy.reset();
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(ref.useCount(), 1);
+}
+
+TEST(MessageRefTest, EncodingIsSharedAcrossSubscribers) {
+    Frame frame(Version::MQTT311);
+    MessageRef ref = MessageRef::create(Message("a/b", "payload", QoS::QOS_1));
+    std::vector<uint8_t> first, second;
+    frame.serializePublish(ref, QoS::QOS_1, false, 1, false, first);
+    const EncodedPublish *cached = ref->getEncoded();
+    ASSERT_NE(cached, nullptr);
+    frame.serializePublish(ref, QoS::QOS_1, false, 0x0203, true, second);
+    EXPECT_EQ(ref->getEncoded(), cached);
+
+    // Only the packet id and the DUP bit differ
+    ASSERT_EQ(first.size(), second.size());
+    EXPECT_EQ(second[0], first[0] | 0x08);
+    EXPECT_EQ(first[cached->packetIdOffset + 1], 1);
+    EXPECT_EQ(second[cached->packetIdOffset], 2);
+    EXPECT_EQ(second[cached->packetIdOffset + 1], 3);
+
+    // Matches the encoding of the equivalent packet
+    PublishPacket publish{"a/b", Message("a/b", "payload").payload, QoS::QOS_1, false};
+    publish.packetId = 1;
+    EXPECT_EQ(frame.serialize(publish), first);
+
+    // A subscriber at another QoS gets its own encoding without replacing the cached one
+    std::vector<uint8_t> atMostOnce;
+    frame.serializePublish(ref, QoS::QOS_0, false, 0, false, atMostOnce);
+    EXPECT_EQ(atMostOnce.size(), first.size() - 2);
+    EXPECT_EQ(ref->getEncoded(), cached);
+}
+
+TEST(MessageRefTest, Mqtt5EncodingCarriesProperties) {
+    Frame frame(Version::MQTT5);
+    Message message("a/b", "payload", QoS::QOS_0);
+    message.properties = frame.serializeProperties({{PropertyID::CONTENT_TYPE, std::string("text/plain")}});
+    std::vector<uint8_t> bytes;
+    frame.serializePublish(MessageRef::create(message), QoS::QOS_0, false, 0, false, bytes);
+
+    PublishPacket publish{"a/b", message.payload, QoS::QOS_0, false};
+    publish.setProperty(PropertyID::CONTENT_TYPE, std::string("text/plain"));
+    EXPECT_EQ(frame.serialize(publish), bytes);
+}
+
+TEST(MessageRefTest, RemainingExpiryIsPatchedPerDelivery) {
+    Frame frame(Version::MQTT5);
+    Message message("a/b", "payload", QoS::QOS_1);
+    message.expiresAt = MessageBlock::currentTime() + 30500;
+    MessageRef ref = MessageRef::create(message);
+    EXPECT_EQ(ref->getRemainingExpiry(message.expiresAt - 30500), 31);
+    EXPECT_EQ(ref->getRemainingExpiry(message.expiresAt + 1), 1);
+
+    std::vector<uint8_t> bytes;
+    frame.serializePublish(ref, QoS::QOS_1, false, 7, false, bytes);
+    const EncodedPublish *cached = ref->getEncoded();
+    ASSERT_NE(cached->expiryOffset, 0);
+    EXPECT_EQ(bytes[cached->expiryOffset - 1], static_cast<uint8_t>(PropertyID::MESSAGE_EXPIRY_INTERVAL));
+    uint32_t remaining = bytes[cached->expiryOffset] << 24 | bytes[cached->expiryOffset + 1] << 16 |
+                         bytes[cached->expiryOffset + 2] << 8 | bytes[cached->expiryOffset + 3];
+    EXPECT_GE(remaining, 30);
+    EXPECT_LE(remaining, 31);
+
+    // Parses back as an ordinary publish
+    auto parsed = std::static_pointer_cast<PublishPacket>(frame.parse(bytes.data(), bytes.size()));
+    EXPECT_EQ(parsed->packetId, 7);
+    EXPECT_EQ(std::get<uint32_t>(*parsed->getProperty(PropertyID::MESSAGE_EXPIRY_INTERVAL)), remaining);
+
+    // MQTT 3.1.1 has no properties to carry it
+    Frame legacy(Version::MQTT311);
+    std::vector<uint8_t> plain;
+    legacy.serializePublish(ref, QoS::QOS_1, false, 7, false, plain);
+    EXPECT_EQ(plain.size(), bytes.size() - 6);
+}
+
+} // namespace MQTT
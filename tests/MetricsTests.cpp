@@ -0,0 +1,129 @@
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include "../src/Metrics.h"
+#include "../src/MetricsServer.h"
+#include "../src/Broker.h"
+#include "../src/Session.h"
+#include "../src/Log.h"
+
+namespace MQTT {
+
+TEST(MetricsTest, CountersOfExitedThreadsAreKept) {
+    uint64_t before = Metrics::getCounter(Counter::PARSE_ERRORS);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([] {
+            for (int j = 0; j < 1000; j++) {
+                Metrics::increment(Counter::PARSE_ERRORS);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(Metrics::getCounter(Counter::PARSE_ERRORS), before + 4000);
+}
+
+TEST(MetricsTest, GaugesSumDeltasOfAllThreads) {
+    int64_t before = Metrics::getGauge(Gauge::CONNECTIONS);
+    Metrics::adjust(Gauge::CONNECTIONS, 3);
+    std::thread([] { Metrics::adjust(Gauge::CONNECTIONS, -1); }).join();
+    EXPECT_EQ(Metrics::getGauge(Gauge::CONNECTIONS), before + 2);
+    Metrics::adjust(Gauge::CONNECTIONS, -2);
+}
+
+TEST(MetricsTest, BucketsAreLogLinear) {
+    for (uint64_t value : {0ull, 1ull, 3ull, 4ull, 7ull, 8ull, 100ull, 1000000ull, ~0ull}) {
+        int bucket = Metrics::bucketOf(value);
+        ASSERT_LT(bucket, Metrics::BUCKETS);
+        EXPECT_LE(Metrics::bucketOf(value / 2), bucket);
+    }
+    EXPECT_EQ(Metrics::bucketOf(3), 3);
+    EXPECT_EQ(Metrics::bucketOf(4), 4);
+    // Four sub-buckets per power of two
+    EXPECT_EQ(Metrics::bucketOf(1024), Metrics::bucketOf(1279));
+    EXPECT_NE(Metrics::bucketOf(1279), Metrics::bucketOf(1280));
+    EXPECT_EQ(Metrics::bucketOf(2048), Metrics::bucketOf(1024) + 4);
+    // Values past the range share the last bucket
+    EXPECT_EQ(Metrics::bucketOf(uint64_t(1) << Metrics::MAX_MAGNITUDE), Metrics::BUCKETS - 1);
+    EXPECT_EQ(Metrics::bucketOf(~0ull), Metrics::BUCKETS - 1);
+    for (int bucket : {0, 3, 4, 7, 8, 100, Metrics::BUCKETS - 1}) {
+        EXPECT_EQ(Metrics::bucketOf(Metrics::bucketLowerBound(bucket)), bucket);
+    }
+}
+
+TEST(MetricsTest, PublishesAreCountedByOutcome) {
+    Broker broker;
+    Session session(&broker, "subscriber");
+    SubscriptionOptions options{QoS::QOS_0, false, false, RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    session.subscribe("metrics/a", options);
+    uint64_t routed = Metrics::getCounter(Counter::PUBLISHES_ROUTED);
+    uint64_t dropped = Metrics::getCounter(Counter::PUBLISHES_DROPPED);
+    uint64_t fanouts = Metrics::getHistogramCount(Histogram::FANOUT);
+
+    broker.publish(Message("metrics/a", "payload"));
+    broker.publish(Message("metrics/b", "payload"));
+    EXPECT_EQ(Metrics::getCounter(Counter::PUBLISHES_ROUTED), routed + 1);
+    EXPECT_EQ(Metrics::getCounter(Counter::PUBLISHES_DROPPED), dropped + 1);
+    EXPECT_EQ(Metrics::getHistogramCount(Histogram::FANOUT), fanouts + 2);
+}
+
+TEST(MetricsTest, ScrapeIsPrometheusText) {
+    Metrics::record(Histogram::FANOUT, 5);
+    Metrics::packetReceived(PacketType::PUBLISH);
+    std::string text = Metrics::scrape();
+    EXPECT_NE(text.find("# TYPE flowmq_fanout histogram\n"), std::string::npos);
+    EXPECT_NE(text.find("flowmq_fanout_bucket{le=\"7\"}"), std::string::npos);
+    EXPECT_NE(text.find("flowmq_fanout_bucket{le=\"+Inf\"}"), std::string::npos);
+    EXPECT_NE(text.find("flowmq_packets_received_total{type=\"publish\"}"), std::string::npos);
+    EXPECT_NE(text.find("# TYPE flowmq_queued_messages gauge\n"), std::string::npos);
+}
+
+static std::string httpGet(int port, const std::string &path) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    EXPECT_EQ(connect(sockfd, reinterpret_cast<sockaddr*>(&address), sizeof(address)), 0);
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    EXPECT_EQ(write(sockfd, request.data(), request.size()), static_cast<ssize_t>(request.size()));
+    std::string response;
+    char buffer[4096];
+    ssize_t length;
+    while ((length = read(sockfd, buffer, sizeof(buffer))) > 0) {
+        response.append(buffer, length);
+    }
+    close(sockfd);
+    return response;
+}
+
+class MetricsServerTest : public ::testing::Test {
+protected:
+    // The server logs where it listens; keep that out of the test output
+    void SetUp() override {
+        Log::setLevel(LogLevel::WARN);
+    }
+
+    void TearDown() override {
+        Log::setLevel(LogLevel::INFO);
+    }
+};
+
+TEST_F(MetricsServerTest, AnswersScrapes) {
+    MetricsServer server(0);
+    server.start();
+    ASSERT_GT(server.getPort(), 0);
+    std::string response = httpGet(server.getPort(), "/metrics");
+    EXPECT_EQ(response.compare(0, 15, "HTTP/1.1 200 OK"), 0) << response;
+    EXPECT_NE(response.find("flowmq_bytes_received_total"), std::string::npos);
+    EXPECT_EQ(httpGet(server.getPort(), "/").compare(0, 22, "HTTP/1.1 404 Not Found"), 0);
+    server.stop();
+}
+
+}
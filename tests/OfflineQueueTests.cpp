@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include "OfflineQueue.h"
+
+using namespace MQTT;
+
+class OfflineQueueTest : public ::testing::Test {
+protected:
+    std::string directory;
+
+    void SetUp() override {
+        directory = (std::filesystem::temp_directory_path() /
+                     ("flowmq-queue-" + std::to_string(::testing::UnitTest::GetInstance()->random_seed()) + "-" +
+                      ::testing::UnitTest::GetInstance()->current_test_info()->name())).string();
+        std::filesystem::remove_all(directory);
+    }
+
+    void TearDown() override {
+        std::filesystem::remove_all(directory);
+    }
+
+    static OfflineQueue::Entry entry(int i) {
+        return OfflineQueue::Entry{MessageRef::create(Message("queue/" + std::to_string(i), std::string(100, 'x'),
+                                                              QoS::QOS_1, i % 2 == 0)),
+                                   QoS::QOS_1, i % 3 == 0};
+    }
+
+    // A message that expires at expiresAt (ms since the epoch)
+    static OfflineQueue::Entry expiring(int i, uint64_t expiresAt) {
+        Message message("queue/" + std::to_string(i), std::string(100, 'x'), QoS::QOS_1);
+        message.expiresAt = expiresAt;
+        return OfflineQueue::Entry{MessageRef::create(message), QoS::QOS_1, false};
+    }
+};
+
+TEST_F(OfflineQueueTest, DropsPastLimitWithoutSpillDirectory) {
+    OfflineQueue queue(1024);
+    int accepted = 0;
+    for (int i = 0; i < 100; i++) {
+        accepted += queue.push(entry(i));
+    }
+    EXPECT_EQ(queue.size(), accepted);
+    EXPECT_EQ(queue.getDroppedCount(), 100 - accepted);
+    EXPECT_LE(queue.getMemoryBytes(), 1024);
+
+    OfflineQueue::Entry popped;
+    ASSERT_TRUE(queue.pop(popped));
+    EXPECT_EQ(popped.message->getTopic(), "queue/0");
+}
+
+TEST_F(OfflineQueueTest, SpillsInOrder) {
+    OfflineQueue queue(4096, directory);
+    const int count = 5000;
+    int next = 0;
+    for (int i = 0; i < count; i++) {
+        EXPECT_TRUE(queue.push(entry(i)));
+        // Interleave draining with new arrivals while part of the queue is on disk
+        if (i % 3 == 0) {
+            OfflineQueue::Entry popped;
+            ASSERT_TRUE(queue.pop(popped));
+            EXPECT_EQ(popped.message->getTopic(), "queue/" + std::to_string(next++));
+        }
+    }
+    EXPECT_GT(queue.getSpilledCount(), 0);
+    EXPECT_LE(queue.getMemoryBytes(), 4096);
+
+    OfflineQueue::Entry popped;
+    while (queue.pop(popped)) {
+        EXPECT_EQ(popped.message->getTopic(), "queue/" + std::to_string(next));
+        EXPECT_EQ(popped.message->isRetain(), next % 2 == 0);
+        EXPECT_EQ(popped.retain, next % 3 == 0);
+        EXPECT_EQ(popped.message->getPayload().size, 100);
+        next++;
+    }
+    EXPECT_EQ(next, count);
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST_F(OfflineQueueTest, SpilledMessagesKeepPropertiesAndPublisher) {
+    OfflineQueue queue(0, directory);
+    // User Property "unit": "celsius", then Content Type "text/plain"
+    const std::vector<uint8_t> properties = {0x26, 0, 4, 'u', 'n', 'i', 't', 0, 7, 'c', 'e', 'l', 's', 'i', 'u', 's',
+                                             0x03, 0, 10, 't', 'e', 'x', 't', '/', 'p', 'l', 'a', 'i', 'n'};
+    for (int i = 0; i < 3; i++) {
+        Message message("sensors/" + std::to_string(i), "21.5", QoS::QOS_1);
+        message.publisherId = "publisher-" + std::to_string(i);
+        message.properties = properties;
+        EXPECT_TRUE(queue.push(OfflineQueue::Entry{MessageRef::create(message), QoS::QOS_1, false}));
+    }
+    EXPECT_EQ(queue.getSpilledCount(), 2);
+
+    for (int i = 0; i < 3; i++) {
+        OfflineQueue::Entry popped;
+        ASSERT_TRUE(queue.pop(popped));
+        EXPECT_EQ(popped.message->getTopic(), "sensors/" + std::to_string(i));
+        EXPECT_EQ(popped.message->getPublisherId(), "publisher-" + std::to_string(i));
+        EXPECT_EQ(popped.message->getProperties().toVector(), properties);
+        EXPECT_EQ(std::string(popped.message->getPayload().begin(), popped.message->getPayload().end()), "21.5");
+    }
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST_F(OfflineQueueTest, RemovesSpillFiles) {
+    {
+        OfflineQueue queue(1024, directory);
+        for (int i = 0; i < 100; i++) {
+            queue.push(entry(i));
+        }
+        EXPECT_TRUE(std::filesystem::exists(directory));
+    }
+    EXPECT_FALSE(std::filesystem::exists(directory));
+}
+
+TEST_F(OfflineQueueTest, ExpiredMessagesAreSkipped) {
+    uint64_t now = MessageBlock::currentTime();
+    OfflineQueue queue(1024, directory);
+    // Enough to spill, so expiry also survives the round trip through a segment
+    for (int i = 0; i < 40; i++) {
+        queue.push(i % 2 ? expiring(i, now - 1) : expiring(i, now + 60000));
+    }
+    EXPECT_GT(queue.getSpilledCount(), 0);
+
+    OfflineQueue::Entry popped;
+    for (int i = 0; i < 40; i += 2) {
+        ASSERT_TRUE(queue.pop(popped));
+        EXPECT_EQ(popped.message->getTopic(), "queue/" + std::to_string(i));
+        EXPECT_EQ(popped.message->getExpiresAt(), now + 60000);
+    }
+    EXPECT_FALSE(queue.pop(popped));
+    EXPECT_EQ(queue.getExpiredCount(), 20);
+}
+
+TEST_F(OfflineQueueTest, RemoveExpiredReportsNextExpiry) {
+    OfflineQueue queue(1024 * 1024);
+    queue.push(expiring(0, 3000));
+    queue.push(entry(1));
+    queue.push(expiring(2, 1000));
+    queue.push(expiring(3, 2000));
+
+    uint64_t nextExpiry;
+    EXPECT_EQ(queue.removeExpired(1500, nextExpiry), 1);
+    EXPECT_EQ(nextExpiry, 2000);
+    EXPECT_EQ(queue.size(), 3);
+    EXPECT_EQ(queue.removeExpired(5000, nextExpiry), 2);
+    EXPECT_EQ(nextExpiry, 0);
+    ASSERT_NE(queue.front(), nullptr);
+    EXPECT_EQ(queue.front()->message->getTopic(), "queue/1");
+    EXPECT_EQ(queue.getMemoryBytes(), sizeof(OfflineQueue::Entry) + 7 + 100);
+}
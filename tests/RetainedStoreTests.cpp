@@ -0,0 +1,218 @@
+#include <gtest/gtest.h>
+#include "../src/RetainedStore.h"
+#include <algorithm>
+#include <filesystem>
+
+namespace MQTT {
+
+class RetainedStoreTest : public ::testing::Test {
+protected:
+    RetainedStore store;
+
+    void retain(const std::string& topic, const std::string& payload) {
+        store.store(MessageRef::create(Message(topic, payload, QoS::QOS_0, true)));
+    }
+
+    std::vector<std::string> topics(const std::string& topicFilter) {
+        std::vector<std::string> result;
+        for (const auto& message : store.match(topicFilter)) {
+            result.push_back(std::string(message->getTopic()));
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+};
+
+TEST_F(RetainedStoreTest, StoreAndFind) {
+    retain("site/1/status", "on");
+    retain("site/1/status", "off");
+    EXPECT_EQ(store.size(), 1);
+    auto message = store.find("site/1/status");
+    ASSERT_NE(message, nullptr);
+    EXPECT_EQ(std::string(message->getPayload().begin(), message->getPayload().end()), "off");
+    EXPECT_EQ(store.find("site/2/status"), nullptr);
+}
+
+TEST_F(RetainedStoreTest, EmptyPayloadClears) {
+    retain("site/1/status", "on");
+    retain("site/1/status/detail", "ok");
+    retain("site/1/status", "");
+    EXPECT_EQ(store.size(), 1);
+    EXPECT_EQ(store.find("site/1/status"), nullptr);
+    EXPECT_NE(store.find("site/1/status/detail"), nullptr);
+}
+
+TEST_F(RetainedStoreTest, WildcardMatch) {
+    retain("site/1/status", "on");
+    retain("site/2/status", "on");
+    retain("site/2/load", "5");
+    retain("site", "root");
+    retain("other/1/status", "on");
+
+    EXPECT_EQ(topics("site/+/status"), (std::vector<std::string>{"site/1/status", "site/2/status"}));
+    EXPECT_EQ(topics("site/#"), (std::vector<std::string>{"site", "site/1/status", "site/2/load", "site/2/status"}));
+    EXPECT_EQ(topics("+/1/status"), (std::vector<std::string>{"other/1/status", "site/1/status"}));
+    EXPECT_EQ(topics("site/2/load"), (std::vector<std::string>{"site/2/load"}));
+    EXPECT_TRUE(topics("site/+").empty());
+}
+
+TEST_F(RetainedStoreTest, RootWildcardSkipsSysTopics) {
+    retain("$SYS/broker/uptime", "10");
+    retain("site/1/status", "on");
+    EXPECT_EQ(topics("#"), (std::vector<std::string>{"site/1/status"}));
+    EXPECT_EQ(topics("+/broker/uptime"), (std::vector<std::string>{}));
+    EXPECT_EQ(topics("$SYS/#"), (std::vector<std::string>{"$SYS/broker/uptime"}));
+}
+
+class PersistentRetainedStoreTest : public ::testing::Test {
+protected:
+    std::string directory;
+
+    void SetUp() override {
+        directory = (std::filesystem::temp_directory_path() /
+                     ("flowmq-retained-" + std::to_string(::testing::UnitTest::GetInstance()->random_seed()) + "-" +
+                      ::testing::UnitTest::GetInstance()->current_test_info()->name())).string();
+        std::filesystem::remove_all(directory);
+    }
+
+    void TearDown() override {
+        std::filesystem::remove_all(directory);
+    }
+
+    static void retain(RetainedStore& store, const std::string& topic, const std::string& payload) {
+        store.store(MessageRef::create(Message(topic, payload, QoS::QOS_1, true)));
+    }
+
+    static std::string payload(const MessageRef& message) {
+        return message ? std::string(message->getPayload().begin(), message->getPayload().end()) : "<none>";
+    }
+
+    static void retainUntil(RetainedStore& store, const std::string& topic, uint64_t expiresAt) {
+        Message message(topic, "expiring", QoS::QOS_1, true);
+        message.expiresAt = expiresAt;
+        store.store(MessageRef::create(message));
+    }
+};
+
+TEST_F(PersistentRetainedStoreTest, SurvivesRestart) {
+    {
+        RetainedStore store(directory);
+        retain(store, "site/1/status", "on");
+        retain(store, "site/2/status", "on");
+        retain(store, "site/1/status", "off");
+        retain(store, "site/2/status", "");
+    }
+    RetainedStore store(directory);
+    EXPECT_EQ(store.match("site/+/status").size(), 1);
+    EXPECT_EQ(payload(store.find("site/1/status")), "off");
+    EXPECT_EQ(store.find("site/1/status")->getQos(), QoS::QOS_1);
+    EXPECT_EQ(store.find("site/2/status"), nullptr);
+    EXPECT_TRUE(store.isLoaded());
+    EXPECT_EQ(store.size(), 1);
+}
+
+TEST_F(PersistentRetainedStoreTest, SweepsDoNotWaitForLoading) {
+    const size_t retained = 50000;
+    {
+        RetainedStore store(directory);
+        for (size_t i = 0; i < retained; i++) {
+            retain(store, "site/" + std::to_string(i) + "/status", "on");
+        }
+    }
+    RetainedStore store(directory);
+    // Indexing this many records takes far longer than the checks below
+    EXPECT_FALSE(store.isLoaded());
+    EXPECT_EQ(store.sweepExpired(MessageBlock::currentTime()), 0);
+    EXPECT_LT(store.loadedSize(), retained);
+    EXPECT_EQ(store.size(), retained);
+    EXPECT_TRUE(store.isLoaded());
+}
+
+TEST_F(PersistentRetainedStoreTest, PropertiesAndPublisherSurviveRestart) {
+    // User Property "unit": "celsius"
+    const std::vector<uint8_t> properties = {0x26, 0, 4, 'u', 'n', 'i', 't', 0, 7, 'c', 'e', 'l', 's', 'i', 'u', 's'};
+    {
+        RetainedStore store(directory);
+        Message message("site/1/temperature", "21.5", QoS::QOS_1, true);
+        message.publisherId = "sensor-1";
+        message.properties = properties;
+        message.expiresAt = MessageBlock::currentTime() + 3600 * 1000;
+        store.store(MessageRef::create(message));
+        retain(store, "site/1/status", "on");
+    }
+    RetainedStore store(directory);
+    MessageRef temperature = store.find("site/1/temperature");
+    ASSERT_NE(temperature, nullptr);
+    EXPECT_EQ(payload(temperature), "21.5");
+    EXPECT_EQ(temperature->getPublisherId(), "sensor-1");
+    EXPECT_EQ(temperature->getProperties().toVector(), properties);
+    EXPECT_NE(temperature->getExpiresAt(), 0);
+    MessageRef status = store.find("site/1/status");
+    ASSERT_NE(status, nullptr);
+    EXPECT_EQ(payload(status), "on");
+    EXPECT_TRUE(status->getProperties().empty());
+}
+
+TEST_F(PersistentRetainedStoreTest, CompactionKeepsLiveRecords) {
+    {
+        RetainedStore store(directory);
+        for (int round = 0; round < 5; round++) {
+            for (int i = 0; i < 100; i++) {
+                retain(store, "site/" + std::to_string(i) + "/status", "v" + std::to_string(round));
+            }
+        }
+        for (int i = 0; i < 50; i++) {
+            retain(store, "site/" + std::to_string(i) + "/status", "");
+        }
+        store.compact();
+        retain(store, "site/0/status", "after");
+        EXPECT_EQ(store.size(), 51);
+        EXPECT_EQ(payload(store.find("site/99/status")), "v4");
+    }
+
+    size_t files = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        // No temporary file is left behind by the compaction
+        EXPECT_EQ(entry.path().extension(), ".seg") << entry.path();
+        files++;
+    }
+    EXPECT_LE(files, 3);
+
+    RetainedStore store(directory);
+    EXPECT_EQ(store.size(), 51);
+    EXPECT_EQ(payload(store.find("site/0/status")), "after");
+    EXPECT_EQ(payload(store.find("site/1/status")), "<none>");
+    EXPECT_EQ(payload(store.find("site/99/status")), "v4");
+}
+
+TEST_F(PersistentRetainedStoreTest, ExpiredMessagesAreSkippedAndSwept) {
+    uint64_t now = MessageBlock::currentTime();
+    {
+        RetainedStore store(directory);
+        retainUntil(store, "site/1/status", now - 1);
+        retainUntil(store, "site/2/status", now + 60000);
+        retain(store, "site/3/status", "on");
+        EXPECT_EQ(store.find("site/1/status"), nullptr);
+        EXPECT_EQ(store.match("site/+/status").size(), 2);
+        EXPECT_EQ(store.size(), 3);
+    }
+    // Expiry is kept in the log
+    RetainedStore store(directory);
+    EXPECT_EQ(store.find("site/2/status")->getExpiresAt(), now + 60000);
+    EXPECT_EQ(store.match("site/+/status").size(), 2);
+    EXPECT_EQ(store.sweepExpired(now), 1);
+    EXPECT_EQ(store.size(), 2);
+    EXPECT_EQ(store.sweepExpired(now + 60000), 1);
+    EXPECT_EQ(store.size(), 1);
+    EXPECT_EQ(payload(store.find("site/3/status")), "on");
+}
+
+TEST_F(PersistentRetainedStoreTest, OverwrittenTopicIsNotSwept) {
+    RetainedStore store(directory);
+    retainUntil(store, "site/1/status", 1000);
+    retain(store, "site/1/status", "kept");
+    EXPECT_EQ(store.sweepExpired(2000), 0);
+    EXPECT_EQ(payload(store.find("site/1/status")), "kept");
+}
+
+} // namespace MQTT
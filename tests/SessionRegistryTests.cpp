@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+#include "../src/SessionRegistry.h"
+#include "../src/Broker.h"
+#include "../src/Session.h"
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace MQTT {
+
+class SessionRegistryTest : public ::testing::Test {
+protected:
+    // These also register with broker; the registry under test only reads their client ids
+    Broker broker;
+    Session a{&broker, "a"};
+    Session b{&broker, "b"};
+    SessionRegistry registry;
+};
+
+TEST_F(SessionRegistryTest, InsertFindErase) {
+    SessionHandle ha = registry.insert("a", &a);
+    SessionHandle hb = registry.insert("b", &b);
+    EXPECT_NE(ha, INVALID_SESSION);
+    EXPECT_NE(ha, hb);
+    EXPECT_EQ(registry.get(ha), &a);
+    EXPECT_EQ(registry.get(hb), &b);
+    EXPECT_EQ(registry.find("b"), hb);
+    EXPECT_EQ(registry.size(), 2);
+
+    EXPECT_TRUE(registry.erase(ha));
+    EXPECT_FALSE(registry.erase(ha));
+    EXPECT_EQ(registry.get(ha), nullptr);
+    EXPECT_EQ(registry.find("a"), INVALID_SESSION);
+    EXPECT_EQ(registry.size(), 1);
+    EXPECT_EQ(registry.get(INVALID_SESSION), nullptr);
+}
+
+TEST_F(SessionRegistryTest, ReusedSlotGetsNewGeneration) {
+    SessionHandle first = registry.insert("a", &a);
+    registry.erase(first);
+    SessionHandle second = registry.insert("b", &b);
+    EXPECT_EQ(second & SessionRegistry::INDEX_MASK, first & SessionRegistry::INDEX_MASK);
+    EXPECT_NE(second, first);
+    EXPECT_EQ(registry.get(first), nullptr);
+    EXPECT_EQ(registry.get(second), &b);
+}
+
+TEST_F(SessionRegistryTest, GenerationWrapSkipsInvalidHandle) {
+    SessionHandle handle = registry.insert("a", &a);
+    for (uint32_t i = 0; i <= SessionRegistry::GENERATION_MASK; i++) {
+        registry.erase(handle);
+        handle = registry.insert("a", &a);
+        EXPECT_NE(handle, INVALID_SESSION);
+        EXPECT_EQ(registry.get(handle), &a);
+    }
+}
+
+TEST_F(SessionRegistryTest, TakenOverClientIdKeepsSuccessor) {
+    SessionHandle old = registry.insert("a", &a);
+    Session successor{&broker, "a"};
+    SessionHandle current = registry.insert("a", &successor);
+    registry.erase(old);
+    EXPECT_EQ(registry.find("a"), current);
+}
+
+TEST_F(SessionRegistryTest, ReadersAreUnaffectedByGrowth) {
+    SessionHandle ha = registry.insert("a", &a);
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> misses{0};
+    std::thread reader([&]() {
+        while (!stop.load(std::memory_order_relaxed)) {
+            misses += registry.get(ha) != &a;
+        }
+    });
+    // Spans several chunks while the reader keeps resolving the first handle
+    for (uint32_t i = 0; i < 4 * SessionRegistry::CHUNK_SIZE; i++) {
+        SessionHandle handle = registry.insert("b" + std::to_string(i), &b);
+        EXPECT_EQ(registry.get(handle), &b);
+    }
+    stop = true;
+    reader.join();
+    EXPECT_EQ(misses.load(), 0u);
+    EXPECT_EQ(registry.size(), 4 * SessionRegistry::CHUNK_SIZE + 1);
+}
+
+TEST_F(SessionRegistryTest, ErasedSessionOutlivesReadersThatResolvedIt) {
+    SessionHandle ha = registry.insert("a", &a);
+    std::atomic<bool> resolved{false};
+    std::atomic<bool> release{false};
+    std::thread reader([&]() {
+        SessionRegistry::ReadGuard guard;
+        EXPECT_EQ(registry.get(ha), &a);
+        resolved = true;
+        while (!release.load()) {
+            std::this_thread::yield();
+        }
+    });
+    while (!resolved.load()) {
+        std::this_thread::yield();
+    }
+    EXPECT_TRUE(registry.erase(ha));
+    std::atomic<bool> waited{false};
+    std::thread eraser([&]() {
+        SessionRegistry::waitForReaders();
+        waited = true;
+    });
+    // Readers starting from here on no longer find it, and do not hold the eraser up
+    {
+        SessionRegistry::ReadGuard guard;
+        EXPECT_EQ(registry.get(ha), nullptr);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_FALSE(waited.load());
+    release = true;
+    eraser.join();
+    reader.join();
+    EXPECT_TRUE(waited.load());
+}
+
+}
@@ -0,0 +1,149 @@
+#include <gtest/gtest.h>
+#include "../src/SharedGroup.h"
+#include <map>
+#include <set>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+namespace MQTT {
+
+class SharedGroupTest : public ::testing::Test {
+protected:
+    SharedGroup group{"g", "sensor/+"};
+    // Stand-ins for the handles of sessions a, b and c
+    static constexpr SessionHandle a = 1, b = 2, c = 3;
+    std::function<size_t(SessionHandle)> noInflight = [](SessionHandle) { return 0; };
+    // Members that are offline or have a full window
+    std::set<SessionHandle> unavailable;
+    std::function<bool(SessionHandle)> available = [this](SessionHandle member) {
+        return unavailable.count(member) == 0;
+    };
+
+    void SetUp() override {
+        group.add(a);
+        group.add(b);
+        group.add(c);
+    }
+
+    SessionHandle pick(SharedStrategy strategy, std::string_view publisherId, std::string_view topic,
+                       const std::function<size_t(SessionHandle)>& inflight) {
+        return group.pick(strategy, publisherId, topic, available, inflight);
+    }
+};
+
+TEST_F(SharedGroupTest, ShareName) {
+    EXPECT_EQ(group.getShareName(), "$share/g/sensor/+");
+}
+
+TEST_F(SharedGroupTest, AddRemove) {
+    EXPECT_FALSE(group.add(a));
+    EXPECT_EQ(group.size(), 3);
+    EXPECT_TRUE(group.remove(b));
+    EXPECT_FALSE(group.remove(b));
+    EXPECT_EQ(group.size(), 2);
+    EXPECT_TRUE(group.contains(a));
+    EXPECT_TRUE(group.contains(c));
+}
+
+TEST_F(SharedGroupTest, RoundRobinVisitsEveryMember) {
+    std::map<SessionHandle, int> counts;
+    for (int i = 0; i < 6; i++) {
+        counts[pick(SharedStrategy::ROUND_ROBIN, "pub", "sensor/1", noInflight)]++;
+    }
+    EXPECT_EQ(counts[a], 2);
+    EXPECT_EQ(counts[b], 2);
+    EXPECT_EQ(counts[c], 2);
+}
+
+TEST_F(SharedGroupTest, UnavailableMembersAreSkipped) {
+    unavailable = {a, c};
+    for (auto strategy : {SharedStrategy::ROUND_ROBIN, SharedStrategy::RANDOM, SharedStrategy::STICKY,
+                          SharedStrategy::HASH_CLIENT_ID, SharedStrategy::HASH_TOPIC,
+                          SharedStrategy::LEAST_INFLIGHT}) {
+        EXPECT_EQ(pick(strategy, "pub", "sensor/1", noInflight), b);
+    }
+    unavailable.insert(b);
+    EXPECT_EQ(pick(SharedStrategy::ROUND_ROBIN, "pub", "sensor/1", noInflight), INVALID_SESSION);
+    group.remove(b);
+    unavailable.erase(a);
+    EXPECT_EQ(pick(SharedStrategy::ROUND_ROBIN, "pub", "sensor/1", noInflight), a);
+}
+
+TEST_F(SharedGroupTest, StickyAndHashAreStable) {
+    const SessionHandle first = pick(SharedStrategy::STICKY, "pub", "sensor/1", noInflight);
+    const SessionHandle byClient = pick(SharedStrategy::HASH_CLIENT_ID, "pub", "sensor/1", noInflight);
+    const SessionHandle byTopic = pick(SharedStrategy::HASH_TOPIC, "pub", "sensor/1", noInflight);
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(pick(SharedStrategy::STICKY, "pub", "sensor/1", noInflight), first);
+        EXPECT_EQ(pick(SharedStrategy::HASH_CLIENT_ID, "pub", "sensor/" + std::to_string(i), noInflight), byClient);
+        EXPECT_EQ(pick(SharedStrategy::HASH_TOPIC, "pub" + std::to_string(i), "sensor/1", noInflight), byTopic);
+    }
+    unavailable.insert(first);
+    EXPECT_NE(pick(SharedStrategy::STICKY, "pub", "sensor/1", noInflight), first);
+}
+
+TEST_F(SharedGroupTest, LeastInflight) {
+    std::map<SessionHandle, size_t> inflight{{a, 5}, {b, 0}, {c, 3}};
+    auto load = [&](SessionHandle member) { return inflight[member]; };
+    std::map<SessionHandle, int> counts;
+    for (int i = 0; i < 300; i++) {
+        counts[pick(SharedStrategy::LEAST_INFLIGHT, "pub", "sensor/1", load)]++;
+    }
+    // The busiest member always loses the comparison; the idlest wins whenever it is sampled
+    EXPECT_EQ(counts[a], 0);
+    EXPECT_GT(counts[b], counts[c]);
+    unavailable.insert(c);
+    EXPECT_EQ(pick(SharedStrategy::LEAST_INFLIGHT, "pub", "sensor/1", load), b);
+}
+
+TEST_F(SharedGroupTest, PublishersPickWhileAvailabilityChanges) {
+    std::atomic<bool> flags[4] = {false, true, true, true};
+    std::function<bool(SessionHandle)> flagged = [&](SessionHandle member) {
+        return flags[member].load(std::memory_order_relaxed);
+    };
+    std::atomic<bool> done{false};
+    std::thread flipper([&]() {
+        for (int i = 0; !done; i++) {
+            flags[1 + i % 3] = i % 2;
+        }
+    });
+    std::vector<std::thread> publishers;
+    for (auto strategy : {SharedStrategy::ROUND_ROBIN, SharedStrategy::STICKY, SharedStrategy::LEAST_INFLIGHT}) {
+        publishers.emplace_back([&, strategy]() {
+            for (int i = 0; i < 20000; i++) {
+                SessionHandle member = group.pick(strategy, "pub", "sensor/1", flagged, noInflight);
+                EXPECT_TRUE(member == INVALID_SESSION || group.contains(member)) << member;
+            }
+        });
+    }
+    for (std::thread &publisher : publishers) {
+        publisher.join();
+    }
+    done = true;
+    flipper.join();
+}
+
+TEST_F(SharedGroupTest, HashMovesFewKeysWhenMembersJoin) {
+    for (SessionHandle member = 4; member <= 10; member++) {
+        group.add(member);
+    }
+    std::vector<SessionHandle> before;
+    for (int i = 0; i < 1000; i++) {
+        before.push_back(pick(SharedStrategy::HASH_TOPIC, "pub", "sensor/" + std::to_string(i), noInflight));
+    }
+    group.add(11);
+    int moved = 0;
+    for (int i = 0; i < 1000; i++) {
+        SessionHandle after = pick(SharedStrategy::HASH_TOPIC, "pub", "sensor/" + std::to_string(i), noInflight);
+        if (after != before[i]) {
+            EXPECT_EQ(after, 11);
+            moved++;
+        }
+    }
+    // About 1 in 11 keys moves to the new member; with a modulo nearly all would
+    EXPECT_GT(moved, 0);
+    EXPECT_LT(moved, 200);
+}
+
+} // namespace MQTT
@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+#include "../src/SlabPool.h"
+#include "../src/Message.h"
+#include <thread>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+namespace MQTT {
+
+TEST(SlabPoolTest, ReleasedObjectIsReused) {
+    void *first = SlabPool::allocate(40);
+    SlabPool::deallocate(first, 40);
+    // Same 48-byte class
+    void *second = SlabPool::allocate(48);
+    EXPECT_EQ(first, second);
+    SlabPool::deallocate(second, 48);
+}
+
+TEST(SlabPoolTest, ObjectsAreDistinctAndAligned) {
+    std::set<void*> pointers;
+    for (int i = 0; i < 10000; i++) {
+        void *pointer = SlabPool::allocate(24);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(pointer) % SlabPool::GRANULARITY, 0);
+        EXPECT_TRUE(pointers.insert(pointer).second);
+    }
+    for (void *pointer : pointers) {
+        SlabPool::deallocate(pointer, 24);
+    }
+}
+
+TEST(SlabPoolTest, LargeSizesFallThrough) {
+    void *pointer = SlabPool::allocate(SlabPool::MAX_SIZE + 1);
+    ASSERT_NE(pointer, nullptr);
+    SlabPool::deallocate(pointer, SlabPool::MAX_SIZE + 1);
+}
+
+TEST(SlabPoolTest, SharedMessageReleasedOnAnotherThread) {
+    auto message = makePooled<const Message>("a/b", "payload", QoS::QOS_1);
+    EXPECT_EQ(message->topic, "a/b");
+    std::thread([moved = std::move(message)]() mutable { moved.reset(); }).join();
+}
+
+TEST(SlabPoolTest, ExitedThreadReturnsObjectsToDepot) {
+    uint64_t slabs = 0;
+    std::thread([&]() {
+        // 1000-byte objects: 65 fit in a slab, so this carves two
+        std::vector<void*> pointers;
+        for (int i = 0; i < 100; i++) {
+            pointers.push_back(SlabPool::allocate(1000));
+        }
+        for (void *pointer : pointers) {
+            SlabPool::deallocate(pointer, 1000);
+        }
+    }).join();
+    slabs = SlabPool::getStats().slabs;
+    std::thread([&]() {
+        std::vector<void*> pointers;
+        for (int i = 0; i < 100; i++) {
+            pointers.push_back(SlabPool::allocate(1000));
+        }
+        for (void *pointer : pointers) {
+            SlabPool::deallocate(pointer, 1000);
+        }
+    }).join();
+    EXPECT_EQ(SlabPool::getStats().slabs, slabs);
+}
+
+TEST(SlabPoolTest, ObjectsFreedOnAnotherThreadFlowBack) {
+    // A publisher allocating what a subscriber frees, both threads living on
+    std::mutex lock;
+    std::condition_variable changed;
+    std::vector<void*> handedOver;
+    bool done = false;
+    uint64_t warmedUp = 0;
+    constexpr int ROUNDS = 400, PER_ROUND = 1000;
+    std::thread subscriber([&]() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            changed.wait(guard, [&] { return done || !handedOver.empty(); });
+            std::vector<void*> batch;
+            batch.swap(handedOver);
+            changed.notify_all();
+            guard.unlock();
+            for (void *pointer : batch) {
+                SlabPool::deallocate(pointer, 200);
+            }
+            guard.lock();
+            if (done && handedOver.empty()) {
+                return;
+            }
+        }
+    });
+    for (int round = 0; round < ROUNDS; round++) {
+        std::vector<void*> batch;
+        for (int i = 0; i < PER_ROUND; i++) {
+            batch.push_back(SlabPool::allocate(200));
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [&] { return handedOver.empty(); });
+        handedOver.swap(batch);
+        changed.notify_all();
+        if (round == ROUNDS / 4) {
+            warmedUp = SlabPool::getStats().slabBytes;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        done = true;
+        changed.notify_all();
+    }
+    subscriber.join();
+    // 400 rounds of 200 KiB each would have carved some 80 MiB without the depot
+    EXPECT_LE(SlabPool::getStats().slabBytes, warmedUp + 4 * SlabPool::SLAB_SIZE);
+}
+
+}
@@ -0,0 +1,101 @@
+#include <gtest/gtest.h>
+#include <random>
+#include "../src/Stats.h"
+#include "../src/SpaceSaving.h"
+
+namespace MQTT {
+
+// A client sending a tenth of 100k messages, more than 100k / 16, among 50k others must be found
+TEST(SpaceSavingTest, FindsHeavyHittersInBoundedMemory) {
+    SpaceSaving summary(16);
+    std::mt19937 random(7);
+    uint64_t flooded = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (i % 10 == 0) {
+            summary.offer("device-13", 1, 100);
+            flooded++;
+        } else {
+            summary.offer("device-" + std::to_string(1000 + random() % 50000));
+        }
+    }
+    EXPECT_EQ(summary.size(), 16u);
+    auto top = summary.top();
+    ASSERT_EQ(top[0].key, "device-13");
+    // Counts never underestimate, and overestimate by at most the error
+    EXPECT_GE(top[0].count, flooded);
+    EXPECT_LE(top[0].count - top[0].error, flooded);
+}
+
+TEST(SpaceSavingTest, EvictedKeyInheritsMinimumAsError) {
+    SpaceSaving summary(2);
+    summary.offer("a", 5);
+    summary.offer("b", 2);
+    summary.offer("c", 1);
+    auto top = summary.top();
+    ASSERT_EQ(top.size(), 2u);
+    EXPECT_EQ(top[0].key, "a");
+    EXPECT_EQ(top[1].key, "c");
+    EXPECT_EQ(top[1].count, 3u);
+    EXPECT_EQ(top[1].error, 2u);
+}
+
+TEST(StatsTest, PrefixIsTheFirstTopicLevels) {
+    Stats::configure(2, 32);
+    EXPECT_EQ(Stats::prefixOf("site/7/device/42"), "site/7");
+    EXPECT_EQ(Stats::prefixOf("site/7"), "site/7");
+    EXPECT_EQ(Stats::prefixOf("site"), "site");
+    Stats::configure(1, 32);
+    EXPECT_EQ(Stats::prefixOf("site/7/device/42"), "site");
+    Stats::configure(2, 32);
+}
+
+TEST(StatsTest, BatchesCountClientsAndPrefixes) {
+    Stats::configure(2, 4);
+    PublishBatch batch;
+    batch.setClientId("flooder");
+    for (int i = 0; i < 20; i++) {
+        batch.add("site/7/device/" + std::to_string(i), 10);
+    }
+    batch.add("other/topic", 5);
+    batch.flush();
+    PublishBatch quiet;
+    quiet.setClientId("quiet");
+    quiet.add("site/8/device/1", 1);
+    quiet.flush();
+
+    auto clients = Stats::getTopClients();
+    ASSERT_EQ(clients.size(), 2u);
+    EXPECT_EQ(clients[0].key, "flooder");
+    EXPECT_EQ(clients[0].count, 21u);
+    EXPECT_EQ(clients[0].bytes, 205u);
+    auto prefixes = Stats::getTopPrefixes();
+    ASSERT_EQ(prefixes.size(), 3u);
+    EXPECT_EQ(prefixes[0].key, "site/7");
+    EXPECT_EQ(prefixes[0].count, 20u);
+    EXPECT_NE(Stats::formatTop().find("topic count=20 error=0 bytes=200 site/7\n"), std::string::npos);
+    Stats::configure(2, 32);
+}
+
+TEST(StatsTest, ConnectionsAreListedWhileAttached) {
+    ConnectionStats busy, idle;
+    Stats::attach(&busy);
+    Stats::attach(&idle);
+    Stats::setClientId(&busy, "busy client");
+    Stats::setClientId(&idle, "idle");
+    ConnectionStats::add(busy.messagesIn, 3);
+    ConnectionStats::add(busy.bytesIn, 300);
+    busy.inflight = 2;
+    idle.lastActivity = 1000;
+
+    std::string text = Stats::formatConnections(4000);
+    EXPECT_NE(text.find("messages_in=3 bytes_in=300 messages_out=0 bytes_out=0 inflight=2 queued=0 idle_ms=0 "
+                        "client=busy client\n"), std::string::npos) << text;
+    EXPECT_NE(text.find("idle_ms=3000 client=idle\n"), std::string::npos) << text;
+    EXPECT_LT(text.find("client=busy"), text.find("client=idle"));
+
+    Stats::detach(&busy);
+    Stats::detach(&idle);
+    EXPECT_EQ(Stats::formatConnections(4000).find("client=idle"), std::string::npos);
+}
+
+}
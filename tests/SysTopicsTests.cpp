@@ -0,0 +1,63 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include "Broker.h"
+#include "Session.h"
+
+class SysTopicsTest : public ::testing::Test
+{
+protected:
+    MQTT::Broker *broker = new MQTT::Broker();
+    MQTT::SubscriptionOptions options{MQTT::QoS::QOS_0, false, false,
+                                      MQTT::RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+
+    static bool contains(const std::vector<std::string> &topics, const std::string &topic) {
+        return std::find(topics.begin(), topics.end(), topic) != topics.end();
+    }
+    std::string retainedValue(const std::string &topic) {
+        MQTT::ByteView payload = broker->getRetained(topic).at(0)->getPayload();
+        return std::string(payload.begin(), payload.end());
+    }
+};
+
+TEST_F(SysTopicsTest, OnlyChangedValuesArePublished)
+{
+    MQTT::Session watcher(broker, "watcher");
+    watcher.subscribe("$SYS/broker/#", options);
+    std::vector<std::string> received;
+    watcher.setDeliverCallback([&](const MQTT::MessageRef& message, uint16_t, MQTT::QoS, bool) {
+        received.push_back(std::string(message->getTopic()));
+    });
+    watcher.connect();
+
+    uint64_t now = MQTT::MessageBlock::currentTime();
+    size_t published = broker->publishSys(now);
+    EXPECT_EQ(received.size(), published);
+    EXPECT_TRUE(contains(received, "$SYS/broker/subscriptions/count"));
+    EXPECT_TRUE(contains(received, "$SYS/broker/uptime"));
+    EXPECT_EQ(retainedValue("$SYS/broker/subscriptions/count"), "1");
+
+    // Not due again before the interval passed
+    EXPECT_EQ(broker->publishSys(now + 1), 0);
+
+    received.clear();
+    MQTT::Session other(broker, "other");
+    other.subscribe("sensors/+", options);
+    broker->publishSys(now + broker->getConfig().sysIntervalMs);
+    EXPECT_TRUE(contains(received, "$SYS/broker/subscriptions/count"));
+    EXPECT_TRUE(contains(received, "$SYS/broker/uptime"));
+    EXPECT_FALSE(contains(received, "$SYS/broker/sessions"));
+    EXPECT_EQ(retainedValue("$SYS/broker/subscriptions/count"), "2");
+}
+
+TEST_F(SysTopicsTest, RootWildcardsDoNotReceiveSysTopics)
+{
+    MQTT::Session everything(broker, "everything");
+    everything.subscribe("#", options);
+    everything.subscribe("+/broker/uptime", options);
+    int received = 0;
+    everything.setDeliverCallback([&](const MQTT::MessageRef&, uint16_t, MQTT::QoS, bool) { received++; });
+    everything.connect();
+
+    EXPECT_GT(broker->publishSys(MQTT::MessageBlock::currentTime()), 0);
+    EXPECT_EQ(received, 0);
+}
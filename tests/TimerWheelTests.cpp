@@ -0,0 +1,54 @@
+#include <gtest/gtest.h>
+#include <vector>
+#include "../src/TimerWheel.h"
+
+namespace MQTT {
+
+TEST(TimerWheelTest, VisitsOnlyDueEntries) {
+    TimerWheel<int> wheel(8, 100);
+    wheel.schedule(1050, 1);
+    wheel.schedule(1250, 2);
+    wheel.schedule(1260, 3);
+    EXPECT_EQ(wheel.size(), 3);
+
+    std::vector<int> expired;
+    auto collect = [&](uint64_t, int key) { expired.push_back(key); };
+    EXPECT_EQ(wheel.advance(1000, collect), 0);
+    EXPECT_EQ(wheel.advance(1255, collect), 2);
+    EXPECT_EQ(expired, (std::vector<int>{1, 2}));
+    // The rest of the current tick is visited again
+    EXPECT_EQ(wheel.advance(1260, collect), 1);
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimerWheelTest, DeadlinesBeyondOneRevolutionWait) {
+    TimerWheel<int> wheel(8, 100);
+    wheel.advance(0, [](uint64_t, int) {});
+    // Same slot as tick 2, one revolution later
+    wheel.schedule(1000, 1);
+    wheel.schedule(200, 2);
+
+    std::vector<int> expired;
+    auto collect = [&](uint64_t, int key) { expired.push_back(key); };
+    EXPECT_EQ(wheel.advance(300, collect), 1);
+    EXPECT_EQ(expired, std::vector<int>{2});
+    EXPECT_EQ(wheel.advance(900, collect), 0);
+    // More than a revolution since the last advance: every slot is checked
+    EXPECT_EQ(wheel.advance(5000, collect), 1);
+    EXPECT_EQ(expired, (std::vector<int>{2, 1}));
+}
+
+TEST(TimerWheelTest, OverdueEntriesFireOnNextAdvance) {
+    TimerWheel<int> wheel(8, 100);
+    wheel.advance(1000, [](uint64_t, int) {});
+    wheel.schedule(500, 7);
+
+    std::vector<int> expired;
+    wheel.advance(1000, [&](uint64_t deadline, int key) {
+        EXPECT_EQ(deadline, 500);
+        expired.push_back(key);
+    });
+    EXPECT_EQ(expired, std::vector<int>{7});
+}
+
+}
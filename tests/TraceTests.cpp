@@ -0,0 +1,86 @@
+#include <gtest/gtest.h>
+#include "../src/Trace.h"
+#include "../src/Metrics.h"
+#include "../src/Broker.h"
+#include "../src/Session.h"
+
+namespace MQTT {
+
+static MessageTrace makeTrace(uint64_t start, uint64_t step) {
+    MessageTrace trace;
+    for (int i = 0; i < static_cast<int>(TracePoint::COUNT); i++) {
+        trace.stamps[i] = start + i * step;
+    }
+    return trace;
+}
+
+TEST(TraceTest, SamplesOneInRate) {
+    int sampled = 0;
+    for (int i = 0; i < 1000; i++) {
+        sampled += Trace::sample(100);
+    }
+    EXPECT_EQ(sampled, 10);
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_FALSE(Trace::sample(0));
+    }
+    EXPECT_TRUE(Trace::sample(1));
+}
+
+TEST(TraceTest, CompletedDeliveriesAreRecordedPerStage) {
+    uint64_t matched = Metrics::getHistogramCount(Histogram::TRACE_MATCH_NANOSECONDS);
+    uint64_t total = Metrics::getHistogramCount(Histogram::TRACE_TOTAL_NANOSECONDS);
+    Trace::complete("a/b", makeTrace(1000, 10));
+    EXPECT_EQ(Metrics::getHistogramCount(Histogram::TRACE_MATCH_NANOSECONDS), matched + 1);
+    EXPECT_EQ(Metrics::getHistogramCount(Histogram::TRACE_TOTAL_NANOSECONDS), total + 1);
+
+    // Without an enqueue stamp the delivery came from an offline queue and is not counted
+    MessageTrace queued = makeTrace(1000, 10);
+    queued[TracePoint::ENQUEUED] = 0;
+    Trace::complete("a/b", queued);
+    EXPECT_EQ(Metrics::getHistogramCount(Histogram::TRACE_TOTAL_NANOSECONDS), total + 1);
+}
+
+TEST(TraceTest, SlowestDeliveriesAreKept) {
+    Trace::setSlowestCapacity(2);
+    Trace::complete("fast", makeTrace(1000, 10));
+    Trace::complete("slowest", makeTrace(1000, 1000));
+    Trace::complete("slow", makeTrace(1000, 100));
+    Trace::complete("fastest", makeTrace(1000, 1));
+    std::vector<Trace::Slow> slowest = Trace::getSlowest();
+    ASSERT_EQ(slowest.size(), 2);
+    EXPECT_EQ(slowest[0].topic, "slowest");
+    EXPECT_EQ(slowest[1].topic, "slow");
+    EXPECT_NE(Trace::formatSlowest().find("total=7.0us parse=1.0us"), std::string::npos);
+    Trace::setSlowestCapacity(0);
+    EXPECT_TRUE(Trace::getSlowest().empty());
+}
+
+TEST(TraceTest, PublishIsStampedThroughMatchAndEnqueue) {
+    Broker broker;
+    Session session(&broker, "subscriber");
+    SubscriptionOptions options{QoS::QOS_0, false, false, RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    session.subscribe("traced/+", options);
+    MessageTrace stamped;
+    uint64_t enqueuedAt = 0;
+    session.setDeliverCallback([&](const MessageRef& message, uint16_t, QoS, bool) {
+        ASSERT_NE(message->getTrace(), nullptr);
+        stamped = *message->getTrace();
+        enqueuedAt = Trace::getEnqueued(message.get());
+    });
+    session.connect();
+
+    MessageTrace trace;
+    trace[TracePoint::RECEIVED] = Trace::now();
+    trace[TracePoint::PARSED] = Trace::now();
+    Message message("traced/a", "payload");
+    message.trace = &trace;
+    broker.publish(message);
+    EXPECT_EQ(stamped[TracePoint::RECEIVED], trace[TracePoint::RECEIVED]);
+    EXPECT_GE(stamped[TracePoint::MATCH_START], trace[TracePoint::PARSED]);
+    EXPECT_GE(stamped[TracePoint::MATCH_END], stamped[TracePoint::MATCH_START]);
+    EXPECT_GE(enqueuedAt, stamped[TracePoint::MATCH_END]);
+    // Only the deliveries being dispatched carry an enqueue stamp
+    EXPECT_EQ(Trace::getEnqueued(nullptr), 0);
+}
+
+}
@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include "../src/Trie.h"
+#include <algorithm>
 
 class TrieTest : public ::testing::Test {
 protected:
@@ -51,3 +52,37 @@ TEST_F(TrieTest, Remove) {
 }
 
 // Add more tests as needed
+
+TEST_F(TrieTest, MatchBatchAgreesWithMatch) {
+    for (const char *filter : {"tower/+/will", "tower/7/will", "tower/#", "+/+/will", "other/x", "#"}) {
+        trie.insert(filter);
+    }
+    std::vector<std::string> topics = {"tower/7/will", "tower/8/will", "other/x", "tower/7/will", "tower",
+                                       "tower/7/will/extra", "a/b/will", "other"};
+    auto batch = trie.matchBatch(topics);
+    ASSERT_EQ(batch.size(), topics.size());
+    for (size_t i = 0; i < topics.size(); i++) {
+        auto expected = trie.match(topics[i]);
+        std::sort(expected.begin(), expected.end());
+        std::sort(batch[i].begin(), batch[i].end());
+        EXPECT_EQ(batch[i], expected) << topics[i];
+    }
+}
+
+TEST_F(TrieTest, RootWildcardsSkipDollarTopics) {
+    trie.insert("#");
+    trie.insert("+/broker/uptime");
+    trie.insert("$SYS/#");
+    trie.insert("$SYS/+/uptime");
+
+    // Wildcards below the first level still match
+    std::vector<std::string> expected{"$SYS/#", "$SYS/+/uptime"};
+    auto matches = trie.match("$SYS/broker/uptime");
+    std::sort(matches.begin(), matches.end());
+    EXPECT_EQ(matches, expected);
+    auto batch = trie.matchBatch({"$SYS/broker/uptime", "app/broker/uptime"});
+    std::sort(batch[0].begin(), batch[0].end());
+    EXPECT_EQ(batch[0], expected);
+    EXPECT_EQ(batch[1].size(), 2);
+    EXPECT_EQ(trie.match("app/broker/uptime").size(), 2);
+}
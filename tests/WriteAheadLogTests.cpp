@@ -0,0 +1,200 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include "WriteAheadLog.h"
+#include "Log.h"
+#include "Broker.h"
+#include "Session.h"
+
+using namespace MQTT;
+
+class WriteAheadLogTest : public ::testing::Test {
+protected:
+    std::string directory;
+
+    void SetUp() override {
+        directory = (std::filesystem::temp_directory_path() /
+                     ("flowmq-wal-" + std::to_string(::testing::UnitTest::GetInstance()->random_seed()) + "-" +
+                      ::testing::UnitTest::GetInstance()->current_test_info()->name())).string();
+        std::filesystem::remove_all(directory);
+    }
+
+    void TearDown() override {
+        std::filesystem::remove_all(directory);
+    }
+
+    static std::string payload(const MessageRef& message) {
+        return message ? std::string(message->getPayload().begin(), message->getPayload().end()) : "<none>";
+    }
+};
+
+TEST_F(WriteAheadLogTest, RecoversUnacknowledgedState) {
+    {
+        WriteAheadLog wal(directory, 0, 1024 * 1024);
+        Message message("sensors/1", "21.5", QoS::QOS_1);
+        message.publisherId = "publisher";
+        wal.logMessage(message);
+        EXPECT_NE(message.id, 0);
+        wal.logDeliver("client1", 1, MessageRef::create(message), QoS::QOS_1);
+        wal.logDeliver("client1", 2, MessageRef::create(message), QoS::QOS_1);
+        wal.logDeliver("client2", 1, MessageRef::create(message), QoS::QOS_1);
+        wal.logAck("client1", 1);
+        wal.logReceived("client3", 7);
+        wal.logReceived("client3", 8);
+        wal.sync(wal.logReleased("client3", 8));
+        EXPECT_EQ(wal.getDurableLsn(), wal.getAppendedLsn());
+    }
+
+    WriteAheadLog wal(directory, 0, 1024 * 1024);
+    auto recovered = wal.recover();
+    ASSERT_EQ(recovered.size(), 3);
+    ASSERT_EQ(recovered["client1"].inflight.size(), 1);
+    const auto& inflight = recovered["client1"].inflight[2];
+    EXPECT_EQ(payload(inflight.message), "21.5");
+    EXPECT_EQ(inflight.message->getTopic(), "sensors/1");
+    EXPECT_EQ(inflight.message->getPublisherId(), "publisher");
+    EXPECT_EQ(inflight.qos, QoS::QOS_1);
+    EXPECT_EQ(recovered["client2"].inflight.size(), 1);
+    EXPECT_EQ(recovered["client3"].awaitingPubrel, std::set<uint16_t>{7});
+}
+
+TEST_F(WriteAheadLogTest, DiscardForgetsClient) {
+    {
+        WriteAheadLog wal(directory, 0, 1024 * 1024);
+        Message message("a/b", "x", QoS::QOS_2);
+        wal.logDeliver("client1", 1, MessageRef::create(message), QoS::QOS_2);
+        wal.logReceived("client1", 3);
+        wal.logDeliver("client2", 1, MessageRef::create(message), QoS::QOS_2);
+        wal.logDiscard("client1");
+    }
+    WriteAheadLog wal(directory, 0, 1024 * 1024);
+    auto recovered = wal.recover();
+    EXPECT_EQ(recovered.count("client1"), 0);
+    EXPECT_EQ(recovered.count("client2"), 1);
+}
+
+TEST_F(WriteAheadLogTest, TornTailIsDropped) {
+    {
+        WriteAheadLog wal(directory, 0, 1024 * 1024);
+        Message message("a/b", "x", QoS::QOS_1);
+        wal.logDeliver("client1", 1, MessageRef::create(message), QoS::QOS_1);
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        std::ofstream(entry.path(), std::ios::binary | std::ios::app) << "garbage from a half-written record";
+    }
+    {
+        WriteAheadLog wal(directory, 0, 1024 * 1024);
+        EXPECT_EQ(wal.recover()["client1"].inflight.size(), 1);
+        Message message("a/c", "y", QoS::QOS_1);
+        wal.logDeliver("client1", 2, MessageRef::create(message), QoS::QOS_1);
+    }
+    WriteAheadLog wal(directory, 0, 1024 * 1024);
+    EXPECT_EQ(wal.recover()["client1"].inflight.size(), 2);
+}
+
+TEST_F(WriteAheadLogTest, GroupCommitSharesFsync) {
+    WriteAheadLog wal(directory, 2000, 1024 * 1024);
+    const int threads = 8;
+    const int messages = 25;
+    std::vector<std::thread> publishers;
+    for (int t = 0; t < threads; t++) {
+        publishers.emplace_back([&wal, t]() {
+            for (int i = 0; i < messages; i++) {
+                Message message("load/" + std::to_string(t), "payload", QoS::QOS_1);
+                uint64_t lsn = wal.logMessage(message);
+                wal.sync(lsn);
+                EXPECT_GE(wal.getDurableLsn(), lsn);
+            }
+        });
+    }
+    for (auto& publisher : publishers) {
+        publisher.join();
+    }
+    EXPECT_LT(wal.getSyncCount(), threads * messages);
+}
+
+TEST_F(WriteAheadLogTest, WriteFailureIsReportedToWaiters) {
+    WriteAheadLog wal(directory, 0, 1024 * 1024, 4096);
+    Message logged("sensors/1", "21.5", QoS::QOS_1);
+    uint64_t durable = wal.logMessage(logged);
+    wal.sync(durable);
+    // The next segment cannot be created where the directory was; the error it logs is expected
+    Log::setLevel(LogLevel::OFF);
+    std::filesystem::remove_all(directory);
+    std::ofstream(directory) << "not a directory";
+    Message message("sensors/1", std::string(8192, 'x'), QoS::QOS_1);
+    uint64_t lsn = wal.logMessage(message);
+    EXPECT_THROW(wal.sync(lsn), std::runtime_error);
+    EXPECT_TRUE(wal.hasFailed());
+    // Records durable before the failure stay so; new publishes are refused
+    wal.sync(durable);
+    EXPECT_THROW(wal.logMessage(message), std::runtime_error);
+    Log::setLevel(LogLevel::INFO);
+}
+
+TEST_F(WriteAheadLogTest, AcknowledgedSegmentsAreDeleted) {
+    WriteAheadLog wal(directory, 0, 1024 * 1024, 4096);
+    Message slow("slow/topic", "kept", QoS::QOS_1);
+    wal.logDeliver("slow", 1, MessageRef::create(slow), QoS::QOS_1);
+    for (uint16_t i = 1; i <= 2000; i++) {
+        Message message("fast/topic", std::string(100, 'x'), QoS::QOS_1);
+        wal.logMessage(message);
+        wal.logDeliver("fast", i, MessageRef::create(message), QoS::QOS_1);
+        wal.sync(wal.logAck("fast", i));
+    }
+    // The unacked delivery is carried forward instead of pinning the first segment forever
+    EXPECT_LE(wal.getSegmentCount(), WriteAheadLog::MAX_SEGMENTS + 1);
+}
+
+TEST_F(WriteAheadLogTest, CarriedForwardDeliverySurvivesRestart) {
+    {
+        WriteAheadLog wal(directory, 0, 1024 * 1024, 4096);
+        Message slow("slow/topic", "kept", QoS::QOS_1);
+        wal.logDeliver("slow", 1, MessageRef::create(slow), QoS::QOS_1);
+        for (uint16_t i = 1; i <= 2000; i++) {
+            Message message("fast/topic", std::string(100, 'x'), QoS::QOS_1);
+            wal.logDeliver("fast", i, MessageRef::create(message), QoS::QOS_1);
+            wal.sync(wal.logAck("fast", i));
+        }
+    }
+    WriteAheadLog wal(directory, 0, 1024 * 1024, 4096);
+    auto recovered = wal.recover();
+    EXPECT_EQ(recovered.count("fast"), 0);
+    ASSERT_EQ(recovered["slow"].inflight.size(), 1);
+    EXPECT_EQ(payload(recovered["slow"].inflight[1].message), "kept");
+}
+
+TEST_F(WriteAheadLogTest, SessionResumesInflightAfterRestart) {
+    BrokerConfig config;
+    config.dataDirectory = directory;
+    config.walCommitIntervalUs = 0;
+    SubscriptionOptions options{QoS::QOS_2, false, false, RetainHandling::DO_NOT_SEND_RETAINED_MESSAGES};
+    {
+        Broker broker(config);
+        Session subscriber(&broker, "subscriber", false);
+        Session publisher(&broker, "publisher", false);
+        std::vector<uint16_t> packetIds;
+        subscriber.setDeliverCallback([&](const MessageRef&, uint16_t packetId, QoS, bool) { packetIds.push_back(packetId); });
+        subscriber.connect();
+        subscriber.subscribe("alerts/#", options);
+        publisher.publish(1, Message("alerts/fire", "now", QoS::QOS_1));
+        publisher.publish(2, Message("alerts/flood", "soon", QoS::QOS_2));
+        publisher.sync();
+        EXPECT_EQ(subscriber.getInflightCount(), 2);
+        subscriber.puback(packetIds.front());
+        subscriber.disconnect();
+    }
+    Broker broker(config);
+    Session subscriber(&broker, "subscriber", false);
+    EXPECT_EQ(subscriber.getInflightCount(), 1);
+
+    // The publisher had not released its QoS 2 packet, so a retransmission is not routed again
+    Session publisher(&broker, "publisher", false);
+    int delivered = 0;
+    subscriber.setDeliverCallback([&](const MessageRef&, uint16_t, QoS, bool) { delivered++; });
+    subscriber.connect();
+    subscriber.subscribe("alerts/#", options);
+    publisher.publish(2, Message("alerts/flood", "soon", QoS::QOS_2));
+    EXPECT_EQ(delivered, 0);
+}